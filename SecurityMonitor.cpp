@@ -1,99 +1,8867 @@
+#ifdef _WIN32
 #define UNICODE
 #define _UNICODE
 #define WIN32_LEAN_AND_MEAN // Exclude rarely-used stuff from Windows headers
 #include <windows.h>
 #include <dbt.h>         // For WM_DEVICECHANGE
+#include <winsock2.h>    // Collector connections
+#include <ws2tcpip.h>
+#include <mswsock.h>     // TransmitFile for segment shipping
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+#endif
+#endif
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <string>
 #include <chrono>        // For timestamps
 #include <iomanip>       // For formatting timestamps
 #include <filesystem>    // For path manipulation (C++17)
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
 #include <shlobj.h>      // For GetModuleFileNameW potentially needed alt path
 #include <initguid.h>    // Should be included once before headers defining GUIDs
 
 // {A5DCBF10-6530-11D2-901F-00C04FB951ED} - GUID_DEVINTERFACE_USB_DEVICE
 // Define it here since we included initguid.h
 DEFINE_GUID(GUID_DEVINTERFACE_USB_DEVICE, 0xA5DCBF10L, 0x6530, 0x11D2, 0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED);
+#else
+// Live capture is Win32-only; the Linux build runs the event pipeline for load generation and tooling.
+#include <poll.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h> // Hardware counters around pipeline stages
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>     // Segment shipping without copies through user space
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>    // Substring scan over segment text
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#include <cpuid.h>        // Invariant TSC check for event timestamps
+#endif
 
 
 // --- Global Variables ---
 std::ofstream g_logFile;
 std::filesystem::path g_logFilePath;
-const char* g_logFileName = "SecurityMonitorLog.txt";
+#ifdef _WIN32
 HWND g_hwnd = NULL; // Handle to our hidden message-only window
+#endif
+std::mutex g_logMutex; // LogEvent is called from the capture thread and background threads
+bool g_consoleEcho = true; // The load generator turns this off so the console doesn't dominate its numbers
+bool g_useHugePages = false; // --hugepages: back capture-path buffers with huge, pre-faulted, locked pages
+
+// Capture loop watchdog: a heartbeat is posted to the capture window periodically and the
+// time it spends queued is recorded in a log2 histogram (bucket i holds lags < 2^i microseconds).
+#ifdef _WIN32
+const UINT WM_APP_HEARTBEAT = WM_APP + 1;
+const UINT WM_APP_CONFIG_CHANGED = WM_APP + 2; // Posted by the config watcher; re-registers device notifications
+HDEVNOTIFY g_hDevNotify = NULL;
+#endif
+const std::chrono::milliseconds g_heartbeatInterval(250);
+const size_t kLagBuckets = 24;
+std::array<std::atomic<uint64_t>, kLagBuckets> g_lagHistogram{};
+std::atomic<int64_t> g_heartbeatPendingSince{0}; // Steady-clock microseconds of the outstanding heartbeat, 0 if none
+std::atomic<bool> g_loopStallReported{false};
+std::atomic<bool> g_watchdogStop{false};
+std::thread g_watchdogThread;
+
+// Periodic maintenance (checkpoints, loss reports, clock calibration, reloads) runs on its
+// own thread so slow file I/O never delays a heartbeat
+const std::chrono::milliseconds kMaintenanceInterval(250);
+std::atomic<bool> g_maintenanceStop{false};
+std::thread g_maintenanceThread;
+std::mutex g_maintenanceWakeMutex;
+std::condition_variable g_maintenanceWake;
+
+// Clock for time-driven logic: intervals, ages, rate limits and logged times. A replay
+// switches it to virtual time driven by the replayed events; SteadyMicros stays real for
+// latency measurements and network timeouts.
+std::atomic<bool> g_virtualClock{false};
+std::atomic<int64_t> g_virtualClockMicros{0};         // Unix microseconds
+int64_t g_virtualClockStart = 0;                      // Unix microseconds when the replay started
+std::atomic<int64_t> g_clockOffset{0};                // ClockMicros - SteadyMicros; keeps ClockMicros monotonic across replays
+const int64_t kReplayEpochMicros = 1767571200000000; // 2026-01-05T00:00:00Z, so replays are reproducible
+
+// Wall-clock timestamps (UnixMicrosNow) come from a cycle counter rather than a system clock
+// call: an invariant TSC when the CPU has one, otherwise the OS monotonic clock, scaled to
+// Unix time by a calibration the maintenance thread refreshes against the system clock. Readers take
+// the calibration under a sequence lock; small drift is slewed out over the next interval
+// rather than stepped, so timestamps stay monotonic.
+struct TimestampCalibration {
+    std::atomic<int64_t> ticks{0};             // Source reading at the anchor
+    std::atomic<int64_t> unixMicros{0};        // Unix time at the anchor
+    std::atomic<double> microsPerTick{0.0};    // 0 = not calibrated yet: read the system clock
+    std::atomic<bool> tsc{false};              // Ticks are TSC cycles, else steady_clock nanoseconds
+};
+struct TimestampSample {
+    int64_t ticks = 0, steadyNanos = 0, unixMicros = 0;
+};
+TimestampCalibration g_timestampCalibration;
+std::atomic<uint32_t> g_timestampSequence{0};  // Odd while the calibration is being rewritten
+std::mutex g_timestampMutex;                   // Serializes calibrations
+TimestampSample g_timestampAnchor;             // Last calibration sample; guarded by g_timestampMutex
+double g_timestampTickRate = 0.0;              // Measured microseconds per tick, before slewing; guarded by g_timestampMutex
+int64_t g_timestampCalibratedAt = 0;           // SteadyMicros of the last calibration
+std::string g_timestampFallbackReason;         // Why the TSC is not in use; guarded by g_timestampMutex
+std::atomic<int64_t> g_timestampDrift{0};      // Predicted minus system time at the last calibration, us
+std::atomic<int64_t> g_timestampMaxDrift{0};   // Largest |drift| seen, us
+std::atomic<uint64_t> g_timestampCalibrations{0};
+std::atomic<uint64_t> g_timestampSteps{0};     // Calibrations that stepped instead of slewing
+const int64_t kTimestampIntervalMicros = 2000000;
+const int64_t kTimestampStepMicros = 100000;   // Step to the system clock beyond this much drift
+const double kTscMaxRateChange = 0.01;         // A TSC rate moving more than this is not invariant
+
+std::atomic<uint32_t> g_stageSampleEvery{0}; // 0 disables stage sampling
+std::string g_perfUnavailableReason;         // Why hardware counters could not be opened, if they couldn't
+std::mutex g_perfReasonMutex;
+
+// Kinds of events produced by the capture pipeline
+enum class EventKind : uint8_t {
+    UsbArrival,
+    UsbRemoval,
+    DeviceArrival,   // Non-USB device interface
+    DeviceRemoval,
+    VolumeMount,
+    VolumeRemoval,
+    Clipboard,
+    Count
+};
+
+const char* const kEventKindNames[] = {
+    "usb_arrival", "usb_removal", "device_arrival", "device_removal", "volume_mount", "volume_removal", "clipboard"};
+
+// Why an event never reached the log, or a later sink
+enum class DropReason : uint8_t {
+    LogWriteFailed,  // Stream write/flush failed (disk full, I/O error)
+    LogNotOpen,
+    Shed,            // Load shedding: too far behind schedule
+    ForwardOverrun,  // Overwritten in the hot tier before it was sent to a collector
+    StorageOverrun,  // Overwritten in the hot tier before it reached a segment
+    Count
+};
+const char* const kDropReasonNames[] = {"log_write_failed", "log_not_open", "shed", "forward_overrun", "storage_overrun"};
+
+// A decoded notification, independent of the Win32 message it came from
+struct SecurityEvent {
+    EventKind kind = EventKind::Clipboard;
+    uint64_t sequence = 0; // Assigned once per event, dropped or not, so consumers can spot gaps
+    std::string detail; // UTF-8 device path, or drive root for volume mounts
+    uint32_t unitMask = 0; // Volume events: drive letter bitmask (bit 0 = A:)
+    int64_t timestampMicros = 0; // Unix microseconds, set by DispatchEvent
+    uint32_t flags = 0; // Set by EvaluateEvent
+    uint32_t hostId = 0; // InternDevice id of the sending host on a collector, 0 = this machine
+};
+
+// Pipeline stages measured by StageTimer
+enum class Stage : uint8_t {
+    Decode,
+    Rules,
+    Serialize,
+    Write,
+    Count
+};
+const char* const kStageNames[] = {"decode", "rules", "serialize", "write"};
+
+// Hardware counters read around sampled stages: cycles, instructions, cache misses, branch misses
+const size_t kPerfCounters = 4;
+const char* const kPerfCounterNames[kPerfCounters] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+// Per-thread perf_event group, opened lazily the first time the thread samples a stage
+struct PerfCounterGroup {
+    int fds[kPerfCounters] = {-1, -1, -1, -1};
+    bool opened = false;    // Open was attempted
+    bool available = false;
+};
+
+// Totals for one stage across all sampled executions
+struct StageStats {
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> nanos{0};
+    std::atomic<uint64_t> counterSamples{0}; // Samples that also have hardware counts
+    std::array<std::atomic<uint64_t>, kPerfCounters> counters{};
+};
+
+// Times one stage (and reads hardware counters when available) for 1 in g_stageSampleEvery calls
+struct StageTimer {
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+    Stage stage;
+    bool active = false;
+    bool haveCounts = false;
+    int64_t startNanos = 0;
+    uint64_t startCounts[kPerfCounters] = {};
+};
+std::array<StageStats, (size_t)Stage::Count> g_stageStats;
+thread_local PerfCounterGroup t_perfGroup;
+thread_local std::array<uint32_t, (size_t)Stage::Count> t_stageTick{};
+
+// Loss accounting: every event takes a sequence number whether or not it is logged, and every
+// drop is counted by (reason, kind). Loss reports summarise the counts since the last report
+// (interval from ConfigImage::lossReportIntervalSec).
+std::atomic<uint64_t> g_nextSequence{1};
+std::array<std::array<std::atomic<uint64_t>, (size_t)EventKind::Count>, (size_t)DropReason::Count> g_dropCounts{}; // [DropReason][EventKind]
+std::array<std::array<uint64_t, (size_t)EventKind::Count>, (size_t)DropReason::Count> g_dropCountsReported{};     // Snapshot at the last logged report
+std::mutex g_lossReportMutex;
+
+// A buffer for the capture path. With pinning requested it is backed by huge pages where the
+// OS grants them, pre-faulted and locked, so the first events after startup or an idle period
+// don't take page faults. Without pinning it is ordinary lazily-faulted heap memory.
+struct PinnedBuffer {
+    void* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;     // Allocated with mmap/VirtualAlloc rather than malloc
+    bool hugePages = false;  // Explicit huge/large pages were obtained
+    bool transparentHuge = false; // Linux: fell back to transparent huge pages (madvise)
+    bool locked = false;
+};
+const size_t kLogBufferSize = 2 * 1024 * 1024;
+PinnedBuffer g_logBuffer; // Stream buffer behind g_logFile
+
+// Compiled configuration. SecurityMonitor.conf (key = value lines) is parsed once per change
+// into this flat, validated, trivially-copyable image; threads read the current image through
+// an atomic pointer and never see a partially applied reload.
+const uint32_t kConfigMagic = 0x31474643; // "CFG1"
+const char* const kConfigFileName = "SecurityMonitor.conf";
+struct ConfigImage {
+    uint32_t magic = kConfigMagic;
+    uint32_t size = sizeof(ConfigImage);
+    uint64_t generation = 0;           // Incremented on every successful publish
+    char logFileName[256] = "SecurityMonitorLog.txt";
+    char prevalenceFileName[256] = "SecurityMonitor.prevalence"; // Fleet prevalence filter next to the executable
+    char policyFileName[256] = "SecurityMonitor.policy";         // Compiled policy image next to the executable
+    char riskModelFileName[256] = "SecurityMonitor.risk";        // Device risk model next to the executable
+    char collectors[512] = "";         // host:port,... to forward events to; empty = no forwarding (startup only)
+    char hostId[64] = "";              // Routing key and name at the collector; empty = the machine's host name
+    uint32_t virtualNodes = 128;       // Points per collector on the hash ring
+    uint8_t deviceFilterUsbOnly = 0;   // device_filter = all | usb
+    uint8_t logKinds[(size_t)EventKind::Count] = {1, 1, 1, 1, 1, 1, 1};
+    uint8_t hugePages = 0;             // Startup only
+    uint8_t storage = 1;               // Move hot tier events to segment files (startup only)
+    uint8_t queryApi = 1;              // Serve the local query API (startup only)
+    uint8_t policyJit = 1;             // Compile policy images to native code (from the next policy load)
+    uint8_t tscTimestamps = 1;         // timestamp_source = tsc | os (tsc falls back to os when unreliable)
+    uint8_t directStorageIo = 1;       // storage_io = direct | buffered, for segment, index and archive files
+    uint8_t shipSegments = 0;          // Also send closed storage files to the collector whole (startup only)
+    uint8_t hashExecutables = 1;       // Hash executables on mounted volumes (startup only)
+    uint32_t loopLagWarnMs = 2000;
+    uint32_t lossReportIntervalSec = 60;
+    uint32_t stageSampleEvery = 0;
+    uint32_t checkpointIntervalSec = 10; // 0 disables periodic checkpoints
+    uint32_t hotTierMb = 16;           // Memory budget for the in-memory event columns (startup only)
+    uint32_t segmentEvents = 65536;    // Close a segment after this many events...
+    uint32_t segmentMaxAgeSec = 300;   // ...or once its oldest event is this old
+    uint32_t archiveAfterSec = 3600;   // Compress segments closed longer ago than this
+    uint32_t segmentBudgetMb = 256;    // Compress oldest segments first while uncompressed ones exceed this
+    uint32_t shipMbPerSec = 64;        // Segment shipping bandwidth cap, 0 = unlimited
+    uint32_t hashWorkers = 2;          // Executable hashing threads (startup only)
+    uint32_t checksum = 0;             // FNV-1a of everything before this field
+};
+std::atomic<const ConfigImage*> g_config{nullptr};
+// Every published image stays alive until exit, so a reader holding an old pointer is never
+// left dangling; images are a few hundred bytes and reloads are human-paced.
+std::vector<std::unique_ptr<ConfigImage>> g_configImages;
+std::mutex g_configPublishMutex;
+std::filesystem::path g_configPath;
+std::thread g_configWatcherThread;
+std::atomic<bool> g_configWatcherStop{false};
+
+// A read-only file mapping (checkpoints, segments)
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+// Device inventory: what is plugged in right now, maintained from arrival/removal events
+struct InventoryEntry {
+    EventKind kind = EventKind::UsbArrival; // UsbArrival or DeviceArrival
+    int64_t firstSeen = 0;                  // Unix seconds
+};
+std::unordered_map<std::string, InventoryEntry> g_inventory;
+uint32_t g_mountedVolumes = 0; // Drive letter bitmask
+std::mutex g_inventoryMutex;
+std::atomic<uint64_t> g_stateVersion{0}; // Bumped on every change a checkpoint would capture
+
+// Checkpoint file: a header followed by inventory records, rewritten (temp file + rename)
+// only when state changed and mapped read-only on restore. Its size depends on live state,
+// never on log history. Sequence numbers are checkpointed as a reserved high-water mark so a
+// restart after a crash never reuses a number that may already be in the log.
+const uint32_t kCheckpointMagic = 0x34504B43; // "CKP4"; the digit changes with the layout
+const char* const kCheckpointFileName = "SecurityMonitor.ckpt";
+const uint64_t kSequenceReserve = 1u << 20;
+struct CheckpointHeader {
+    uint32_t magic = kCheckpointMagic;
+    uint32_t headerSize = sizeof(CheckpointHeader);
+    uint64_t stateVersion = 0;
+    int64_t writtenAt = 0;                   // Unix seconds
+    uint64_t sequenceHighWater = 0;          // Restored g_nextSequence
+    uint64_t forwardAcked = 0;               // Restored g_forwardAcked
+    uint64_t dropCounts[(size_t)DropReason::Count][(size_t)EventKind::Count] = {};
+    uint32_t mountedVolumes = 0;
+    uint32_t deviceCount = 0;
+    uint64_t payloadBytes = 0;
+    uint32_t checksum = 0;                   // FNV-1a over the payload
+    uint32_t reserved = 0;
+};
+// Payload record: CheckpointDevice followed by pathLength bytes of UTF-8 path
+struct CheckpointDevice {
+    int64_t firstSeen;
+    uint16_t pathLength;
+    uint8_t kind;
+    uint8_t reserved;
+    uint32_t reserved2;
+};
+std::filesystem::path g_checkpointPath;
+std::atomic<uint64_t> g_sequenceHighWater{0}; // Last reserved sequence persisted in a checkpoint
+std::atomic<bool> g_reservationExtending{false}; // A thread is persisting a fresh reservation
+std::atomic<uint64_t> g_reservationRetryAt{0};   // After a failed extension, sequence to try again at
+uint64_t g_checkpointedVersion = 0;
+int64_t g_lastCheckpoint = 0;
+std::mutex g_checkpointMutex;
+
+// Hot tier: the most recent events as a structure-of-arrays ring, one column per field, so
+// time-range filters and per-kind aggregates are tight loops over contiguous arrays. The
+// capture thread is the only writer; readers only trust slots at least kHotTierGuard behind
+// the oldest live slot and re-check head afterwards (see HotTierRange).
+struct HotTier {
+    PinnedBuffer memory;
+    size_t capacity = 0;             // Power of two
+    int64_t* timestamps = nullptr;   // Unix microseconds, non-decreasing: the order range queries search
+    int64_t* eventTimes = nullptr;   // Unix microseconds as the event carried them; earlier for late events
+    uint64_t* sequences = nullptr;
+    uint32_t* deviceIds = nullptr;   // InternDevice ids, 0 = no device
+    uint32_t* hostIds = nullptr;     // InternDevice ids of host names (collector), 0 = local
+    uint32_t* flags = nullptr;
+    uint8_t* kinds = nullptr;
+    std::atomic<uint64_t> head{0};   // Total events ever appended
+};
+const size_t kHotTierBytesPerEvent = 2 * sizeof(int64_t) + sizeof(uint64_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t);
+HotTier g_hotTier;
+// Device path intern table shared by the hot tier and later stages
+std::unordered_map<std::string, uint32_t> g_deviceIds;
+std::vector<std::string> g_devicePaths{""}; // Id 0 is "no device"
+std::mutex g_internMutex;
+
+struct HotTierCounts {
+    uint64_t byKind[(size_t)EventKind::Count] = {};
+    uint64_t total = 0;
+};
+// A conjunction of column predicates evaluated over hot tier slots in batches of 64, each
+// predicate producing a match bitmask that is ANDed into the result (see MatchHotTierBlock)
+struct EventPredicate {
+    uint32_t kindMask = 0;             // Bit per EventKind, 0 = any kind
+    uint32_t deviceId = 0;             // 0 = any device
+    uint32_t flagsAny = 0;             // At least one of these flags, 0 = any flags
+};
+
+// Tiered storage: a background thread drains the hot tier into immutable segment files
+// (seg-<first sequence>.seg: a header and the same columns plus message text, mapped for
+// reads), then compresses segments into archives (.arc) by age or when uncompressed segments
+// exceed their byte budget. ReadEvents queries archives, segments and the hot tier as one.
+const uint32_t kSegmentMagic = 0x31474553; // "SEG1"
+const uint32_t kArchiveMagic = 0x31435241; // "ARC1"
+struct SegmentHeader {
+    uint32_t magic = kSegmentMagic;
+    uint32_t headerSize = sizeof(SegmentHeader);
+    uint64_t eventCount = 0;
+    uint64_t firstSequence = 0;
+    uint64_t lastSequence = 0;
+    int64_t minTimestamp = 0;                // Unix microseconds
+    int64_t maxTimestamp = 0;
+    uint64_t textBytes = 0;
+    uint32_t checksum = 0;                   // FNV-1a over the body
+    uint32_t reserved = 0;
+};
+// Body: timestamps[n] int64, sequences[n] uint64, flags[n] uint32, kinds[n] uint8 padded to
+// 8 bytes, textOffsets[n + 1] uint32, text. An archive is an ArchiveHeader followed by the
+// body with the timestamp and sequence columns delta-encoded, then LZ-compressed.
+struct ArchiveHeader {
+    uint32_t magic = kArchiveMagic;
+    uint32_t headerSize = sizeof(ArchiveHeader);
+    uint64_t compressedBytes = 0;
+    uint32_t checksum = 0;                   // FNV-1a over the compressed bytes
+    uint32_t reserved = 0;
+    SegmentHeader segment;                   // Describes the uncompressed body
+};
+struct SegmentView {
+    const int64_t* timestamps = nullptr;
+    const uint64_t* sequences = nullptr;
+    const uint32_t* flags = nullptr;
+    const uint8_t* kinds = nullptr;
+    const uint32_t* textOffsets = nullptr;
+    const char* text = nullptr;
+    size_t count = 0;
+};
+struct StoredSegment {
+    std::filesystem::path stem;              // Directory / "seg-<first sequence>", no extension
+    SegmentHeader header;
+    bool archived = false;
+    uint64_t fileBytes = 0;
+    int64_t closedAt = 0;                    // Steady-clock microseconds (startup time for old files)
+};
+// Trigram index (seg-<first sequence>.idx, kept when the segment is archived): for every
+// 3-byte substring of the message text, the blocks of kIndexBlockEvents events containing
+// it, as varint-encoded block deltas. A substring query intersects the posting lists of its
+// trigrams and only verifies the surviving blocks.
+const uint32_t kIndexMagic = 0x31494754; // "TGI1"
+const uint32_t kIndexBlockEvents = 64;
+struct IndexHeader {
+    uint32_t magic = kIndexMagic;
+    uint32_t headerSize = sizeof(IndexHeader);
+    uint64_t eventCount = 0;
+    uint32_t blockEvents = kIndexBlockEvents;
+    uint32_t blockCount = 0;
+    uint32_t trigramCount = 0;
+    uint32_t checksum = 0;                   // FNV-1a over entries and postings
+    uint64_t postingBytes = 0;
+};
+// Entries follow the header sorted by trigram, then the postings
+struct IndexEntry {
+    uint32_t trigram;                        // Bytes b0 | b1 << 8 | b2 << 16
+    uint32_t blockCount;                     // Length of the posting list
+    uint64_t offset;                         // Into the postings
+};
+struct IndexView {
+    const IndexHeader* header = nullptr;
+    const IndexEntry* entries = nullptr;
+    const uint8_t* postings = nullptr;
+};
+struct StoredEvent {
+    uint64_t sequence = 0;
+    int64_t timestampMicros = 0;
+    uint32_t flags = 0;
+    EventKind kind = EventKind::UsbArrival;
+    std::string message;                     // FormatEvent text
+};
+// Columns of the segment being filled; only the storage thread touches it
+struct SegmentBuilder {
+    std::vector<int64_t> timestamps;
+    std::vector<uint64_t> sequences;
+    std::vector<uint32_t> flags;
+    std::vector<uint8_t> kinds;
+    std::vector<uint32_t> textOffsets{0};
+    std::string text;
+    uint64_t endPosition = 0;                // Hot tier position after the last event added
+    int64_t openedAt = 0;                    // Steady-clock microseconds of the first event
+};
+// Segment columns from a mapped .seg file or a decompressed archive
+struct LoadedSegment {
+    MappedFile mapped;
+    std::vector<uint64_t> decompressed;      // uint64_t elements keep the columns aligned
+    SegmentView view;
+};
+std::filesystem::path g_storageDir;
+std::vector<StoredSegment> g_storageCatalog; // Ordered by first sequence
+size_t g_storageArchivedPrefix = 0;          // Catalog entries before this are all archived (storage thread)
+// Hot tier positions below this are in segment files; ReadEvents serves the rest from memory.
+// Guarded by g_storageMutex together with the catalog so a reader never sees an event twice.
+uint64_t g_storagePersisted = 0;
+std::mutex g_storageMutex;
+SegmentBuilder g_segmentBuilder;
+uint64_t g_storageCursor = 0;                // Next hot tier position to drain
+std::vector<std::string> g_storagePathCache; // Storage thread's copy of the intern table (see HotTierEvent)
+std::vector<std::filesystem::path> g_storageOrphans; // Replaced files that could not be deleted yet
+uint64_t g_indexBuildMicros = 0;             // Trigram index build cost, for stats (under g_storageMutex)
+uint64_t g_indexedTextBytes = 0;
+uint64_t g_indexBytes = 0;
+const size_t kDirectIoChunk = 1 << 20;       // Staging buffer for direct writes
+const size_t kDirectIoAlign = 4096;          // Offset, length and buffer alignment for O_DIRECT
+PinnedBuffer g_directIoBuffer;               // Page aligned; guarded by g_directIoMutex
+std::mutex g_directIoMutex;
+std::atomic<uint64_t> g_storageDirectWrites{0};
+std::atomic<uint64_t> g_storageFallbackWrites{0}; // Direct I/O refused: synced and dropped from the cache instead
+std::atomic<uint64_t> g_storageBufferedWrites{0}; // storage_io = buffered
+std::atomic<uint64_t> g_storageWriteBytes{0};
+std::atomic<uint64_t> g_storageWriteMicros{0};
+std::thread g_storageThread;
+std::atomic<bool> g_storageStop{false};
+std::mutex g_storageWakeMutex;
+std::condition_variable g_storageWake;
+
+// Fleet prevalence: the collector (--prevalence) keeps a distinct-host sketch per device
+// model and publishes a cuckoo filter of the models seen on at least `threshold` hosts.
+// Agents map the filter read-only and test every arrival against it in constant time (two
+// buckets of four 16-bit fingerprints); models that age out are deleted from the filter.
+const uint32_t kCuckooMagic = 0x31464B43;     // "CKF1"
+const uint32_t kCuckooSlots = 4;
+const uint32_t kPrevalenceMagic = 0x31565250; // "PRV1"
+const size_t kHllRegisters = 256;             // ~6.5% error on distinct host counts
+struct CuckooHeader {
+    uint32_t magic = kCuckooMagic;
+    uint32_t headerSize = sizeof(CuckooHeader);
+    uint64_t bucketCount = 0;                // Power of two
+    uint64_t itemCount = 0;
+    int64_t publishedAt = 0;                 // Unix seconds
+    uint32_t checksum = 0;                   // FNV-1a over the slots
+    uint32_t reserved = 0;
+};
+// Slots are bucketCount * kCuckooSlots fingerprints; 0 marks an empty slot
+struct CuckooFilter {
+    std::vector<uint16_t> slots;
+    uint64_t bucketCount = 0;
+    uint64_t itemCount = 0;
+};
+// A published filter mapped by the agent; swapped as a whole when the file changes
+struct PrevalenceFilter {
+    MappedFile mapped;
+    const CuckooHeader* header = nullptr;
+    const uint16_t* slots = nullptr;
+    ~PrevalenceFilter();
+};
+// Collector-side state per device model (state file: header then records followed by the key)
+struct PrevalenceHeader {
+    uint32_t magic = kPrevalenceMagic;
+    uint32_t headerSize = sizeof(PrevalenceHeader);
+    uint64_t deviceCount = 0;
+    uint64_t payloadBytes = 0;
+    uint32_t checksum = 0;                   // FNV-1a over the payload
+    uint32_t reserved = 0;
+};
+struct PrevalenceRecord {
+    int64_t lastSeen;                        // Unix seconds
+    uint16_t keyLength;
+    uint8_t inFilter;
+    uint8_t reserved[5];
+    uint8_t registers[kHllRegisters];        // HyperLogLog of host ids
+};
+struct PrevalenceConfig {
+    std::string observationsPath;            // Lines of "<unix seconds> <host id> <device path>"
+    std::string statePath = "prevalence.state";
+    std::string filterPath = "SecurityMonitor.prevalence";
+    uint32_t threshold = 1000;               // Distinct hosts for a model to count as common
+    uint32_t maxAgeDays = 90;                // Forget models not seen anywhere for this long
+    int64_t now = 0;                         // Unix seconds; 0 = current time
+};
+const uint32_t kFlagFleetCommon = 1u << 0;   // Arrival of a model common across the fleet
+const uint32_t kFlagFleetRare = 1u << 1;     // Arrival of a model not in the loaded filter
+std::shared_ptr<const PrevalenceFilter> g_prevalence; // Accessed with std::atomic_load/store
+std::filesystem::path g_prevalencePath;      // Overrides prevalence_file (load generator)
+std::filesystem::file_time_type g_prevalenceWriteTime;
+int64_t g_prevalenceCheckedAt = 0;
+
+// Policy: allowlists and blocklists (by device model, see DeviceModelKey) compiled from a
+// text source into a versioned, checksummed image of typed sections. Updates travel as binary
+// deltas against the previous version ("<policy>.<from>-<to>.delta" next to the image, staged
+// there by the forwarder from its collector or by anything else); the agent applies them off
+// the capture thread, verifies the result and swaps the whole image.
+const uint32_t kPolicyMagic = 0x314C4F50;      // "POL1"
+const uint32_t kPolicyDeltaMagic = 0x314C4450; // "PDL1"
+enum class PolicySection : uint32_t {
+    Allowlist = 1, // Sorted Hash64 of model keys
+    Blocklist = 2, // Sorted Hash64 of model keys
+};
+struct PolicyHeader {
+    uint32_t magic = kPolicyMagic;
+    uint32_t headerSize = sizeof(PolicyHeader);
+    uint64_t version = 0;
+    uint64_t totalBytes = 0;                   // Header included
+    uint32_t sectionCount = 0;
+    uint32_t checksum = 0;                     // FNV-1a over everything after the header
+};
+struct PolicySectionEntry {
+    uint32_t type;
+    uint32_t count;
+    uint64_t offset;                           // From the start of the image
+    uint64_t bytes;
+};
+// A delta rebuilds the target image from the base with copy and insert operations:
+// ([literal length][literals][copy length][base offset])..., varints, last op has no copy
+struct PolicyDeltaHeader {
+    uint32_t magic = kPolicyDeltaMagic;
+    uint32_t headerSize = sizeof(PolicyDeltaHeader);
+    uint64_t fromVersion = 0;
+    uint64_t toVersion = 0;
+    uint32_t fromChecksum = 0;
+    uint32_t toChecksum = 0;
+    uint64_t targetBytes = 0;
+    uint64_t opsBytes = 0;
+    uint32_t checksum = 0;                     // FNV-1a over the ops
+    uint32_t reserved = 0;
+};
+// Native code compiled from a policy image at load time (see CompilePolicyCode): the sorted
+// allow and block lists become trees of compare-and-branch instructions with the hashes as
+// immediates, so a lookup makes no data loads. x86-64 only; elsewhere, or when the lists are
+// too large or policy_jit is off, PolicyFlags binary-searches the image instead.
+const size_t kPolicyJitMaxEntries = 1u << 16; // ~25 bytes of code per entry
+struct PolicyCode {
+    void* memory = nullptr;
+    size_t size = 0;
+    uint32_t (*entry)(uint64_t modelHash) = nullptr;
+    PolicyCode() = default;
+    PolicyCode(const PolicyCode&) = delete;
+    PolicyCode& operator=(const PolicyCode&) = delete;
+    ~PolicyCode();
+};
+// A parsed image; the words own the bytes so the sections are 8-byte aligned
+struct PolicyImage {
+    std::vector<uint64_t> words;
+    const PolicyHeader* header = nullptr;
+    const uint64_t* allow = nullptr;
+    size_t allowCount = 0;
+    const uint64_t* block = nullptr;
+    size_t blockCount = 0;
+    PolicyCode code;
+};
+const uint32_t kFlagAllowlisted = 1u << 2;     // Device model on the policy allowlist
+const uint32_t kFlagBlocklisted = 1u << 3;     // Device model on the policy blocklist
+std::shared_ptr<const PolicyImage> g_policy;   // Accessed with std::atomic_load/store
+std::filesystem::path g_policyPath;            // Overrides policy_file (load generator)
+std::filesystem::file_time_type g_policyWriteTime;
+int64_t g_policyCheckedAt = 0;
+
+// Device risk model: a gradient-boosted tree ensemble (converted from an XGBoost text dump by
+// --risk convert) scoring each device arrival from a few features. Every tree is padded to the
+// ensemble's depth and stored as an implicit binary heap (node i's children are 2i+1, 2i+2), so
+// scoring walks a fixed number of compare-and-index steps per tree without data-dependent
+// branches. The score is the logistic of the summed leaves; at or above the model's threshold
+// the arrival is flagged.
+const uint32_t kRiskMagic = 0x314B5352;       // "RSK1"
+const uint32_t kRiskMaxDepth = 8;
+const int64_t kRiskWindowMicros = 60000000;   // recent_* features look back this far
+enum class RiskFeature : uint32_t {
+    HourOfDay,                                // Local time, 0-23
+    FleetRare,                                // 1 rare, 0 common, 0.5 without a prevalence filter
+    DeviceClass,                              // See RiskDeviceClass
+    RecentArrivals,                           // Arrivals in the window, this one included
+    RecentHidShare,                           // Fraction of those that were keyboards or other HID
+    VendorId,                                 // USB VID, 0 if none
+    Count
+};
+const char* const kRiskFeatureNames[] = {"hour_of_day", "fleet_rare", "device_class", "recent_arrivals", "recent_hid_share", "vendor_id"};
+struct RiskHeader {
+    uint32_t magic = kRiskMagic;
+    uint32_t headerSize = sizeof(RiskHeader);
+    uint32_t treeCount = 0;
+    uint32_t depth = 0;                       // Each tree: 2^depth - 1 RiskNodes, then 2^depth float leaves
+    uint32_t featureCount = (uint32_t)RiskFeature::Count;
+    float baseMargin = 0.0f;
+    float threshold = 0.5f;                   // Flag arrivals scoring at least this probability
+    uint32_t checksum = 0;                    // FNV-1a over the trees
+};
+struct RiskNode {
+    uint32_t feature;
+    float threshold;                          // Right child when the feature is >= this, else left
+};
+// A tree as read from a dump: children are indices into the same vector, -1 for a leaf
+struct RiskDumpNode {
+    int32_t yes = -1, no = -1;
+    uint32_t feature = 0;
+    float threshold = 0.0f;                   // "yes" when the feature is < this
+    float leaf = 0.0f;
+};
+// A loaded model; the words own the bytes so the nodes are aligned
+struct RiskModel {
+    std::vector<uint64_t> words;
+    const RiskHeader* header = nullptr;
+    const char* trees = nullptr;
+    size_t treeStride = 0;                    // Bytes per tree
+};
+const uint32_t kFlagRisky = 1u << 4;          // Scored at or above the risk model's threshold
+std::shared_ptr<const RiskModel> g_riskModel; // Accessed with std::atomic_load/store
+std::filesystem::path g_riskModelPath;        // Overrides risk_model_file (load generator)
+std::filesystem::file_time_type g_riskModelWriteTime;
+int64_t g_riskModelCheckedAt = 0;
+int64_t g_riskUtcOffsetSec = 0;               // Local time offset for hour_of_day, refreshed on load
+std::deque<std::pair<int64_t, uint8_t>> g_riskRecent; // (event time, device class) of recent arrivals; rules stage only
+uint32_t g_riskRecentHid = 0;                 // Keyboards and other HID in g_riskRecent
+
+// Executable hashing (hash_executables). A mounted volume's top-level executables and
+// installers are hashed (SHA-256) by a small pool of worker threads, off the capture path,
+// and the results logged against the mount event once ready. Hashes are cached by the file's
+// identity and version (device, inode or file index, size, modification time), so the same
+// binary is read once however often it shows up; requests for a file already being hashed
+// wait for that result instead of reading it again.
+const size_t kHashReadBytes = 1u << 20;       // Sequential read size
+const size_t kHashQueueLimit = 1024;          // Requests waiting for a worker; more are dropped
+const size_t kHashCacheLimit = 65536;        // Least recently used hashes are evicted past this
+const size_t kHashVolumeFiles = 64;           // Executables hashed per mounted volume
+struct ExecutableKey {
+    uint64_t device = 0;                      // st_dev, or the volume serial number
+    uint64_t inode = 0;                       // st_ino, or the NTFS file index
+    uint64_t size = 0;
+    int64_t modified = 0;                     // Nanoseconds (Linux) or FILETIME ticks (Windows)
+    bool operator==(const ExecutableKey& other) const {
+        return device == other.device && inode == other.inode && size == other.size && modified == other.modified;
+    }
+};
+struct ExecutableKeyHash {
+    size_t operator()(const ExecutableKey& key) const {
+        return (size_t)((key.inode * 0x9E3779B97F4A7C15ull) ^ (key.device * 0xC2B2AE3D27D4EB4Full) ^ key.size ^ (uint64_t)key.modified);
+    }
+};
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t bytes;                           // Message length so far
+    uint8_t block[64];                        // Partial block
+    size_t used;
+};
+// Called once per request with the hex SHA-256 (empty if the file could not be read), the
+// size and whether the hash came from the cache
+typedef std::function<void(const std::string&, uint64_t, bool)> HashCallback;
+struct HashRequest {
+    std::filesystem::path path;
+    ExecutableKey key;
+    bool scanVolume = false;                  // path is a volume root: hash the executables on it
+    uint64_t sequence = 0;                    // The mount event, for scanVolume
+};
+std::mutex g_hashMutex;
+std::condition_variable g_hashWake;
+std::deque<HashRequest> g_hashQueue;
+typedef std::list<std::pair<ExecutableKey, std::string>> HashCacheOrder; // (key, hex SHA-256)
+HashCacheOrder g_hashCacheOrder;              // Most recently used first
+std::unordered_map<ExecutableKey, HashCacheOrder::iterator, ExecutableKeyHash> g_hashCache;
+std::unordered_map<ExecutableKey, std::vector<HashCallback>, ExecutableKeyHash> g_hashInFlight;
+std::vector<std::thread> g_hashWorkers;
+bool g_hashStop = false;                      // Guarded by g_hashMutex
+std::atomic<uint64_t> g_hashHits{0};
+std::atomic<uint64_t> g_hashMisses{0};
+std::atomic<uint64_t> g_hashCoalesced{0};     // Waited for a hash already in progress
+std::atomic<uint64_t> g_hashDropped{0};       // Queue full or pool stopped
+uint64_t g_hashDroppedReported = 0;           // g_hashDropped at the last loss report; guarded by g_lossReportMutex
+std::atomic<uint64_t> g_hashFailed{0};        // Unreadable, or changed while being hashed
+std::atomic<uint64_t> g_hashedBytes{0};
+std::atomic<uint64_t> g_hashMicros{0};        // Worker time spent reading and hashing
+
+// Collector links. Agents forward events read from the hot tier to one of several collectors
+// (--collector), chosen by consistent hashing of the host id over a ring with virtual nodes so
+// adding or removing a collector moves only the hosts adjacent to its points. A collector that
+// fails is skipped, with backoff, in favour of the next one clockwise on the ring. Frames are
+// a FrameHeader followed by the payload (a FileSpan frame is also followed by the raw file
+// bytes it announces, checked as a whole file on arrival); delivery is at-least-once (a
+// batch is resent until acknowledged) and collectors drop per-host sequence numbers they
+// have already stored.
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+const SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+const SocketHandle kInvalidSocket = -1;
+#endif
+const uint32_t kFrameMagic = 0x314E5746; // "FWN1"
+// Host ids and collector names: they become directory names and log fields
+const char* const kNodeNameChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-";
+enum class FrameType : uint32_t {
+    Hello = 1,  // Agent -> collector: host id
+    Events = 2, // Agent -> collector: WireEvent records
+    Ack = 3,    // Collector -> agent: last sequence stored, or bytes stored of a shipped file; collector -> replicating collector: bytes stored
+    ReplicaHello = 4,    // Collector -> peer: source collector name
+    ReplicaManifest = 5, // Peer -> collector: files already held (name, size, checksum)
+    FileChunk = 6,       // Collector -> peer: name, offset, data
+    FileDone = 7,        // Collector -> peer, agent -> collector: name, size, checksum
+    ShipHello = 8,       // Agent -> collector: host id, then closed storage files
+    ShipManifest = 9,    // Collector -> agent: files held (name, bytes, complete)
+    FileSpan = 10,       // Agent -> collector: name, offset, length; length raw bytes follow the frame
+    PolicyOffer = 11,    // Agent -> collector: policy version and checksum held (0 = none)
+    PolicyUpdate = 12,   // Collector -> agent: nothing (up to date), a policy delta or a whole image
+};
+struct FrameHeader {
+    uint32_t magic = kFrameMagic;
+    uint32_t type = 0;
+    uint32_t length = 0;                     // Payload bytes
+    uint32_t checksum = 0;                   // FNV-1a over the payload
+};
+const uint32_t kMaxFrameBytes = 16u << 20;
+// Events payload record, followed by detailLength bytes of detail
+struct WireEvent {
+    uint64_t sequence;
+    int64_t timestampMicros;
+    uint32_t flags;
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t detailLength;
+};
+struct CollectorNode {
+    std::string host;
+    std::string port;
+    int64_t downUntil = 0;                   // Steady-clock microseconds; skipped until then
+    uint32_t failures = 0;                   // Consecutive, for backoff
+};
+// Ring points (hash, node index), sorted by hash
+typedef std::vector<std::pair<uint64_t, uint32_t>> HashRing;
+std::vector<CollectorNode> g_collectors;
+HashRing g_collectorRing;
+std::string g_hostId;
+uint64_t g_forwardCursor = 0;                // Next hot tier position to send
+std::atomic<uint64_t> g_forwardAcked{0};     // Last sequence a collector acknowledged, checkpointed
+uint64_t g_forwardResendBelow = 0;           // Stored events in (g_forwardAcked, this) are resent first
+std::vector<std::string> g_forwardInternCache;
+std::thread g_forwarderThread;
+std::atomic<bool> g_forwarderStop{false};
+std::atomic<uint64_t> g_forwardedEvents{0};
+std::atomic<uint64_t> g_forwardFailovers{0};
+std::atomic<uint64_t> g_forwardOverrun{0};   // Overwritten in memory before they could be sent
+std::atomic<uint64_t> g_forwardResent{0};    // Read back from storage after a restart
+const int64_t kPolicyOfferMicros = 60000000; // The forwarder offers its policy version this often
+
+// Policy distribution: a collector started with policy=FILE answers each agent's offer with a
+// delta from the agent's version to FILE's, or the whole image when it has no copy of that
+// version, keeping every version it has served under DIR/policy to diff against later.
+// Agents stage what they receive next to their policy image, where LoadPolicy verifies,
+// persists and swaps it as for any other delta.
+std::filesystem::path g_policyServePath;
+std::filesystem::path g_policyHistoryDir;
+std::string g_policyServeImage;              // FILE as last read, validated
+std::unordered_map<uint64_t, std::string> g_policyServeDeltas; // From version -> delta to g_policyServeImage
+std::filesystem::file_time_type g_policyServeWriteTime;
+std::mutex g_policyServeMutex;
+
+// Collector mode: "--collector port=N dir=DIR duration=S config=FILE peer=HOST:PORT name=ID
+// replicate_mb_s=N lateness_ms=N policy=FILE"
+struct CollectorConfig {
+    std::string port = "7420";
+    std::string directory = "collector";
+    double durationSec = 0.0;                // 0 = until killed
+    std::string configFileName;
+    std::string peer;                        // Replicate closed storage files to this collector
+    std::string name;                        // Name this collector replicates as (default host-port)
+    double replicateMbPerSec = 32.0;         // Replication bandwidth cap, 0 = unlimited
+    double latenessMs = 2000.0;              // Reordering window, 0 = store in arrival order
+    std::string policyFileName;              // Policy image distributed to agents
+};
+std::mutex g_collectorMutex;                 // Serializes hot tier appends from connection threads
+std::unordered_map<std::string, uint64_t> g_collectorHighWater; // Host id -> last stored sequence
+std::ofstream g_collectorObservations;       // Arrival observations for --prevalence
+std::atomic<bool> g_collectorStop{false};
+std::atomic<uint64_t> g_collectorEvents{0};
+std::atomic<uint64_t> g_collectorDuplicates{0};
+
+// Event-time reordering. Agents' batches arrive interleaved and delayed differently per
+// connection, so events are held in a min-heap on their timestamp and released once every
+// active source's watermark (the newest timestamp it has sent; each source sends in order)
+// has passed them, or once they trail the newest event by more than the allowed lateness.
+// A source that sends nothing for the lateness period stops holding the others back. Events
+// that arrive behind what was already released are late: still stored with their own time,
+// flagged and counted (the hot tier orders them at the time of the events before them).
+const uint32_t kFlagLate = 1u << 5;          // Arrived behind events already released
+struct ReorderEntry {
+    int64_t timestamp = 0;
+    uint64_t order = 0;                      // Arrival order; breaks timestamp ties
+    int64_t arrivedAt = 0;                   // ClockMicros
+    SecurityEvent event;
+};
+struct ReorderSource {
+    int64_t watermark = INT64_MIN;
+    int64_t advancedAt = 0;                  // ClockMicros of the source's last event
+};
+struct ReorderBuffer {
+    int64_t latenessMicros = 2000000;        // 0 = release in arrival order
+    std::vector<ReorderEntry> heap;          // Min-heap on (timestamp, order)
+    std::unordered_map<uint32_t, ReorderSource> sources;
+    uint64_t nextOrder = 0;
+    int64_t releasedUpTo = INT64_MIN;        // Newest timestamp released so far
+    uint64_t released = 0;
+    uint64_t late = 0;
+    uint64_t heldMicros = 0;                 // Added latency summed over released events
+    int64_t maxHeldMicros = 0;
+    size_t maxDepth = 0;
+    std::array<uint64_t, kLagBuckets> heldHistogram{}; // Same log2 buckets as the loop lag histogram
+};
+ReorderBuffer g_collectorReorder;            // Guarded by g_collectorMutex
+std::atomic<uint32_t> g_collectorConnections{0}; // Reorder source ids
+
+// Collector replication. A collector started with peer=HOST:PORT ships every closed segment,
+// index and archive file to that peer, which keeps them under replicas/<name>/ in the same
+// layout as segments/ (the directory can be opened as storage to recover). On every
+// connection the peer lists what it already holds and only the rest is sent, so catching up
+// after a disconnection or restart of either side needs no other state. Files are streamed
+// in chunks at no more than the configured rate and verified by size and FNV-1a before they
+// are renamed into place.
+const size_t kReplicaChunkBytes = 256u << 10;
+struct FileDigest {
+    uint64_t size = 0;
+    uint32_t checksum = 0;
+};
+struct ReplicaThrottle {
+    double bytesPerMicro = 0.0;              // 0 = unlimited
+    int64_t nextFree = 0;                    // Steady-clock microseconds
+};
+CollectorNode g_replicaPeer;
+std::string g_replicaName;
+double g_replicaBytesPerMicro = 0.0;
+std::thread g_replicatorThread;
+std::atomic<bool> g_replicatorStop{false};
+std::atomic<int64_t> g_replicatorDeadline{0}; // Give up on the final pass after this
+std::atomic<uint64_t> g_replicatedFiles{0};
+std::atomic<uint64_t> g_replicatedBytes{0};
+std::atomic<uint64_t> g_replicaPending{0};
+std::atomic<uint64_t> g_replicaConnects{0};
+std::filesystem::path g_replicaRoot;         // Peer side: replicas/ under the collector directory
+std::atomic<uint64_t> g_replicaReceivedFiles{0};
+std::atomic<uint64_t> g_replicaReceivedBytes{0};
+std::atomic<uint64_t> g_replicaRejected{0};
+
+// Segment shipping (ship_segments). Besides forwarding live events, an agent with storage
+// sends its closed segment, index and archive files whole to the collector it is routed to,
+// over a second connection and straight from the page cache (sendfile, TransmitFile). The
+// collector keeps them under shipped/<host>/ in the storage layout, verified by the checksum
+// each file carries in its header, and keeps partial files (.part) across disconnections: its
+// manifest gives the bytes held of each file, so an interrupted transfer resumes at that
+// offset. Shipped files are a copy of the agent's storage; events still reach the collector's
+// own storage and queries only through forwarding, backlog included.
+const uint64_t kShipSpanBytes = 8u << 20;    // Raw bytes after each FileSpan frame
+std::thread g_shipperThread;
+std::atomic<bool> g_shipperStop{false};
+std::atomic<int64_t> g_shipperDeadline{0};   // Give up on the final pass after this
+std::atomic<uint64_t> g_shippedFiles{0};
+std::atomic<uint64_t> g_shippedBytes{0};
+std::atomic<uint64_t> g_shipResumedBytes{0}; // Already held by the collector when a transfer resumed
+std::atomic<uint64_t> g_shipPending{0};
+std::atomic<uint64_t> g_shipCpuMicros{0};    // Shipper thread CPU time
+std::filesystem::path g_shipRoot;            // Collector side: shipped/ under the collector directory
+std::atomic<uint64_t> g_shipReceivedFiles{0};
+std::atomic<uint64_t> g_shipReceivedBytes{0};
+std::atomic<uint64_t> g_shipRejected{0};
+
+// Local query API. Tools on this machine connect to a UNIX-domain socket next to the
+// executable (Windows: the named pipe \\.\pipe\SecurityMonitor), send fixed-size QueryRequest
+// records and get back a QueryResponseHeader and a body, over one connection for as many
+// queries as they like. A dedicated thread answers without taking any lock the capture path
+// holds: counters come straight from their atomics, recent events from the hot tier (like
+// any other reader), and inventory from an immutable QuerySnapshot that UpdateInventory
+// republishes on change (at most every kQuerySnapshotMicros; the maintenance thread catches up).
+const uint32_t kQueryMagic = 0x31595251; // "QRY1"
+const char* const kQuerySocketName = "SecurityMonitor.sock";
+#ifdef _WIN32
+const wchar_t* const kQueryPipeName = L"\\\\.\\pipe\\SecurityMonitor";
+#endif
+enum class QueryType : uint16_t {
+    Ping = 0,
+    Inventory = 1,    // Body: varint mounted volume mask, then per device varint kind, first seen, path length, path
+    RecentEvents = 2, // Body: per event, newest first: varint sequence, timestamp, flags, kind, detail length, detail
+    Counters = 3,     // Body: per counter varint name length, name, varint value
+    RuleState = 4,    // Same encoding as Counters
+};
+enum class QueryStatus : uint16_t {
+    Ok = 0,
+    BadRequest = 1,
+    Unavailable = 2,  // E.g. recent events with the hot tier disabled
+};
+struct QueryRequest {
+    uint32_t magic = kQueryMagic;
+    uint16_t type = 0;
+    uint16_t reserved = 0;
+    uint32_t limit = 0;                      // RecentEvents: most events to return (0 = 100)
+    uint32_t kindMask = 0;                   // RecentEvents: bit per EventKind, 0 = all
+    int64_t sinceMicros = 0;                 // RecentEvents: only events at or after this Unix time
+};
+struct QueryResponseHeader {
+    uint32_t magic = kQueryMagic;
+    uint16_t type = 0;
+    uint16_t status = 0;
+    uint32_t length = 0;                     // Body bytes
+    uint32_t count = 0;                      // Records in the body
+    uint64_t stateVersion = 0;               // Inventory: g_stateVersion the snapshot was built at
+};
+const uint32_t kQueryMaxEvents = 4096;
+const int64_t kQuerySnapshotMicros = 20000;
+struct QuerySnapshot {
+    uint64_t stateVersion = 0;
+    uint32_t deviceCount = 0;
+    std::string inventory;                   // Encoded Inventory body
+};
+std::shared_ptr<const QuerySnapshot> g_querySnapshot; // Accessed with std::atomic_load/store
+std::atomic<bool> g_querySnapshotStale{false};
+std::atomic<int64_t> g_querySnapshotAt{0};  // Steady-clock microseconds
+std::atomic<bool> g_queryServerRunning{false};
+std::atomic<bool> g_queryServerStop{false};
+std::atomic<bool> g_queryServerExited{false};
+std::thread g_queryServerThread;
+#ifdef _WIN32
+std::atomic<DWORD> g_queryServerThreadId{0}; // For CancelSynchronousIo
+#else
+int g_queryListener = -1;
+#endif
+std::filesystem::path g_querySocketPath;     // Overrides the socket next to the executable (load generator)
+std::vector<std::string> g_queryInternCache; // Query thread only
+std::atomic<uint64_t> g_queriesServed{0};
+
+// Load generator settings (see RunLoadGen). Mix weights are relative, in the order
+// USB arrival, USB removal, volume mount, clipboard burst.
+struct LoadGenConfig {
+    double rate = 10000.0;         // Target arrivals per second (a clipboard burst is one arrival)
+    double durationSec = 5.0;
+    bool poisson = false;          // Open-loop Poisson arrivals instead of a fixed interval
+    std::array<double, 4> mix = {40.0, 40.0, 10.0, 10.0};
+    int clipboardBurst = 8;        // Clipboard events delivered back-to-back per burst
+    double maxBacklogMs = 1000.0;  // Events scheduled further in the past than this are shed
+    std::string logFileName = "SecurityMonitorLoadGen.txt";
+    uint32_t stageSampleEvery = 0; // Sample stage counters for 1 in N events, 0 = off
+    bool hugePages = false;        // Record latency samples into a pinned huge-page buffer
+    std::string configFileName;    // Load and watch this config file during the run
+    std::string checkpointFileName; // Restore from this checkpoint before the run, write it after
+    std::string storageDir;         // Run the storage manager against this directory
+    std::string search;             // With storageDir: substring query checked against the read-back
+    std::string prevalenceFileName; // Rate arrivals against this fleet prevalence filter
+    std::string policyFileName;     // Apply this policy image (and its deltas) during the run
+    std::string riskModelFileName;  // Score arrivals with this risk model
+    std::string collectors;         // Forward events to these collectors (host:port,...)
+    std::string hostId;             // Host id to forward as
+    std::string querySocket;        // Serve the query API on this UNIX socket during the run
+    bool virtualClock = false;      // Replay on a virtual clock: no waiting, periodic work run inline
+};
+
+struct LoadGenResult {
+    uint64_t offered = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    double elapsedSec = 0.0;
+    double throughput = 0.0;       // Delivered events per second
+    double p50Us = 0.0, p90Us = 0.0, p99Us = 0.0, p999Us = 0.0, maxUs = 0.0;
+    double firstEventUs = 0.0;     // Latency of the first delivered event (cold caches and pages)
+    double virtualSec = 0.0;       // Virtual time covered by a replay
+    std::string sampleMemory;      // DescribePinnedBuffer of the latency sample buffer
+};
+
+// Benchmark runner settings (see RunBenchCommand)
+struct BenchConfig {
+    int repetitions = 5;
+    double warmupSec = 1.0;
+    int cpu = -1;                  // Pin the benchmark thread to this CPU, -1 to leave unpinned
+    double tolerancePct = 5.0;     // Minimum relative change treated as a regression
+    double noiseFactor = 3.0;      // Changes within this many MADs of either run are noise
+    std::string baselinePath;      // Compare against this JSON baseline
+    std::string savePath;          // Write this run's results as a JSON baseline
+    uint32_t stageSampleEvery = 0; // Sample stage counters for 1 in N events, 0 = off
+    std::string filter;            // Only run benchmarks whose name starts with this
+};
+
+// One benchmark's aggregated result: medians across repetitions plus median absolute deviations
+struct BenchResult {
+    std::string name;
+    double throughput = 0.0, throughputMad = 0.0;
+    double p50Us = 0.0, p99Us = 0.0, p99Mad = 0.0;
+    int repetitions = 0;
+    std::vector<std::pair<std::string, double>> stageMetrics; // e.g. "decode_cycles", informational only
+};
 
 // --- Function Prototypes ---
 std::string GetTimestamp();
-void LogEvent(const std::string& message);
-void LogError(const std::string& context, DWORD errorCode);
+bool LogEvent(const std::string& message, DropReason* failure = nullptr);
 std::filesystem::path GetExecutableDirectory();
+int64_t SteadyMicros();
+int64_t ThreadCpuMicros();
+int64_t ClockMicros();
+void StartVirtualClock(int64_t unixMicros);
+void AdvanceVirtualClock(int64_t unixMicros);
+void StopVirtualClock();
+void RecordLoopLag(int64_t lagMicros);
+std::string FormatLagHistogram();
+bool PostHeartbeat(int64_t sentMicros);
+void WatchdogThreadProc();
+void StartWatchdog();
+void StopWatchdog();
+void MaintenanceThreadProc();
+void StartMaintenance();
+void StopMaintenance();
+std::string WideToUtf8(const std::wstring& wide);
+SecurityEvent DecodeDeviceInterface(bool arrival, bool isUsb, const wchar_t* name);
+SecurityEvent DecodeVolume(bool arrival, uint32_t unitMask);
+uint32_t EvaluateEvent(const SecurityEvent& event);
+std::string FormatEvent(const SecurityEvent& event);
+bool DispatchEvent(SecurityEvent event);
+void RecordDrop(EventKind kind, DropReason reason);
+bool EmitLossReport(bool force);
+bool OpenPerfCounters(PerfCounterGroup& group);
+bool ReadPerfCounters(const PerfCounterGroup& group, uint64_t values[kPerfCounters]);
+void ResetStageStats();
+std::string FormatStageStats();
+bool AllocatePinnedBuffer(PinnedBuffer& buffer, size_t size, bool pinned);
+void FreePinnedBuffer(PinnedBuffer& buffer);
+std::string DescribePinnedBuffer(const PinnedBuffer& buffer);
+bool OpenLogFile(const std::filesystem::path& path, std::ios::openmode mode);
+const ConfigImage& CurrentConfig();
+uint32_t ConfigChecksum(const ConfigImage& image);
+bool CompileConfig(const std::string& text, ConfigImage& image, std::string& error);
+void PublishConfig(const ConfigImage& image, bool initial);
+bool ReloadConfig(bool initial, std::string& error);
+void ConfigWatcherThreadProc();
+void StartConfigWatcher();
+void StopConfigWatcher();
+void UpdateInventory(const SecurityEvent& event);
+uint32_t Fnv1a(const void* data, size_t size, uint32_t hash = 2166136261u);
+bool WriteCheckpoint(bool force);
+void ExtendSequenceReservation(uint64_t sequence);
+bool RestoreCheckpoint(std::string& summary);
+bool MapFileReadOnly(const std::filesystem::path& path, MappedFile& mapped);
+void UnmapFile(MappedFile& mapped);
+uint32_t InternDevice(const std::string& path);
+std::string DevicePath(uint32_t id);
+bool InitHotTier(size_t budgetBytes);
+void AppendHotTier(const SecurityEvent& event);
+void RecordHotTierOverrun(uint64_t from, uint64_t to, DropReason reason);
+uint64_t HotTierOldestIntact();
+bool HotTierRange(int64_t fromMicros, int64_t toMicros, uint64_t& first, uint64_t& last);
+HotTierCounts QueryHotTierCounts(int64_t fromMicros, int64_t toMicros);
+unsigned LowestBit(uint64_t mask);
+bool MatchHotTierSlot(size_t slot, const EventPredicate& predicate);
+uint64_t MatchHotTierBlockScalar(size_t begin, size_t count, const EventPredicate& predicate);
+uint64_t MatchHotTierBlock(size_t begin, size_t count, const EventPredicate& predicate);
+std::vector<uint64_t> QueryHotTierSequences(int64_t fromMicros, int64_t toMicros, const EventPredicate& predicate, size_t limit);
+int64_t UnixMicrosNow();
+int64_t SystemMicros();
+int64_t ReadTsc();
+bool TscInvariant();
+TimestampSample SampleTimestampSources(bool tsc);
+void PublishTimestampCalibration(int64_t ticks, int64_t unixMicros, double microsPerTick, bool tsc);
+void InitTimestampClock();
+bool RecalibrateTimestamps(bool force);
+std::string FormatTimestampStats();
+SecurityEvent HotTierEvent(size_t slot, std::vector<std::string>& internCache);
+std::string StoredMessage(const SecurityEvent& event, const std::vector<std::string>& internCache);
+void PutVarint(std::string& output, uint64_t value);
+bool GetVarint(const char*& input, const char* end, uint64_t& value);
+size_t CompressLz(const char* input, size_t size, std::string& output);
+bool DecompressLz(const char* input, size_t size, char* output, size_t outputSize);
+size_t SegmentBodyBytes(uint64_t count, uint64_t textBytes);
+bool ParseSegmentBody(const char* body, size_t size, const SegmentHeader& header, SegmentView& view);
+bool WriteFileAtomically(const std::filesystem::path& path, const std::string& header, const std::string& body);
+bool WriteFileDirect(const std::filesystem::path& path, const std::string& header, const std::string& body);
+bool WriteStorageFile(const std::filesystem::path& path, const std::string& header, const std::string& body);
+uint64_t PageCacheBytes(const std::filesystem::path& path);
+bool InitStorage(const std::filesystem::path& directory, std::string& summary);
+bool DrainHotTier();
+bool CloseSegment();
+bool ArchiveSegment(StoredSegment& segment);
+void StorageTick(bool flush);
+void StorageThreadProc();
+void StartStorage();
+void StopStorage();
+bool LoadSegment(const StoredSegment& segment, LoadedSegment& loaded);
+size_t FindSubstring(const char* text, size_t size, const char* needle, size_t length);
+size_t BuildTrigramIndex(const SegmentView& view, std::string& output);
+bool ParseTrigramIndex(const char* data, size_t size, IndexView& view);
+bool CandidateBlocks(const IndexView& index, const std::string& needle, std::vector<uint8_t>& blocks);
+void SearchSegment(const SegmentView& view, const std::vector<uint8_t>* candidates, const std::string& needle, int64_t fromMicros,
+                   int64_t toMicros, size_t limit, std::vector<StoredEvent>& events);
+std::vector<StoredEvent> ReadEvents(int64_t fromMicros, int64_t toMicros, size_t limit, const std::string& contains = std::string());
+std::vector<StoredEvent> ReadStoredSequences(uint64_t after, uint64_t below, size_t limit);
+std::string StoredEventDetail(EventKind kind, const std::string& message);
+uint64_t Hash64(const void* data, size_t size);
+std::string DeviceModelKey(const std::string& path);
+void CuckooPosition(uint64_t hash, uint64_t bucketCount, uint16_t& fingerprint, uint64_t& first, uint64_t& second);
+bool CuckooContains(const uint16_t* slots, uint64_t bucketCount, uint64_t hash);
+bool CuckooInsert(CuckooFilter& filter, uint64_t hash);
+bool CuckooRemove(CuckooFilter& filter, uint64_t hash);
+bool LoadPrevalenceFilter(bool force);
+std::string FormatEventFlags(uint32_t flags);
+bool ParsePrevalenceArgs(int argc, char* argv[], PrevalenceConfig& config);
+int RunPrevalenceCommand(int argc, char* argv[]);
+bool CompilePolicy(const std::string& text, std::string& image, std::string& error);
+bool ParsePolicyImage(const std::string& bytes, PolicyImage& policy);
+std::string MakePolicyDelta(const std::string& base, const std::string& target);
+bool ApplyPolicyDelta(const std::string& base, const std::string& delta, std::string& target, std::string& error);
+bool ReadWholeFile(const std::filesystem::path& path, std::string& bytes);
+std::filesystem::path PolicyFilePath();
+bool LoadPolicy(bool force);
+std::string PolicyUpdateFor(uint64_t version, uint32_t checksum);
+bool ExchangePolicy(SocketHandle connection);
+uint32_t PolicyFlags(const PolicyImage& policy, uint64_t modelHash);
+uint32_t InterpretPolicyFlags(const PolicyImage& policy, uint64_t modelHash);
+void FreePolicyCode(PolicyCode& code);
+bool CompilePolicyCode(PolicyImage& policy, std::string& error);
+std::string PreparePolicyMatcher(PolicyImage& policy);
+int RunPolicyCommand(int argc, char* argv[]);
+bool ParseRiskDump(const std::string& text, std::vector<std::vector<RiskDumpNode>>& trees, std::string& error);
+bool BuildRiskModel(const std::vector<std::vector<RiskDumpNode>>& trees, float baseMargin, float threshold, std::string& bytes,
+                    std::string& error);
+int RiskDumpDepth(const std::vector<RiskDumpNode>& tree, int32_t node, int level);
+void FillRiskTree(const std::vector<RiskDumpNode>& tree, int32_t node, uint32_t slot, uint32_t level, uint32_t depth,
+                  RiskNode* nodes, float* leaves);
+bool ParseRiskModel(const std::string& bytes, RiskModel& model);
+bool LoadRiskModel(bool force);
+float RiskScore(const RiskModel& model, const float* features);
+uint8_t RiskDeviceClass(const std::string& path);
+void RiskFeatures(const SecurityEvent& event, float fleetRare, float* features);
+int RunRiskCommand(int argc, char* argv[]);
+void Sha256Init(Sha256& sha);
+void Sha256Blocks(uint32_t* state, const uint8_t* data, size_t blocks);
+void Sha256Update(Sha256& sha, const void* data, size_t size);
+std::string Sha256Final(Sha256& sha);
+bool StatExecutable(const std::filesystem::path& path, ExecutableKey& key);
+bool HashFile(const std::filesystem::path& path, uint64_t expectedSize, std::vector<char>& buffer, std::string& hex);
+bool FindCachedHash(const ExecutableKey& key, std::string& sha256);
+void CacheHash(const ExecutableKey& key, const std::string& sha256);
+void ClearHashCache();
+bool StartHashPool(uint32_t workers);
+void StopHashPool();
+bool HashExecutable(const std::filesystem::path& path, HashCallback done);
+bool SubmitVolumeScan(const std::string& root, uint64_t sequence);
+void ScanVolume(const HashRequest& request);
+void HashWorkerProc();
+std::string FormatHashStats();
+bool InitNetwork();
+void CloseSocket(SocketHandle socket);
+int WaitReadable(SocketHandle socket, int timeoutMs);
+SocketHandle ConnectTcp(const std::string& host, const std::string& port, int timeoutMs);
+SocketHandle ListenTcp(const std::string& port);
+void SetSocketTimeout(SocketHandle socket, int timeoutMs);
+bool SendAll(SocketHandle socket, const char* data, size_t size);
+bool RecvAll(SocketHandle socket, char* data, size_t size);
+bool SendFrame(SocketHandle socket, FrameType type, const std::string& payload);
+bool RecvFrame(SocketHandle socket, FrameType& type, std::string& payload);
+std::string LocalHostName();
+HashRing BuildHashRing(const std::vector<std::string>& nodes, uint32_t virtualNodes);
+int RouteOnRing(const HashRing& ring, uint64_t keyHash, const std::function<bool(uint32_t)>& usable);
+int64_t BackoffUntil(uint32_t failures);
+bool StartForwarder(const std::string& collectors, const std::string& hostId);
+void ForwarderThreadProc();
+void StopForwarder();
+std::string FormatForwarderStats();
+bool ReorderLater(const ReorderEntry& a, const ReorderEntry& b);
+void ReorderAdd(ReorderBuffer& buffer, uint32_t source, SecurityEvent event, int64_t now);
+void ReorderRelease(ReorderBuffer& buffer, int64_t now, std::vector<SecurityEvent>& released);
+std::string FormatReorderStats(const ReorderBuffer& buffer);
+void StoreCollectedEvents(int64_t now);
+void CollectorConnectionProc(SocketHandle socket);
+int RunCollectorCommand(int argc, char* argv[]);
+bool IsReplicaFileName(const std::string& name);
+std::vector<std::string> ListStorageFiles(const std::filesystem::path& directory);
+bool KeepCopying(const std::atomic<bool>& stop, const std::atomic<int64_t>& deadline, bool& finalPass);
+void ThrottleReplica(ReplicaThrottle& throttle, size_t bytes);
+bool DigestFile(const std::filesystem::path& path, ReplicaThrottle& throttle, FileDigest& digest);
+bool SendReplicaFile(SocketHandle socket, const std::filesystem::path& path, const std::string& name,
+                     ReplicaThrottle& throttle, FileDigest& digest);
+bool StartReplicator(const std::string& peer, const std::string& name, double megabytesPerSec);
+void ReplicatorThreadProc();
+void StopReplicator();
+std::string FormatReplicationStats();
+void ReceiveReplica(SocketHandle socket, const std::string& source);
+bool ReadStorageChecksum(const std::filesystem::path& path, uint32_t& checksum);
+bool VerifyStorageFile(const std::filesystem::path& path, const std::string& name, uint32_t& checksum);
+bool ShipFile(SocketHandle socket, const std::filesystem::path& path, const std::string& name, uint64_t offset,
+              ReplicaThrottle& throttle, bool& stored);
+bool StartShipper();
+void ShipperThreadProc();
+void StopShipper();
+std::string FormatShippingStats();
+void ReceiveShipment(SocketHandle socket, const std::string& host);
+void PublishQuerySnapshot();
+std::string AnswerQuery(const QueryRequest& request);
+bool StartQueryServer();
+void QueryServerThreadProc();
+void StopQueryServer();
+int RunQueryCommand(int argc, char* argv[]);
+std::string FormatStorageStats();
+bool ParseLoadGenArgs(int argc, char* argv[], LoadGenConfig& config);
+void ReplayTick();
+LoadGenResult RunLoadGen(const LoadGenConfig& config);
+std::string FormatLoadGenResult(const LoadGenResult& result);
+int RunLoadGenCommand(int argc, char* argv[]);
+bool ParseBenchArgs(int argc, char* argv[], BenchConfig& config);
+bool PinCurrentThread(int cpu);
+double Median(std::vector<double> values);
+double MedianAbsDeviation(const std::vector<double>& values, double median);
+std::vector<BenchResult> RunBenchSuite(const BenchConfig& config);
+BenchResult RunMicroBench(const std::string& name, const BenchConfig& config, size_t iterations, const std::function<void()>& op);
+void RunMicroBenchmarks(const BenchConfig& config, std::vector<BenchResult>& results);
+bool WriteBenchJson(const std::string& path, const std::vector<BenchResult>& results);
+bool ReadBenchJson(const std::string& path, std::vector<BenchResult>& results);
+bool CompareBenchResults(const std::vector<BenchResult>& baseline, const std::vector<BenchResult>& current, const BenchConfig& config);
+int RunBenchCommand(int argc, char* argv[]);
+#ifdef _WIN32
+void LogError(const std::string& context, DWORD errorCode);
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 bool RegisterDeviceNotifications(HWND hwnd);
+int RunMonitor();
+#endif
+
+// --- Implementation ---
+
+// Get current timestamp as string. Formatting (localtime + put_time) costs far more than
+// reading the clock, so each thread redoes it only when the second changes.
+std::string GetTimestamp() {
+    thread_local int64_t cachedSecond = -1;
+    thread_local std::string cachedPrefix;
+    int64_t second = UnixMicrosNow() / 1000000;
+    if (second == cachedSecond) return cachedPrefix;
+    try {
+        auto now_c = (std::time_t)second;
+        std::tm now_tm;
+#ifdef _WIN32
+        localtime_s(&now_tm, &now_c); // Use safer localtime_s on Windows
+#else
+        localtime_r(&now_c, &now_tm);
+#endif
+        std::stringstream ss;
+        ss << std::put_time(&now_tm, "[%Y-%m-%d %H:%M:%S] ");
+        cachedPrefix = ss.str();
+        cachedSecond = second;
+        return cachedPrefix;
+    } catch (const std::exception& e) {
+        std::cerr << "Error getting timestamp: " << e.what() << std::endl;
+        return "[TIMESTAMP_ERROR] ";
+    }
+}
+
+// Log an event to the file and console. Returns false if the event did not reach the log file,
+// with the reason in *failure if given.
+bool LogEvent(const std::string& message, DropReason* failure) {
+    std::lock_guard<std::mutex> lock(g_logMutex);
+    std::string timedMessage = GetTimestamp() + message;
+    if (g_consoleEcho) {
+        std::cout << timedMessage << std::endl; // Also print to console for visibility
+    }
+    if (g_logFile.is_open()) {
+        g_logFile << timedMessage << std::endl;
+        g_logFile.flush(); // Ensure it's written immediately
+        if (g_logFile.fail()) {
+             std::cerr << GetTimestamp() << "FATAL: Failed to write to log file '" << g_logFilePath.string() << "'!" << std::endl;
+             // Consider more drastic action here? Maybe try reopening?
+             g_logFile.clear(); // Let later writes retry instead of failing forever on a sticky failbit
+             if (failure) *failure = DropReason::LogWriteFailed;
+             return false;
+        }
+        return true;
+    } else {
+         std::cerr << GetTimestamp() << "ERROR: Log file is not open. Cannot log: " << message << std::endl;
+         if (failure) *failure = DropReason::LogNotOpen;
+         return false;
+    }
+}
+
+#ifdef _WIN32
+// Log an error, including Windows error code
+void LogError(const std::string& context, DWORD errorCode) {
+     LPSTR messageBuffer = nullptr;
+     size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                                  NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
+
+     std::string errorMessage(messageBuffer, size);
+     LocalFree(messageBuffer); // Free the buffer allocated by FormatMessage
+
+     std::string logMsg = "ERROR in " + context + ": " + errorMessage + " (Code: " + std::to_string(errorCode) + ")";
+     LogEvent(logMsg); // Log it like a regular event
+}
+
+#endif
+
+// Get the directory where the executable is running
+std::filesystem::path GetExecutableDirectory() {
+#ifndef _WIN32
+    std::error_code ec;
+    std::filesystem::path exePath = std::filesystem::read_symlink("/proc/self/exe", ec);
+    if (ec) {
+        std::cerr << "FATAL: Failed to get executable path: " << ec.message() << std::endl;
+        return std::filesystem::current_path();
+    }
+    return exePath.parent_path();
+#else
+    wchar_t path[MAX_PATH] = {0};
+    // Use GetModuleFileNameW for Unicode path support
+    if (GetModuleFileNameW(NULL, path, MAX_PATH) == 0) {
+        DWORD error = GetLastError();
+         std::cerr << "FATAL: Failed to get executable path. Error code: " << error << std::endl;
+         // Fallback or exit? For now, return current dir, but log the error severely.
+         LogError("GetExecutableDirectory/GetModuleFileNameW", error);
+         return std::filesystem::current_path();
+    }
+    std::filesystem::path exePath(path);
+    return exePath.parent_path(); // Return the directory part
+#endif
+}
+
+
+// Monotonic time in microseconds, used for lag measurement only (never logged as wall time)
+int64_t SteadyMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time (user + system) consumed so far by the calling thread
+int64_t ThreadCpuMicros() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+    auto micros = [](const FILETIME& t) { return (int64_t)((((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime) / 10); };
+    return micros(kernel) + micros(user);
+#else
+    timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) return 0;
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+// Monotonic time in microseconds for time-driven logic; virtual during a replay
+int64_t ClockMicros() {
+    int64_t offset = g_clockOffset.load(std::memory_order_relaxed);
+    if (!g_virtualClock.load(std::memory_order_relaxed)) return SteadyMicros() + offset;
+    return offset + g_virtualClockMicros.load(std::memory_order_relaxed) - g_virtualClockStart;
+}
+
+// Freeze the logic clock at the current time and drive it from virtual Unix time
+void StartVirtualClock(int64_t unixMicros) {
+    g_clockOffset.store(ClockMicros());
+    g_virtualClockStart = unixMicros;
+    g_virtualClockMicros.store(unixMicros);
+    g_virtualClock.store(true);
+}
+
+// Move virtual time forward; it never goes backwards
+void AdvanceVirtualClock(int64_t unixMicros) {
+    int64_t current = g_virtualClockMicros.load(std::memory_order_relaxed);
+    while (unixMicros > current && !g_virtualClockMicros.compare_exchange_weak(current, unixMicros, std::memory_order_relaxed)) {
+    }
+}
+
+// Back to real time, continuing from where the virtual clock got to
+void StopVirtualClock() {
+    if (!g_virtualClock.load()) return;
+    int64_t reached = ClockMicros();
+    g_virtualClock.store(false);
+    g_clockOffset.store(reached - SteadyMicros());
+}
+
+// Add one heartbeat lag sample to the histogram
+void RecordLoopLag(int64_t lagMicros) {
+    size_t bucket = 0;
+    while (bucket + 1 < kLagBuckets && lagMicros >= (int64_t(1) << bucket)) {
+        ++bucket;
+    }
+    g_lagHistogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Render the non-empty histogram buckets as "<2^i us:count" pairs
+std::string FormatLagHistogram() {
+    std::stringstream ss;
+    uint64_t total = 0;
+    for (size_t i = 0; i < kLagBuckets; ++i) {
+        uint64_t count = g_lagHistogram[i].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        total += count;
+        if (i + 1 == kLagBuckets) {
+            ss << " >=" << (int64_t(1) << (i - 1)) << "us:" << count;
+        } else {
+            ss << " <" << (int64_t(1) << i) << "us:" << count;
+        }
+    }
+    return "Capture loop lag histogram (" + std::to_string(total) + " samples):" + (total ? ss.str() : " none");
+}
+
+// Hand a heartbeat to the capture loop. Only this step is platform specific; a Linux epoll
+// loop would answer the same heartbeat from an eventfd instead of a window message.
+bool PostHeartbeat(int64_t sentMicros) {
+#ifdef _WIN32
+    return PostMessage(g_hwnd, WM_APP_HEARTBEAT, 0, (LPARAM)sentMicros) != FALSE;
+#else
+    (void)sentMicros;
+    return false; // No capture loop to answer it
+#endif
+}
+
+// Watchdog thread: posts heartbeats to the capture loop and reports when one goes unanswered.
+void WatchdogThreadProc() {
+    while (!g_watchdogStop.load()) {
+        std::this_thread::sleep_for(g_heartbeatInterval);
+        int64_t now = SteadyMicros();
+        int64_t pending = g_heartbeatPendingSince.load();
+        if (pending == 0) {
+            g_heartbeatPendingSince.store(now);
+            if (!PostHeartbeat(now)) {
+                g_heartbeatPendingSince.store(0); // Queue full or window gone; retry next tick
+            }
+        } else if (now - pending > (int64_t)CurrentConfig().loopLagWarnMs * 1000
+                   && !g_loopStallReported.exchange(true)) {
+            std::string warning = "WARNING: Capture loop blocked for " + std::to_string((now - pending) / 1000) +
+                                  " ms; device/clipboard notifications are queuing up.";
+            // The loop may be stuck inside LogEvent itself, so get the warning out on stderr first
+            std::cerr << warning << std::endl;
+            LogEvent(warning);
+        }
+    }
+}
+
+void StartWatchdog() {
+    g_watchdogStop.store(false);
+    g_watchdogThread = std::thread(WatchdogThreadProc);
+}
+
+void StopWatchdog() {
+    g_watchdogStop.store(true);
+    if (g_watchdogThread.joinable()) {
+        g_watchdogThread.join();
+    }
+}
+
+// Maintenance thread: the periodic work each function rate-limits by its own interval
+void MaintenanceThreadProc() {
+    while (!g_maintenanceStop.load()) {
+        EmitLossReport(false);
+        WriteCheckpoint(false);
+        RecalibrateTimestamps(false);
+        LoadPrevalenceFilter(false);
+        LoadPolicy(false);
+        LoadRiskModel(false);
+        if (g_querySnapshotStale.load()) {
+            std::lock_guard<std::mutex> lock(g_inventoryMutex);
+            PublishQuerySnapshot();
+        }
+        std::unique_lock<std::mutex> lock(g_maintenanceWakeMutex);
+        g_maintenanceWake.wait_for(lock, kMaintenanceInterval, [] { return g_maintenanceStop.load(); });
+    }
+}
+
+void StartMaintenance() {
+    g_maintenanceStop.store(false);
+    g_maintenanceThread = std::thread(MaintenanceThreadProc);
+}
+
+void StopMaintenance() {
+    if (!g_maintenanceThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(g_maintenanceWakeMutex);
+        g_maintenanceStop.store(true);
+    }
+    g_maintenanceWake.notify_all();
+    g_maintenanceThread.join();
+}
+
+
+// --- Stage Counters ---
+// Optional per-stage sampling of wall time and, on Linux, perf_event_open hardware counters.
+// Everything still works (wall time only) when counters can't be opened: other OSes, VMs
+// without a PMU, or perf_event_paranoid forbidding it.
+
+bool OpenPerfCounters(PerfCounterGroup& group) {
+    group.opened = true;
+#ifdef __linux__
+    static const uint64_t configs[kPerfCounters] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    // Count kernel time too (syscalls in the write stage) unless perf_event_paranoid forbids it
+    for (int excludeKernel = 0; excludeKernel <= 1; ++excludeKernel) {
+        bool ok = true;
+        for (size_t i = 0; i < kPerfCounters && ok; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.disabled = (i == 0);
+            attr.exclude_kernel = excludeKernel;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            int leader = (i == 0) ? -1 : group.fds[0];
+            group.fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            ok = group.fds[i] >= 0;
+        }
+        if (ok) {
+            ioctl(group.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            group.available = true;
+            return true;
+        }
+        int error = errno;
+        for (int& fd : group.fds) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+        if (excludeKernel == 1) {
+            std::lock_guard<std::mutex> lock(g_perfReasonMutex);
+            g_perfUnavailableReason = std::string("perf_event_open: ") + std::strerror(error);
+        }
+    }
+    return false;
+#else
+    std::lock_guard<std::mutex> lock(g_perfReasonMutex);
+    g_perfUnavailableReason = "not supported on this platform";
+    return false;
+#endif
+}
+
+bool ReadPerfCounters(const PerfCounterGroup& group, uint64_t values[kPerfCounters]) {
+#ifdef __linux__
+    struct {
+        uint64_t count;
+        uint64_t values[kPerfCounters];
+    } data;
+    if (read(group.fds[0], &data, sizeof(data)) != (ssize_t)sizeof(data) || data.count != kPerfCounters) {
+        return false;
+    }
+    std::memcpy(values, data.values, sizeof(data.values));
+    return true;
+#else
+    (void)group;
+    (void)values;
+    return false;
+#endif
+}
+
+StageTimer::StageTimer(Stage s) : stage(s) {
+    uint32_t every = g_stageSampleEvery.load(std::memory_order_relaxed);
+    if (every == 0 || ++t_stageTick[(size_t)s] % every != 0) {
+        return;
+    }
+    active = true;
+    if (!t_perfGroup.opened) {
+        OpenPerfCounters(t_perfGroup);
+    }
+    haveCounts = t_perfGroup.available && ReadPerfCounters(t_perfGroup, startCounts);
+    startNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+StageTimer::~StageTimer() {
+    if (!active) return;
+    int64_t endNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t endCounts[kPerfCounters];
+    StageStats& stats = g_stageStats[(size_t)stage];
+    stats.samples.fetch_add(1, std::memory_order_relaxed);
+    stats.nanos.fetch_add((uint64_t)(endNanos - startNanos), std::memory_order_relaxed);
+    if (haveCounts && ReadPerfCounters(t_perfGroup, endCounts)) {
+        stats.counterSamples.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < kPerfCounters; ++i) {
+            stats.counters[i].fetch_add(endCounts[i] - startCounts[i], std::memory_order_relaxed);
+        }
+    }
+}
+
+void ResetStageStats() {
+    for (StageStats& stats : g_stageStats) {
+        stats.samples.store(0);
+        stats.nanos.store(0);
+        stats.counterSamples.store(0);
+        for (auto& counter : stats.counters) counter.store(0);
+    }
+}
+
+// One line per-stage summary: mean wall time and hardware counts per sampled execution
+std::string FormatStageStats() {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << "Stage counters (1 in " << g_stageSampleEvery.load() << "):";
+    bool anyCounts = false;
+    for (size_t i = 0; i < (size_t)Stage::Count; ++i) {
+        const StageStats& stats = g_stageStats[i];
+        uint64_t samples = stats.samples.load();
+        if (samples == 0) continue;
+        ss << " " << kStageNames[i] << "[n=" << samples << " ns=" << (double)stats.nanos.load() / samples;
+        uint64_t counted = stats.counterSamples.load();
+        if (counted > 0) {
+            anyCounts = true;
+            double cycles = (double)stats.counters[0].load() / counted;
+            double instructions = (double)stats.counters[1].load() / counted;
+            ss << " cycles=" << cycles << " ipc=" << std::setprecision(2) << (cycles > 0 ? instructions / cycles : 0.0)
+               << std::setprecision(1) << " cache_misses=" << (double)stats.counters[2].load() / counted
+               << " branch_misses=" << (double)stats.counters[3].load() / counted;
+        }
+        ss << "]";
+    }
+    if (!anyCounts) {
+        std::lock_guard<std::mutex> lock(g_perfReasonMutex);
+        ss << " hardware counters unavailable"
+           << (g_perfUnavailableReason.empty() ? std::string() : " (" + g_perfUnavailableReason + ")");
+    }
+    return ss.str();
+}
+
+// --- Pinned Buffers ---
+
+#ifdef _WIN32
+// Large pages need SeLockMemoryPrivilege enabled in the process token
+bool EnableLockMemoryPrivilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool ok = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+              AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+              GetLastError() == ERROR_SUCCESS; // AdjustTokenPrivileges "succeeds" without assigning it
+    CloseHandle(token);
+    return ok;
+}
+#endif
+
+bool AllocatePinnedBuffer(PinnedBuffer& buffer, size_t size, bool pinned) {
+    FreePinnedBuffer(buffer);
+    if (!pinned) {
+        buffer.data = std::malloc(size);
+        buffer.size = size;
+        return buffer.data != nullptr;
+    }
+#ifdef _WIN32
+    static bool privilegeEnabled = EnableLockMemoryPrivilege();
+    SIZE_T largePage = GetLargePageMinimum();
+    if (privilegeEnabled && largePage > 0) {
+        SIZE_T rounded = (size + largePage - 1) / largePage * largePage;
+        buffer.data = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (buffer.data) {
+            // Large pages are always resident and non-pageable
+            buffer.size = rounded;
+            buffer.mapped = buffer.hugePages = buffer.locked = true;
+            return true;
+        }
+    }
+    buffer.data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!buffer.data) return false;
+    buffer.size = size;
+    buffer.mapped = true;
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        static_cast<volatile char*>(buffer.data)[offset] = 0; // Pre-fault
+    }
+    buffer.locked = VirtualLock(buffer.data, size) != FALSE;
+    return true;
+#else
+    const size_t hugePage = 2 * 1024 * 1024;
+    size_t rounded = (size + hugePage - 1) / hugePage * hugePage;
+    int populate = 0;
+#ifdef MAP_POPULATE
+    populate = MAP_POPULATE;
+#endif
+    void* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit huge pages only work if the admin reserved some (vm.nr_hugepages)
+    data = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    buffer.hugePages = (data != MAP_FAILED);
+#endif
+    if (data == MAP_FAILED) {
+        data = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+        buffer.transparentHuge = madvise(data, rounded, MADV_HUGEPAGE) == 0;
+#endif
+        for (size_t offset = 0; offset < rounded; offset += 4096) {
+            static_cast<volatile char*>(data)[offset] = 0; // Pre-fault after the advice so THP can back it
+        }
+    }
+    buffer.data = data;
+    buffer.size = rounded;
+    buffer.mapped = true;
+    buffer.locked = mlock(data, rounded) == 0; // Fails without CAP_IPC_LOCK or enough RLIMIT_MEMLOCK
+    return true;
+#endif
+}
+
+void FreePinnedBuffer(PinnedBuffer& buffer) {
+    if (!buffer.data) return;
+    if (!buffer.mapped) {
+        std::free(buffer.data);
+    } else {
+#ifdef _WIN32
+        VirtualFree(buffer.data, 0, MEM_RELEASE);
+#else
+        munmap(buffer.data, buffer.size);
+#endif
+    }
+    buffer = PinnedBuffer();
+}
+
+std::string DescribePinnedBuffer(const PinnedBuffer& buffer) {
+    if (!buffer.mapped) return "heap";
+    std::string pages = buffer.hugePages ? "huge pages" : buffer.transparentHuge ? "transparent huge pages (advised)" : "4K pages";
+    return pages + ", pre-faulted, " + (buffer.locked ? "locked" : "not locked");
+}
+
+// Open g_logFile, giving it a pinned stream buffer first when --hugepages is on
+bool OpenLogFile(const std::filesystem::path& path, std::ios::openmode mode) {
+    g_logFilePath = path;
+    if (g_useHugePages && AllocatePinnedBuffer(g_logBuffer, kLogBufferSize, true)) {
+        g_logFile.rdbuf()->pubsetbuf(static_cast<char*>(g_logBuffer.data), (std::streamsize)g_logBuffer.size);
+    }
+    g_logFile.open(path, mode);
+    return g_logFile.is_open();
+}
+
+// --- Configuration ---
+
+const ConfigImage& CurrentConfig() {
+    static const ConfigImage defaults;
+    const ConfigImage* image = g_config.load(std::memory_order_acquire);
+    return image ? *image : defaults;
+}
+
+uint32_t Fnv1a(const void* data, size_t size, uint32_t hash) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t ConfigChecksum(const ConfigImage& image) {
+    return Fnv1a(&image, offsetof(ConfigImage, checksum));
+}
+
+// Parse "key = value" lines ('#' starts a comment) into a validated image. On error the
+// image is left in an unspecified state and error names the offending line.
+bool CompileConfig(const std::string& text, ConfigImage& image, std::string& error) {
+    image = ConfigImage();
+    std::stringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    auto trim = [](std::string str) {
+        size_t first = str.find_first_not_of(" \t\r");
+        size_t last = str.find_last_not_of(" \t\r");
+        return first == std::string::npos ? std::string() : str.substr(first, last - first + 1);
+    };
+    auto parseBool = [](const std::string& value, uint8_t& out) {
+        if (value == "true" || value == "1" || value == "yes") { out = 1; return true; }
+        if (value == "false" || value == "0" || value == "no") { out = 0; return true; }
+        return false;
+    };
+    auto parseUint = [](const std::string& value, uint32_t minimum, uint32_t maximum, uint32_t& out) {
+        try {
+            size_t used = 0;
+            unsigned long parsed = std::stoul(value, &used);
+            if (used != value.size() || parsed < minimum || parsed > maximum) return false;
+            out = (uint32_t)parsed;
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    };
+
+    while (std::getline(lines, line)) {
+        ++lineNumber;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        line = trim(line);
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            error = "line " + std::to_string(lineNumber) + ": expected key = value";
+            return false;
+        }
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+        bool ok = true;
+        uint8_t flag = 0;
+        if (key == "log_file") {
+            ok = !value.empty() && value.size() < sizeof(image.logFileName) &&
+                 value.find_first_of("/\\:") == std::string::npos; // A file name next to the executable
+            if (ok) std::strncpy(image.logFileName, value.c_str(), sizeof(image.logFileName) - 1);
+        } else if (key == "prevalence_file") {
+            ok = !value.empty() && value.size() < sizeof(image.prevalenceFileName) &&
+                 value.find_first_of("/\\:") == std::string::npos;
+            if (ok) std::strncpy(image.prevalenceFileName, value.c_str(), sizeof(image.prevalenceFileName) - 1);
+        } else if (key == "policy_file") {
+            ok = !value.empty() && value.size() < sizeof(image.policyFileName) &&
+                 value.find_first_of("/\\:") == std::string::npos;
+            if (ok) std::strncpy(image.policyFileName, value.c_str(), sizeof(image.policyFileName) - 1);
+        } else if (key == "risk_model_file") {
+            ok = !value.empty() && value.size() < sizeof(image.riskModelFileName) &&
+                 value.find_first_of("/\\:") == std::string::npos;
+            if (ok) std::strncpy(image.riskModelFileName, value.c_str(), sizeof(image.riskModelFileName) - 1);
+        } else if (key == "collectors") {
+            ok = value.size() < sizeof(image.collectors);
+            if (ok) std::strncpy(image.collectors, value.c_str(), sizeof(image.collectors) - 1);
+        } else if (key == "host_id") {
+            ok = value.size() < sizeof(image.hostId) && value.find_first_not_of(kNodeNameChars) == std::string::npos &&
+                 (value.empty() || value[0] != '.');
+            if (ok) std::strncpy(image.hostId, value.c_str(), sizeof(image.hostId) - 1);
+        } else if (key == "virtual_nodes") {
+            ok = parseUint(value, 1, 4096, image.virtualNodes);
+        } else if (key == "device_filter") {
+            ok = (value == "all" || value == "usb");
+            image.deviceFilterUsbOnly = (value == "usb");
+        } else if (key == "log_usb") {
+            ok = parseBool(value, flag);
+            image.logKinds[(size_t)EventKind::UsbArrival] = image.logKinds[(size_t)EventKind::UsbRemoval] = flag;
+        } else if (key == "log_device_interfaces") {
+            ok = parseBool(value, flag);
+            image.logKinds[(size_t)EventKind::DeviceArrival] = image.logKinds[(size_t)EventKind::DeviceRemoval] = flag;
+        } else if (key == "log_volumes") {
+            ok = parseBool(value, flag);
+            image.logKinds[(size_t)EventKind::VolumeMount] = image.logKinds[(size_t)EventKind::VolumeRemoval] = flag;
+        } else if (key == "log_clipboard") {
+            ok = parseBool(value, image.logKinds[(size_t)EventKind::Clipboard]);
+        } else if (key == "hugepages") {
+            ok = parseBool(value, image.hugePages);
+        } else if (key == "loop_lag_warn_ms") {
+            ok = parseUint(value, 10, 600000, image.loopLagWarnMs);
+        } else if (key == "loss_report_interval_s") {
+            ok = parseUint(value, 1, 86400, image.lossReportIntervalSec);
+        } else if (key == "stage_sample_every") {
+            ok = parseUint(value, 0, 1000000, image.stageSampleEvery);
+        } else if (key == "hot_tier_mb") {
+            ok = parseUint(value, 0, 65536, image.hotTierMb);
+        } else if (key == "checkpoint_interval_s") {
+            ok = parseUint(value, 0, 86400, image.checkpointIntervalSec);
+        } else if (key == "storage") {
+            ok = parseBool(value, image.storage);
+        } else if (key == "query_api") {
+            ok = parseBool(value, image.queryApi);
+        } else if (key == "policy_jit") {
+            ok = parseBool(value, image.policyJit);
+        } else if (key == "storage_io") {
+            ok = (value == "direct" || value == "buffered");
+            image.directStorageIo = (value == "direct");
+        } else if (key == "ship_segments") {
+            ok = parseBool(value, image.shipSegments);
+        } else if (key == "ship_mb_s") {
+            ok = parseUint(value, 0, 100000, image.shipMbPerSec);
+        } else if (key == "hash_executables") {
+            ok = parseBool(value, image.hashExecutables);
+        } else if (key == "hash_workers") {
+            ok = parseUint(value, 1, 64, image.hashWorkers);
+        } else if (key == "timestamp_source") {
+            ok = (value == "tsc" || value == "os");
+            image.tscTimestamps = (value == "tsc");
+        } else if (key == "segment_events") {
+            ok = parseUint(value, 1024, 1u << 24, image.segmentEvents);
+        } else if (key == "segment_max_age_s") {
+            ok = parseUint(value, 1, 86400, image.segmentMaxAgeSec);
+        } else if (key == "archive_after_s") {
+            ok = parseUint(value, 0, 365 * 86400, image.archiveAfterSec);
+        } else if (key == "segment_budget_mb") {
+            ok = parseUint(value, 1, 1u << 20, image.segmentBudgetMb);
+        } else {
+            error = "line " + std::to_string(lineNumber) + ": unknown key '" + key + "'";
+            return false;
+        }
+        if (!ok) {
+            error = "line " + std::to_string(lineNumber) + ": invalid value '" + value + "' for " + key;
+            return false;
+        }
+    }
+    image.checksum = ConfigChecksum(image);
+    return true;
+}
+
+// Make image the current configuration and apply the settings that need more than a re-read
+void PublishConfig(const ConfigImage& image, bool initial) {
+    std::lock_guard<std::mutex> lock(g_configPublishMutex);
+    const ConfigImage& previous = CurrentConfig();
+    std::unique_ptr<ConfigImage> published(new ConfigImage(image));
+    published->generation = previous.generation + 1;
+    published->checksum = ConfigChecksum(*published);
+    bool logFileChanged = std::strcmp(previous.logFileName, published->logFileName) != 0;
+    bool filterChanged = previous.deviceFilterUsbOnly != published->deviceFilterUsbOnly;
+    g_config.store(published.get(), std::memory_order_release);
+    g_configImages.push_back(std::move(published));
+
+    g_stageSampleEvery.store(image.stageSampleEvery);
+    if (initial) return;
+    if (logFileChanged) {
+        std::lock_guard<std::mutex> logLock(g_logMutex);
+        std::filesystem::path newPath = g_logFilePath.parent_path() / image.logFileName;
+        g_logFile.close();
+        g_logFile.clear();
+        g_logFile.open(newPath, std::ios::app);
+        g_logFilePath = newPath;
+    }
+#ifdef _WIN32
+    if (filterChanged && g_hwnd) {
+        PostMessage(g_hwnd, WM_APP_CONFIG_CHANGED, 0, 0); // Notifications must be re-registered on the capture thread
+    }
+#else
+    (void)filterChanged;
+#endif
+}
+
+// Read, compile and publish g_configPath. A missing file means defaults; an invalid file keeps
+// the current configuration. Reload cost and time since the file changed are logged.
+bool ReloadConfig(bool initial, std::string& error) {
+    int64_t start = SteadyMicros();
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(g_configPath, ec);
+    std::ifstream in(g_configPath);
+    if (!in.is_open()) {
+        if (initial) {
+            PublishConfig(ConfigImage(), true);
+            return true;
+        }
+        error = "cannot open " + g_configPath.string();
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    ConfigImage image;
+    if (!CompileConfig(text.str(), image, error)) {
+        if (initial) PublishConfig(ConfigImage(), true);
+        return false;
+    }
+    PublishConfig(image, initial);
+    int64_t cost = SteadyMicros() - start;
+    if (!initial) {
+        std::string message = "Configuration reloaded (generation " + std::to_string(CurrentConfig().generation) +
+                              "): compile+publish " + std::to_string(cost) + " us";
+        if (!ec) {
+            auto sinceChange = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::filesystem::file_time_type::clock::now() - modified).count();
+            message += ", in effect " + std::to_string(sinceChange) + " ms after the file changed";
+        }
+        LogEvent(message);
+    }
+    return true;
+}
+
+// Watches the config file's directory and reloads when the file is written or replaced
+void ConfigWatcherThreadProc() {
+    std::filesystem::path dir = g_configPath.parent_path();
+    std::string name = g_configPath.filename().string();
+#ifdef _WIN32
+    HANDLE change = FindFirstChangeNotificationW(dir.wstring().c_str(), FALSE,
+                                                 FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (change == INVALID_HANDLE_VALUE) {
+        LogError("FindFirstChangeNotificationW (config watcher)", GetLastError());
+        return;
+    }
+    std::error_code ec;
+    auto lastSeen = std::filesystem::last_write_time(g_configPath, ec);
+    while (!g_configWatcherStop.load()) {
+        if (WaitForSingleObject(change, 500) == WAIT_OBJECT_0) {
+            // The notification covers the whole directory (including our own log); only
+            // reload if the config file itself changed
+            auto modified = std::filesystem::last_write_time(g_configPath, ec);
+            if (!ec && modified != lastSeen) {
+                lastSeen = modified;
+                std::string error;
+                if (!ReloadConfig(false, error)) LogEvent("WARNING: Configuration reload rejected: " + error);
+            }
+            FindNextChangeNotification(change);
+        }
+    }
+    FindCloseChangeNotification(change);
+#else
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LogEvent(std::string("WARNING: Config watcher unavailable: ") + std::strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    alignas(inotify_event) char buffer[4096];
+    while (!g_configWatcherStop.load()) {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        bool changed = false;
+        ssize_t length;
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length;) {
+                inotify_event* event = reinterpret_cast<inotify_event*>(p);
+                if (event->len > 0 && name == event->name) changed = true;
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (changed) {
+            std::string error;
+            if (!ReloadConfig(false, error)) LogEvent("WARNING: Configuration reload rejected: " + error);
+        }
+    }
+    close(fd);
+#endif
+}
+
+void StartConfigWatcher() {
+    g_configWatcherStop.store(false);
+    g_configWatcherThread = std::thread(ConfigWatcherThreadProc);
+}
+
+void StopConfigWatcher() {
+    g_configWatcherStop.store(true);
+    if (g_configWatcherThread.joinable()) {
+        g_configWatcherThread.join();
+    }
+}
+
+// Convert a wide device path to UTF-8 for logging
+std::string WideToUtf8(const std::wstring& wide) {
+    if (wide.empty()) return std::string();
+#ifdef _WIN32
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wide[0], (int)wide.size(), NULL, 0, NULL, NULL);
+    std::string narrow(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, &wide[0], (int)wide.size(), &narrow[0], size_needed, NULL, NULL);
+    return narrow;
+#else
+    // wchar_t is UTF-32 here
+    std::string narrow;
+    narrow.reserve(wide.size());
+    for (wchar_t wc : wide) {
+        uint32_t c = (uint32_t)wc;
+        if (c < 0x80) {
+            narrow += (char)c;
+        } else if (c < 0x800) {
+            narrow += (char)(0xC0 | (c >> 6));
+            narrow += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            narrow += (char)(0xE0 | (c >> 12));
+            narrow += (char)(0x80 | ((c >> 6) & 0x3F));
+            narrow += (char)(0x80 | (c & 0x3F));
+        } else {
+            narrow += (char)(0xF0 | (c >> 18));
+            narrow += (char)(0x80 | ((c >> 12) & 0x3F));
+            narrow += (char)(0x80 | ((c >> 6) & 0x3F));
+            narrow += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return narrow;
+#endif
+}
+
+// --- Event Pipeline ---
+// Decode (notification -> SecurityEvent), format, then write. WindowProc and the load
+// generator both feed events through these functions.
+
+SecurityEvent DecodeDeviceInterface(bool arrival, bool isUsb, const wchar_t* name) {
+    StageTimer timer(Stage::Decode);
+    SecurityEvent event;
+    if (isUsb) {
+        event.kind = arrival ? EventKind::UsbArrival : EventKind::UsbRemoval;
+    } else {
+        event.kind = arrival ? EventKind::DeviceArrival : EventKind::DeviceRemoval;
+    }
+    event.detail = WideToUtf8(name ? std::wstring(name) : std::wstring());
+    return event;
+}
+
+SecurityEvent DecodeVolume(bool arrival, uint32_t unitMask) {
+    StageTimer timer(Stage::Decode);
+    SecurityEvent event;
+    event.kind = arrival ? EventKind::VolumeMount : EventKind::VolumeRemoval;
+    event.unitMask = unitMask;
+    if (arrival) {
+        // Get drive letter
+        char driveLetter = '?';
+        for (char i = 0; i < 26; ++i) {
+            if (unitMask & (1u << i)) {
+                driveLetter = 'A' + i;
+                break;
+            }
+        }
+        event.detail = std::string(1, driveLetter) + ":\\";
+    }
+    return event;
+}
+
+// Render an event as the log line text (without timestamp)
+std::string FormatEvent(const SecurityEvent& event) {
+    switch (event.kind) {
+        case EventKind::UsbArrival:    return "USB Device Plugged In: " + event.detail;
+        case EventKind::UsbRemoval:    return "USB Device Removed: " + event.detail;
+        case EventKind::DeviceArrival: return "Non-USB Device Interface Arrival (Potential Driver/Software Install?): " + event.detail;
+        case EventKind::DeviceRemoval: return "Non-USB Device Interface Removal: " + event.detail;
+        case EventKind::VolumeMount:   return "Volume/Drive Mounted: " + event.detail;
+        case EventKind::VolumeRemoval: return "Volume/Drive Removed.";
+        case EventKind::Clipboard:     return "Clipboard content changed (Copy/Paste detected).";
+        default:                       return "Unknown event.";
+    }
+}
+
+// Rules stage: returns flags describing the event
+uint32_t EvaluateEvent(const SecurityEvent& event) {
+    uint32_t flags = 0;
+    if (event.kind == EventKind::UsbArrival || event.kind == EventKind::DeviceArrival) {
+        std::shared_ptr<const PrevalenceFilter> filter = std::atomic_load(&g_prevalence);
+        std::shared_ptr<const PolicyImage> policy = std::atomic_load(&g_policy);
+        std::shared_ptr<const RiskModel> model = std::atomic_load(&g_riskModel);
+        if (filter || policy) {
+            std::string key = DeviceModelKey(event.detail);
+            uint64_t hash = Hash64(key.data(), key.size());
+            if (filter) flags |= CuckooContains(filter->slots, filter->header->bucketCount, hash) ? kFlagFleetCommon : kFlagFleetRare;
+            if (policy) flags |= PolicyFlags(*policy, hash);
+        }
+        if (model) {
+            float features[(size_t)RiskFeature::Count];
+            RiskFeatures(event, filter ? ((flags & kFlagFleetRare) ? 1.0f : 0.0f) : 0.5f, features);
+            if (RiskScore(*model, features) >= model->header->threshold) flags |= kFlagRisky;
+        }
+    }
+    return flags;
+}
+
+// Log line suffix for flags set by the rules stage
+std::string FormatEventFlags(uint32_t flags) {
+    std::string suffix;
+    if (flags & kFlagBlocklisted) suffix += " [policy: blocked]";
+    if (flags & kFlagAllowlisted) suffix += " [policy: allowed]";
+    if (flags & kFlagFleetRare) suffix += " [fleet: rare]";
+    if (flags & kFlagFleetCommon) suffix += " [fleet: common]";
+    if (flags & kFlagRisky) suffix += " [risk: high]";
+    if (flags & kFlagLate) suffix += " [late]";
+    return suffix;
+}
+
+// Push one decoded event through the rest of the pipeline. Log lines carry the event's
+// sequence number ("#N") so gaps are visible to consumers.
+bool DispatchEvent(SecurityEvent event) {
+    UpdateInventory(event);
+    if (!CurrentConfig().logKinds[(size_t)event.kind]) {
+        return true; // Filtered out by configuration; not a loss, so no sequence number
+    }
+    event.sequence = g_nextSequence.fetch_add(1, std::memory_order_relaxed);
+    event.timestampMicros = UnixMicrosNow();
+    uint64_t highWater = g_sequenceHighWater.load(std::memory_order_relaxed);
+    if (highWater != 0 && event.sequence + kSequenceReserve / 2 >= highWater) {
+        ExtendSequenceReservation(event.sequence);
+    }
+    {
+        StageTimer timer(Stage::Rules);
+        event.flags = EvaluateEvent(event);
+    }
+    std::string message;
+    {
+        StageTimer timer(Stage::Serialize);
+        message = "#" + std::to_string(event.sequence) + " " + FormatEvent(event) + FormatEventFlags(event.flags);
+    }
+    DropReason reason = DropReason::LogWriteFailed;
+    bool logged;
+    {
+        StageTimer timer(Stage::Write);
+        logged = LogEvent(message, &reason);
+    }
+    // The scan's hashes are logged on their own lines, whether or not this one made it
+    if (event.kind == EventKind::VolumeMount) SubmitVolumeScan(event.detail, event.sequence);
+    if (!logged) {
+        RecordDrop(event.kind, reason);
+        return false;
+    }
+    // Only events the log kept reach memory, storage and collectors, so every consumer agrees
+    // with the loss report about what was lost
+    AppendHotTier(event);
+    return true;
+}
+
+// Track plugged-in devices and mounted volumes
+void UpdateInventory(const SecurityEvent& event) {
+    std::lock_guard<std::mutex> lock(g_inventoryMutex);
+    switch (event.kind) {
+        case EventKind::UsbArrival:
+        case EventKind::DeviceArrival:
+            if (g_inventory.find(event.detail) == g_inventory.end()) {
+                InventoryEntry entry;
+                entry.kind = event.kind;
+                entry.firstSeen = UnixMicrosNow() / 1000000;
+                g_inventory.emplace(event.detail, entry);
+            }
+            break;
+        case EventKind::UsbRemoval:
+        case EventKind::DeviceRemoval:
+            g_inventory.erase(event.detail);
+            break;
+        case EventKind::VolumeMount:
+            g_mountedVolumes |= event.unitMask;
+            break;
+        case EventKind::VolumeRemoval:
+            g_mountedVolumes &= ~event.unitMask;
+            break;
+        default:
+            return; // No state change
+    }
+    g_stateVersion.fetch_add(1, std::memory_order_relaxed);
+    if (g_queryServerRunning.load(std::memory_order_relaxed)) {
+        if (SteadyMicros() - g_querySnapshotAt.load(std::memory_order_relaxed) >= kQuerySnapshotMicros) {
+            PublishQuerySnapshot();
+        } else {
+            g_querySnapshotStale.store(true, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Count a lost event. Callers dropping an event before DispatchEvent must also take a
+// sequence number for it so the gap shows up in the log.
+void RecordDrop(EventKind kind, DropReason reason) {
+    g_dropCounts[(size_t)reason][(size_t)kind].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Log a loss report if anything was dropped since the last one (or always, if forced and
+// there has ever been a loss). Executable hash requests dropped from the enrichment pool are
+// reported alongside: the events were logged, but without their hashes. If the report itself
+// can't be written the counts stay pending and roll into the next report.
+bool EmitLossReport(bool force) {
+    static int64_t lastReport = 0;
+    std::lock_guard<std::mutex> lock(g_lossReportMutex);
+    int64_t now = ClockMicros();
+    if (!force && now - lastReport < (int64_t)CurrentConfig().lossReportIntervalSec * 1000000) {
+        return false;
+    }
+    lastReport = now;
+
+    std::array<std::array<uint64_t, (size_t)EventKind::Count>, (size_t)DropReason::Count> current;
+    uint64_t sinceLast = 0, total = 0;
+    std::stringstream details;
+    for (size_t r = 0; r < (size_t)DropReason::Count; ++r) {
+        for (size_t k = 0; k < (size_t)EventKind::Count; ++k) {
+            current[r][k] = g_dropCounts[r][k].load(std::memory_order_relaxed);
+            uint64_t delta = current[r][k] - g_dropCountsReported[r][k];
+            total += current[r][k];
+            if (delta == 0) continue;
+            details << (sinceLast ? ", " : " ") << kEventKindNames[k] << "/" << kDropReasonNames[r] << "=" << delta;
+            sinceLast += delta;
+        }
+    }
+    const uint64_t hashDropped = g_hashDropped.load();
+    if (hashDropped < g_hashDroppedReported) g_hashDroppedReported = 0; // Reset by a benchmark
+    const uint64_t hashSinceLast = hashDropped - g_hashDroppedReported;
+    if (sinceLast == 0 && hashSinceLast == 0 && !(force && total > 0)) {
+        return false;
+    }
+    std::string report = "LOSS REPORT: " + std::to_string(sinceLast) + " events dropped since last report (" +
+                         std::to_string(total) + " total, next sequence #" + std::to_string(g_nextSequence.load()) + ")" +
+                         (sinceLast ? ":" + details.str() : std::string("."));
+    if (hashSinceLast) {
+        report += (sinceLast ? "; " : " ") + std::to_string(hashSinceLast) + " executable hash requests dropped (" +
+                  std::to_string(hashDropped) + " total)";
+    }
+    if (LogEvent(report)) {
+        g_dropCountsReported = current;
+        g_hashDroppedReported = hashDropped;
+        g_stateVersion.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+// --- Timestamps ---
+
+int64_t SystemMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64_t ReadTsc() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return (int64_t)__rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return (int64_t)__builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// CPUID 0x80000007 EDX bit 8: the TSC ticks at a constant rate in every P-, C- and T-state
+bool TscInvariant() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if ((unsigned)regs[0] < 0x80000007u) return false;
+    __cpuid(regs, 0x80000007);
+    return ((unsigned)regs[3] >> 8) & 1;
+#elif defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && ((edx >> 8) & 1);
+#else
+    return false;
+#endif
+}
+
+// Read the tick source alongside both OS clocks; the tightest of a few tries pins the tick
+// reading to the clock readings
+TimestampSample SampleTimestampSources(bool tsc) {
+    TimestampSample best;
+    int64_t bestWindow = INT64_MAX;
+    for (int i = 0; i < 5; ++i) {
+        TimestampSample sample;
+        int64_t before = tsc ? ReadTsc() : 0;
+        sample.steadyNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        sample.unixMicros = SystemMicros();
+        int64_t after = tsc ? ReadTsc() : 0;
+        sample.ticks = tsc ? before + (after - before) / 2 : sample.steadyNanos;
+        if (after - before < bestWindow) {
+            bestWindow = after - before;
+            best = sample;
+        }
+    }
+    return best;
+}
+
+void PublishTimestampCalibration(int64_t ticks, int64_t unixMicros, double microsPerTick, bool tsc) {
+    uint32_t sequence = g_timestampSequence.load(std::memory_order_relaxed);
+    g_timestampSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    g_timestampCalibration.ticks.store(ticks, std::memory_order_relaxed);
+    g_timestampCalibration.unixMicros.store(unixMicros, std::memory_order_relaxed);
+    g_timestampCalibration.microsPerTick.store(microsPerTick, std::memory_order_relaxed);
+    g_timestampCalibration.tsc.store(tsc, std::memory_order_relaxed);
+    g_timestampSequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Pick the tick source and measure its rate against the monotonic clock over a short sleep
+void InitTimestampClock() {
+    std::lock_guard<std::mutex> lock(g_timestampMutex);
+    bool tsc = CurrentConfig().tscTimestamps && TscInvariant();
+    g_timestampFallbackReason = !CurrentConfig().tscTimestamps ? "timestamp_source = os" : tsc ? "" : "no invariant TSC";
+    double microsPerTick = 0.001; // steady_clock nanoseconds
+    TimestampSample sample = SampleTimestampSources(tsc);
+    if (tsc) {
+        TimestampSample first = sample;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        sample = SampleTimestampSources(true);
+        microsPerTick = (sample.steadyNanos - first.steadyNanos) / 1000.0 / (double)(sample.ticks - first.ticks);
+        if (!(microsPerTick > 1e-5 && microsPerTick < 1e-2)) { // Outside 100 MHz - 100 GHz
+            tsc = false;
+            g_timestampFallbackReason = "TSC rate out of range";
+            microsPerTick = 0.001;
+            sample = SampleTimestampSources(false);
+        }
+    }
+    g_timestampAnchor = sample;
+    g_timestampTickRate = microsPerTick;
+    g_timestampCalibratedAt = SteadyMicros();
+    PublishTimestampCalibration(sample.ticks, sample.unixMicros, microsPerTick, tsc);
+}
+
+// Compare the calibrated clock with the system clock, record the drift and re-anchor: slew
+// small drift out over the next interval, step past large drift (the system clock was set).
+// Falls back to the monotonic clock for good if the TSC rate moves or the TSC goes backwards.
+bool RecalibrateTimestamps(bool force) {
+    std::unique_lock<std::mutex> lock(g_timestampMutex);
+    if (g_timestampCalibration.microsPerTick.load() == 0.0) return false; // Not initialized
+    int64_t now = SteadyMicros();
+    if (!force && now - g_timestampCalibratedAt < kTimestampIntervalMicros) return false;
+    bool tsc = g_timestampCalibration.tsc.load();
+    double microsPerTick = g_timestampCalibration.microsPerTick.load();
+    TimestampSample sample = SampleTimestampSources(tsc);
+    int64_t predicted = g_timestampCalibration.unixMicros.load() +
+                        (int64_t)((sample.ticks - g_timestampCalibration.ticks.load()) * microsPerTick);
+    int64_t drift = predicted - sample.unixMicros;
+    g_timestampDrift.store(drift);
+    if (std::abs(drift) > g_timestampMaxDrift.load()) g_timestampMaxDrift.store(std::abs(drift));
+    g_timestampCalibrations.fetch_add(1);
+
+    std::string warning;
+    if (tsc) {
+        double measured = sample.ticks > g_timestampAnchor.ticks
+                              ? (sample.steadyNanos - g_timestampAnchor.steadyNanos) / 1000.0 / (double)(sample.ticks - g_timestampAnchor.ticks)
+                              : 0.0;
+        if (!CurrentConfig().tscTimestamps) {
+            g_timestampFallbackReason = "timestamp_source = os";
+            warning = "Timestamps now use the OS monotonic clock (timestamp_source = os)";
+        } else if (std::abs(measured / g_timestampTickRate - 1.0) > kTscMaxRateChange) {
+            // Against the last measured rate: the published one includes the slew
+            g_timestampFallbackReason = measured > 0 ? "TSC rate changed" : "TSC went backwards";
+            warning = "WARNING: " + g_timestampFallbackReason + "; timestamps now use the OS monotonic clock";
+        }
+        if (warning.empty()) {
+            microsPerTick = measured;
+        } else {
+            tsc = false;
+            sample = SampleTimestampSources(false);
+            microsPerTick = 0.001;
+        }
+    } else {
+        microsPerTick = 0.001;
+    }
+    g_timestampTickRate = microsPerTick;
+    int64_t anchorMicros = predicted;
+    if (std::abs(drift) > kTimestampStepMicros) {
+        anchorMicros = sample.unixMicros;
+        g_timestampSteps.fetch_add(1);
+    } else {
+        // Land on the system clock at the next calibration
+        microsPerTick *= (double)(kTimestampIntervalMicros - drift) / kTimestampIntervalMicros;
+    }
+    g_timestampAnchor = sample;
+    g_timestampCalibratedAt = now;
+    PublishTimestampCalibration(sample.ticks, anchorMicros, microsPerTick, tsc);
+    lock.unlock();
+    if (!warning.empty()) LogEvent(warning);
+    return true;
+}
+
+// Unix microseconds from the calibrated tick source; virtual during a replay
+int64_t UnixMicrosNow() {
+    if (g_virtualClock.load(std::memory_order_relaxed)) return g_virtualClockMicros.load(std::memory_order_relaxed);
+    for (;;) {
+        uint32_t sequence = g_timestampSequence.load(std::memory_order_acquire);
+        int64_t ticks = g_timestampCalibration.ticks.load(std::memory_order_relaxed);
+        int64_t unixMicros = g_timestampCalibration.unixMicros.load(std::memory_order_relaxed);
+        double microsPerTick = g_timestampCalibration.microsPerTick.load(std::memory_order_relaxed);
+        bool tsc = g_timestampCalibration.tsc.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((sequence & 1) || sequence != g_timestampSequence.load(std::memory_order_relaxed)) continue;
+        if (microsPerTick == 0.0) return SystemMicros();
+        int64_t now = tsc ? ReadTsc()
+                          : std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        return unixMicros + (int64_t)((now - ticks) * microsPerTick);
+    }
+}
+
+std::string FormatTimestampStats() {
+    std::lock_guard<std::mutex> lock(g_timestampMutex);
+    std::stringstream ss;
+    double microsPerTick = g_timestampCalibration.microsPerTick.load();
+    ss << std::fixed << std::setprecision(1) << "Timestamps: ";
+    if (microsPerTick == 0.0) return ss.str() + "system clock (not calibrated)";
+    if (g_timestampCalibration.tsc.load()) {
+        ss << "invariant TSC at " << 1.0 / microsPerTick << " MHz";
+    } else {
+        ss << "OS monotonic clock (" << g_timestampFallbackReason << ")";
+    }
+    ss << ", " << g_timestampCalibrations.load() << " calibrations, drift against the system clock last=" << g_timestampDrift.load()
+       << "us max=" << g_timestampMaxDrift.load() << "us, " << g_timestampSteps.load() << " steps";
+    return ss.str();
+}
+
+// --- Hot Tier ---
+
+uint32_t InternDevice(const std::string& path) {
+    if (path.empty()) return 0;
+    std::lock_guard<std::mutex> lock(g_internMutex);
+    auto it = g_deviceIds.find(path);
+    if (it != g_deviceIds.end()) return it->second;
+    uint32_t id = (uint32_t)g_devicePaths.size();
+    g_devicePaths.push_back(path);
+    g_deviceIds.emplace(path, id);
+    return id;
+}
+
+std::string DevicePath(uint32_t id) {
+    std::lock_guard<std::mutex> lock(g_internMutex);
+    return id < g_devicePaths.size() ? g_devicePaths[id] : std::string();
+}
+
+// Size the ring to the largest power of two that fits the budget. Columns share one buffer
+// (pinned when --hugepages/hugepages = true).
+bool InitHotTier(size_t budgetBytes) {
+    FreePinnedBuffer(g_hotTier.memory);
+    g_hotTier.capacity = 0;
+    g_hotTier.head.store(0);
+    size_t capacity = 1;
+    while (capacity * 2 * kHotTierBytesPerEvent <= budgetBytes) capacity *= 2;
+    if (capacity < 1024) return false; // Budget too small to be useful; hot tier disabled
+    if (!AllocatePinnedBuffer(g_hotTier.memory, capacity * kHotTierBytesPerEvent, g_useHugePages)) return false;
+    char* base = static_cast<char*>(g_hotTier.memory.data);
+    g_hotTier.timestamps = reinterpret_cast<int64_t*>(base);
+    g_hotTier.eventTimes = reinterpret_cast<int64_t*>(base + capacity * 8);
+    g_hotTier.sequences = reinterpret_cast<uint64_t*>(base + capacity * 16);
+    g_hotTier.deviceIds = reinterpret_cast<uint32_t*>(base + capacity * 24);
+    g_hotTier.hostIds = reinterpret_cast<uint32_t*>(base + capacity * 28);
+    g_hotTier.flags = reinterpret_cast<uint32_t*>(base + capacity * 32);
+    g_hotTier.kinds = reinterpret_cast<uint8_t*>(base + capacity * 36);
+    g_hotTier.capacity = capacity;
+    return true;
+}
+
+void AppendHotTier(const SecurityEvent& event) {
+    if (g_hotTier.capacity == 0) return;
+    uint64_t head = g_hotTier.head.load(std::memory_order_relaxed);
+    size_t slot = (size_t)(head & (g_hotTier.capacity - 1));
+    int64_t previous = head ? g_hotTier.timestamps[(head - 1) & (g_hotTier.capacity - 1)] : 0;
+    g_hotTier.timestamps[slot] = std::max(event.timestampMicros, previous); // Keep sorted across clock steps and late events
+    g_hotTier.eventTimes[slot] = event.timestampMicros;
+    g_hotTier.sequences[slot] = event.sequence;
+    g_hotTier.deviceIds[slot] = InternDevice(event.detail);
+    g_hotTier.hostIds[slot] = event.hostId;
+    g_hotTier.flags[slot] = event.flags;
+    g_hotTier.kinds[slot] = (uint8_t)event.kind;
+    g_hotTier.head.store(head + 1, std::memory_order_release);
+}
+
+// Count hot tier positions [from, to) that were overwritten before a reader got to them, by
+// the kind now in each slot (once lapped, that of a newer event; the total stays exact)
+void RecordHotTierOverrun(uint64_t from, uint64_t to, DropReason reason) {
+    const size_t mask = g_hotTier.capacity - 1;
+    for (uint64_t position = from; position < to; ++position) {
+        uint8_t kind = g_hotTier.kinds[position & mask];
+        RecordDrop(kind < (uint8_t)EventKind::Count ? (EventKind)kind : EventKind::Clipboard, reason);
+    }
+}
+
+// First hot tier position the writer cannot have started overwriting. Bulk readers check it
+// again after copying slots: anything they copied from below it may be torn.
+uint64_t HotTierOldestIntact() {
+    const uint64_t window = g_hotTier.capacity - g_hotTier.capacity / 8;
+    std::atomic_thread_fence(std::memory_order_acquire); // Keeps the slot reads before the head load
+    uint64_t head = g_hotTier.head.load(std::memory_order_relaxed);
+    return head > window ? head - window : 0;
+}
+
+// Find the logical index range [first, last) of events with timestamps in [from, to) by
+// binary search over the sorted timestamp column. The oldest kHotTierGuard slots are excluded
+// because the writer may be overwriting them while a query runs.
+bool HotTierRange(int64_t fromMicros, int64_t toMicros, uint64_t& first, uint64_t& last) {
+    if (g_hotTier.capacity == 0) return false;
+    const uint64_t guard = g_hotTier.capacity / 8;
+    uint64_t head = g_hotTier.head.load(std::memory_order_acquire);
+    uint64_t oldest = head > g_hotTier.capacity - guard ? head - (g_hotTier.capacity - guard) : 0;
+    const size_t mask = g_hotTier.capacity - 1;
+    auto lowerBound = [&](int64_t t) {
+        uint64_t lo = oldest, hi = head;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (g_hotTier.timestamps[mid & mask] < t) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    };
+    first = lowerBound(fromMicros);
+    last = lowerBound(toMicros);
+    return true;
+}
+
+// Per-kind counts over a time range: one branch-free counting pass per kind over at most two
+// contiguous slices of the kind column, which compilers vectorize
+HotTierCounts QueryHotTierCounts(int64_t fromMicros, int64_t toMicros) {
+    HotTierCounts counts;
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        uint64_t first, last;
+        if (!HotTierRange(fromMicros, toMicros, first, last)) return counts;
+        counts = HotTierCounts();
+        const size_t mask = g_hotTier.capacity - 1;
+        uint64_t position = first;
+        while (position < last) {
+            size_t begin = (size_t)(position & mask);
+            size_t end = (size_t)std::min<uint64_t>(g_hotTier.capacity, begin + (last - position));
+            const uint8_t* kinds = g_hotTier.kinds;
+            for (uint8_t k = 0; k < (uint8_t)EventKind::Count; ++k) {
+                uint32_t count = 0; // Narrow accumulator keeps more lanes per vector
+                for (size_t i = begin; i < end; ++i) {
+                    count += (kinds[i] == k);
+                }
+                counts.byKind[k] += count;
+            }
+            position += end - begin;
+        }
+        counts.total = last - first;
+        // If the writer lapped the range while we read it, the counts may be torn; retry
+        uint64_t head = g_hotTier.head.load(std::memory_order_acquire);
+        if (head < g_hotTier.capacity || first >= head - g_hotTier.capacity) break;
+    }
+    return counts;
+}
+
+// Index of the lowest set bit of a nonzero mask
+unsigned LowestBit(uint64_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+
+bool MatchHotTierSlot(size_t slot, const EventPredicate& predicate) {
+    return (predicate.kindMask == 0 || ((predicate.kindMask >> g_hotTier.kinds[slot]) & 1u)) &&
+           (predicate.deviceId == 0 || g_hotTier.deviceIds[slot] == predicate.deviceId) &&
+           (predicate.flagsAny == 0 || (g_hotTier.flags[slot] & predicate.flagsAny));
+}
+
+// Match bitmask of count (<= 64) contiguous slots from begin, one event at a time
+uint64_t MatchHotTierBlockScalar(size_t begin, size_t count, const EventPredicate& predicate) {
+    uint64_t matches = 0;
+    for (size_t i = 0; i < count; ++i) {
+        matches |= (uint64_t)MatchHotTierSlot(begin + i, predicate) << i;
+    }
+    return matches;
+}
+
+// The same mask, evaluating each predicate over 16 slots per step: kinds as bytes (one
+// compare per wanted kind), device ids and flags as 32-bit lanes
+uint64_t MatchHotTierBlock(size_t begin, size_t count, const EventPredicate& predicate) {
+    size_t i = 0;
+    uint64_t matches = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const uint32_t allKinds = (1u << (uint32_t)EventKind::Count) - 1;
+    const uint32_t kinds = predicate.kindMask & allKinds;
+    const bool anyKind = predicate.kindMask == 0 || kinds == allKinds;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i device = _mm_set1_epi32((int)predicate.deviceId);
+    const __m128i flagsAny = _mm_set1_epi32((int)predicate.flagsAny);
+    for (; i + 16 <= count; i += 16) {
+        uint64_t bits = 0xFFFF;
+        if (!anyKind) {
+            __m128i column = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_hotTier.kinds + begin + i));
+            __m128i hit = zero;
+            for (uint32_t k = 0; k < (uint32_t)EventKind::Count; ++k) {
+                if (kinds & (1u << k)) hit = _mm_or_si128(hit, _mm_cmpeq_epi8(column, _mm_set1_epi8((char)k)));
+            }
+            bits &= (uint64_t)_mm_movemask_epi8(hit);
+        }
+        if (predicate.deviceId != 0) {
+            uint64_t deviceBits = 0;
+            for (size_t j = 0; j < 16; j += 4) {
+                __m128i ids = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_hotTier.deviceIds + begin + i + j));
+                deviceBits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ids, device))) << j;
+            }
+            bits &= deviceBits;
+        }
+        if (predicate.flagsAny != 0) {
+            uint64_t flagBits = 0;
+            for (size_t j = 0; j < 16; j += 4) {
+                __m128i flags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_hotTier.flags + begin + i + j));
+                __m128i none = _mm_cmpeq_epi32(_mm_and_si128(flags, flagsAny), zero);
+                flagBits |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(none)) & 0xF) << j;
+            }
+            bits &= flagBits;
+        }
+        matches |= bits << i;
+    }
+#endif
+    if (i < count) matches |= MatchHotTierBlockScalar(begin + i, count - i, predicate) << i;
+    return matches;
+}
+
+// Sequence numbers of events in a time range matching a predicate, evaluated in batches of
+// 64 over at most two contiguous slices of the columns
+std::vector<uint64_t> QueryHotTierSequences(int64_t fromMicros, int64_t toMicros, const EventPredicate& predicate, size_t limit) {
+    std::vector<uint64_t> sequences;
+    uint64_t first, last;
+    if (!HotTierRange(fromMicros, toMicros, first, last)) return sequences;
+    const size_t mask = g_hotTier.capacity - 1;
+    for (uint64_t position = first; position < last && sequences.size() < limit;) {
+        size_t begin = (size_t)(position & mask);
+        size_t count = (size_t)std::min<uint64_t>({64, last - position, g_hotTier.capacity - begin});
+        for (uint64_t bits = MatchHotTierBlock(begin, count, predicate); bits && sequences.size() < limit; bits &= bits - 1) {
+            sequences.push_back(g_hotTier.sequences[begin + LowestBit(bits)]);
+        }
+        position += count;
+    }
+    return sequences;
+}
+
+// Rebuild the event in a hot tier slot. Interned strings are resolved through the caller's
+// copy of the intern table, refreshed only when it lacks an id, so bulk readers don't contend
+// with the capture thread on g_internMutex.
+SecurityEvent HotTierEvent(size_t slot, std::vector<std::string>& internCache) {
+    uint32_t deviceId = g_hotTier.deviceIds[slot];
+    uint32_t hostId = g_hotTier.hostIds[slot];
+    if (deviceId >= internCache.size() || hostId >= internCache.size()) {
+        std::lock_guard<std::mutex> lock(g_internMutex);
+        internCache.assign(g_devicePaths.begin(), g_devicePaths.end());
+    }
+    SecurityEvent event;
+    event.kind = (EventKind)g_hotTier.kinds[slot];
+    event.sequence = g_hotTier.sequences[slot];
+    event.timestampMicros = g_hotTier.eventTimes[slot];
+    event.flags = g_hotTier.flags[slot];
+    event.hostId = hostId;
+    event.detail = deviceId < internCache.size() ? internCache[deviceId] : std::string();
+    return event;
+}
+
+// Message text as stored in segments: FormatEvent, prefixed with "[host] " for events a
+// collector received from another machine
+std::string StoredMessage(const SecurityEvent& event, const std::vector<std::string>& internCache) {
+    if (event.hostId == 0 || event.hostId >= internCache.size()) return FormatEvent(event);
+    return "[" + internCache[event.hostId] + "] " + FormatEvent(event);
+}
+
+// --- Checkpoints ---
+
+// Write a checkpoint if state changed and the configured interval passed (or if forced)
+bool WriteCheckpoint(bool force) {
+    std::lock_guard<std::mutex> lock(g_checkpointMutex);
+    if (g_checkpointPath.empty()) return false;
+    uint32_t interval = CurrentConfig().checkpointIntervalSec;
+    int64_t now = ClockMicros();
+    if (!force && (interval == 0 || now - g_lastCheckpoint < (int64_t)interval * 1000000)) {
+        return false;
+    }
+    uint64_t version = g_stateVersion.load();
+    if (version == g_checkpointedVersion && g_sequenceHighWater.load() != 0) {
+        return false; // Nothing changed since the last checkpoint
+    }
+    g_lastCheckpoint = now;
+
+    CheckpointHeader header;
+    header.stateVersion = version;
+    header.writtenAt = UnixMicrosNow() / 1000000;
+    header.sequenceHighWater = g_nextSequence.load() + kSequenceReserve;
+    header.forwardAcked = g_forwardAcked.load();
+    for (size_t r = 0; r < (size_t)DropReason::Count; ++r) {
+        for (size_t k = 0; k < (size_t)EventKind::Count; ++k) {
+            header.dropCounts[r][k] = g_dropCounts[r][k].load();
+        }
+    }
+    std::string payload;
+    {
+        std::lock_guard<std::mutex> inventoryLock(g_inventoryMutex);
+        header.mountedVolumes = g_mountedVolumes;
+        for (const auto& device : g_inventory) {
+            CheckpointDevice record = {};
+            record.firstSeen = device.second.firstSeen;
+            record.pathLength = (uint16_t)std::min<size_t>(device.first.size(), UINT16_MAX);
+            record.kind = (uint8_t)device.second.kind;
+            payload.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            payload.append(device.first, 0, record.pathLength);
+            ++header.deviceCount;
+        }
+    }
+    header.payloadBytes = payload.size();
+    header.checksum = Fnv1a(payload.data(), payload.size());
+
+    // Write to a temp file and rename over the old checkpoint so a crash mid-write leaves the
+    // previous checkpoint intact
+    std::filesystem::path temp = g_checkpointPath;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(payload.data(), (std::streamsize)payload.size());
+        if (!out) {
+            LogEvent("WARNING: Failed to write checkpoint " + temp.string());
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, g_checkpointPath, ec);
+    if (ec) {
+        LogEvent("WARNING: Failed to replace checkpoint " + g_checkpointPath.string() + ": " + ec.message());
+        return false;
+    }
+    g_checkpointedVersion = version;
+    g_sequenceHighWater.store(header.sequenceHighWater);
+    return true;
+}
+
+// Persist a fresh sequence reservation as soon as half of the current one is used, whatever
+// the checkpoint interval, so a crash never restores a high-water below a logged sequence.
+// The first thread to cross does the write; the rest carry on numbering from the remaining half.
+void ExtendSequenceReservation(uint64_t sequence) {
+    if (sequence < g_reservationRetryAt.load(std::memory_order_relaxed)) return;
+    if (g_reservationExtending.exchange(true)) return;
+    g_stateVersion.fetch_add(1);
+    if (!WriteCheckpoint(true)) {
+        g_reservationRetryAt.store(sequence + 1024, std::memory_order_relaxed); // Don't retry on every event
+        if (sequence >= g_sequenceHighWater.load()) {
+            std::cerr << "WARNING: Sequence reservation exhausted; a crash now may reuse sequence numbers" << std::endl;
+        }
+    }
+    g_reservationExtending.store(false);
+}
+
+// Map a whole file read-only. Empty files fail (nothing to map).
+bool MapFileReadOnly(const std::filesystem::path& path, MappedFile& mapped) {
+    UnmapFile(mapped);
+#ifdef _WIN32
+    mapped.file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped.file == INVALID_HANDLE_VALUE) return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(mapped.file, &info)) {
+        mapped.size = ((size_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    }
+    mapped.mapping = mapped.size ? CreateFileMappingW(mapped.file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    mapped.data = mapped.mapping ? static_cast<const char*>(MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+    mapped.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (mapped.fd < 0) return false;
+    struct stat st;
+    if (fstat(mapped.fd, &st) == 0 && st.st_size > 0) {
+        mapped.size = (size_t)st.st_size;
+        void* data = mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, mapped.fd, 0);
+        mapped.data = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+    }
+#endif
+    if (!mapped.data) {
+        UnmapFile(mapped);
+        return false;
+    }
+    return true;
+}
+
+void UnmapFile(MappedFile& mapped) {
+#ifdef _WIN32
+    if (mapped.data) UnmapViewOfFile(mapped.data);
+    if (mapped.mapping) CloseHandle(mapped.mapping);
+    if (mapped.file != INVALID_HANDLE_VALUE) CloseHandle(mapped.file);
+#else
+    if (mapped.data) munmap(const_cast<char*>(mapped.data), mapped.size);
+    if (mapped.fd >= 0) close(mapped.fd);
+#endif
+    mapped = MappedFile();
+}
+
+// Map the checkpoint read-only and restore inventory, drop counters and sequence numbering.
+// Cost is proportional to live state only.
+bool RestoreCheckpoint(std::string& summary) {
+    int64_t start = SteadyMicros();
+    MappedFile mapped;
+    if (!MapFileReadOnly(g_checkpointPath, mapped)) {
+        summary = "No checkpoint at " + g_checkpointPath.string() + ", starting fresh";
+        return false;
+    }
+    const char* data = mapped.data;
+    size_t size = mapped.size;
+
+    bool ok = false;
+    CheckpointHeader header;
+    if (data && size >= sizeof(header)) {
+        std::memcpy(&header, data, sizeof(header));
+        ok = header.magic == kCheckpointMagic && header.headerSize == sizeof(header) &&
+             header.payloadBytes == size - sizeof(header) &&
+             header.checksum == Fnv1a(data + sizeof(header), (size_t)header.payloadBytes);
+    }
+    if (ok) {
+        std::lock_guard<std::mutex> lock(g_inventoryMutex);
+        const char* p = data + sizeof(header);
+        const char* end = p + header.payloadBytes;
+        for (uint32_t i = 0; i < header.deviceCount && p + sizeof(CheckpointDevice) <= end; ++i) {
+            CheckpointDevice record;
+            std::memcpy(&record, p, sizeof(record));
+            p += sizeof(record);
+            if (p + record.pathLength > end) break;
+            InventoryEntry entry;
+            entry.kind = (EventKind)record.kind;
+            entry.firstSeen = record.firstSeen;
+            g_inventory[std::string(p, record.pathLength)] = entry;
+            p += record.pathLength;
+        }
+        g_mountedVolumes = header.mountedVolumes;
+        for (size_t r = 0; r < (size_t)DropReason::Count; ++r) {
+            for (size_t k = 0; k < (size_t)EventKind::Count; ++k) {
+                g_dropCounts[r][k].store(header.dropCounts[r][k]);
+                g_dropCountsReported[r][k] = header.dropCounts[r][k];
+            }
+        }
+        g_nextSequence.store(header.sequenceHighWater);
+        g_forwardAcked.store(header.forwardAcked);
+    }
+    // Another layout version starts with the same fields; keep at least its numbering
+    uint64_t otherHighWater = 0;
+    const size_t highWaterOffset = offsetof(CheckpointHeader, sequenceHighWater);
+    if (!ok && data && size >= highWaterOffset + sizeof(otherHighWater)) {
+        uint32_t magic;
+        std::memcpy(&magic, data, sizeof(magic));
+        if (magic != kCheckpointMagic && (magic & 0xFFFFFF) == (kCheckpointMagic & 0xFFFFFF)) {
+            std::memcpy(&otherHighWater, data + highWaterOffset, sizeof(otherHighWater));
+        }
+    }
+
+    UnmapFile(mapped);
+    if (!ok && otherHighWater != 0) {
+        g_nextSequence.store(otherHighWater);
+        summary = "checkpoint " + g_checkpointPath.string() + " has another layout version; sequence resumes at #" +
+                  std::to_string(otherHighWater) + ", other state starts fresh";
+        return false;
+    }
+    if (!ok) {
+        summary = "checkpoint " + g_checkpointPath.string() + " is invalid, starting fresh";
+        return false;
+    }
+    summary = "Restored checkpoint in " + std::to_string(SteadyMicros() - start) + " us: " +
+              std::to_string(header.deviceCount) + " devices present, sequence resumes at #" +
+              std::to_string(header.sequenceHighWater) + " (numbers up to there may predate the restart)" +
+              (header.forwardAcked ? ", forwarding resumes after #" + std::to_string(header.forwardAcked) : "");
+    return true;
+}
+
+// --- Tiered Storage ---
+
+// LEB128 varints, shared by the archive codec and policy deltas
+void PutVarint(std::string& output, uint64_t value) {
+    while (value >= 0x80) {
+        output.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    output.push_back((char)value);
+}
+
+bool GetVarint(const char*& input, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && input < end; shift += 7) {
+        uint8_t byte = (uint8_t)*input++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// LZ77 with varint tokens: [literal length][literals]([match length][offset])... The last
+// token has no match. Simple and fast enough for a background thread; the columns compress
+// well once timestamps and sequences are delta-encoded.
+size_t CompressLz(const char* input, size_t size, std::string& output) {
+    const size_t kMinMatch = 4;
+    const int kHashBits = 16;
+    auto hash4 = [&](size_t i) {
+        uint32_t word;
+        std::memcpy(&word, input + i, 4);
+        return (word * 2654435761u) >> (32 - kHashBits);
+    };
+    std::vector<uint32_t> table((size_t)1 << kHashBits, UINT32_MAX);
+    size_t start = output.size();
+    size_t literalStart = 0;
+    size_t i = 0;
+    while (i + kMinMatch <= size) {
+        uint32_t h = hash4(i);
+        uint32_t candidate = table[h];
+        table[h] = (uint32_t)i;
+        if (candidate == UINT32_MAX || std::memcmp(input + candidate, input + i, kMinMatch) != 0) {
+            ++i;
+            continue;
+        }
+        size_t length = kMinMatch;
+        while (i + length < size && input[candidate + length] == input[i + length]) ++length;
+        PutVarint(output, i - literalStart);
+        output.append(input + literalStart, i - literalStart);
+        PutVarint(output, length);
+        PutVarint(output, i - candidate);
+        i += length;
+        literalStart = i;
+    }
+    PutVarint(output, size - literalStart);
+    output.append(input + literalStart, size - literalStart);
+    return output.size() - start;
+}
+
+// Returns false unless input decodes to exactly outputSize bytes
+bool DecompressLz(const char* input, size_t size, char* output, size_t outputSize) {
+    const char* end = input + size;
+    size_t written = 0;
+    while (input < end) {
+        uint64_t literals, length, offset;
+        if (!GetVarint(input, end, literals) || literals > (uint64_t)(end - input) || literals > outputSize - written) return false;
+        std::memcpy(output + written, input, (size_t)literals);
+        input += literals;
+        written += (size_t)literals;
+        if (input == end) break;
+        if (!GetVarint(input, end, length) || !GetVarint(input, end, offset) || offset == 0 || offset > written || length > outputSize - written) return false;
+        const char* from = output + written - offset;
+        for (uint64_t n = 0; n < length; ++n) output[written + n] = from[n]; // May overlap
+        written += (size_t)length;
+    }
+    return written == outputSize;
+}
+
+size_t SegmentBodyBytes(uint64_t count, uint64_t textBytes) {
+    size_t kindBytes = ((size_t)count + 7) & ~(size_t)7;
+    return (size_t)count * (8 + 8 + 4) + kindBytes + ((size_t)count + 1) * 4 + (size_t)textBytes;
+}
+
+// Point view at the columns of a segment body, validating sizes and text offsets
+bool ParseSegmentBody(const char* body, size_t size, const SegmentHeader& header, SegmentView& view) {
+    size_t n = (size_t)header.eventCount;
+    if (size != SegmentBodyBytes(n, header.textBytes)) return false;
+    view.count = n;
+    view.timestamps = reinterpret_cast<const int64_t*>(body);
+    view.sequences = reinterpret_cast<const uint64_t*>(body + n * 8);
+    view.flags = reinterpret_cast<const uint32_t*>(body + n * 16);
+    view.kinds = reinterpret_cast<const uint8_t*>(body + n * 20);
+    view.textOffsets = reinterpret_cast<const uint32_t*>(body + n * 20 + ((n + 7) & ~(size_t)7));
+    view.text = reinterpret_cast<const char*>(view.textOffsets + n + 1);
+    return view.textOffsets[0] == 0 && view.textOffsets[n] == header.textBytes;
+}
+
+// Temp file + rename, as for checkpoints: a crash leaves either the old file or the new one
+bool WriteFileAtomically(const std::filesystem::path& path, const std::string& header, const std::string& body) {
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(header.data(), (std::streamsize)header.size());
+        out.write(body.data(), (std::streamsize)body.size());
+        if (!out) {
+            LogEvent("WARNING: Failed to write " + temp.string());
+            out.close();
+            std::error_code ec;
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        LogEvent("WARNING: Failed to rename " + temp.string() + ": " + ec.message());
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+// Write a storage file (segment, index or archive) without leaving it in the page cache, so
+// the monitor doesn't evict the user's working set. Data goes out through an aligned staging
+// buffer with O_DIRECT (FILE_FLAG_NO_BUFFERING on Windows), the last block padded and the
+// padding truncated off afterwards. Where the file system refuses direct I/O, at open or on
+// the first write, Linux writes through the cache, syncs and drops the pages with
+// posix_fadvise(DONTNEED); Windows falls back to a plain buffered write. Same temp file +
+// rename as WriteFileAtomically; the temp file is removed on failure.
+bool WriteFileDirect(const std::filesystem::path& path, const std::string& header, const std::string& body) {
+    std::lock_guard<std::mutex> lock(g_directIoMutex);
+    if (!g_directIoBuffer.data && !AllocatePinnedBuffer(g_directIoBuffer, kDirectIoChunk, true)) {
+        return WriteFileAtomically(path, header, body);
+    }
+    int64_t start = SteadyMicros();
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    const size_t total = header.size() + body.size();
+    char* buffer = static_cast<char*>(g_directIoBuffer.data);
+    auto stage = [&](size_t offset, size_t length) { // Copy [offset, offset + length) of header + body
+        size_t fromHeader = offset < header.size() ? std::min(length, header.size() - offset) : 0;
+        if (fromHeader > 0) std::memcpy(buffer, header.data() + offset, fromHeader);
+        if (length > fromHeader) std::memcpy(buffer + fromHeader, body.data() + (offset + fromHeader - header.size()), length - fromHeader);
+    };
+    bool ok = true, direct = true;
+#ifdef _WIN32
+    HANDLE file = CreateFileW(temp.wstring().c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        g_storageFallbackWrites.fetch_add(1);
+        return WriteFileAtomically(path, header, body);
+    }
+    for (size_t done = 0; done < total && ok; done += kDirectIoChunk) {
+        size_t length = std::min(kDirectIoChunk, total - done);
+        stage(done, length);
+        size_t padded = (length + kDirectIoAlign - 1) & ~(kDirectIoAlign - 1);
+        std::memset(buffer + length, 0, padded - length);
+        DWORD written = 0;
+        ok = WriteFile(file, buffer, (DWORD)padded, &written, NULL) && written == padded;
+        if (!ok && done == 0 && GetLastError() == ERROR_INVALID_PARAMETER) {
+            // The file system accepted the unbuffered handle but not the write
+            CloseHandle(file);
+            g_storageFallbackWrites.fetch_add(1);
+            return WriteFileAtomically(path, header, body); // Truncates the temp file
+        }
+    }
+    CloseHandle(file);
+    if (ok) {
+        // Unbuffered handles can only end files on a sector boundary; trim through a normal one
+        file = CreateFileW(temp.wstring().c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)total;
+        ok = file != INVALID_HANDLE_VALUE && SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+#else
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) { // tmpfs and some network file systems
+        direct = false;
+        fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        LogEvent("WARNING: Failed to create " + temp.string() + ": " + std::strerror(errno));
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    for (size_t done = 0; done < total && ok;) {
+        size_t length = std::min(kDirectIoChunk, total - done);
+        stage(done, length);
+        size_t padded = direct ? (length + kDirectIoAlign - 1) & ~(kDirectIoAlign - 1) : length;
+        std::memset(buffer + length, 0, padded - length);
+        bool rejected = false;
+        for (size_t written = 0; written < padded && ok;) {
+            ssize_t n = pwrite(fd, buffer + written, padded - written, (off_t)(done + written));
+            if (n < 0 && errno == EINTR) continue;
+            ok = n > 0;
+            rejected = n < 0 && errno == EINVAL && direct && done == 0 && written == 0;
+            if (ok) written += (size_t)n;
+        }
+        if (rejected) {
+            // Some file systems accept O_DIRECT at open and only refuse the write; start over buffered
+            close(fd);
+            direct = false;
+            fd = open(temp.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+            ok = fd >= 0;
+            continue;
+        }
+        done += length;
+    }
+    if (fd >= 0) {
+        if (direct) {
+            ok = ok && ftruncate(fd, (off_t)total) == 0;
+        } else {
+            ok = ok && fdatasync(fd) == 0; // Dirty pages can't be dropped
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(fd);
+    }
+#endif
+    std::error_code ec;
+    if (!ok) {
+        LogEvent("WARNING: Failed to write " + temp.string());
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        LogEvent("WARNING: Failed to rename " + temp.string() + ": " + ec.message());
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    (direct ? g_storageDirectWrites : g_storageFallbackWrites).fetch_add(1);
+    g_storageWriteBytes.fetch_add(total);
+    g_storageWriteMicros.fetch_add((uint64_t)(SteadyMicros() - start));
+    return true;
+}
+
+// Segment, index and archive files go through here: direct or buffered per storage_io
+bool WriteStorageFile(const std::filesystem::path& path, const std::string& header, const std::string& body) {
+    if (CurrentConfig().directStorageIo) return WriteFileDirect(path, header, body);
+    int64_t start = SteadyMicros();
+    if (!WriteFileAtomically(path, header, body)) return false;
+    g_storageBufferedWrites.fetch_add(1);
+    g_storageWriteBytes.fetch_add(header.size() + body.size());
+    g_storageWriteMicros.fetch_add((uint64_t)(SteadyMicros() - start));
+    return true;
+}
+
+// Bytes of a file currently in the page cache (Linux; 0 elsewhere)
+uint64_t PageCacheBytes(const std::filesystem::path& path) {
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat info;
+    uint64_t resident = 0;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            std::vector<unsigned char> pages(((size_t)info.st_size + page - 1) / page);
+            if (mincore(data, (size_t)info.st_size, pages.data()) == 0) {
+                for (unsigned char p : pages) resident += (p & 1) ? page : 0;
+            }
+            munmap(data, (size_t)info.st_size);
+        }
+    }
+    close(fd);
+    return std::min<uint64_t>(resident, (uint64_t)info.st_size);
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+// Catalog existing segment and archive files by their headers; leftover temp files from a
+// crash are removed
+bool InitStorage(const std::filesystem::path& directory, std::string& summary) {
+    std::lock_guard<std::mutex> lock(g_storageMutex);
+    g_storageDir = directory;
+    g_storageCatalog.clear();
+    g_storageArchivedPrefix = 0;
+    g_storagePersisted = g_storageCursor = g_hotTier.head.load();
+    g_segmentBuilder = SegmentBuilder();
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec) {
+        summary = "Storage disabled: cannot create " + directory.string() + ": " + ec.message();
+        g_storageDir.clear();
+        return false;
+    }
+    size_t skipped = 0;
+    int64_t now = ClockMicros();
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        std::filesystem::path path = entry.path();
+        std::string extension = path.extension().string();
+        if (extension == ".tmp") {
+            std::filesystem::remove(path, ec);
+            continue;
+        }
+        if (extension != ".seg" && extension != ".arc") continue;
+        StoredSegment segment;
+        segment.stem = path;
+        segment.stem.replace_extension();
+        segment.archived = (extension == ".arc");
+        segment.fileBytes = entry.file_size(ec);
+        segment.closedAt = now;
+        std::ifstream in(path, std::ios::binary);
+        bool ok;
+        if (segment.archived) {
+            ArchiveHeader archive;
+            ok = (bool)in.read(reinterpret_cast<char*>(&archive), sizeof(archive)) && archive.magic == kArchiveMagic &&
+                 archive.headerSize == sizeof(archive) && archive.compressedBytes == segment.fileBytes - sizeof(archive);
+            segment.header = archive.segment;
+        } else {
+            ok = (bool)in.read(reinterpret_cast<char*>(&segment.header), sizeof(segment.header)) &&
+                 segment.fileBytes == sizeof(SegmentHeader) + SegmentBodyBytes(segment.header.eventCount, segment.header.textBytes);
+        }
+        ok = ok && segment.header.magic == kSegmentMagic && segment.header.headerSize == sizeof(SegmentHeader);
+        if (!ok) {
+            ++skipped;
+            continue;
+        }
+        g_storageCatalog.push_back(segment);
+    }
+    std::sort(g_storageCatalog.begin(), g_storageCatalog.end(), [](const StoredSegment& a, const StoredSegment& b) {
+        return a.header.firstSequence < b.header.firstSequence;
+    });
+    summary = "Storage: " + directory.string() + ", " + std::to_string(g_storageCatalog.size()) + " segment/archive files";
+    if (skipped) summary += " (" + std::to_string(skipped) + " unreadable files ignored)";
+    return true;
+}
+
+// Copy hot tier events past the cursor into the segment builder, stopping once it holds
+// segment_events events or the next message would put text beyond what its uint32 offsets
+// address; returns true if it stopped early. Slots the writer may be reusing are never read;
+// if ingest outran the drain, the events lost from storage are counted as drops.
+bool DrainHotTier() {
+    if (g_hotTier.capacity == 0) return false;
+    const uint64_t guard = g_hotTier.capacity / 8;
+    const size_t mask = g_hotTier.capacity - 1;
+    SegmentBuilder& b = g_segmentBuilder;
+    const uint32_t maxEvents = CurrentConfig().segmentEvents;
+    const size_t keptEvents = b.timestamps.size(), keptText = b.text.size();
+    const int64_t keptOpenedAt = b.openedAt;
+    bool full = false;
+    while (true) {
+        uint64_t head = g_hotTier.head.load(std::memory_order_acquire);
+        uint64_t oldest = head > g_hotTier.capacity - guard ? head - (g_hotTier.capacity - guard) : 0;
+        if (g_storageCursor < oldest) {
+            LogEvent("WARNING: Storage fell behind ingest; " + std::to_string(oldest - g_storageCursor) +
+                     " events were overwritten in memory before reaching a segment");
+            RecordHotTierOverrun(g_storageCursor, oldest, DropReason::StorageOverrun);
+            g_storageCursor = oldest;
+        }
+        const uint64_t start = g_storageCursor;
+        full = false;
+        for (; g_storageCursor < head; ++g_storageCursor) {
+            if (b.timestamps.size() >= maxEvents) {
+                full = true;
+                break;
+            }
+            SecurityEvent event = HotTierEvent((size_t)(g_storageCursor & mask), g_storagePathCache);
+            std::string message = StoredMessage(event, g_storagePathCache);
+            if (!b.timestamps.empty() && b.text.size() + message.size() > UINT32_MAX) {
+                full = true;
+                break;
+            }
+            if (b.timestamps.empty()) b.openedAt = ClockMicros();
+            b.timestamps.push_back(event.timestampMicros);
+            b.sequences.push_back(event.sequence);
+            b.flags.push_back(event.flags);
+            b.kinds.push_back((uint8_t)event.kind);
+            b.text += message;
+            b.textOffsets.push_back((uint32_t)b.text.size());
+        }
+        // The writer may have lapped the first slots while they were being copied; if so, drop
+        // this pass and copy again from what is still intact
+        if (start >= HotTierOldestIntact()) break;
+        b.timestamps.resize(keptEvents);
+        b.sequences.resize(keptEvents);
+        b.flags.resize(keptEvents);
+        b.kinds.resize(keptEvents);
+        b.textOffsets.resize(keptEvents + 1);
+        b.text.resize(keptText);
+        b.openedAt = keptOpenedAt;
+        g_storageCursor = start;
+    }
+    b.endPosition = g_storageCursor;
+    return full;
+}
+
+// Write the builder out as a segment file and hand its events over from the hot tier
+bool CloseSegment() {
+    SegmentBuilder& b = g_segmentBuilder;
+    size_t n = b.timestamps.size();
+    if (n == 0) return true;
+    SegmentHeader header;
+    header.eventCount = n;
+    header.firstSequence = b.sequences.front();
+    header.lastSequence = b.sequences.back();
+    header.minTimestamp = *std::min_element(b.timestamps.begin(), b.timestamps.end());
+    header.maxTimestamp = *std::max_element(b.timestamps.begin(), b.timestamps.end());
+    header.textBytes = b.text.size();
+    std::string body;
+    body.reserve(SegmentBodyBytes(n, header.textBytes));
+    body.append(reinterpret_cast<const char*>(b.timestamps.data()), n * 8);
+    body.append(reinterpret_cast<const char*>(b.sequences.data()), n * 8);
+    body.append(reinterpret_cast<const char*>(b.flags.data()), n * 4);
+    body.append(reinterpret_cast<const char*>(b.kinds.data()), n);
+    body.append(((n + 7) & ~(size_t)7) - n, '\0');
+    body.append(reinterpret_cast<const char*>(b.textOffsets.data()), (n + 1) * 4);
+    body += b.text;
+    header.checksum = Fnv1a(body.data(), body.size());
+
+    StoredSegment segment;
+    segment.stem = g_storageDir / ("seg-" + std::to_string(header.firstSequence));
+    segment.header = header;
+    segment.fileBytes = sizeof(header) + body.size();
+    segment.closedAt = ClockMicros();
+    std::filesystem::path path = segment.stem;
+    path += ".seg";
+    if (!WriteStorageFile(path, std::string(reinterpret_cast<const char*>(&header), sizeof(header)), body)) {
+        return false; // Events stay in the builder and in memory; retried on the next tick
+    }
+    // Index before publishing the segment; without an index file searches fall back to a scan
+    int64_t indexStart = SteadyMicros();
+    SegmentView view;
+    std::string index;
+    IndexHeader indexHeader;
+    if (ParseSegmentBody(body.data(), body.size(), header, view)) {
+        indexHeader.eventCount = n;
+        indexHeader.blockCount = (uint32_t)((n + kIndexBlockEvents - 1) / kIndexBlockEvents);
+        indexHeader.trigramCount = (uint32_t)BuildTrigramIndex(view, index);
+        indexHeader.postingBytes = index.size() - (size_t)indexHeader.trigramCount * sizeof(IndexEntry);
+        indexHeader.checksum = Fnv1a(index.data(), index.size());
+        path.replace_extension(".idx");
+        WriteStorageFile(path, std::string(reinterpret_cast<const char*>(&indexHeader), sizeof(indexHeader)), index);
+    }
+    int64_t indexMicros = SteadyMicros() - indexStart;
+    std::lock_guard<std::mutex> lock(g_storageMutex);
+    g_indexBuildMicros += indexMicros;
+    g_indexedTextBytes += header.textBytes;
+    g_indexBytes += sizeof(indexHeader) + index.size();
+    g_storageCatalog.push_back(segment);
+    g_storagePersisted = b.endPosition;
+    b = SegmentBuilder();
+    b.endPosition = g_storageCursor;
+    return true;
+}
+
+// Replace a segment file with its compressed archive. Readers that already mapped the
+// segment keep reading it; the file is deleted once nothing holds it.
+bool ArchiveSegment(StoredSegment& segment) {
+    std::filesystem::path segmentPath = segment.stem;
+    segmentPath += ".seg";
+    MappedFile mapped;
+    if (!MapFileReadOnly(segmentPath, mapped)) return false;
+    std::string body(mapped.data + sizeof(SegmentHeader), mapped.size - sizeof(SegmentHeader));
+    UnmapFile(mapped);
+    SegmentView view;
+    if (Fnv1a(body.data(), body.size()) != segment.header.checksum || !ParseSegmentBody(body.data(), body.size(), segment.header, view)) {
+        LogEvent("WARNING: Segment " + segmentPath.string() + " is corrupt, not archiving");
+        return false;
+    }
+    // Delta-encode timestamps and sequences so runs of small numbers compress
+    int64_t* timestamps = reinterpret_cast<int64_t*>(&body[0]);
+    uint64_t* sequences = reinterpret_cast<uint64_t*>(&body[0] + view.count * 8);
+    for (size_t i = view.count; i-- > 1;) {
+        timestamps[i] -= timestamps[i - 1];
+        sequences[i] -= sequences[i - 1];
+    }
+    ArchiveHeader archive;
+    archive.segment = segment.header;
+    std::string compressed;
+    archive.compressedBytes = CompressLz(body.data(), body.size(), compressed);
+    archive.checksum = Fnv1a(compressed.data(), compressed.size());
+    std::filesystem::path archivePath = segment.stem;
+    archivePath += ".arc";
+    if (!WriteStorageFile(archivePath, std::string(reinterpret_cast<const char*>(&archive), sizeof(archive)), compressed)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_storageMutex);
+        segment.archived = true;
+        segment.fileBytes = sizeof(archive) + compressed.size();
+    }
+    g_storageOrphans.push_back(segmentPath);
+    return true;
+}
+
+// One round of tier transitions: drain memory, close a full or old segment, archive old
+// segments and, oldest first, segments over the uncompressed budget
+void StorageTick(bool flush) {
+    const ConfigImage& config = CurrentConfig();
+    bool full = DrainHotTier();
+    int64_t now = ClockMicros();
+    const SegmentBuilder& b = g_segmentBuilder;
+    // A full builder is closed and refilled within the tick, so a burst isn't held back a
+    // tick per segment
+    while (full || flush || (!b.timestamps.empty() && now - b.openedAt >= (int64_t)config.segmentMaxAgeSec * 1000000)) {
+        if (!CloseSegment() || !full) break;
+        full = DrainHotTier();
+    }
+
+    std::vector<size_t> segments;
+    uint64_t segmentBytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_storageMutex);
+        while (g_storageArchivedPrefix < g_storageCatalog.size() && g_storageCatalog[g_storageArchivedPrefix].archived) {
+            ++g_storageArchivedPrefix;
+        }
+        for (size_t i = g_storageArchivedPrefix; i < g_storageCatalog.size(); ++i) {
+            if (g_storageCatalog[i].archived) continue;
+            segments.push_back(i);
+            segmentBytes += g_storageCatalog[i].fileBytes;
+        }
+    }
+    const uint64_t budget = (uint64_t)config.segmentBudgetMb << 20;
+    for (size_t index : segments) {
+        StoredSegment& segment = g_storageCatalog[index]; // Only this thread adds or changes entries
+        bool old = now - segment.closedAt >= (int64_t)config.archiveAfterSec * 1000000;
+        if (!old && segmentBytes <= budget) continue;
+        uint64_t before = segment.fileBytes;
+        if (ArchiveSegment(segment)) segmentBytes -= before;
+    }
+
+    for (size_t i = 0; i < g_storageOrphans.size();) {
+        std::error_code ec;
+        std::filesystem::remove(g_storageOrphans[i], ec);
+        if (ec) {
+            ++i; // Still mapped by a reader (Windows); try again next tick
+        } else {
+            g_storageOrphans.erase(g_storageOrphans.begin() + i);
+        }
+    }
+}
+
+void StorageThreadProc() {
+    while (!g_storageStop.load()) {
+        StorageTick(false);
+        std::unique_lock<std::mutex> lock(g_storageWakeMutex);
+        g_storageWake.wait_for(lock, std::chrono::milliseconds(250), [] { return g_storageStop.load(); });
+    }
+    StorageTick(true); // Persist whatever is still only in memory
+}
+
+void StartStorage() {
+    if (g_storageDir.empty() || g_hotTier.capacity == 0) return;
+    g_storageStop.store(false);
+    g_storageThread = std::thread(StorageThreadProc);
+}
+
+void StopStorage() {
+    if (!g_storageThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(g_storageWakeMutex);
+        g_storageStop.store(true);
+    }
+    g_storageWake.notify_all();
+    g_storageThread.join();
+}
+
+// Map a segment, or decompress its archive if it has been archived (possibly since the
+// caller copied the catalog)
+bool LoadSegment(const StoredSegment& segment, LoadedSegment& loaded) {
+    std::filesystem::path path = segment.stem;
+    path += ".seg";
+    if (MapFileReadOnly(path, loaded.mapped)) {
+        const char* body = loaded.mapped.data + sizeof(SegmentHeader);
+        return loaded.mapped.size >= sizeof(SegmentHeader) &&
+               ParseSegmentBody(body, loaded.mapped.size - sizeof(SegmentHeader), segment.header, loaded.view);
+    }
+    path.replace_extension(".arc");
+    if (!MapFileReadOnly(path, loaded.mapped)) return false;
+    ArchiveHeader archive;
+    bool ok = loaded.mapped.size >= sizeof(archive);
+    if (ok) {
+        std::memcpy(&archive, loaded.mapped.data, sizeof(archive));
+        size_t bodyBytes = SegmentBodyBytes(archive.segment.eventCount, archive.segment.textBytes);
+        loaded.decompressed.resize(bodyBytes / 8 + 1);
+        char* bytes = reinterpret_cast<char*>(loaded.decompressed.data());
+        ok = archive.compressedBytes == loaded.mapped.size - sizeof(archive) &&
+             archive.checksum == Fnv1a(loaded.mapped.data + sizeof(archive), (size_t)archive.compressedBytes) &&
+             DecompressLz(loaded.mapped.data + sizeof(archive), (size_t)archive.compressedBytes, bytes, bodyBytes) &&
+             ParseSegmentBody(bytes, bodyBytes, archive.segment, loaded.view);
+    }
+    UnmapFile(loaded.mapped);
+    if (!ok) return false;
+    int64_t* timestamps = const_cast<int64_t*>(loaded.view.timestamps);
+    uint64_t* sequences = const_cast<uint64_t*>(loaded.view.sequences);
+    for (size_t i = 1; i < loaded.view.count; ++i) {
+        timestamps[i] += timestamps[i - 1];
+        sequences[i] += sequences[i - 1];
+    }
+    return true;
+}
+
+// Offset of the first occurrence of needle in text, or size if there is none. The SSE2 path
+// compares the needle's first and last bytes at 16 positions at once and verifies only where
+// both match.
+size_t FindSubstring(const char* text, size_t size, const char* needle, size_t length) {
+    if (length == 0) return 0;
+    if (length > size) return size;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 16 <= size; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + length - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask) {
+            unsigned bit = 0;
+            while (!((mask >> bit) & 1u)) ++bit;
+            if (std::memcmp(text + i + bit, needle, length) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + length <= size; ++i) {
+        if (text[i] == needle[0] && std::memcmp(text + i, needle, length) == 0) return i;
+    }
+    return size;
+}
+
+// Serialize entries then postings for the segment's messages into output (header excluded).
+// Trigrams that span two messages are not indexed; queries match within one message.
+size_t BuildTrigramIndex(const SegmentView& view, std::string& output) {
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+    std::vector<uint32_t> blockTrigrams;
+    size_t blockCount = (view.count + kIndexBlockEvents - 1) / kIndexBlockEvents;
+    for (size_t block = 0; block < blockCount; ++block) {
+        blockTrigrams.clear();
+        size_t end = std::min(view.count, (block + 1) * kIndexBlockEvents);
+        for (size_t e = block * kIndexBlockEvents; e < end; ++e) {
+            const uint8_t* text = reinterpret_cast<const uint8_t*>(view.text) + view.textOffsets[e];
+            size_t length = view.textOffsets[e + 1] - view.textOffsets[e];
+            for (size_t i = 0; i + 3 <= length; ++i) {
+                blockTrigrams.push_back(text[i] | (uint32_t)text[i + 1] << 8 | (uint32_t)text[i + 2] << 16);
+            }
+        }
+        std::sort(blockTrigrams.begin(), blockTrigrams.end());
+        blockTrigrams.erase(std::unique(blockTrigrams.begin(), blockTrigrams.end()), blockTrigrams.end());
+        for (uint32_t trigram : blockTrigrams) postings[trigram].push_back((uint32_t)block);
+    }
+
+    std::vector<uint32_t> trigrams;
+    trigrams.reserve(postings.size());
+    for (const auto& entry : postings) trigrams.push_back(entry.first);
+    std::sort(trigrams.begin(), trigrams.end());
+    std::vector<IndexEntry> entries(trigrams.size());
+    std::string encoded;
+    for (size_t t = 0; t < trigrams.size(); ++t) {
+        const std::vector<uint32_t>& blocks = postings[trigrams[t]];
+        entries[t] = {trigrams[t], (uint32_t)blocks.size(), encoded.size()};
+        uint32_t previous = 0;
+        for (uint32_t block : blocks) {
+            uint32_t delta = block - previous;
+            previous = block;
+            while (delta >= 0x80) {
+                encoded.push_back((char)(delta | 0x80));
+                delta >>= 7;
+            }
+            encoded.push_back((char)delta);
+        }
+    }
+    output.assign(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(IndexEntry));
+    output += encoded;
+    return entries.size();
+}
+
+bool ParseTrigramIndex(const char* data, size_t size, IndexView& view) {
+    if (size < sizeof(IndexHeader)) return false;
+    view.header = reinterpret_cast<const IndexHeader*>(data);
+    const IndexHeader& header = *view.header;
+    size_t bodyBytes = (size_t)header.trigramCount * sizeof(IndexEntry) + (size_t)header.postingBytes;
+    if (header.magic != kIndexMagic || header.headerSize != sizeof(IndexHeader) || header.blockEvents != kIndexBlockEvents ||
+        size != sizeof(IndexHeader) + bodyBytes || header.checksum != Fnv1a(data + sizeof(IndexHeader), bodyBytes)) {
+        return false;
+    }
+    view.entries = reinterpret_cast<const IndexEntry*>(data + sizeof(IndexHeader));
+    view.postings = reinterpret_cast<const uint8_t*>(view.entries + header.trigramCount);
+    return true;
+}
+
+// Mark blocks that contain every trigram of needle (blocks[i] = 1), rarest trigram first.
+// Needles shorter than a trigram make every block a candidate.
+bool CandidateBlocks(const IndexView& index, const std::string& needle, std::vector<uint8_t>& blocks) {
+    blocks.assign(index.header->blockCount, 1);
+    if (needle.size() < 3) return true;
+    std::vector<const IndexEntry*> lists;
+    const IndexEntry* entriesEnd = index.entries + index.header->trigramCount;
+    for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(needle.data()) + i;
+        uint32_t trigram = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+        const IndexEntry* entry = std::lower_bound(index.entries, entriesEnd, trigram,
+                                                   [](const IndexEntry& e, uint32_t t) { return e.trigram < t; });
+        if (entry == entriesEnd || entry->trigram != trigram) {
+            blocks.assign(blocks.size(), 0);
+            return false; // Some trigram never occurs: no candidates
+        }
+        lists.push_back(entry);
+    }
+    std::sort(lists.begin(), lists.end(), [](const IndexEntry* a, const IndexEntry* b) { return a->blockCount < b->blockCount; });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+    std::vector<uint8_t> present(blocks.size());
+    size_t remaining = blocks.size();
+    for (const IndexEntry* entry : lists) {
+        std::fill(present.begin(), present.end(), 0);
+        const uint8_t* p = index.postings + entry->offset;
+        const uint8_t* end = index.postings + index.header->postingBytes;
+        uint32_t block = 0;
+        for (uint32_t n = 0; n < entry->blockCount && p < end; ++n) {
+            uint32_t delta = 0;
+            for (int shift = 0; p < end; shift += 7) {
+                uint8_t byte = *p++;
+                delta |= (uint32_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) break;
+            }
+            block += delta;
+            if (block < present.size()) present[block] = 1;
+        }
+        remaining = 0;
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            blocks[b] &= present[b];
+            remaining += blocks[b];
+        }
+        if (remaining == 0) break;
+    }
+    return remaining > 0;
+}
+
+// Append events of one segment in [from, to) whose message contains needle (every event if
+// needle is empty). Given candidate blocks (see CandidateBlocks) only those are scanned.
+void SearchSegment(const SegmentView& view, const std::vector<uint8_t>* candidates, const std::string& needle, int64_t fromMicros,
+                   int64_t toMicros, size_t limit, std::vector<StoredEvent>& events) {
+    auto emit = [&](size_t i) {
+        if (view.timestamps[i] < fromMicros || view.timestamps[i] >= toMicros) return;
+        StoredEvent event;
+        event.sequence = view.sequences[i];
+        event.timestampMicros = view.timestamps[i];
+        event.flags = view.flags[i];
+        event.kind = (EventKind)view.kinds[i];
+        event.message.assign(view.text + view.textOffsets[i], view.textOffsets[i + 1] - view.textOffsets[i]);
+        events.push_back(std::move(event));
+    };
+    if (needle.empty()) {
+        for (size_t i = 0; i < view.count && events.size() < limit; ++i) emit(i);
+        return;
+    }
+    // Scan the text of events [first, last) and map each hit back to its event
+    auto scan = [&](size_t first, size_t last) {
+        size_t position = view.textOffsets[first];
+        const size_t end = view.textOffsets[last];
+        while (position < end && events.size() < limit) {
+            size_t hit = position + FindSubstring(view.text + position, end - position, needle.data(), needle.size());
+            if (hit >= end) break;
+            size_t i = (size_t)(std::upper_bound(view.textOffsets + first, view.textOffsets + last + 1, (uint32_t)hit) - view.textOffsets) - 1;
+            if (hit + needle.size() <= view.textOffsets[i + 1]) {
+                emit(i);
+                position = view.textOffsets[i + 1]; // One result per event
+            } else {
+                position = hit + 1; // Straddles two messages
+            }
+        }
+    };
+    if (!candidates) {
+        scan(0, view.count);
+        return;
+    }
+    const std::vector<uint8_t>& blocks = *candidates;
+    for (size_t b = 0; b < blocks.size() && events.size() < limit; ++b) {
+        if (!blocks[b]) continue;
+        size_t first = b * kIndexBlockEvents;
+        while (b + 1 < blocks.size() && blocks[b + 1]) ++b; // Scan runs of candidate blocks in one pass
+        scan(first, std::min(view.count, (b + 1) * (size_t)kIndexBlockEvents));
+    }
+}
+
+// Events with timestamps in [from, to) from every tier, oldest file first then memory, at
+// most limit of them, optionally only those whose message contains a substring. Files are
+// consulted only when their time range overlaps, and narrowed by their trigram index.
+std::vector<StoredEvent> ReadEvents(int64_t fromMicros, int64_t toMicros, size_t limit, const std::string& contains) {
+    std::vector<StoredEvent> events;
+    std::vector<StoredSegment> catalog;
+    uint64_t persisted;
+    {
+        std::lock_guard<std::mutex> lock(g_storageMutex);
+        catalog = g_storageCatalog;
+        persisted = g_storagePersisted;
+    }
+    for (const StoredSegment& segment : catalog) {
+        if (events.size() >= limit) return events;
+        if (segment.header.maxTimestamp < fromMicros || segment.header.minTimestamp >= toMicros) continue;
+        std::vector<uint8_t> blocks;
+        bool indexed = false;
+        if (!contains.empty()) {
+            std::filesystem::path indexPath = segment.stem;
+            indexPath += ".idx";
+            MappedFile indexFile;
+            IndexView index;
+            indexed = MapFileReadOnly(indexPath, indexFile) && ParseTrigramIndex(indexFile.data, indexFile.size, index) &&
+                      index.header->eventCount == segment.header.eventCount;
+            bool any = indexed && CandidateBlocks(index, contains, blocks);
+            UnmapFile(indexFile);
+            if (indexed && !any) continue; // Not in this segment; skip loading it at all
+        }
+        LoadedSegment loaded;
+        if (LoadSegment(segment, loaded)) {
+            SearchSegment(loaded.view, indexed ? &blocks : nullptr, contains, fromMicros, toMicros, limit, events);
+        }
+        UnmapFile(loaded.mapped);
+    }
+
+    uint64_t first, last;
+    if (HotTierRange(fromMicros, toMicros, first, last)) {
+        const size_t mask = g_hotTier.capacity - 1;
+        std::vector<std::string> internCache;
+        for (uint64_t position = std::max(first, persisted); position < last && events.size() < limit; ++position) {
+            SecurityEvent event = HotTierEvent((size_t)(position & mask), internCache);
+            StoredEvent stored;
+            stored.message = StoredMessage(event, internCache);
+            if (!contains.empty() && stored.message.find(contains) == std::string::npos) continue;
+            stored.sequence = event.sequence;
+            stored.timestampMicros = event.timestampMicros;
+            stored.flags = event.flags;
+            stored.kind = event.kind;
+            events.push_back(std::move(stored));
+        }
+    }
+    return events;
+}
+
+// Events with sequence numbers in (after, below) from segment and archive files, in sequence
+// order, at most limit of them; the forwarder resends what a restart left unacknowledged
+std::vector<StoredEvent> ReadStoredSequences(uint64_t after, uint64_t below, size_t limit) {
+    std::vector<StoredEvent> events;
+    std::vector<StoredSegment> catalog;
+    {
+        std::lock_guard<std::mutex> lock(g_storageMutex);
+        catalog = g_storageCatalog;
+    }
+    for (const StoredSegment& segment : catalog) {
+        if (events.size() >= limit) break; // Later files start at later sequences
+        if (segment.header.lastSequence <= after || segment.header.firstSequence >= below) continue;
+        LoadedSegment loaded;
+        if (LoadSegment(segment, loaded)) {
+            const SegmentView& view = loaded.view;
+            for (size_t i = 0; i < view.count; ++i) {
+                if (view.sequences[i] <= after || view.sequences[i] >= below) continue;
+                StoredEvent stored;
+                stored.sequence = view.sequences[i];
+                stored.timestampMicros = view.timestamps[i];
+                stored.flags = view.flags[i];
+                stored.kind = (EventKind)view.kinds[i];
+                stored.message.assign(view.text + view.textOffsets[i], view.textOffsets[i + 1] - view.textOffsets[i]);
+                events.push_back(std::move(stored));
+            }
+        }
+        UnmapFile(loaded.mapped);
+    }
+    std::sort(events.begin(), events.end(), [](const StoredEvent& a, const StoredEvent& b) { return a.sequence < b.sequence; });
+    if (events.size() > limit) events.resize(limit);
+    return events;
+}
+
+// The detail FormatEvent put into a stored message; segments keep only the text
+std::string StoredEventDetail(EventKind kind, const std::string& message) {
+    SecurityEvent empty;
+    empty.kind = kind;
+    const std::string prefix = FormatEvent(empty);
+    return message.compare(0, prefix.size(), prefix) == 0 ? message.substr(prefix.size()) : message;
+}
+
+std::string FormatStorageStats() {
+    uint64_t segments = 0, segmentBytes = 0, archives = 0, archiveBytes = 0, archivedRaw = 0, events = 0;
+    uint64_t cachedBytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_storageMutex);
+        for (const StoredSegment& segment : g_storageCatalog) {
+            events += segment.header.eventCount;
+            for (const char* extension : {".seg", ".idx", ".arc"}) {
+                std::filesystem::path path = segment.stem;
+                path += extension;
+                cachedBytes += PageCacheBytes(path);
+            }
+            if (segment.archived) {
+                ++archives;
+                archiveBytes += segment.fileBytes;
+                archivedRaw += sizeof(SegmentHeader) + SegmentBodyBytes(segment.header.eventCount, segment.header.textBytes);
+            } else {
+                ++segments;
+                segmentBytes += segment.fileBytes;
+            }
+        }
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Storage: " << events << " events in files; "
+       << segments << " segments (" << segmentBytes / 1048576.0 << " MB), "
+       << archives << " archives (" << archiveBytes / 1048576.0 << " MB";
+    if (archiveBytes > 0) ss << ", " << (double)archivedRaw / archiveBytes << "x compression";
+    ss << ")";
+    uint64_t writeBytes = g_storageWriteBytes.load(), writeMicros = g_storageWriteMicros.load();
+    if (writeBytes > 0) {
+        ss << "; writes: " << g_storageDirectWrites.load() << " direct, " << g_storageFallbackWrites.load() << " synced and dropped, "
+           << g_storageBufferedWrites.load() << " buffered, " << writeBytes / 1048576.0 << " MB at "
+           << (writeMicros ? writeBytes / 1.048576 / writeMicros : 0.0) << " MB/s";
+    }
+#ifdef __linux__
+    ss << "; page cache holds " << cachedBytes / 1048576.0 << " MB of storage files";
+#endif
+    std::lock_guard<std::mutex> lock(g_storageMutex);
+    if (g_indexedTextBytes > 0) {
+        ss << "; trigram index " << g_indexBuildMicros / 1000.0 / (g_indexedTextBytes / 1048576.0) << " ms per MB of text, "
+           << 100.0 * g_indexBytes / g_indexedTextBytes << "% of text size";
+    }
+    return ss.str();
+}
+
+// --- Fleet Prevalence ---
+
+// FNV-1a, then a 64-bit finalizer so every output bit depends on every input byte
+uint64_t Hash64(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb34fa5bb8f57ull;
+    return hash ^ (hash >> 33);
+}
+
+// The identity prevalence is counted by: "VID_xxxx&PID_xxxx" when the path has one (the same
+// model on every host), otherwise the whole path upper-cased
+std::string DeviceModelKey(const std::string& path) {
+    std::string upper = path;
+    for (char& c : upper) c = (char)std::toupper((unsigned char)c);
+    size_t vid = upper.find("VID_");
+    size_t pid = upper.find("PID_");
+    if (vid != std::string::npos && pid != std::string::npos && vid + 8 <= upper.size() && pid + 8 <= upper.size()) {
+        return upper.substr(vid, 8) + "&" + upper.substr(pid, 8);
+    }
+    return upper;
+}
+
+// Fingerprint and the two candidate buckets of a key hash. The second bucket is derived from
+// the first and the fingerprint alone, so an entry can be moved without its key.
+void CuckooPosition(uint64_t hash, uint64_t bucketCount, uint16_t& fingerprint, uint64_t& first, uint64_t& second) {
+    fingerprint = (uint16_t)(hash >> 48);
+    if (fingerprint == 0) fingerprint = 1;
+    first = hash & (bucketCount - 1);
+    second = (first ^ (fingerprint * 0x5bd1e995ull)) & (bucketCount - 1);
+}
+
+bool CuckooContains(const uint16_t* slots, uint64_t bucketCount, uint64_t hash) {
+    uint16_t fingerprint;
+    uint64_t first, second;
+    CuckooPosition(hash, bucketCount, fingerprint, first, second);
+    const uint16_t* a = slots + first * kCuckooSlots;
+    const uint16_t* b = slots + second * kCuckooSlots;
+    return (a[0] == fingerprint) | (a[1] == fingerprint) | (a[2] == fingerprint) | (a[3] == fingerprint) |
+           (b[0] == fingerprint) | (b[1] == fingerprint) | (b[2] == fingerprint) | (b[3] == fingerprint);
+}
+
+// Insert, relocating existing fingerprints if both buckets are full. Returns false if the
+// filter is too full; the caller then rebuilds it larger (one displaced entry may be lost).
+bool CuckooInsert(CuckooFilter& filter, uint64_t hash) {
+    uint16_t fingerprint;
+    uint64_t first, second;
+    CuckooPosition(hash, filter.bucketCount, fingerprint, first, second);
+    auto place = [&](uint64_t bucket, uint16_t value) {
+        for (uint32_t s = 0; s < kCuckooSlots; ++s) {
+            if (filter.slots[bucket * kCuckooSlots + s] == 0) {
+                filter.slots[bucket * kCuckooSlots + s] = value;
+                return true;
+            }
+        }
+        return false;
+    };
+    if (place(first, fingerprint) || place(second, fingerprint)) {
+        ++filter.itemCount;
+        return true;
+    }
+    uint64_t bucket = (hash >> 32) & 1 ? first : second;
+    for (uint32_t kick = 0; kick < 500; ++kick) {
+        uint16_t& victim = filter.slots[bucket * kCuckooSlots + (kick * 7 + (uint32_t)hash) % kCuckooSlots];
+        std::swap(fingerprint, victim);
+        bucket = (bucket ^ (fingerprint * 0x5bd1e995ull)) & (filter.bucketCount - 1);
+        if (place(bucket, fingerprint)) {
+            ++filter.itemCount;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooRemove(CuckooFilter& filter, uint64_t hash) {
+    uint16_t fingerprint;
+    uint64_t first, second;
+    CuckooPosition(hash, filter.bucketCount, fingerprint, first, second);
+    for (uint64_t bucket : {first, second}) {
+        for (uint32_t s = 0; s < kCuckooSlots; ++s) {
+            if (filter.slots[bucket * kCuckooSlots + s] == fingerprint) {
+                filter.slots[bucket * kCuckooSlots + s] = 0;
+                --filter.itemCount;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+PrevalenceFilter::~PrevalenceFilter() {
+    UnmapFile(mapped);
+}
+
+// Map the published prevalence filter if it changed (checked every few seconds unless
+// forced) and swap it in. Lookups in flight keep the previous mapping alive until they finish.
+bool LoadPrevalenceFilter(bool force) {
+    int64_t now = ClockMicros();
+    if (!force && now - g_prevalenceCheckedAt < 5000000) return false;
+    g_prevalenceCheckedAt = now;
+    std::filesystem::path path = g_prevalencePath.empty() ? GetExecutableDirectory() / CurrentConfig().prevalenceFileName : g_prevalencePath;
+    std::error_code ec;
+    std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path, ec);
+    std::shared_ptr<const PrevalenceFilter> current = std::atomic_load(&g_prevalence);
+    if (ec) {
+        if (current) {
+            std::atomic_store(&g_prevalence, std::shared_ptr<const PrevalenceFilter>());
+            LogEvent("Fleet prevalence filter " + path.string() + " removed; arrivals are no longer rated");
+        }
+        return false;
+    }
+    if (current && writeTime == g_prevalenceWriteTime && !force) return false;
+    g_prevalenceWriteTime = writeTime;
+
+    std::shared_ptr<PrevalenceFilter> filter = std::make_shared<PrevalenceFilter>();
+    bool ok = MapFileReadOnly(path, filter->mapped) && filter->mapped.size >= sizeof(CuckooHeader);
+    if (ok) {
+        filter->header = reinterpret_cast<const CuckooHeader*>(filter->mapped.data);
+        filter->slots = reinterpret_cast<const uint16_t*>(filter->mapped.data + sizeof(CuckooHeader));
+        uint64_t buckets = filter->header->bucketCount;
+        size_t slotBytes = (size_t)buckets * kCuckooSlots * sizeof(uint16_t);
+        ok = filter->header->magic == kCuckooMagic && filter->header->headerSize == sizeof(CuckooHeader) &&
+             buckets > 0 && (buckets & (buckets - 1)) == 0 && filter->mapped.size == sizeof(CuckooHeader) + slotBytes &&
+             filter->header->checksum == Fnv1a(filter->slots, slotBytes);
+    }
+    if (!ok) {
+        LogEvent("WARNING: Fleet prevalence filter " + path.string() + " is invalid; keeping the previous one");
+        return false;
+    }
+    std::stringstream ss;
+    ss << "Loaded fleet prevalence filter " << path.string() << ": " << filter->header->itemCount << " common device models, "
+       << filter->mapped.size / 1024 << " KB, published at unix " << filter->header->publishedAt;
+    std::atomic_store(&g_prevalence, std::shared_ptr<const PrevalenceFilter>(filter));
+    LogEvent(ss.str());
+    return true;
+}
+
+// "--prevalence observations=FILE state=FILE filter=FILE threshold=N max_age_days=N now=SECONDS"
+// is the collector-side job: fold new (time, host, device) observations into the per-model
+// host sketches, age out models not seen recently, and update the published filter in place
+// (inserting newly common models, deleting aged-out ones), rebuilding it only when it fills.
+bool ParsePrevalenceArgs(int argc, char* argv[], PrevalenceConfig& config) {
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Invalid prevalence option: " << arg << std::endl;
+            return false;
+        }
+        std::string key = arg.substr(0, eq);
+        std::string value = arg.substr(eq + 1);
+        try {
+            if (key == "observations") config.observationsPath = value;
+            else if (key == "state") config.statePath = value;
+            else if (key == "filter") config.filterPath = value;
+            else if (key == "threshold") config.threshold = (uint32_t)std::stoul(value);
+            else if (key == "max_age_days") config.maxAgeDays = (uint32_t)std::stoul(value);
+            else if (key == "now") config.now = std::stoll(value);
+            else {
+                std::cerr << "Unknown prevalence option: " << key << std::endl;
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (config.now == 0) {
+        config.now = UnixMicrosNow() / 1000000;
+    }
+    return true;
+}
+
+int RunPrevalenceCommand(int argc, char* argv[]) {
+    PrevalenceConfig config;
+    if (!ParsePrevalenceArgs(argc, argv, config)) {
+        return 2;
+    }
+    int64_t start = SteadyMicros();
+    struct Model {
+        int64_t lastSeen = 0;
+        bool inFilter = false;
+        std::array<uint8_t, kHllRegisters> registers{};
+    };
+    auto estimate = [](const Model& model) {
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (uint8_t r : model.registers) {
+            sum += std::ldexp(1.0, -(int)r);
+            zeros += (r == 0);
+        }
+        const double m = (double)kHllRegisters;
+        double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0) e = m * std::log(m / zeros); // Small-range correction
+        return e;
+    };
+
+    // 1. Load the sketches from the previous run
+    std::unordered_map<std::string, Model> models;
+    MappedFile mapped;
+    if (MapFileReadOnly(config.statePath, mapped)) {
+        PrevalenceHeader header;
+        bool ok = mapped.size >= sizeof(header);
+        if (ok) {
+            std::memcpy(&header, mapped.data, sizeof(header));
+            ok = header.magic == kPrevalenceMagic && header.headerSize == sizeof(header) &&
+                 header.payloadBytes == mapped.size - sizeof(header) &&
+                 header.checksum == Fnv1a(mapped.data + sizeof(header), (size_t)header.payloadBytes);
+        }
+        const char* p = mapped.data + sizeof(header);
+        const char* end = mapped.data + mapped.size;
+        for (uint64_t i = 0; ok && i < header.deviceCount && p + sizeof(PrevalenceRecord) <= end; ++i) {
+            PrevalenceRecord record;
+            std::memcpy(&record, p, sizeof(record));
+            p += sizeof(record);
+            if (p + record.keyLength > end) break;
+            Model& model = models[std::string(p, record.keyLength)];
+            model.lastSeen = record.lastSeen;
+            model.inFilter = record.inFilter != 0;
+            std::memcpy(model.registers.data(), record.registers, kHllRegisters);
+            p += record.keyLength;
+        }
+        if (!ok) std::cerr << "Ignoring invalid prevalence state " << config.statePath << std::endl;
+        UnmapFile(mapped);
+    }
+    size_t previousModels = models.size();
+
+    // 2. Fold in new observations: one HyperLogLog update per (host, model)
+    uint64_t observations = 0, malformed = 0;
+    if (!config.observationsPath.empty()) {
+        std::ifstream in(config.observationsPath);
+        if (!in.is_open()) {
+            std::cerr << "Could not open observations " << config.observationsPath << std::endl;
+            return 1;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::stringstream fields(line);
+            int64_t seen;
+            std::string host, device;
+            if (!(fields >> seen >> host) || !std::getline(fields >> std::ws, device) || device.empty()) {
+                malformed += !line.empty();
+                continue;
+            }
+            Model& model = models[DeviceModelKey(device)];
+            model.lastSeen = std::max(model.lastSeen, seen);
+            uint64_t hash = Hash64(host.data(), host.size());
+            uint8_t& reg = model.registers[hash >> 56];
+            uint64_t rest = (hash << 8) | 0x80; // Bound the rank at 57
+            uint8_t rank = 1;
+            while (!(rest >> 63)) {
+                ++rank;
+                rest <<= 1;
+            }
+            reg = std::max(reg, rank);
+            ++observations;
+        }
+    }
+
+    // 3. Start from the published filter so updates are deletions and insertions, not a rebuild
+    CuckooFilter filter;
+    size_t expectedInFilter = 0;
+    for (const auto& entry : models) expectedInFilter += entry.second.inFilter;
+    if (MapFileReadOnly(config.filterPath, mapped)) {
+        CuckooHeader header;
+        if (mapped.size >= sizeof(header)) {
+            std::memcpy(&header, mapped.data, sizeof(header));
+            size_t slotBytes = (size_t)header.bucketCount * kCuckooSlots * sizeof(uint16_t);
+            if (header.magic == kCuckooMagic && mapped.size == sizeof(header) + slotBytes && header.itemCount == expectedInFilter &&
+                header.checksum == Fnv1a(mapped.data + sizeof(header), slotBytes)) {
+                filter.bucketCount = header.bucketCount;
+                filter.itemCount = header.itemCount;
+                filter.slots.resize(slotBytes / sizeof(uint16_t));
+                std::memcpy(filter.slots.data(), mapped.data + sizeof(header), slotBytes);
+            }
+        }
+        UnmapFile(mapped);
+    }
+    bool rebuild = filter.bucketCount == 0;
+
+    // 4. Age out, then insert newly common models
+    size_t agedOut = 0, added = 0, removed = 0, common = 0;
+    const int64_t cutoff = config.now - (int64_t)config.maxAgeDays * 86400;
+    for (auto it = models.begin(); it != models.end();) {
+        Model& model = it->second;
+        uint64_t hash = Hash64(it->first.data(), it->first.size());
+        bool wanted = model.lastSeen >= cutoff && estimate(model) >= config.threshold;
+        if (model.inFilter && !wanted) {
+            if (!rebuild) CuckooRemove(filter, hash);
+            model.inFilter = false;
+            ++removed;
+        } else if (!model.inFilter && wanted) {
+            if (!rebuild && !CuckooInsert(filter, hash)) rebuild = true;
+            model.inFilter = true;
+            ++added;
+        }
+        common += model.inFilter;
+        if (model.lastSeen < cutoff) {
+            ++agedOut;
+            it = models.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!rebuild && filter.itemCount > filter.bucketCount * kCuckooSlots * 95 / 100) rebuild = true;
+    for (uint64_t buckets = 16; rebuild; buckets *= 2) {
+        if (buckets * kCuckooSlots * 85 / 100 < common) continue; // Aim for <= 85% occupancy
+        filter.bucketCount = buckets;
+        filter.itemCount = 0;
+        filter.slots.assign(buckets * kCuckooSlots, 0);
+        rebuild = false;
+        for (const auto& entry : models) {
+            if (entry.second.inFilter && !CuckooInsert(filter, Hash64(entry.first.data(), entry.first.size()))) {
+                rebuild = true;
+                break;
+            }
+        }
+    }
+
+    // 5. Publish the filter and save the sketches
+    CuckooHeader filterHeader;
+    filterHeader.bucketCount = filter.bucketCount;
+    filterHeader.itemCount = filter.itemCount;
+    filterHeader.publishedAt = config.now;
+    filterHeader.checksum = Fnv1a(filter.slots.data(), filter.slots.size() * sizeof(uint16_t));
+    std::string slots(reinterpret_cast<const char*>(filter.slots.data()), filter.slots.size() * sizeof(uint16_t));
+    std::string payload;
+    for (const auto& entry : models) {
+        PrevalenceRecord record = {};
+        record.lastSeen = entry.second.lastSeen;
+        record.keyLength = (uint16_t)std::min<size_t>(entry.first.size(), UINT16_MAX);
+        record.inFilter = entry.second.inFilter;
+        std::memcpy(record.registers, entry.second.registers.data(), kHllRegisters);
+        payload.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        payload.append(entry.first, 0, record.keyLength);
+    }
+    PrevalenceHeader stateHeader;
+    stateHeader.deviceCount = models.size();
+    stateHeader.payloadBytes = payload.size();
+    stateHeader.checksum = Fnv1a(payload.data(), payload.size());
+    if (!WriteFileAtomically(config.filterPath, std::string(reinterpret_cast<const char*>(&filterHeader), sizeof(filterHeader)), slots) ||
+        !WriteFileAtomically(config.statePath, std::string(reinterpret_cast<const char*>(&stateHeader), sizeof(stateHeader)), payload)) {
+        std::cerr << "Could not write prevalence filter or state" << std::endl;
+        return 1;
+    }
+    std::cout << std::fixed << std::setprecision(1) << "Prevalence: " << observations << " observations (" << malformed
+              << " malformed), " << models.size() << " models tracked (" << previousModels << " before, " << agedOut
+              << " aged out), " << common << " common (+" << added << " -" << removed << "); filter " << filter.bucketCount
+              << " buckets, " << (sizeof(filterHeader) + slots.size()) / 1024.0 << " KB, "
+              << 100.0 * filter.itemCount / (filter.bucketCount * kCuckooSlots) << "% full; "
+              << (SteadyMicros() - start) / 1000.0 << " ms" << std::endl;
+    return 0;
+}
+
+// --- Policy ---
+
+// Compile "version = N", "allow <device path or model>" and "block <...>" lines ('#' starts
+// a comment) into an image. Sections are sorted so a small change is a small delta.
+bool CompilePolicy(const std::string& text, std::string& image, std::string& error) {
+    std::stringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    uint64_t version = 0;
+    std::vector<uint64_t> allow, block;
+    while (std::getline(lines, line)) {
+        ++lineNumber;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::stringstream fields(line);
+        std::string verb, rest;
+        if (!(fields >> verb)) continue;
+        std::getline(fields >> std::ws, rest);
+        while (!rest.empty() && (rest.back() == ' ' || rest.back() == '\t' || rest.back() == '\r')) rest.pop_back();
+        if (verb == "version") {
+            size_t eq = rest.find_first_not_of("= \t");
+            try {
+                version = eq == std::string::npos ? 0 : std::stoull(rest.substr(eq));
+            } catch (const std::exception&) {
+                version = 0;
+            }
+            if (version == 0) {
+                error = "line " + std::to_string(lineNumber) + ": version must be a positive number";
+                return false;
+            }
+        } else if ((verb == "allow" || verb == "block") && !rest.empty()) {
+            std::string key = DeviceModelKey(rest);
+            (verb == "allow" ? allow : block).push_back(Hash64(key.data(), key.size()));
+        } else {
+            error = "line " + std::to_string(lineNumber) + ": expected version = N, allow DEVICE or block DEVICE";
+            return false;
+        }
+    }
+    if (version == 0) {
+        error = "missing version = N";
+        return false;
+    }
+    for (std::vector<uint64_t>* list : {&allow, &block}) {
+        std::sort(list->begin(), list->end());
+        list->erase(std::unique(list->begin(), list->end()), list->end());
+    }
+
+    PolicyHeader header;
+    header.version = version;
+    header.sectionCount = 2;
+    PolicySectionEntry sections[2] = {
+        {(uint32_t)PolicySection::Allowlist, (uint32_t)allow.size(), 0, allow.size() * sizeof(uint64_t)},
+        {(uint32_t)PolicySection::Blocklist, (uint32_t)block.size(), 0, block.size() * sizeof(uint64_t)},
+    };
+    sections[0].offset = sizeof(header) + sizeof(sections);
+    sections[1].offset = sections[0].offset + sections[0].bytes;
+    header.totalBytes = sections[1].offset + sections[1].bytes;
+    std::string body(reinterpret_cast<const char*>(sections), sizeof(sections));
+    body.append(reinterpret_cast<const char*>(allow.data()), allow.size() * sizeof(uint64_t));
+    body.append(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(uint64_t));
+    header.checksum = Fnv1a(body.data(), body.size());
+    image.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    image += body;
+    return true;
+}
+
+// Validate an image and point policy at its sections
+bool ParsePolicyImage(const std::string& bytes, PolicyImage& policy) {
+    FreePolicyCode(policy.code); // Compiled from the old lists
+    PolicyHeader header;
+    if (bytes.size() < sizeof(header)) return false;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (header.magic != kPolicyMagic || header.headerSize != sizeof(header) || header.totalBytes != bytes.size() ||
+        header.sectionCount > 64 || sizeof(header) + header.sectionCount * sizeof(PolicySectionEntry) > bytes.size() ||
+        header.checksum != Fnv1a(bytes.data() + sizeof(header), bytes.size() - sizeof(header))) {
+        return false;
+    }
+    policy.words.assign((bytes.size() + 7) / 8, 0);
+    std::memcpy(policy.words.data(), bytes.data(), bytes.size());
+    const char* base = reinterpret_cast<const char*>(policy.words.data());
+    policy.header = reinterpret_cast<const PolicyHeader*>(base);
+    const PolicySectionEntry* sections = reinterpret_cast<const PolicySectionEntry*>(base + sizeof(header));
+    for (uint32_t i = 0; i < header.sectionCount; ++i) {
+        const PolicySectionEntry& section = sections[i];
+        if (section.offset % 8 != 0 || section.offset > bytes.size() || section.bytes > bytes.size() - section.offset ||
+            section.bytes != (uint64_t)section.count * sizeof(uint64_t)) {
+            return false;
+        }
+        const uint64_t* data = reinterpret_cast<const uint64_t*>(base + section.offset);
+        if (section.type == (uint32_t)PolicySection::Allowlist) {
+            policy.allow = data;
+            policy.allowCount = section.count;
+        } else if (section.type == (uint32_t)PolicySection::Blocklist) {
+            policy.block = data;
+            policy.blockCount = section.count;
+        } // Unknown sections are from a newer compiler; ignored
+    }
+    return true;
+}
+
+// Encode target as copies from base plus inserted literals. Base is indexed by 8-byte
+// windows; matches are extended greedily.
+std::string MakePolicyDelta(const std::string& base, const std::string& target) {
+    const size_t kWindow = 8;
+    size_t tableSize = 1024;
+    while (tableSize < base.size()) tableSize *= 2;
+    std::vector<uint32_t> table(tableSize, UINT32_MAX);
+    auto window = [&](const std::string& data, size_t i) {
+        return (size_t)(Hash64(data.data() + i, kWindow) & (tableSize - 1));
+    };
+    for (size_t i = 0; i + kWindow <= base.size(); ++i) table[window(base, i)] = (uint32_t)i;
+
+    std::string ops;
+    size_t literalStart = 0, j = 0;
+    while (j + kWindow <= target.size()) {
+        uint32_t candidate = table[window(target, j)];
+        if (candidate == UINT32_MAX || std::memcmp(base.data() + candidate, target.data() + j, kWindow) != 0) {
+            ++j;
+            continue;
+        }
+        size_t length = kWindow;
+        while (candidate + length < base.size() && j + length < target.size() && base[candidate + length] == target[j + length]) ++length;
+        PutVarint(ops, j - literalStart);
+        ops.append(target, literalStart, j - literalStart);
+        PutVarint(ops, length);
+        PutVarint(ops, candidate);
+        j += length;
+        literalStart = j;
+    }
+    PutVarint(ops, target.size() - literalStart);
+    ops.append(target, literalStart, std::string::npos);
+
+    PolicyHeader from, to;
+    std::memcpy(&from, base.data(), std::min(sizeof(from), base.size()));
+    std::memcpy(&to, target.data(), std::min(sizeof(to), target.size()));
+    PolicyDeltaHeader header;
+    header.fromVersion = from.version;
+    header.toVersion = to.version;
+    header.fromChecksum = from.checksum;
+    header.toChecksum = to.checksum;
+    header.targetBytes = target.size();
+    header.opsBytes = ops.size();
+    header.checksum = Fnv1a(ops.data(), ops.size());
+    return std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + ops;
+}
+
+// Rebuild the target image; fails unless the delta was made against exactly this base and
+// the result is the image the delta promises
+bool ApplyPolicyDelta(const std::string& base, const std::string& delta, std::string& target, std::string& error) {
+    PolicyDeltaHeader header;
+    PolicyHeader from;
+    if (delta.size() < sizeof(header) || base.size() < sizeof(from)) {
+        error = "truncated";
+        return false;
+    }
+    std::memcpy(&header, delta.data(), sizeof(header));
+    std::memcpy(&from, base.data(), sizeof(from));
+    if (header.magic != kPolicyDeltaMagic || header.headerSize != sizeof(header) || header.opsBytes != delta.size() - sizeof(header) ||
+        header.checksum != Fnv1a(delta.data() + sizeof(header), (size_t)header.opsBytes)) {
+        error = "corrupt delta";
+        return false;
+    }
+    if (header.fromVersion != from.version || header.fromChecksum != from.checksum) {
+        error = "delta is for version " + std::to_string(header.fromVersion) + ", have " + std::to_string(from.version);
+        return false;
+    }
+    target.clear();
+    target.reserve((size_t)header.targetBytes);
+    const char* p = delta.data() + sizeof(header);
+    const char* end = delta.data() + delta.size();
+    while (p < end) {
+        uint64_t literals, length, offset;
+        if (!GetVarint(p, end, literals) || literals > (uint64_t)(end - p)) break;
+        target.append(p, (size_t)literals);
+        p += literals;
+        if (p == end) break;
+        if (!GetVarint(p, end, length) || !GetVarint(p, end, offset) || offset > base.size() || length > base.size() - offset) {
+            error = "bad copy";
+            return false;
+        }
+        target.append(base, (size_t)offset, (size_t)length);
+    }
+    PolicyHeader to;
+    if (p != end || target.size() != header.targetBytes || target.size() < sizeof(to)) {
+        error = "wrong result size";
+        return false;
+    }
+    std::memcpy(&to, target.data(), sizeof(to));
+    if (to.version != header.toVersion || to.checksum != header.toChecksum) {
+        error = "result does not match the target version";
+        return false;
+    }
+    return true;
+}
+
+bool ReadWholeFile(const std::filesystem::path& path, std::string& bytes) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    bytes = ss.str();
+    return !in.bad();
+}
+
+std::filesystem::path PolicyFilePath() {
+    return g_policyPath.empty() ? GetExecutableDirectory() / CurrentConfig().policyFileName : g_policyPath;
+}
+
+// Load the policy image if it changed, then apply any deltas chaining from its version,
+// persisting each result (temp file + rename) before publishing it. Runs on the maintenance
+// thread every few seconds; evaluation keeps using the previous image until the swap.
+bool LoadPolicy(bool force) {
+    int64_t now = ClockMicros();
+    if (!force && now - g_policyCheckedAt < 5000000) return false;
+    g_policyCheckedAt = now;
+    std::filesystem::path path = PolicyFilePath();
+    std::error_code ec;
+    std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path, ec);
+    std::shared_ptr<const PolicyImage> current = std::atomic_load(&g_policy);
+    if (ec) {
+        if (current) {
+            std::atomic_store(&g_policy, std::shared_ptr<const PolicyImage>());
+            LogEvent("Policy " + path.string() + " removed; allow/block lists no longer applied");
+        }
+        return false;
+    }
+    std::string image;
+    if (!current || writeTime != g_policyWriteTime || force) {
+        std::shared_ptr<PolicyImage> policy = std::make_shared<PolicyImage>();
+        if (!ReadWholeFile(path, image) || !ParsePolicyImage(image, *policy)) {
+            LogEvent("WARNING: Policy image " + path.string() + " is invalid; keeping the previous policy");
+            g_policyWriteTime = writeTime;
+            return false;
+        }
+        g_policyWriteTime = writeTime;
+        std::string matcher = PreparePolicyMatcher(*policy);
+        std::atomic_store(&g_policy, std::shared_ptr<const PolicyImage>(policy));
+        current = policy;
+        LogEvent("Loaded policy version " + std::to_string(policy->header->version) + ": " + std::to_string(policy->allowCount) +
+                 " allowed, " + std::to_string(policy->blockCount) + " blocked device models; " + matcher);
+    }
+
+    bool applied = false;
+    for (bool progress = true; progress;) {
+        progress = false;
+        std::string prefix = path.filename().string() + "." + std::to_string(current->header->version) + "-";
+        for (const auto& entry : std::filesystem::directory_iterator(path.parent_path(), ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0 || entry.path().extension() != ".delta") continue;
+            int64_t applyStart = SteadyMicros();
+            std::string delta, target, error;
+            if (image.empty()) {
+                image.assign(reinterpret_cast<const char*>(current->words.data()), (size_t)current->header->totalBytes);
+            }
+            std::shared_ptr<PolicyImage> policy = std::make_shared<PolicyImage>();
+            bool ok = ReadWholeFile(entry.path(), delta) && ApplyPolicyDelta(image, delta, target, error) &&
+                      ParsePolicyImage(target, *policy) && WriteFileAtomically(path, target, std::string());
+            if (!ok) {
+                std::filesystem::path rejected = entry.path();
+                rejected += ".rejected";
+                std::filesystem::rename(entry.path(), rejected, ec);
+                LogEvent("WARNING: Policy delta " + name + " rejected (" + (error.empty() ? "invalid result" : error) + ")");
+                continue;
+            }
+            std::string matcher = PreparePolicyMatcher(*policy);
+            int64_t applyMicros = SteadyMicros() - applyStart;
+            std::atomic_store(&g_policy, std::shared_ptr<const PolicyImage>(policy));
+            g_policyWriteTime = std::filesystem::last_write_time(path, ec);
+            std::filesystem::remove(entry.path(), ec);
+            LogEvent("Applied policy delta " + std::to_string(current->header->version) + " -> " + std::to_string(policy->header->version) +
+                     " (" + std::to_string(delta.size()) + " bytes for a " + std::to_string(target.size()) + "-byte image) in " +
+                     std::to_string(applyMicros) + " us: " + std::to_string(policy->allowCount) + " allowed, " +
+                     std::to_string(policy->blockCount) + " blocked; " + matcher);
+            current = policy;
+            image = target;
+            applied = progress = true;
+            break; // The directory changed; rescan for the next version
+        }
+    }
+    return applied;
+}
+
+uint32_t PolicyFlags(const PolicyImage& policy, uint64_t modelHash) {
+    if (policy.code.entry) return policy.code.entry(modelHash);
+    return InterpretPolicyFlags(policy, modelHash);
+}
+
+uint32_t InterpretPolicyFlags(const PolicyImage& policy, uint64_t modelHash) {
+    uint32_t flags = 0;
+    if (std::binary_search(policy.allow, policy.allow + policy.allowCount, modelHash)) flags |= kFlagAllowlisted;
+    if (std::binary_search(policy.block, policy.block + policy.blockCount, modelHash)) flags |= kFlagBlocklisted;
+    return flags;
+}
+
+PolicyCode::~PolicyCode() {
+    FreePolicyCode(*this);
+}
+
+void FreePolicyCode(PolicyCode& code) {
+    if (!code.memory) return;
+#ifdef _WIN32
+    VirtualFree(code.memory, 0, MEM_RELEASE);
+#else
+    munmap(code.memory, code.size);
+#endif
+    code.memory = nullptr;
+    code.size = 0;
+    code.entry = nullptr;
+}
+
+// Emits a lookup function equivalent to InterpretPolicyFlags:
+//       xor eax, eax
+//       <allow tree>           every path jumps to allowHit or allowMiss
+//   allowHit:  or eax, kFlagAllowlisted
+//   allowMiss: <block tree>    every path jumps to blockHit or done
+//   blockHit:  or eax, kFlagBlocklisted
+//   done:      ret
+// Each tree node is "mov r8, hash; cmp key, r8; je hit; jb left" followed by the right subtree
+// and then the left one; ranges of three or fewer end in a run of compares.
+bool CompilePolicyCode(PolicyImage& policy, std::string& error) {
+    FreePolicyCode(policy.code);
+#if defined(__x86_64__) || defined(_M_X64)
+    if (policy.allowCount + policy.blockCount > kPolicyJitMaxEntries) {
+        error = "lists larger than " + std::to_string(kPolicyJitMaxEntries) + " entries";
+        return false;
+    }
+#ifdef _WIN32
+    const uint8_t cmpKeyR8 = 0xC1; // Key in rcx (Microsoft x64 convention)
+#else
+    const uint8_t cmpKeyR8 = 0xC7; // Key in rdi (System V)
+#endif
+    std::vector<uint8_t> code;
+    auto emit = [&](std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); };
+    auto emit32 = [&](uint32_t value) {
+        for (int i = 0; i < 4; ++i) code.push_back((uint8_t)(value >> (8 * i)));
+    };
+    auto jump = [&](std::initializer_list<uint8_t> opcode, std::vector<size_t>& fixups) {
+        emit(opcode);
+        fixups.push_back(code.size());
+        emit32(0);
+    };
+    auto bind = [&](const std::vector<size_t>& fixups) {
+        for (size_t at : fixups) {
+            uint32_t rel = (uint32_t)(code.size() - (at + 4));
+            std::memcpy(&code[at], &rel, sizeof(rel));
+        }
+    };
+    auto compare = [&](uint64_t hash, std::vector<size_t>& hits) {
+        emit({0x49, 0xB8}); // mov r8, imm64
+        for (int i = 0; i < 8; ++i) code.push_back((uint8_t)(hash >> (8 * i)));
+        emit({0x4C, 0x39, cmpKeyR8}); // cmp key, r8
+        jump({0x0F, 0x84}, hits);     // je hit
+    };
+    std::function<void(const uint64_t*, size_t, std::vector<size_t>&, std::vector<size_t>&)> tree =
+        [&](const uint64_t* hashes, size_t count, std::vector<size_t>& hits, std::vector<size_t>& misses) {
+            if (count <= 3) {
+                for (size_t i = 0; i < count; ++i) compare(hashes[i], hits);
+                jump({0xE9}, misses);
+                return;
+            }
+            size_t mid = count / 2;
+            compare(hashes[mid], hits);
+            std::vector<size_t> left;
+            jump({0x0F, 0x82}, left); // jb left (unsigned below)
+            tree(hashes + mid + 1, count - mid - 1, hits, misses);
+            bind(left);
+            tree(hashes, mid, hits, misses);
+        };
+    std::vector<size_t> allowHits, allowMisses, blockHits, done;
+    emit({0x31, 0xC0}); // xor eax, eax
+    tree(policy.allow, policy.allowCount, allowHits, allowMisses);
+    bind(allowHits);
+    emit({0x0D});       // or eax, imm32
+    emit32(kFlagAllowlisted);
+    bind(allowMisses);
+    tree(policy.block, policy.blockCount, blockHits, done);
+    bind(blockHits);
+    emit({0x0D});
+    emit32(kFlagBlocklisted);
+    bind(done);
+    emit({0xC3});       // ret
+
+    // Written while writable, then switched to read+execute so it is never both
+#ifdef _WIN32
+    void* memory = VirtualAlloc(NULL, code.size(), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    DWORD previous;
+    if (!memory) {
+        error = "VirtualAlloc failed";
+        return false;
+    }
+    std::memcpy(memory, code.data(), code.size());
+    if (!VirtualProtect(memory, code.size(), PAGE_EXECUTE_READ, &previous)) {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        error = "VirtualProtect failed";
+        return false;
+    }
+    FlushInstructionCache(GetCurrentProcess(), memory, code.size());
+#else
+    void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        error = std::string("mmap failed: ") + std::strerror(errno);
+        return false;
+    }
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+        error = std::string("mprotect failed: ") + std::strerror(errno);
+        munmap(memory, code.size());
+        return false;
+    }
+#endif
+    policy.code.memory = memory;
+    policy.code.size = code.size();
+    policy.code.entry = reinterpret_cast<uint32_t (*)(uint64_t)>(memory);
+    return true;
+#else
+    (void)policy;
+    error = "not an x86-64 build";
+    return false;
+#endif
+}
+
+// Compile the image if configured to; returns how lookups will run, for the load message
+std::string PreparePolicyMatcher(PolicyImage& policy) {
+    if (!CurrentConfig().policyJit) return "interpreted (policy_jit off)";
+    std::string error;
+    if (!CompilePolicyCode(policy, error)) return "interpreted (" + error + ")";
+    return "compiled to " + std::to_string(policy.code.size) + " bytes of native code";
+}
+
+// "--policy compile source=FILE out=FILE", "--policy delta from=FILE to=FILE out=FILE" and
+// "--policy apply base=FILE delta=FILE out=FILE": the collector-side tools that build images
+// and the deltas shipped to agents
+int RunPolicyCommand(int argc, char* argv[]) {
+    std::string command = argc > 2 ? argv[2] : "";
+    std::unordered_map<std::string, std::string> options;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Invalid policy option: " << arg << std::endl;
+            return 2;
+        }
+        options[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    auto require = [&](std::initializer_list<const char*> keys) {
+        for (const char* key : keys) {
+            if (options[key].empty()) {
+                std::cerr << "--policy " << command << " needs " << key << "=FILE" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    };
+    std::string error;
+    if (command == "compile" && require({"source", "out"})) {
+        std::string text, image;
+        if (!ReadWholeFile(options["source"], text) || !CompilePolicy(text, image, error)) {
+            std::cerr << "Cannot compile " << options["source"] << ": " << (error.empty() ? "unreadable" : error) << std::endl;
+            return 1;
+        }
+        PolicyImage policy;
+        ParsePolicyImage(image, policy);
+        if (!WriteFileAtomically(options["out"], image, std::string())) return 1;
+        std::cout << "Policy version " << policy.header->version << ": " << policy.allowCount << " allowed, " << policy.blockCount
+                  << " blocked, " << image.size() << " bytes" << std::endl;
+        return 0;
+    }
+    if (command == "delta" && require({"from", "to", "out"})) {
+        std::string base, target;
+        PolicyImage a, b;
+        if (!ReadWholeFile(options["from"], base) || !ReadWholeFile(options["to"], target) ||
+            !ParsePolicyImage(base, a) || !ParsePolicyImage(target, b)) {
+            std::cerr << "from and to must be valid policy images" << std::endl;
+            return 1;
+        }
+        int64_t start = SteadyMicros();
+        std::string delta = MakePolicyDelta(base, target);
+        int64_t micros = SteadyMicros() - start;
+        if (!WriteFileAtomically(options["out"], delta, std::string())) return 1;
+        std::cout << std::fixed << std::setprecision(2) << "Delta " << a.header->version << " -> " << b.header->version << ": "
+                  << delta.size() << " bytes (" << 100.0 * delta.size() / target.size() << "% of the " << target.size()
+                  << "-byte image), built in " << micros << " us" << std::endl;
+        return 0;
+    }
+    if (command == "apply" && require({"base", "delta", "out"})) {
+        std::string base, delta, target;
+        PolicyImage policy;
+        if (!ReadWholeFile(options["base"], base) || !ReadWholeFile(options["delta"], delta)) {
+            std::cerr << "Cannot read base or delta" << std::endl;
+            return 1;
+        }
+        int64_t start = SteadyMicros();
+        if (!ApplyPolicyDelta(base, delta, target, error) || !ParsePolicyImage(target, policy)) {
+            std::cerr << "Cannot apply delta: " << (error.empty() ? "invalid result" : error) << std::endl;
+            return 1;
+        }
+        int64_t micros = SteadyMicros() - start;
+        if (!WriteFileAtomically(options["out"], target, std::string())) return 1;
+        std::cout << "Applied delta in " << micros << " us: policy version " << policy.header->version << ", " << target.size()
+                  << " bytes" << std::endl;
+        return 0;
+    }
+    if (command != "compile" && command != "delta" && command != "apply") {
+        std::cerr << "Usage: --policy compile|delta|apply key=value..." << std::endl;
+    }
+    return 2;
+}
+
+// --- Risk Model ---
+
+// Parse an XGBoost text dump ("booster[N]:" headers, then "ID:[FEATURE<T] yes=A,no=B,..." and
+// "ID:leaf=V" lines). Features are named fK or by kRiskFeatureNames; the "missing" branch is
+// ignored since every feature is always present.
+bool ParseRiskDump(const std::string& text, std::vector<std::vector<RiskDumpNode>>& trees, std::string& error) {
+    std::stringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    trees.clear();
+    auto fail = [&](const std::string& message) {
+        error = "line " + std::to_string(lineNumber) + ": " + message;
+        return false;
+    };
+    while (std::getline(lines, line)) {
+        ++lineNumber;
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos) continue;
+        line = line.substr(start);
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.compare(0, 8, "booster[") == 0) {
+            trees.emplace_back();
+            continue;
+        }
+        if (trees.empty()) return fail("node before the first booster[N]:");
+        size_t colon = line.find(':');
+        char* end = nullptr;
+        unsigned long id = std::strtoul(line.c_str(), &end, 10);
+        if (colon == std::string::npos || end != line.c_str() + colon || id > 65535) return fail("expected ID:...");
+        std::vector<RiskDumpNode>& tree = trees.back();
+        if (tree.size() <= id) tree.resize(id + 1);
+        RiskDumpNode& node = tree[id];
+        std::string rest = line.substr(colon + 1);
+        if (rest.compare(0, 5, "leaf=") == 0) {
+            node.leaf = std::strtof(rest.c_str() + 5, &end);
+            if (end == rest.c_str() + 5) return fail("bad leaf value");
+            continue;
+        }
+        size_t less = rest.find('<'), close = rest.find(']'), yes = rest.find("yes="), no = rest.find("no=");
+        if (rest.empty() || rest[0] != '[' || less == std::string::npos || close == std::string::npos || less > close ||
+            yes == std::string::npos || no == std::string::npos) {
+            return fail("expected [FEATURE<T] yes=A,no=B or leaf=V");
+        }
+        std::string feature = rest.substr(1, less - 1);
+        node.feature = (uint32_t)RiskFeature::Count;
+        if (feature.size() > 1 && feature[0] == 'f' && std::isdigit((unsigned char)feature[1])) {
+            node.feature = (uint32_t)std::strtoul(feature.c_str() + 1, nullptr, 10);
+        }
+        for (uint32_t i = 0; i < (uint32_t)RiskFeature::Count; ++i) {
+            if (feature == kRiskFeatureNames[i]) node.feature = i;
+        }
+        if (node.feature >= (uint32_t)RiskFeature::Count) return fail("unknown feature " + feature);
+        node.threshold = std::strtof(rest.c_str() + less + 1, nullptr);
+        node.yes = (int32_t)std::strtol(rest.c_str() + yes + 4, nullptr, 10);
+        node.no = (int32_t)std::strtol(rest.c_str() + no + 3, nullptr, 10);
+        if (node.yes <= 0 || node.no <= 0) return fail("bad child ids");
+    }
+    if (trees.empty()) {
+        error = "no booster[N]: trees";
+        return false;
+    }
+    return true;
+}
+
+// Depth of the subtree at node, or -1 if a child is missing or the tree has a cycle
+int RiskDumpDepth(const std::vector<RiskDumpNode>& tree, int32_t node, int level) {
+    if (node < 0 || (size_t)node >= tree.size() || level > (int)kRiskMaxDepth) return -1;
+    if (tree[node].yes < 0) return 0;
+    int yes = RiskDumpDepth(tree, tree[node].yes, level + 1);
+    int no = RiskDumpDepth(tree, tree[node].no, level + 1);
+    return yes < 0 || no < 0 ? -1 : 1 + std::max(yes, no);
+}
+
+// Lay a dump subtree out at heap index slot, padding leaves above the full depth with nodes
+// that always go left (threshold +inf) onto copies of the leaf
+void FillRiskTree(const std::vector<RiskDumpNode>& tree, int32_t node, uint32_t slot, uint32_t level, uint32_t depth,
+                  RiskNode* nodes, float* leaves) {
+    const RiskDumpNode& dump = tree[node];
+    if (level == depth) {
+        leaves[slot - ((1u << depth) - 1)] = dump.leaf;
+        return;
+    }
+    bool leaf = dump.yes < 0;
+    nodes[slot] = leaf ? RiskNode{0, std::numeric_limits<float>::infinity()} : RiskNode{dump.feature, dump.threshold};
+    FillRiskTree(tree, leaf ? node : dump.yes, 2 * slot + 1, level + 1, depth, nodes, leaves);
+    FillRiskTree(tree, leaf ? node : dump.no, 2 * slot + 2, level + 1, depth, nodes, leaves);
+}
+
+// Build a model image: header, then every tree padded to the deepest one
+bool BuildRiskModel(const std::vector<std::vector<RiskDumpNode>>& trees, float baseMargin, float threshold, std::string& bytes,
+                    std::string& error) {
+    uint32_t depth = 0;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        int treeDepth = RiskDumpDepth(trees[i], 0, 0);
+        if (treeDepth < 0) {
+            error = "tree " + std::to_string(i) + " is malformed or deeper than " + std::to_string(kRiskMaxDepth);
+            return false;
+        }
+        depth = std::max(depth, (uint32_t)treeDepth);
+    }
+    if (trees.empty() || trees.size() > 65536) {
+        error = "need 1 to 65536 trees";
+        return false;
+    }
+    uint32_t nodeCount = (1u << depth) - 1;
+    std::vector<RiskNode> nodes(nodeCount);
+    std::vector<float> leaves((size_t)1 << depth);
+    std::string body;
+    for (const std::vector<RiskDumpNode>& tree : trees) {
+        FillRiskTree(tree, 0, 0, 0, depth, nodes.data(), leaves.data());
+        body.append(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(RiskNode));
+        body.append(reinterpret_cast<const char*>(leaves.data()), leaves.size() * sizeof(float));
+    }
+    RiskHeader header;
+    header.treeCount = (uint32_t)trees.size();
+    header.depth = depth;
+    header.baseMargin = baseMargin;
+    header.threshold = threshold;
+    header.checksum = Fnv1a(body.data(), body.size());
+    bytes.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    bytes += body;
+    return true;
+}
+
+// Validate a model image and point model at its trees
+bool ParseRiskModel(const std::string& bytes, RiskModel& model) {
+    RiskHeader header;
+    if (bytes.size() < sizeof(header)) return false;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (header.magic != kRiskMagic || header.headerSize != sizeof(header) || header.featureCount != (uint32_t)RiskFeature::Count ||
+        header.depth > kRiskMaxDepth || header.treeCount == 0 || header.treeCount > 65536) {
+        return false;
+    }
+    size_t nodeCount = ((size_t)1 << header.depth) - 1;
+    size_t stride = nodeCount * sizeof(RiskNode) + ((size_t)1 << header.depth) * sizeof(float);
+    if (bytes.size() != sizeof(header) + stride * header.treeCount ||
+        header.checksum != Fnv1a(bytes.data() + sizeof(header), bytes.size() - sizeof(header))) {
+        return false;
+    }
+    model.words.assign((bytes.size() + 7) / 8, 0);
+    std::memcpy(model.words.data(), bytes.data(), bytes.size());
+    const char* base = reinterpret_cast<const char*>(model.words.data());
+    model.header = reinterpret_cast<const RiskHeader*>(base);
+    model.trees = base + sizeof(header);
+    model.treeStride = stride;
+    for (uint32_t t = 0; t < header.treeCount; ++t) {
+        const RiskNode* nodes = reinterpret_cast<const RiskNode*>(model.trees + t * stride);
+        for (size_t i = 0; i < nodeCount; ++i) {
+            if (nodes[i].feature >= (uint32_t)RiskFeature::Count) return false; // Scoring indexes features unchecked
+        }
+    }
+    return true;
+}
+
+// Load the risk model if it changed. Runs on the maintenance thread every few seconds, like
+// LoadPrevalenceFilter; scoring keeps using the previous model until the swap.
+bool LoadRiskModel(bool force) {
+    int64_t now = ClockMicros();
+    if (!force && now - g_riskModelCheckedAt < 5000000) return false;
+    g_riskModelCheckedAt = now;
+    std::filesystem::path path = g_riskModelPath.empty() ? GetExecutableDirectory() / CurrentConfig().riskModelFileName : g_riskModelPath;
+    std::error_code ec;
+    std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path, ec);
+    std::shared_ptr<const RiskModel> current = std::atomic_load(&g_riskModel);
+    if (ec) {
+        if (current) {
+            std::atomic_store(&g_riskModel, std::shared_ptr<const RiskModel>());
+            LogEvent("Risk model " + path.string() + " removed; arrivals are no longer scored");
+        }
+        return false;
+    }
+    if (current && writeTime == g_riskModelWriteTime && !force) return false;
+    g_riskModelWriteTime = writeTime;
+    std::string bytes;
+    std::shared_ptr<RiskModel> model = std::make_shared<RiskModel>();
+    if (!ReadWholeFile(path, bytes) || !ParseRiskModel(bytes, *model)) {
+        LogEvent("WARNING: Risk model " + path.string() + " is invalid; keeping the previous model");
+        return false;
+    }
+    // hour_of_day is local time; refresh the offset here rather than per event
+    std::time_t unix = (std::time_t)(UnixMicrosNow() / 1000000);
+    std::tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &unix);
+#else
+    gmtime_r(&unix, &utc);
+#endif
+    utc.tm_isdst = -1;
+    g_riskUtcOffsetSec = (int64_t)(unix - std::mktime(&utc));
+    std::atomic_store(&g_riskModel, std::shared_ptr<const RiskModel>(model));
+    std::stringstream threshold;
+    threshold << model->header->threshold;
+    LogEvent("Loaded risk model: " + std::to_string(model->header->treeCount) + " trees of depth " +
+             std::to_string(model->header->depth) + ", flagging arrivals scoring >= " + threshold.str());
+    return true;
+}
+
+// Probability from the ensemble. Four trees are walked in lockstep so their loads overlap;
+// each step is a compare feeding the next index, with no branch on the data.
+float RiskScore(const RiskModel& model, const float* features) {
+    const uint32_t depth = model.header->depth;
+    const uint32_t treeCount = model.header->treeCount;
+    const size_t stride = model.treeStride;
+    const size_t leafOffset = (((size_t)1 << depth) - 1) * sizeof(RiskNode);
+    const uint32_t firstLeaf = (1u << depth) - 1;
+    float sum = model.header->baseMargin;
+    uint32_t t = 0;
+    for (; t + 4 <= treeCount; t += 4) {
+        const char* tree = model.trees + t * stride;
+        const RiskNode* n0 = reinterpret_cast<const RiskNode*>(tree);
+        const RiskNode* n1 = reinterpret_cast<const RiskNode*>(tree + stride);
+        const RiskNode* n2 = reinterpret_cast<const RiskNode*>(tree + 2 * stride);
+        const RiskNode* n3 = reinterpret_cast<const RiskNode*>(tree + 3 * stride);
+        uint32_t i0 = 0, i1 = 0, i2 = 0, i3 = 0;
+        for (uint32_t level = 0; level < depth; ++level) {
+            i0 = 2 * i0 + 1 + (uint32_t)(features[n0[i0].feature] >= n0[i0].threshold);
+            i1 = 2 * i1 + 1 + (uint32_t)(features[n1[i1].feature] >= n1[i1].threshold);
+            i2 = 2 * i2 + 1 + (uint32_t)(features[n2[i2].feature] >= n2[i2].threshold);
+            i3 = 2 * i3 + 1 + (uint32_t)(features[n3[i3].feature] >= n3[i3].threshold);
+        }
+        // Summed in tree order so scores match a tree-by-tree walk exactly
+        sum += reinterpret_cast<const float*>(tree + leafOffset)[i0 - firstLeaf];
+        sum += reinterpret_cast<const float*>(tree + stride + leafOffset)[i1 - firstLeaf];
+        sum += reinterpret_cast<const float*>(tree + 2 * stride + leafOffset)[i2 - firstLeaf];
+        sum += reinterpret_cast<const float*>(tree + 3 * stride + leafOffset)[i3 - firstLeaf];
+    }
+    for (; t < treeCount; ++t) {
+        const char* tree = model.trees + t * stride;
+        const RiskNode* nodes = reinterpret_cast<const RiskNode*>(tree);
+        uint32_t i = 0;
+        for (uint32_t level = 0; level < depth; ++level) {
+            i = 2 * i + 1 + (uint32_t)(features[nodes[i].feature] >= nodes[i].threshold);
+        }
+        sum += reinterpret_cast<const float*>(tree + leafOffset)[i - firstLeaf];
+    }
+    return 1.0f / (1.0f + std::exp(-sum));
+}
+
+// Device class from the interface GUID at the end of a device path: 0 other, 1 USB device,
+// 2 HID, 3 keyboard, 4 disk
+uint8_t RiskDeviceClass(const std::string& path) {
+    static const char* const kClassGuids[] = {"A5DCBF10", "4D1E55B2", "884B96C3", "53F56307"};
+    size_t brace = path.rfind('{');
+    if (brace == std::string::npos || path.size() - brace < 9) return 0;
+    for (uint8_t c = 0; c < 4; ++c) {
+        bool match = true;
+        for (size_t i = 0; i < 8 && match; ++i) match = std::toupper((unsigned char)path[brace + 1 + i]) == kClassGuids[c][i];
+        if (match) return c + 1;
+    }
+    return 0;
+}
+
+// Feature vector for an arrival. Also records the arrival in the recent window, so call
+// once per event, from the rules stage.
+void RiskFeatures(const SecurityEvent& event, float fleetRare, float* features) {
+    int64_t seconds = event.timestampMicros / 1000000 + g_riskUtcOffsetSec;
+    uint8_t deviceClass = RiskDeviceClass(event.detail);
+    while (!g_riskRecent.empty() && g_riskRecent.front().first <= event.timestampMicros - kRiskWindowMicros) {
+        g_riskRecentHid -= g_riskRecent.front().second == 2 || g_riskRecent.front().second == 3;
+        g_riskRecent.pop_front();
+    }
+    g_riskRecent.emplace_back(event.timestampMicros, deviceClass);
+    g_riskRecentHid += deviceClass == 2 || deviceClass == 3;
+    uint32_t vendor = 0;
+    for (size_t i = 0; i + 8 <= event.detail.size(); ++i) {
+        if (std::toupper((unsigned char)event.detail[i]) == 'V' && std::toupper((unsigned char)event.detail[i + 1]) == 'I' &&
+            std::toupper((unsigned char)event.detail[i + 2]) == 'D' && event.detail[i + 3] == '_') {
+            vendor = (uint32_t)std::strtoul(event.detail.substr(i + 4, 4).c_str(), nullptr, 16);
+            break;
+        }
+    }
+    features[(size_t)RiskFeature::HourOfDay] = (float)(((seconds % 86400) + 86400) % 86400 / 3600);
+    features[(size_t)RiskFeature::FleetRare] = fleetRare;
+    features[(size_t)RiskFeature::DeviceClass] = deviceClass;
+    features[(size_t)RiskFeature::RecentArrivals] = (float)g_riskRecent.size();
+    features[(size_t)RiskFeature::RecentHidShare] = (float)g_riskRecentHid / (float)g_riskRecent.size();
+    features[(size_t)RiskFeature::VendorId] = (float)vendor;
+}
+
+// "--risk convert dump=FILE out=FILE [threshold=P] [base_margin=M]" turns an XGBoost text dump
+// (trained on the features above, binary:logistic) into a model image; base_margin is the
+// logit of the training base_score. "--risk score model=FILE features=V,V,..." scores one
+// feature vector.
+int RunRiskCommand(int argc, char* argv[]) {
+    std::string command = argc > 2 ? argv[2] : "";
+    std::unordered_map<std::string, std::string> options;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Invalid risk option: " << arg << std::endl;
+            return 2;
+        }
+        options[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    if (command == "convert" && !options["dump"].empty() && !options["out"].empty()) {
+        std::string text, bytes, error;
+        std::vector<std::vector<RiskDumpNode>> trees;
+        float threshold = options["threshold"].empty() ? 0.5f : std::strtof(options["threshold"].c_str(), nullptr);
+        float baseMargin = options["base_margin"].empty() ? 0.0f : std::strtof(options["base_margin"].c_str(), nullptr);
+        if (!(threshold > 0.0f && threshold < 1.0f)) {
+            std::cerr << "threshold must be a probability between 0 and 1" << std::endl;
+            return 2;
+        }
+        if (!ReadWholeFile(options["dump"], text) || !ParseRiskDump(text, trees, error) ||
+            !BuildRiskModel(trees, baseMargin, threshold, bytes, error)) {
+            std::cerr << "Cannot convert " << options["dump"] << ": " << (error.empty() ? "unreadable" : error) << std::endl;
+            return 1;
+        }
+        RiskModel model;
+        ParseRiskModel(bytes, model);
+        if (!WriteFileAtomically(options["out"], bytes, std::string())) return 1;
+        std::cout << "Risk model: " << model.header->treeCount << " trees padded to depth " << model.header->depth << ", "
+                  << bytes.size() << " bytes" << std::endl;
+        return 0;
+    }
+    if (command == "score" && !options["model"].empty()) {
+        std::string bytes;
+        RiskModel model;
+        if (!ReadWholeFile(options["model"], bytes) || !ParseRiskModel(bytes, model)) {
+            std::cerr << options["model"] << " is not a valid risk model" << std::endl;
+            return 1;
+        }
+        float features[(size_t)RiskFeature::Count] = {};
+        std::stringstream values(options["features"]);
+        std::string value;
+        for (size_t i = 0; i < (size_t)RiskFeature::Count && std::getline(values, value, ','); ++i) {
+            features[i] = std::strtof(value.c_str(), nullptr);
+        }
+        float score = RiskScore(model, features);
+        std::cout << std::setprecision(6) << score << (score >= model.header->threshold ? " (flagged)" : "") << std::endl;
+        return 0;
+    }
+    std::cerr << "Usage: --risk convert dump=FILE out=FILE [threshold=P] [base_margin=M] | --risk score model=FILE features=V,..."
+              << std::endl;
+    return 2;
+}
+
+// --- Executable Hashing ---
+
+const uint32_t kSha256Rounds[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void Sha256Init(Sha256& sha) {
+    static const uint32_t kInitial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::memcpy(sha.state, kInitial, sizeof(kInitial));
+    sha.bytes = 0;
+    sha.used = 0;
+}
+
+// Compress whole 64-byte blocks into the state
+void Sha256Blocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    uint32_t w[64];
+    for (; blocks > 0; --blocks, data += 64) {
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256Rounds[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+void Sha256Update(Sha256& sha, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    sha.bytes += size;
+    if (sha.used > 0) {
+        size_t take = std::min(size, sizeof(sha.block) - sha.used);
+        std::memcpy(sha.block + sha.used, p, take);
+        sha.used += take;
+        p += take;
+        size -= take;
+        if (sha.used < sizeof(sha.block)) return;
+        Sha256Blocks(sha.state, sha.block, 1);
+        sha.used = 0;
+    }
+    Sha256Blocks(sha.state, p, size / 64);
+    p += size & ~(size_t)63;
+    sha.used = size & 63;
+    std::memcpy(sha.block, p, sha.used);
+}
+
+// Pad, finish and return the digest as lowercase hex
+std::string Sha256Final(Sha256& sha) {
+    const uint64_t bits = sha.bytes * 8;
+    uint8_t padding[64] = {0x80};
+    uint8_t length[8];
+    for (int i = 0; i < 8; ++i) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    Sha256Update(sha, padding, (sha.used < 56 ? 56 : 120) - sha.used);
+    Sha256Update(sha, length, sizeof(length));
+    char hex[65];
+    for (int i = 0; i < 8; ++i) snprintf(hex + 8 * i, 9, "%08x", sha.state[i]);
+    return std::string(hex, 64);
+}
+
+// Identity and version of a regular file, without reading it
+bool StatExecutable(const std::filesystem::path& path, ExecutableKey& key) {
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.wstring().c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(file, &info) && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    CloseHandle(file);
+    if (!ok) return false;
+    key.device = info.dwVolumeSerialNumber;
+    key.inode = (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+    key.size = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+    key.modified = (int64_t)((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+    key.device = (uint64_t)info.st_dev;
+    key.inode = (uint64_t)info.st_ino;
+    key.size = (uint64_t)info.st_size;
+    key.modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// SHA-256 of a file read front to back in kHashReadBytes requests; false unless exactly
+// expectedSize bytes were read
+bool HashFile(const std::filesystem::path& path, uint64_t expectedSize, std::vector<char>& buffer, std::string& hex) {
+    Sha256 sha;
+    Sha256Init(sha);
+    uint64_t total = 0;
+    bool ok = true;
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    DWORD got = 0;
+    while ((ok = ReadFile(file, buffer.data(), (DWORD)buffer.size(), &got, NULL) != 0) && got > 0) {
+        Sha256Update(sha, buffer.data(), got);
+        total += got;
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+#ifdef __linux__
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Larger readahead
+#endif
+    while (true) {
+        ssize_t got = read(fd, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            ok = (got == 0);
+            break;
+        }
+        Sha256Update(sha, buffer.data(), (size_t)got);
+        total += (uint64_t)got;
+    }
+    close(fd);
+#endif
+    if (!ok || total != expectedSize) return false;
+    hex = Sha256Final(sha);
+    return true;
+}
+
+// The hash cache, under g_hashMutex. A hit moves the entry to the front of g_hashCacheOrder;
+// once full, the entry at the back, used least recently, makes room for a new one.
+bool FindCachedHash(const ExecutableKey& key, std::string& sha256) {
+    auto found = g_hashCache.find(key);
+    if (found == g_hashCache.end()) return false;
+    g_hashCacheOrder.splice(g_hashCacheOrder.begin(), g_hashCacheOrder, found->second);
+    sha256 = found->second->second;
+    return true;
+}
+
+void CacheHash(const ExecutableKey& key, const std::string& sha256) {
+    auto found = g_hashCache.find(key);
+    if (found != g_hashCache.end()) {
+        found->second->second = sha256;
+        g_hashCacheOrder.splice(g_hashCacheOrder.begin(), g_hashCacheOrder, found->second);
+        return;
+    }
+    if (g_hashCache.size() >= kHashCacheLimit) {
+        g_hashCache.erase(g_hashCacheOrder.back().first);
+        g_hashCacheOrder.pop_back();
+    }
+    g_hashCacheOrder.emplace_front(key, sha256);
+    g_hashCache[key] = g_hashCacheOrder.begin();
+}
+
+void ClearHashCache() {
+    g_hashCache.clear();
+    g_hashCacheOrder.clear();
+}
+
+bool StartHashPool(uint32_t workers) {
+    std::lock_guard<std::mutex> lock(g_hashMutex);
+    if (!g_hashWorkers.empty() || workers == 0) return false;
+    g_hashStop = false;
+    for (uint32_t i = 0; i < workers; ++i) g_hashWorkers.emplace_back(HashWorkerProc);
+    return true;
+}
+
+// Requests still queued are dropped; their callbacks never run
+void StopHashPool() {
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> lock(g_hashMutex);
+        g_hashStop = true;
+        g_hashDropped += g_hashQueue.size();
+        g_hashQueue.clear();
+        workers.swap(g_hashWorkers);
+    }
+    g_hashWake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+    std::lock_guard<std::mutex> lock(g_hashMutex);
+    g_hashInFlight.clear();
+}
+
+// Answer from the cache, join a hash already in progress, or queue the file for a worker.
+// done runs on this thread for a cache hit, otherwise on the worker once the file has been
+// read. False if the file can't be examined, the pool isn't running or the queue is full.
+bool HashExecutable(const std::filesystem::path& path, HashCallback done) {
+    ExecutableKey key;
+    if (!StatExecutable(path, key)) {
+        ++g_hashFailed;
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(g_hashMutex);
+    if (g_hashWorkers.empty() || g_hashStop) {
+        if (g_hashStop) ++g_hashDropped;
+        return false;
+    }
+    std::string sha256;
+    if (FindCachedHash(key, sha256)) {
+        lock.unlock();
+        ++g_hashHits;
+        done(sha256, key.size, true);
+        return true;
+    }
+    auto pending = g_hashInFlight.find(key);
+    if (pending != g_hashInFlight.end()) {
+        pending->second.push_back(std::move(done));
+        ++g_hashCoalesced;
+        return true;
+    }
+    if (g_hashQueue.size() >= kHashQueueLimit) {
+        ++g_hashDropped;
+        return false;
+    }
+    ++g_hashMisses;
+    g_hashInFlight[key].push_back(std::move(done));
+    HashRequest request;
+    request.path = path;
+    request.key = key;
+    g_hashQueue.push_back(std::move(request));
+    lock.unlock();
+    g_hashWake.notify_one();
+    return true;
+}
+
+// Queue a newly mounted volume; a worker lists it so the capture thread never waits on the device
+bool SubmitVolumeScan(const std::string& root, uint64_t sequence) {
+    {
+        std::lock_guard<std::mutex> lock(g_hashMutex);
+        if (g_hashWorkers.empty() || g_hashStop) {
+            if (g_hashStop) ++g_hashDropped;
+            return false;
+        }
+        if (g_hashQueue.size() >= kHashQueueLimit) {
+            ++g_hashDropped;
+            return false;
+        }
+        HashRequest request;
+        request.path = std::filesystem::u8path(root);
+        request.scanVolume = true;
+        request.sequence = sequence;
+        g_hashQueue.push_back(std::move(request));
+    }
+    g_hashWake.notify_one();
+    return true;
+}
+
+// Hash the executables and installers at the top of a mounted volume, logging each result
+// against the mount event
+void ScanVolume(const HashRequest& request) {
+    static const char* const kExtensions[] = {".exe", ".dll", ".sys", ".msi", ".com", ".scr", ".bat", ".cmd", ".ps1", ".vbs", ".js", ".inf"};
+    const std::string prefix = "Enrichment for #" + std::to_string(request.sequence) + ": ";
+    std::error_code ec;
+    size_t submitted = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(request.path, ec)) {
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+        if (std::find_if(std::begin(kExtensions), std::end(kExtensions), [&](const char* e) { return extension == e; }) == std::end(kExtensions) ||
+            !entry.is_regular_file(ec)) {
+            continue;
+        }
+        if (submitted == kHashVolumeFiles) {
+            LogEvent(prefix + "more than " + std::to_string(kHashVolumeFiles) + " executables on " + request.path.u8string() +
+                     "; the rest were not hashed");
+            break;
+        }
+        const std::string name = entry.path().u8string();
+        bool queued = HashExecutable(entry.path(), [prefix, name](const std::string& sha256, uint64_t size, bool cached) {
+            LogEvent(prefix + name + (sha256.empty() ? " could not be read" : " sha256=" + sha256) + " (" + std::to_string(size) +
+                     " bytes" + (cached ? ", cached" : "") + ")");
+        });
+        if (!queued) LogEvent(prefix + name + " not hashed (unreadable or hashing backlog full)");
+        ++submitted;
+    }
+}
+
+void HashWorkerProc() {
+    std::vector<char> buffer(kHashReadBytes);
+    std::unique_lock<std::mutex> lock(g_hashMutex);
+    while (true) {
+        g_hashWake.wait(lock, [] { return g_hashStop || !g_hashQueue.empty(); });
+        if (g_hashStop) break;
+        HashRequest request = std::move(g_hashQueue.front());
+        g_hashQueue.pop_front();
+        lock.unlock();
+        if (request.scanVolume) {
+            ScanVolume(request);
+            lock.lock();
+            continue;
+        }
+        // Cached only if the file still is the version that was asked about
+        std::string sha256;
+        ExecutableKey after;
+        int64_t start = SteadyMicros();
+        bool ok = HashFile(request.path, request.key.size, buffer, sha256) && StatExecutable(request.path, after) && after == request.key;
+        g_hashMicros += (uint64_t)(SteadyMicros() - start);
+        if (ok) {
+            g_hashedBytes += request.key.size;
+        } else {
+            ++g_hashFailed;
+            sha256.clear();
+        }
+        std::vector<HashCallback> waiters;
+        lock.lock();
+        auto pending = g_hashInFlight.find(request.key);
+        if (pending != g_hashInFlight.end()) {
+            waiters.swap(pending->second);
+            g_hashInFlight.erase(pending);
+        }
+        if (ok) CacheHash(request.key, sha256);
+        lock.unlock();
+        for (HashCallback& done : waiters) done(sha256, request.key.size, false);
+        lock.lock();
+    }
+}
+
+std::string FormatHashStats() {
+    const uint64_t hits = g_hashHits.load(), misses = g_hashMisses.load(), coalesced = g_hashCoalesced.load();
+    const uint64_t lookups = hits + misses + coalesced, bytes = g_hashedBytes.load(), micros = g_hashMicros.load();
+    char line[320];
+    snprintf(line, sizeof(line), "Executable hashing: %llu lookups, %.1f%% cache hits, %llu joined a hash in progress, "
+             "%llu files hashed (%.2f MB, %.1f MB/s per worker), %llu dropped, %llu unreadable or changed",
+             (unsigned long long)lookups, lookups ? 100.0 * hits / lookups : 0.0, (unsigned long long)coalesced,
+             (unsigned long long)misses, bytes / 1048576.0, micros ? bytes / (double)micros * 1e6 / 1048576.0 : 0.0,
+             (unsigned long long)g_hashDropped.load(), (unsigned long long)g_hashFailed.load());
+    return line;
+}
+
+// --- Event Reordering ---
+
+bool ReorderLater(const ReorderEntry& a, const ReorderEntry& b) {
+    return a.timestamp != b.timestamp ? a.timestamp > b.timestamp : a.order > b.order;
+}
+
+void ReorderAdd(ReorderBuffer& buffer, uint32_t source, SecurityEvent event, int64_t now) {
+    ReorderSource& state = buffer.sources[source];
+    state.watermark = std::max(state.watermark, event.timestampMicros);
+    state.advancedAt = now;
+    if (event.timestampMicros < buffer.releasedUpTo) {
+        event.flags |= kFlagLate;
+        ++buffer.late;
+    }
+    ReorderEntry entry;
+    entry.timestamp = event.timestampMicros;
+    entry.order = buffer.nextOrder++;
+    entry.arrivedAt = now;
+    entry.event = std::move(event);
+    buffer.heap.push_back(std::move(entry));
+    std::push_heap(buffer.heap.begin(), buffer.heap.end(), ReorderLater);
+    buffer.maxDepth = std::max(buffer.maxDepth, buffer.heap.size());
+}
+
+// Append every event no on-time event can precede any more to released, in event-time order
+void ReorderRelease(ReorderBuffer& buffer, int64_t now, std::vector<SecurityEvent>& released) {
+    int64_t threshold = INT64_MAX; // No sources left (or reordering off): release everything
+    if (buffer.latenessMicros > 0 && !buffer.sources.empty()) {
+        int64_t newest = INT64_MIN, slowest = INT64_MAX;
+        for (const auto& entry : buffer.sources) {
+            newest = std::max(newest, entry.second.watermark);
+            if (now - entry.second.advancedAt < buffer.latenessMicros) slowest = std::min(slowest, entry.second.watermark);
+        }
+        threshold = std::max(slowest, newest - buffer.latenessMicros);
+    }
+    threshold = std::max(threshold, buffer.releasedUpTo); // Late events go straight out
+    while (!buffer.heap.empty() && buffer.heap.front().timestamp <= threshold) {
+        std::pop_heap(buffer.heap.begin(), buffer.heap.end(), ReorderLater);
+        ReorderEntry& entry = buffer.heap.back();
+        int64_t held = now - entry.arrivedAt;
+        size_t bucket = 0;
+        while (bucket + 1 < kLagBuckets && held >= (int64_t(1) << bucket)) ++bucket;
+        ++buffer.heldHistogram[bucket];
+        buffer.heldMicros += (uint64_t)held;
+        buffer.maxHeldMicros = std::max(buffer.maxHeldMicros, held);
+        ++buffer.released;
+        buffer.releasedUpTo = std::max(buffer.releasedUpTo, entry.timestamp);
+        released.push_back(std::move(entry.event));
+        buffer.heap.pop_back();
+    }
+}
+
+std::string FormatReorderStats(const ReorderBuffer& buffer) {
+    // p99 as the upper bound of the histogram bucket it falls in
+    uint64_t seen = 0;
+    size_t p99Bucket = 0;
+    while (p99Bucket + 1 < kLagBuckets && (seen += buffer.heldHistogram[p99Bucket]) * 100 < buffer.released * 99) ++p99Bucket;
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << "Reordering (lateness " << buffer.latenessMicros / 1000 << " ms): "
+       << buffer.released << " events released, " << buffer.late << " late, " << buffer.heap.size() << " held (max "
+       << buffer.maxDepth << "); added latency mean=" << (buffer.released ? buffer.heldMicros / 1000.0 / buffer.released : 0.0)
+       << " ms p99<" << (int64_t(1) << p99Bucket) / 1000.0 << " ms max=" << buffer.maxHeldMicros / 1000.0 << " ms";
+    return ss.str();
+}
+
+// Store whatever the reorder buffer can release; the caller holds g_collectorMutex
+void StoreCollectedEvents(int64_t now) {
+    std::vector<SecurityEvent> released;
+    ReorderRelease(g_collectorReorder, now, released);
+    for (const SecurityEvent& event : released) {
+        AppendHotTier(event);
+        ++g_collectorEvents;
+    }
+}
+
+// --- Collector Links ---
+
+bool InitNetwork() {
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+void CloseSocket(SocketHandle socket) {
+    if (socket == kInvalidSocket) return;
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+// 1 if readable, 0 on timeout, -1 on error
+int WaitReadable(SocketHandle socket, int timeoutMs) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(socket, &readable);
+    timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    int ready = select((int)socket + 1, &readable, nullptr, nullptr, &timeout);
+    return ready < 0 ? -1 : (ready > 0 ? 1 : 0);
+}
+
+void SetSocketTimeout(SocketHandle socket, int timeoutMs) {
+#ifdef _WIN32
+    DWORD timeout = (DWORD)timeoutMs;
+#else
+    timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// Connect with a timeout (a dead collector must not stall the forwarder for the OS default)
+SocketHandle ConnectTcp(const std::string& host, const std::string& port, int timeoutMs) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) return kInvalidSocket;
+    SocketHandle result = kInvalidSocket;
+    for (addrinfo* address = addresses; address && result == kInvalidSocket; address = address->ai_next) {
+        SocketHandle s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (s == kInvalidSocket) continue;
+#ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(s, FIONBIO, &nonBlocking);
+        bool pending = connect(s, address->ai_addr, (int)address->ai_addrlen) != 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        int fileFlags = fcntl(s, F_GETFL, 0);
+        fcntl(s, F_SETFL, fileFlags | O_NONBLOCK);
+        bool pending = connect(s, address->ai_addr, address->ai_addrlen) != 0 && errno == EINPROGRESS;
+#endif
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(s, &writable);
+        timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+        int error = pending ? 0 : -1;
+        socklen_t length = sizeof(error);
+        if (pending && select((int)s + 1, nullptr, &writable, nullptr, &timeout) == 1) {
+            getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length);
+        } else if (pending) {
+            error = -1; // Timed out
+        }
+        if (error != 0) {
+            CloseSocket(s);
+            continue;
+        }
+#ifdef _WIN32
+        nonBlocking = 0;
+        ioctlsocket(s, FIONBIO, &nonBlocking);
+#else
+        fcntl(s, F_SETFL, fileFlags);
+#endif
+        int noDelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        result = s;
+    }
+    freeaddrinfo(addresses);
+    return result;
+}
+
+SocketHandle ListenTcp(const std::string& port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* address = nullptr;
+    if (getaddrinfo(nullptr, port.c_str(), &hints, &address) != 0) return kInvalidSocket;
+    SocketHandle s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    int reuse = 1;
+    if (s != kInvalidSocket) {
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        if (bind(s, address->ai_addr, (int)address->ai_addrlen) != 0 || listen(s, 64) != 0) {
+            CloseSocket(s);
+            s = kInvalidSocket;
+        }
+    }
+    freeaddrinfo(address);
+    return s;
+}
+
+bool SendAll(SocketHandle socket, const char* data, size_t size) {
+#ifdef _WIN32
+    const int flags = 0;
+#else
+    const int flags = MSG_NOSIGNAL; // A collector going away is an error, not SIGPIPE
+#endif
+    while (size > 0) {
+        int sent = (int)send(socket, data, (int)std::min<size_t>(size, 1 << 20), flags);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool RecvAll(SocketHandle socket, char* data, size_t size) {
+    while (size > 0) {
+        int received = (int)recv(socket, data, (int)std::min<size_t>(size, 1 << 20), 0);
+        if (received <= 0) return false;
+        data += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+bool SendFrame(SocketHandle socket, FrameType type, const std::string& payload) {
+    FrameHeader header;
+    header.type = (uint32_t)type;
+    header.length = (uint32_t)payload.size();
+    header.checksum = Fnv1a(payload.data(), payload.size());
+    std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+    frame += payload;
+    return SendAll(socket, frame.data(), frame.size());
+}
+
+bool RecvFrame(SocketHandle socket, FrameType& type, std::string& payload) {
+    FrameHeader header;
+    if (!RecvAll(socket, reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != kFrameMagic ||
+        header.length > kMaxFrameBytes) {
+        return false;
+    }
+    payload.resize(header.length);
+    if (!RecvAll(socket, &payload[0], payload.size()) || header.checksum != Fnv1a(payload.data(), payload.size())) return false;
+    type = (FrameType)header.type;
+    return true;
+}
+
+std::string LocalHostName() {
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0') return "unknown-host";
+    return name;
+}
+
+// virtualNodes points per node at Hash64("<node>#<i>")
+HashRing BuildHashRing(const std::vector<std::string>& nodes, uint32_t virtualNodes) {
+    HashRing ring;
+    for (uint32_t n = 0; n < nodes.size(); ++n) {
+        for (uint32_t v = 0; v < virtualNodes; ++v) {
+            std::string point = nodes[n] + "#" + std::to_string(v);
+            ring.push_back({Hash64(point.data(), point.size()), n});
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+    return ring;
+}
+
+// The first usable node clockwise from the key's position, or -1 if none is usable
+int RouteOnRing(const HashRing& ring, uint64_t keyHash, const std::function<bool(uint32_t)>& usable) {
+    if (ring.empty()) return -1;
+    size_t start = (size_t)(std::lower_bound(ring.begin(), ring.end(), std::make_pair(keyHash, 0u)) - ring.begin());
+    std::vector<uint8_t> tried;
+    for (size_t step = 0; step < ring.size(); ++step) {
+        uint32_t node = ring[(start + step) % ring.size()].second;
+        if (node >= tried.size()) tried.resize(node + 1, 0);
+        if (tried[node]) continue;
+        tried[node] = 1;
+        if (usable(node)) return (int)node;
+    }
+    return -1;
+}
+
+// When to try a peer again after its failures-th failure in a row: 0.5 s, doubling, at most 30 s
+int64_t BackoffUntil(uint32_t failures) {
+    return SteadyMicros() + std::min<int64_t>(30000000, 250000LL << std::min<uint32_t>(failures, 7));
+}
+
+// Parse "host:port,host:port" and start the forwarder thread (needs the hot tier)
+bool StartForwarder(const std::string& collectors, const std::string& hostId) {
+    g_collectors.clear();
+    std::vector<std::string> names;
+    std::stringstream list(collectors);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        size_t colon = item.rfind(':');
+        if (item.empty()) continue;
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size()) {
+            LogEvent("WARNING: Ignoring collector '" + item + "' (expected host:port)");
+            continue;
+        }
+        CollectorNode node;
+        node.host = item.substr(0, colon);
+        node.port = item.substr(colon + 1);
+        g_collectors.push_back(node);
+        names.push_back(item);
+    }
+    if (g_collectors.empty() || g_hotTier.capacity == 0 || !InitNetwork()) return false;
+    g_hostId = hostId.empty() ? LocalHostName() : hostId;
+    if (g_hostId.find_first_not_of(kNodeNameChars) != std::string::npos || g_hostId[0] == '.') {
+        LogEvent("WARNING: Host id '" + g_hostId + "' has characters collectors reject (allowed: letters, digits, . _ -)");
+        return false;
+    }
+    g_collectorRing = BuildHashRing(names, CurrentConfig().virtualNodes);
+    g_forwardCursor = g_hotTier.head.load();
+    // Everything numbered before this start that storage kept and no collector acknowledged
+    g_forwardResendBelow = g_forwardAcked.load() ? g_nextSequence.load() : 0;
+    g_forwarderStop.store(false);
+    g_forwarderThread = std::thread(ForwarderThreadProc);
+    return true;
+}
+
+// Send hot tier events in batches to the collector that owns this host on the ring; on any
+// failure mark that collector down (exponential backoff) and resend to the next one.
+// Returning to the owner once it recovers keeps a host's history on as few nodes as possible.
+// After a restart, stored events past the checkpointed acknowledgement are sent first.
+void ForwarderThreadProc() {
+    const uint64_t hostHash = Hash64(g_hostId.data(), g_hostId.size());
+    const size_t mask = g_hotTier.capacity - 1;
+    const uint64_t guard = g_hotTier.capacity / 8;
+    SocketHandle connection = kInvalidSocket;
+    int connectedNode = -1, previousNode = -1;
+    std::string batch;
+    uint32_t batchCount = 0;
+    uint64_t batchLast = 0;
+    int64_t giveUpAt = 0;
+    uint64_t resendAfter = g_forwardAcked.load();
+    int64_t policyOfferAt = 0;                // Also connects an idle agent to fetch policy
+    auto addToBatch = [&](const SecurityEvent& event) {
+        WireEvent record = {};
+        record.sequence = event.sequence;
+        record.timestampMicros = event.timestampMicros;
+        record.flags = event.flags;
+        record.kind = (uint8_t)event.kind;
+        record.detailLength = (uint16_t)std::min<size_t>(event.detail.size(), UINT16_MAX);
+        batch.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        batch.append(event.detail, 0, record.detailLength);
+        batchLast = event.sequence;
+        ++batchCount;
+    };
+    auto nodeName = [](int node) { return g_collectors[node].host + ":" + g_collectors[node].port; };
+    auto backOff = [&](int node, const char* what) {
+        CollectorNode& c = g_collectors[node];
+        if (c.failures++ == 0) LogEvent("WARNING: Collector " + nodeName(node) + " " + what + "; failing over");
+        c.downUntil = BackoffUntil(c.failures);
+    };
+    auto markDown = [&](int node, const char* what) {
+        backOff(node, what);
+        CloseSocket(connection);
+        connection = kInvalidSocket;
+        connectedNode = -1;
+    };
+
+    while (true) {
+        if (g_forwarderStop.load() && giveUpAt == 0) giveUpAt = SteadyMicros() + 5000000; // Flush for up to 5 s
+        if (batchCount == 0 && resendAfter < g_forwardResendBelow) {
+            std::vector<StoredEvent> backlog = ReadStoredSequences(resendAfter, g_forwardResendBelow, 4096);
+            resendAfter = backlog.empty() ? g_forwardResendBelow : backlog.back().sequence;
+            batch.assign(sizeof(uint32_t), '\0');
+            for (const StoredEvent& stored : backlog) {
+                SecurityEvent event;
+                event.kind = stored.kind;
+                event.sequence = stored.sequence;
+                event.timestampMicros = stored.timestampMicros;
+                event.flags = stored.flags;
+                event.detail = StoredEventDetail(stored.kind, stored.message);
+                addToBatch(event);
+            }
+            std::memcpy(&batch[0], &batchCount, sizeof(batchCount));
+            g_forwardResent += batchCount;
+        }
+        while (batchCount == 0) {
+            uint64_t head = g_hotTier.head.load(std::memory_order_acquire);
+            uint64_t oldest = head > g_hotTier.capacity - guard ? head - (g_hotTier.capacity - guard) : 0;
+            if (g_forwardCursor < oldest) {
+                g_forwardOverrun += oldest - g_forwardCursor;
+                RecordHotTierOverrun(g_forwardCursor, oldest, DropReason::ForwardOverrun);
+                LogEvent("WARNING: Forwarding fell behind ingest; " + std::to_string(oldest - g_forwardCursor) +
+                         " events were overwritten in memory before they were sent");
+                g_forwardCursor = oldest;
+            }
+            const uint64_t start = g_forwardCursor;
+            batch.assign(sizeof(uint32_t), '\0');
+            for (; g_forwardCursor < head && batchCount < 4096; ++g_forwardCursor) {
+                addToBatch(HotTierEvent((size_t)(g_forwardCursor & mask), g_forwardInternCache));
+            }
+            std::memcpy(&batch[0], &batchCount, sizeof(batchCount));
+            // Slots lapped while they were being copied may be torn; build the batch again
+            if (start >= HotTierOldestIntact()) break;
+            g_forwardCursor = start;
+            batchCount = 0;
+        }
+        if (batchCount == 0 && (giveUpAt || SteadyMicros() < policyOfferAt)) {
+            if (giveUpAt) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+        if (giveUpAt && SteadyMicros() > giveUpAt) break;
+
+        int64_t now = SteadyMicros();
+        int node = RouteOnRing(g_collectorRing, hostHash, [&](uint32_t n) { return g_collectors[n].downUntil <= now; });
+        if (node < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Everything is down; events wait in memory
+            continue;
+        }
+        if (node != connectedNode) {
+            // Keep the current connection until the preferred collector actually answers
+            SocketHandle candidate = ConnectTcp(g_collectors[node].host, g_collectors[node].port, 1000);
+            if (candidate != kInvalidSocket) SetSocketTimeout(candidate, 5000);
+            if (candidate == kInvalidSocket || !SendFrame(candidate, FrameType::Hello, g_hostId)) {
+                CloseSocket(candidate);
+                backOff(node, "unreachable");
+                continue;
+            }
+            CloseSocket(connection);
+            connection = candidate;
+            connectedNode = node;
+            if (previousNode >= 0 && previousNode != node) ++g_forwardFailovers;
+            LogEvent("Forwarding events for host " + g_hostId + " to collector " + nodeName(node) +
+                     (previousNode >= 0 && previousNode != node ? " (was " + nodeName(previousNode) + ")" : ""));
+            previousNode = node;
+            policyOfferAt = 0;
+        }
+        if (now >= policyOfferAt) {
+            if (!ExchangePolicy(connection)) {
+                markDown(node, "failed the policy exchange");
+                continue;
+            }
+            policyOfferAt = now + kPolicyOfferMicros;
+        }
+        if (batchCount == 0) continue;
+        FrameType type;
+        std::string ack;
+        uint64_t acked = 0;
+        if (!SendFrame(connection, FrameType::Events, batch) || !RecvFrame(connection, type, ack) ||
+            type != FrameType::Ack || ack.size() != sizeof(acked)) {
+            markDown(node, "failed mid-batch");
+            continue;
+        }
+        std::memcpy(&acked, ack.data(), sizeof(acked));
+        if (acked != batchLast) {
+            markDown(node, "acknowledged the wrong batch");
+            continue;
+        }
+        g_collectors[node].failures = 0;
+        g_forwardedEvents += batchCount;
+        g_forwardAcked.store(acked);
+        g_stateVersion.fetch_add(1, std::memory_order_relaxed);
+        batchCount = 0;
+    }
+    CloseSocket(connection);
+}
+
+// Offer this agent's policy version on a forwarding connection and stage the collector's
+// answer for LoadPolicy: a delta under the usual name next to the image, or a whole image
+// (validated first) in its place. Fails only if the connection does.
+bool ExchangePolicy(SocketHandle connection) {
+    std::shared_ptr<const PolicyImage> current = std::atomic_load(&g_policy);
+    uint64_t version = current ? current->header->version : 0;
+    uint32_t checksum = current ? current->header->checksum : 0;
+    std::string offer(reinterpret_cast<const char*>(&version), sizeof(version));
+    offer.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    FrameType type;
+    std::string update;
+    if (!SendFrame(connection, FrameType::PolicyOffer, offer) || !RecvFrame(connection, type, update) ||
+        type != FrameType::PolicyUpdate) {
+        return false;
+    }
+    if (update.empty()) return true; // Up to date, or the collector distributes no policy
+    std::filesystem::path path = PolicyFilePath();
+    uint32_t magic = 0;
+    std::memcpy(&magic, update.data(), std::min(sizeof(magic), update.size()));
+    PolicyDeltaHeader delta;
+    PolicyImage image;
+    if (magic == kPolicyDeltaMagic && update.size() >= sizeof(delta)) {
+        std::memcpy(&delta, update.data(), sizeof(delta));
+        std::filesystem::path staged = path;
+        staged += "." + std::to_string(delta.fromVersion) + "-" + std::to_string(delta.toVersion) + ".delta";
+        if (WriteFileAtomically(staged, update, std::string())) {
+            LogEvent("Received policy delta " + std::to_string(delta.fromVersion) + " -> " + std::to_string(delta.toVersion) +
+                     " (" + std::to_string(update.size()) + " bytes) from the collector");
+        }
+    } else if (ParsePolicyImage(update, image)) {
+        if (WriteFileAtomically(path, update, std::string())) {
+            LogEvent("Received policy version " + std::to_string(image.header->version) + " from the collector");
+        }
+    } else {
+        LogEvent("WARNING: Collector sent an invalid policy update; ignored");
+    }
+    return true;
+}
+
+void StopForwarder() {
+    if (!g_forwarderThread.joinable()) return;
+    g_forwarderStop.store(true);
+    g_forwarderThread.join();
+}
+
+std::string FormatForwarderStats() {
+    uint64_t unsent = g_hotTier.capacity ? g_hotTier.head.load() - g_forwardCursor : 0;
+    return "Forwarding: " + std::to_string(g_forwardedEvents.load()) + " events sent for host " + g_hostId + ", " +
+           std::to_string(g_forwardFailovers.load()) + " failovers, " + std::to_string(g_forwardOverrun.load()) +
+           " overwritten before sending, " + std::to_string(unsent) + " unsent, " +
+           std::to_string(g_forwardResent.load()) + " resent from storage after a restart";
+}
+
+// What an agent holding policy `version` (an image with that checksum) needs: nothing when it
+// is current or newer, a delta when that version was served before, else the whole image
+std::string PolicyUpdateFor(uint64_t version, uint32_t checksum) {
+    if (g_policyServePath.empty()) return std::string();
+    std::lock_guard<std::mutex> lock(g_policyServeMutex);
+    std::error_code ec;
+    std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(g_policyServePath, ec);
+    if (!ec && writeTime != g_policyServeWriteTime) {
+        g_policyServeWriteTime = writeTime;
+        std::string image;
+        PolicyImage parsed;
+        if (ReadWholeFile(g_policyServePath, image) && ParsePolicyImage(image, parsed)) {
+            std::filesystem::path kept = g_policyHistoryDir / (std::to_string(parsed.header->version) + ".policy");
+            if (!std::filesystem::exists(kept, ec)) WriteFileAtomically(kept, image, std::string());
+            g_policyServeImage = image;
+            g_policyServeDeltas.clear();
+            LogEvent("Collector: distributing policy version " + std::to_string(parsed.header->version));
+        } else {
+            LogEvent("WARNING: Policy image " + g_policyServePath.string() + " is invalid; still distributing the previous one");
+        }
+    }
+    if (g_policyServeImage.empty()) return std::string();
+    PolicyHeader current;
+    std::memcpy(&current, g_policyServeImage.data(), sizeof(current));
+    if (version >= current.version) return std::string();
+    auto cached = g_policyServeDeltas.find(version);
+    if (cached != g_policyServeDeltas.end()) return cached->second;
+    std::string base;
+    PolicyHeader from;
+    if (version != 0 && ReadWholeFile(g_policyHistoryDir / (std::to_string(version) + ".policy"), base) && base.size() >= sizeof(from)) {
+        std::memcpy(&from, base.data(), sizeof(from));
+        if (from.checksum == checksum) {
+            return g_policyServeDeltas[version] = MakePolicyDelta(base, g_policyServeImage);
+        }
+    }
+    return g_policyServeImage;
+}
+
+// One agent connection: Hello, then Events frames, each acknowledged once stored, and policy
+// offers, each answered with an update (or a collector's replication, or an agent's segment
+// shipping)
+void CollectorConnectionProc(SocketHandle socket) {
+    SetSocketTimeout(socket, 5000);
+    FrameType type;
+    std::string payload;
+    if (!RecvFrame(socket, type, payload) || payload.empty() || payload.size() > 255 ||
+        (type != FrameType::Hello && type != FrameType::ReplicaHello && type != FrameType::ShipHello)) {
+        CloseSocket(socket);
+        return;
+    }
+    // The name becomes a directory under replicas/ or shipped/, or a field of the
+    // space-separated prevalence observations
+    if (payload.find_first_not_of(kNodeNameChars) != std::string::npos ||
+        payload[0] == '.') {
+        CloseSocket(socket);
+        return;
+    }
+    if (type == FrameType::ReplicaHello || type == FrameType::ShipHello) {
+        if (type == FrameType::ReplicaHello) {
+            ReceiveReplica(socket, payload);
+        } else {
+            ReceiveShipment(socket, payload);
+        }
+        return;
+    }
+    const std::string host = payload;
+    const uint32_t hostId = InternDevice(host);
+    const uint32_t source = ++g_collectorConnections; // Watermarks are per connection, which delivers in order
+    LogEvent("Collector: agent " + host + " connected");
+    while (!g_collectorStop.load()) {
+        int ready = WaitReadable(socket, 250);
+        if (ready == 0) continue;
+        if (ready < 0 || !RecvFrame(socket, type, payload)) break;
+        if (type == FrameType::PolicyOffer) {
+            uint64_t version;
+            uint32_t checksum;
+            if (payload.size() != sizeof(version) + sizeof(checksum)) break;
+            std::memcpy(&version, payload.data(), sizeof(version));
+            std::memcpy(&checksum, payload.data() + sizeof(version), sizeof(checksum));
+            if (!SendFrame(socket, FrameType::PolicyUpdate, PolicyUpdateFor(version, checksum))) break;
+            continue;
+        }
+        if (type != FrameType::Events || payload.size() < sizeof(uint32_t)) break;
+        uint32_t count;
+        std::memcpy(&count, payload.data(), sizeof(count));
+        const char* p = payload.data() + sizeof(count);
+        const char* end = payload.data() + payload.size();
+        uint64_t last = 0;
+        bool ok = true;
+        std::lock_guard<std::mutex> lock(g_collectorMutex);
+        const int64_t now = ClockMicros();
+        uint64_t& highWater = g_collectorHighWater[host];
+        for (uint32_t i = 0; i < count; ++i) {
+            WireEvent record;
+            if (p + sizeof(record) > end) { ok = false; break; }
+            std::memcpy(&record, p, sizeof(record));
+            p += sizeof(record);
+            if (p + record.detailLength > end || record.kind >= (uint8_t)EventKind::Count) { ok = false; break; }
+            last = record.sequence;
+            if (record.sequence <= highWater) {
+                ++g_collectorDuplicates; // Resent after a lost acknowledgement
+                p += record.detailLength;
+                continue;
+            }
+            highWater = record.sequence;
+            SecurityEvent event;
+            event.kind = (EventKind)record.kind;
+            event.sequence = record.sequence;
+            event.timestampMicros = record.timestampMicros;
+            event.flags = record.flags;
+            event.hostId = hostId;
+            event.detail.assign(p, record.detailLength);
+            p += record.detailLength;
+            if ((event.kind == EventKind::UsbArrival || event.kind == EventKind::DeviceArrival) && g_collectorObservations.is_open()) {
+                g_collectorObservations << record.timestampMicros / 1000000 << ' ' << host << ' ' << event.detail << '\n';
+            }
+            ReorderAdd(g_collectorReorder, source, std::move(event), now);
+        }
+        StoreCollectedEvents(now);
+        if (!ok || !SendFrame(socket, FrameType::Ack, std::string(reinterpret_cast<const char*>(&last), sizeof(last)))) break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_collectorMutex);
+        g_collectorReorder.sources.erase(source); // Stop holding the other agents back
+        StoreCollectedEvents(ClockMicros());
+    }
+    LogEvent("Collector: agent " + host + " disconnected");
+    CloseSocket(socket);
+}
+
+// Receive events from agents into this process's hot tier and tiered storage under DIR,
+// record device arrivals as prevalence observations (see --prevalence), keep replicas of peer
+// collectors' storage under DIR/replicas and agents' shipped segment files under DIR/shipped,
+// with policy=, bring agents' policy up to date and, with peer=, replicate our own storage
+int RunCollectorCommand(int argc, char* argv[]) {
+    CollectorConfig config;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        try {
+            if (key == "port" && !value.empty()) config.port = value;
+            else if (key == "dir" && !value.empty()) config.directory = value;
+            else if (key == "duration") config.durationSec = std::stod(value);
+            else if (key == "config" && !value.empty()) config.configFileName = value;
+            else if (key == "peer" && !value.empty()) config.peer = value;
+            else if (key == "name" && !value.empty()) config.name = value;
+            else if (key == "replicate_mb_s") config.replicateMbPerSec = std::stod(value);
+            else if (key == "lateness_ms") config.latenessMs = std::max(0.0, std::stod(value));
+            else if (key == "policy" && !value.empty()) config.policyFileName = value;
+            else {
+                std::cerr << "Unknown or invalid collector option: " << arg << std::endl;
+                return 2;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+            return 2;
+        }
+    }
+    std::filesystem::path directory = std::filesystem::absolute(config.directory);
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (!OpenLogFile(directory / "SecurityMonitorCollector.txt", std::ios::app)) {
+        std::cerr << "FATAL: Could not open collector log in " << directory.string() << std::endl;
+        return 1;
+    }
+    if (!config.configFileName.empty()) {
+        g_configPath = std::filesystem::absolute(config.configFileName);
+        std::string configError;
+        if (!ReloadConfig(true, configError)) {
+            std::cerr << "Invalid config " << g_configPath.string() << ": " << configError << std::endl;
+            return 2;
+        }
+    }
+    if (!InitHotTier((size_t)std::max<uint32_t>(CurrentConfig().hotTierMb, 1) << 20)) {
+        std::cerr << "FATAL: Could not allocate the collector's hot tier" << std::endl;
+        return 1;
+    }
+    std::string storageSummary;
+    InitStorage(directory / "segments", storageSummary);
+    LogEvent(storageSummary);
+    g_collectorReorder.latenessMicros = (int64_t)(config.latenessMs * 1000.0);
+    g_collectorObservations.open(directory / "prevalence.observations", std::ios::app);
+    SocketHandle listener = InitNetwork() ? ListenTcp(config.port) : kInvalidSocket;
+    if (listener == kInvalidSocket) {
+        std::cerr << "FATAL: Could not listen on port " << config.port << std::endl;
+        return 1;
+    }
+    StartStorage();
+    g_replicaRoot = directory / "replicas";
+    g_shipRoot = directory / "shipped";
+    if (!config.policyFileName.empty()) {
+        g_policyServePath = std::filesystem::absolute(config.policyFileName);
+        g_policyHistoryDir = directory / "policy";
+        std::filesystem::create_directories(g_policyHistoryDir, ec);
+    }
+    if (!config.peer.empty() &&
+        !StartReplicator(config.peer, config.name.empty() ? LocalHostName() + "-" + config.port : config.name, config.replicateMbPerSec)) {
+        std::cerr << "Could not replicate to " << config.peer << " (expected host:port)" << std::endl;
+    }
+    std::signal(SIGINT, [](int) { g_collectorStop.store(true); });
+    std::signal(SIGTERM, [](int) { g_collectorStop.store(true); });
+    LogEvent("Collector listening on port " + config.port + ", storing in " + directory.string());
+
+    // Connection threads are reaped as they finish, so agents reconnecting over a long run
+    // don't accumulate exited threads
+    struct Connection {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<Connection> connections;
+    const int64_t start = SteadyMicros();
+    int64_t lastReport = start;
+    while (!g_collectorStop.load()) {
+        int64_t now = SteadyMicros();
+        if (config.durationSec > 0 && now - start >= (int64_t)(config.durationSec * 1e6)) break;
+        if (now - lastReport >= 10000000) {
+            lastReport = now;
+            LogEvent("Collector: " + std::to_string(g_collectorEvents.load()) + " events stored, " +
+                     std::to_string(g_collectorDuplicates.load()) + " duplicates skipped");
+            std::string reorderStats;
+            {
+                std::lock_guard<std::mutex> lock(g_collectorMutex);
+                reorderStats = FormatReorderStats(g_collectorReorder);
+            }
+            LogEvent(reorderStats);
+            if (g_replicatorThread.joinable()) LogEvent(FormatReplicationStats());
+        }
+        {
+            // Release events held for agents that went quiet
+            std::lock_guard<std::mutex> lock(g_collectorMutex);
+            StoreCollectedEvents(ClockMicros());
+        }
+        for (size_t i = 0; i < connections.size();) {
+            if (connections[i].done->load()) {
+                connections[i].thread.join();
+                connections.erase(connections.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+        if (WaitReadable(listener, 250) != 1) continue;
+        SocketHandle client = accept(listener, nullptr, nullptr);
+        if (client != kInvalidSocket) {
+            auto done = std::make_shared<std::atomic<bool>>(false);
+            connections.push_back({std::thread([client, done] {
+                CollectorConnectionProc(client);
+                done->store(true);
+            }), done});
+        }
+    }
+    g_collectorStop.store(true);
+    CloseSocket(listener);
+    for (Connection& connection : connections) connection.thread.join();
+    {
+        std::lock_guard<std::mutex> lock(g_collectorMutex);
+        g_collectorReorder.sources.clear();
+        StoreCollectedEvents(ClockMicros());
+    }
+    StopStorage();
+    StopReplicator();
+    g_collectorObservations.close();
+    {
+        std::lock_guard<std::mutex> lock(g_collectorMutex);
+        LogEvent("Collector stopped: " + std::to_string(g_collectorEvents.load()) + " events from " +
+                 std::to_string(g_collectorHighWater.size()) + " hosts, " + std::to_string(g_collectorDuplicates.load()) +
+                 " duplicates skipped");
+        LogEvent(FormatReorderStats(g_collectorReorder));
+    }
+    LogEvent(FormatStorageStats());
+    if (!config.peer.empty()) LogEvent(FormatReplicationStats());
+    if (g_replicaReceivedFiles.load() > 0) {
+        LogEvent("Replicas: " + std::to_string(g_replicaReceivedFiles.load()) + " files (" +
+                 std::to_string(g_replicaReceivedBytes.load() >> 20) + " MB) received from peers, " +
+                 std::to_string(g_replicaRejected.load()) + " failed verification");
+    }
+    if (g_shipReceivedFiles.load() > 0 || g_shipRejected.load() > 0) {
+        LogEvent("Shipped segments: " + std::to_string(g_shipReceivedFiles.load()) + " files (" +
+                 std::to_string(g_shipReceivedBytes.load() >> 20) + " MB) received from agents, " +
+                 std::to_string(g_shipRejected.load()) + " failed verification");
+    }
+    g_logFile.close();
+    return 0;
+}
+
+// --- Collector Replication ---
+
+// seg-<sequence>.seg|.idx|.arc, the only names replicated
+bool IsReplicaFileName(const std::string& name) {
+    if (name.size() < 9 || name.compare(0, 4, "seg-") != 0) return false;
+    size_t dot = name.find('.', 4);
+    if (dot == std::string::npos || dot == 4) return false;
+    for (size_t i = 4; i < dot; ++i) {
+        if (name[i] < '0' || name[i] > '9') return false;
+    }
+    std::string extension = name.substr(dot);
+    return extension == ".seg" || extension == ".idx" || extension == ".arc";
+}
+
+// The storage files to copy elsewhere, oldest first; a segment that has been archived is
+// replaced by its archive
+std::vector<std::string> ListStorageFiles(const std::filesystem::path& directory) {
+    std::vector<std::pair<uint64_t, std::string>> files;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        std::string name = entry.path().filename().string();
+        if (IsReplicaFileName(name)) files.push_back({std::stoull(name.substr(4)), name});
+    }
+    std::sort(files.begin(), files.end());
+    std::vector<std::string> names;
+    for (auto& file : files) {
+        const std::string& name = file.second;
+        if (name.compare(name.size() - 4, 4, ".seg") == 0 &&
+            std::filesystem::exists(directory / (name.substr(0, name.size() - 4) + ".arc"), ec)) continue;
+        names.push_back(std::move(file.second));
+    }
+    return names;
+}
+
+// Loop condition of the threads that copy storage files: once stopped they make one more
+// pass, which picks up the segment closed at shutdown, unless the deadline has passed
+bool KeepCopying(const std::atomic<bool>& stop, const std::atomic<int64_t>& deadline, bool& finalPass) {
+    if (!stop.load()) return true;
+    if (finalPass || SteadyMicros() > deadline.load()) return false;
+    finalPass = true;
+    return true;
+}
+
+// Pace reads and sends to the configured rate so replication stays in the background
+void ThrottleReplica(ReplicaThrottle& throttle, size_t bytes) {
+    if (throttle.bytesPerMicro <= 0) return;
+    int64_t now = SteadyMicros();
+    throttle.nextFree = std::max(throttle.nextFree, now) + (int64_t)(bytes / throttle.bytesPerMicro);
+    if (throttle.nextFree > now) std::this_thread::sleep_for(std::chrono::microseconds(throttle.nextFree - now));
+}
+
+bool DigestFile(const std::filesystem::path& path, ReplicaThrottle& throttle, FileDigest& digest) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return false;
+    std::string chunk(kReplicaChunkBytes, '\0');
+    digest = FileDigest();
+    digest.checksum = Fnv1a(nullptr, 0);
+    while (in) {
+        in.read(&chunk[0], (std::streamsize)chunk.size());
+        size_t got = (size_t)in.gcount();
+        digest.checksum = Fnv1a(chunk.data(), got, digest.checksum);
+        digest.size += got;
+        ThrottleReplica(throttle, got);
+    }
+    return in.eof();
+}
+
+// Stream one file as FileChunk frames, then FileDone with its size and checksum, and wait
+// for the peer to confirm it verified and stored the same bytes
+bool SendReplicaFile(SocketHandle socket, const std::filesystem::path& path, const std::string& name,
+                     ReplicaThrottle& throttle, FileDigest& digest) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return true; // Archived and removed since the listing; nothing to send
+    std::string chunk(kReplicaChunkBytes, '\0');
+    digest = FileDigest();
+    digest.checksum = Fnv1a(nullptr, 0);
+    while (!in.eof()) {
+        if (g_replicatorStop.load() && SteadyMicros() > g_replicatorDeadline.load()) return false;
+        in.read(&chunk[0], (std::streamsize)chunk.size());
+        size_t got = (size_t)in.gcount();
+        if (!in && !in.eof()) return false;
+        std::string payload;
+        PutVarint(payload, name.size());
+        payload += name;
+        PutVarint(payload, digest.size);
+        payload.append(chunk, 0, got);
+        if (!SendFrame(socket, FrameType::FileChunk, payload)) return false;
+        digest.checksum = Fnv1a(chunk.data(), got, digest.checksum);
+        digest.size += got;
+        ThrottleReplica(throttle, got);
+    }
+    std::string done;
+    PutVarint(done, name.size());
+    done += name;
+    PutVarint(done, digest.size);
+    PutVarint(done, digest.checksum);
+    FrameType type;
+    std::string ack;
+    uint64_t stored = 0;
+    if (!SendFrame(socket, FrameType::FileDone, done) || !RecvFrame(socket, type, ack) || type != FrameType::Ack ||
+        ack.size() != sizeof(stored)) {
+        return false;
+    }
+    std::memcpy(&stored, ack.data(), sizeof(stored));
+    if (stored != digest.size) {
+        LogEvent("WARNING: Peer rejected replica of " + name + "; will resend");
+        return false;
+    }
+    return true;
+}
+
+bool StartReplicator(const std::string& peer, const std::string& name, double megabytesPerSec) {
+    size_t colon = peer.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == peer.size() || g_storageDir.empty()) return false;
+    g_replicaPeer.host = peer.substr(0, colon);
+    g_replicaPeer.port = peer.substr(colon + 1);
+    g_replicaName = name;
+    g_replicaBytesPerMicro = megabytesPerSec * 1048576.0 / 1e6;
+    g_replicatorStop.store(false);
+    g_replicatorThread = std::thread(ReplicatorThreadProc);
+    return true;
+}
+
+// Keep the peer's copy of this collector's storage directory complete. After every
+// (re)connection the peer's manifest decides what is missing; files the peer already has
+// are compared by size and checksum before being skipped.
+void ReplicatorThreadProc() {
+    SocketHandle connection = kInvalidSocket;
+    std::unordered_map<std::string, FileDigest> onPeer, local;
+    ReplicaThrottle throttle;
+    throttle.bytesPerMicro = g_replicaBytesPerMicro;
+    const std::string peerName = g_replicaPeer.host + ":" + g_replicaPeer.port;
+    bool finalPass = false;
+    while (KeepCopying(g_replicatorStop, g_replicatorDeadline, finalPass)) {
+        if (connection == kInvalidSocket) {
+            if (SteadyMicros() < g_replicaPeer.downUntil) {
+                if (finalPass) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            connection = ConnectTcp(g_replicaPeer.host, g_replicaPeer.port, 1000);
+            FrameType type;
+            std::string manifest;
+            if (connection != kInvalidSocket) SetSocketTimeout(connection, 10000);
+            if (connection == kInvalidSocket || !SendFrame(connection, FrameType::ReplicaHello, g_replicaName) ||
+                !RecvFrame(connection, type, manifest) || type != FrameType::ReplicaManifest) {
+                if (g_replicaPeer.failures++ == 0) LogEvent("WARNING: Replication peer " + peerName + " unreachable; will catch up when it returns");
+                g_replicaPeer.downUntil = BackoffUntil(g_replicaPeer.failures);
+                CloseSocket(connection);
+                connection = kInvalidSocket;
+                continue;
+            }
+            onPeer.clear();
+            const char* p = manifest.data();
+            const char* end = p + manifest.size();
+            uint64_t count = 0, length = 0, size = 0, checksum = 0;
+            GetVarint(p, end, count);
+            for (uint64_t i = 0; i < count && GetVarint(p, end, length) && length <= (uint64_t)(end - p); ++i) {
+                std::string file(p, (size_t)length);
+                p += length;
+                if (!GetVarint(p, end, size) || !GetVarint(p, end, checksum)) break;
+                onPeer[file] = {size, (uint32_t)checksum};
+            }
+            g_replicaPeer.failures = 0;
+            ++g_replicaConnects;
+            LogEvent("Replicating to " + peerName + " as " + g_replicaName + "; peer holds " + std::to_string(onPeer.size()) + " files");
+        }
+
+        std::vector<std::string> files = ListStorageFiles(g_storageDir);
+        std::error_code ec;
+        uint64_t pending = 0;
+        for (const std::string& name : files) {
+            if (!onPeer.count(name)) ++pending;
+        }
+        g_replicaPending.store(pending);
+        bool failed = false;
+        for (const std::string& name : files) {
+            if (failed || (g_replicatorStop.load() && SteadyMicros() > g_replicatorDeadline.load())) break;
+            std::filesystem::path path = g_storageDir / name;
+            auto peerCopy = onPeer.find(name);
+            if (peerCopy != onPeer.end()) {
+                auto known = local.find(name);
+                if (known == local.end()) {
+                    FileDigest digest;
+                    if (!DigestFile(path, throttle, digest)) continue;
+                    known = local.emplace(name, digest).first;
+                }
+                if (known->second.size == peerCopy->second.size && known->second.checksum == peerCopy->second.checksum) continue;
+                LogEvent("WARNING: Peer copy of " + name + " differs; resending");
+            }
+            FileDigest digest;
+            if (!SendReplicaFile(connection, path, name, throttle, digest)) {
+                failed = true;
+                break;
+            }
+            if (digest.size == 0 && !std::filesystem::exists(path, ec)) continue;
+            onPeer[name] = local[name] = digest;
+            ++g_replicatedFiles;
+            g_replicatedBytes += digest.size;
+            if (g_replicaPending.load() > 0) --g_replicaPending;
+        }
+        if (failed) {
+            if (g_replicaPeer.failures++ == 0) LogEvent("WARNING: Replication to " + peerName + " interrupted; will catch up when it returns");
+            g_replicaPeer.downUntil = BackoffUntil(g_replicaPeer.failures);
+            CloseSocket(connection);
+            connection = kInvalidSocket;
+            continue;
+        }
+        for (auto it = local.begin(); it != local.end();) {
+            it = std::filesystem::exists(g_storageDir / it->first, ec) ? std::next(it) : local.erase(it);
+        }
+        if (finalPass) break;
+        for (int i = 0; i < 10 && !g_replicatorStop.load(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    CloseSocket(connection);
+}
+
+// Called after the storage thread has closed its last segment; allows a bounded final pass
+void StopReplicator() {
+    if (!g_replicatorThread.joinable()) return;
+    g_replicatorDeadline.store(SteadyMicros() + 10000000);
+    g_replicatorStop.store(true);
+    g_replicatorThread.join();
+}
+
+std::string FormatReplicationStats() {
+    char line[256];
+    snprintf(line, sizeof(line), "Replication to %s:%s: %llu files (%.2f MB) sent, %llu pending, %llu connections",
+             g_replicaPeer.host.c_str(), g_replicaPeer.port.c_str(), (unsigned long long)g_replicatedFiles.load(),
+             g_replicatedBytes.load() / 1048576.0, (unsigned long long)g_replicaPending.load(),
+             (unsigned long long)g_replicaConnects.load());
+    return line;
+}
+
+// Peer side: replicas/<source>/ holds verified files plus MANIFEST ("name size checksum"
+// per line, appended as files arrive). Listing only entries whose file still exists with
+// that size makes a crash at any point safe; partial transfers (.part) are discarded.
+void ReceiveReplica(SocketHandle socket, const std::string& source) {
+    std::filesystem::path directory = g_replicaRoot / source;
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    std::unordered_map<std::string, FileDigest> manifest;
+    std::string text;
+    ReadWholeFile(directory / "MANIFEST", text);
+    std::istringstream lines(text);
+    std::string name;
+    FileDigest digest;
+    while (lines >> name >> digest.size >> digest.checksum) manifest[name] = digest;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        if (entry.path().extension() == ".part") std::filesystem::remove(entry.path(), ec);
+    }
+    std::string compacted, records;
+    uint64_t listed = 0;
+    for (auto it = manifest.begin(); it != manifest.end();) {
+        std::error_code sizeError;
+        if (std::filesystem::file_size(directory / it->first, sizeError) != it->second.size || sizeError) {
+            it = manifest.erase(it);
+            continue;
+        }
+        compacted += it->first + " " + std::to_string(it->second.size) + " " + std::to_string(it->second.checksum) + "\n";
+        PutVarint(records, it->first.size());
+        records += it->first;
+        PutVarint(records, it->second.size);
+        PutVarint(records, it->second.checksum);
+        ++listed;
+        ++it;
+    }
+    std::string listing;
+    PutVarint(listing, listed);
+    listing += records;
+    WriteFileAtomically(directory / "MANIFEST", compacted, "");
+    if (!SendFrame(socket, FrameType::ReplicaManifest, listing)) {
+        CloseSocket(socket);
+        return;
+    }
+    LogEvent("Replica: collector " + source + " connected, " + std::to_string(listed) + " files on hand");
+
+    std::ofstream part;
+    std::string partName;
+    uint64_t partBytes = 0;
+    uint32_t partChecksum = 0;
+    FrameType type;
+    std::string payload;
+    while (!g_collectorStop.load()) {
+        int ready = WaitReadable(socket, 250);
+        if (ready == 0) continue;
+        if (ready < 0 || !RecvFrame(socket, type, payload)) break;
+        const char* p = payload.data();
+        const char* end = p + payload.size();
+        uint64_t length = 0, offset = 0, checksum = 0;
+        if (!GetVarint(p, end, length) || length > (uint64_t)(end - p)) break;
+        name.assign(p, (size_t)length);
+        p += length;
+        if (!IsReplicaFileName(name) || !GetVarint(p, end, offset)) break;
+        if (type == FrameType::FileChunk) {
+            if (offset == 0) {
+                part.close();
+                part.open(directory / (name + ".part"), std::ios::binary | std::ios::trunc);
+                partName = name;
+                partBytes = 0;
+                partChecksum = Fnv1a(nullptr, 0);
+            }
+            if (name != partName || offset != partBytes || !part.is_open()) break;
+            part.write(p, end - p);
+            partChecksum = Fnv1a(p, (size_t)(end - p), partChecksum);
+            partBytes += (uint64_t)(end - p);
+            continue;
+        }
+        if (type != FrameType::FileDone || !GetVarint(p, end, checksum)) break;
+        uint64_t stored = UINT64_MAX;
+        if (name == partName && part.is_open()) {
+            part.close();
+            std::filesystem::path partPath = directory / (name + ".part");
+            if (!part.fail() && offset == partBytes && (uint32_t)checksum == partChecksum) {
+                std::filesystem::rename(partPath, directory / name, ec);
+                if (!ec) stored = partBytes;
+            }
+            if (stored == UINT64_MAX) {
+                std::filesystem::remove(partPath, ec);
+                ++g_replicaRejected;
+                LogEvent("WARNING: Replica " + source + "/" + name + " failed verification; discarded");
+            }
+        }
+        if (stored != UINT64_MAX) {
+            if (name.compare(name.size() - 4, 4, ".arc") == 0) {
+                std::filesystem::remove(directory / (name.substr(0, name.size() - 4) + ".seg"), ec);
+            }
+            std::ofstream(directory / "MANIFEST", std::ios::app) << name << ' ' << stored << ' ' << (uint32_t)checksum << '\n';
+            ++g_replicaReceivedFiles;
+            g_replicaReceivedBytes += stored;
+        }
+        partName.clear();
+        if (!SendFrame(socket, FrameType::Ack, std::string(reinterpret_cast<const char*>(&stored), sizeof(stored)))) break;
+    }
+    if (part.is_open()) {
+        part.close();
+        std::filesystem::remove(directory / (partName + ".part"), ec);
+    }
+    LogEvent("Replica: collector " + source + " disconnected");
+    CloseSocket(socket);
+}
+
+// --- Segment Shipping ---
+
+// The checksum a closed storage file carries in its own header, read without the body
+bool ReadStorageChecksum(const std::filesystem::path& path, uint32_t& checksum) {
+    std::ifstream in(path, std::ios::binary);
+    std::string extension = path.extension().string();
+    if (extension == ".arc") {
+        ArchiveHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != kArchiveMagic) return false;
+        checksum = header.checksum;
+    } else if (extension == ".idx") {
+        IndexHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != kIndexMagic) return false;
+        checksum = header.checksum;
+    } else {
+        SegmentHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != kSegmentMagic) return false;
+        checksum = header.checksum;
+    }
+    return true;
+}
+
+// Check a received file (named as in storage) against its header: size and FNV-1a of the body
+bool VerifyStorageFile(const std::filesystem::path& path, const std::string& name, uint32_t& checksum) {
+    MappedFile mapped;
+    if (!MapFileReadOnly(path, mapped)) return false;
+    const char* data = mapped.data;
+    const size_t size = mapped.size;
+    const std::string extension = name.substr(name.rfind('.'));
+    bool ok = false;
+    if (extension == ".seg" && size >= sizeof(SegmentHeader)) {
+        SegmentHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        ok = header.magic == kSegmentMagic && header.headerSize == sizeof(header) &&
+             size == sizeof(header) + SegmentBodyBytes(header.eventCount, header.textBytes) &&
+             header.checksum == Fnv1a(data + sizeof(header), size - sizeof(header));
+        checksum = header.checksum;
+    } else if (extension == ".arc" && size >= sizeof(ArchiveHeader)) {
+        ArchiveHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        ok = header.magic == kArchiveMagic && header.headerSize == sizeof(header) &&
+             header.compressedBytes == size - sizeof(header) && header.checksum == Fnv1a(data + sizeof(header), size - sizeof(header));
+        checksum = header.checksum;
+    } else if (extension == ".idx") {
+        IndexView view;
+        ok = ParseTrigramIndex(data, size, view);
+        if (ok) checksum = view.header->checksum;
+    }
+    UnmapFile(mapped);
+    return ok;
+}
+
+// Send bytes [offset, size) of a closed storage file as FileSpan frames, each followed by its
+// span of the file handed to the kernel (sendfile, TransmitFile) rather than read and copied,
+// then FileDone with the size and the header checksum. The collector verifies the whole file
+// and answers with the bytes stored. A file gone since the listing is not an error.
+bool ShipFile(SocketHandle socket, const std::filesystem::path& path, const std::string& name, uint64_t offset,
+              ReplicaThrottle& throttle, bool& stored) {
+    stored = false;
+    std::error_code ec;
+    uint32_t checksum = 0;
+    const uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec || !ReadStorageChecksum(path, checksum)) return true;
+    if (offset > size) offset = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return true;
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return true;
+#endif
+    bool ok = true;
+    while (ok && offset < size) {
+        if (g_shipperStop.load() && SteadyMicros() > g_shipperDeadline.load()) {
+            ok = false;
+            break;
+        }
+        const uint64_t length = std::min<uint64_t>(kShipSpanBytes, size - offset);
+        std::string span;
+        PutVarint(span, name.size());
+        span += name;
+        PutVarint(span, offset);
+        PutVarint(span, length);
+        ok = SendFrame(socket, FrameType::FileSpan, span);
+#ifdef _WIN32
+        LARGE_INTEGER position;
+        position.QuadPart = (LONGLONG)offset;
+        ok = ok && SetFilePointerEx(file, position, NULL, FILE_BEGIN) && TransmitFile(socket, file, (DWORD)length, 0, NULL, NULL, 0);
+#elif defined(__linux__)
+        off_t position = (off_t)offset;
+        for (uint64_t left = length; ok && left > 0;) {
+            ssize_t sent = sendfile(socket, fd, &position, (size_t)left);
+            if (sent < 0 && errno == EINTR) continue;
+            ok = sent > 0;
+            if (ok) left -= (uint64_t)sent;
+        }
+#else
+        std::string chunk((size_t)length, '\0');
+        ok = ok && pread(fd, &chunk[0], chunk.size(), (off_t)offset) == (ssize_t)chunk.size() && SendAll(socket, chunk.data(), chunk.size());
+#endif
+        if (!ok) break;
+        offset += length;
+        g_shippedBytes += length;
+        ThrottleReplica(throttle, (size_t)length);
+    }
+#ifdef _WIN32
+    CloseHandle(file);
+#else
+    close(fd);
+#endif
+    if (!ok) return false;
+    std::string done;
+    PutVarint(done, name.size());
+    done += name;
+    PutVarint(done, size);
+    PutVarint(done, checksum);
+    FrameType type;
+    std::string ack;
+    uint64_t bytes = 0;
+    if (!SendFrame(socket, FrameType::FileDone, done) || !RecvFrame(socket, type, ack) || type != FrameType::Ack ||
+        ack.size() != sizeof(bytes)) {
+        return false;
+    }
+    std::memcpy(&bytes, ack.data(), sizeof(bytes));
+    if (bytes != size) {
+        LogEvent("WARNING: Collector rejected shipped " + name + "; will resend");
+        return false;
+    }
+    stored = true;
+    return true;
+}
+
+// Needs the collector list and host id from StartForwarder, and storage
+bool StartShipper() {
+    if (!CurrentConfig().shipSegments || g_collectors.empty() || g_storageDir.empty()) return false;
+    g_shipperStop.store(false);
+    g_shipperThread = std::thread(ShipperThreadProc);
+    return true;
+}
+
+// Keep the routed collector's copy of this host's closed storage files complete, oldest
+// first. Every (re)connection starts from the collector's manifest: files it holds whole
+// are skipped and partial ones resume at the bytes it already has.
+void ShipperThreadProc() {
+    const uint64_t hostHash = Hash64(g_hostId.data(), g_hostId.size());
+    std::vector<CollectorNode> nodes = g_collectors; // Own backoff; the forwarder's state is its own
+    ReplicaThrottle throttle;
+    throttle.bytesPerMicro = CurrentConfig().shipMbPerSec * 1048576.0 / 1e6;
+    SocketHandle connection = kInvalidSocket;
+    int connectedNode = -1;
+    std::unordered_map<std::string, std::pair<uint64_t, bool>> held; // Name -> (bytes, complete) at the collector
+    auto nodeName = [&](int node) { return nodes[node].host + ":" + nodes[node].port; };
+    auto backOff = [&](int node, const char* what) {
+        if (nodes[node].failures++ == 0) LogEvent("WARNING: Segment shipping to " + nodeName(node) + " " + what + "; will catch up when it returns");
+        nodes[node].downUntil = BackoffUntil(nodes[node].failures);
+        CloseSocket(connection);
+        connection = kInvalidSocket;
+        connectedNode = -1;
+    };
+    bool finalPass = false;
+    while (KeepCopying(g_shipperStop, g_shipperDeadline, finalPass)) {
+        g_shipCpuMicros.store((uint64_t)ThreadCpuMicros());
+        if (connection == kInvalidSocket) {
+            int64_t now = SteadyMicros();
+            int node = RouteOnRing(g_collectorRing, hostHash, [&](uint32_t n) { return nodes[n].downUntil <= now; });
+            if (node < 0) {
+                if (finalPass) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            connection = ConnectTcp(nodes[node].host, nodes[node].port, 1000);
+            FrameType type;
+            std::string manifest;
+            if (connection != kInvalidSocket) SetSocketTimeout(connection, 10000);
+            if (connection == kInvalidSocket || !SendFrame(connection, FrameType::ShipHello, g_hostId) ||
+                !RecvFrame(connection, type, manifest) || type != FrameType::ShipManifest) {
+                backOff(node, "failed");
+                continue;
+            }
+            held.clear();
+            const char* p = manifest.data();
+            const char* end = p + manifest.size();
+            uint64_t count = 0, length = 0, bytes = 0, complete = 0, partial = 0;
+            GetVarint(p, end, count);
+            for (uint64_t i = 0; i < count && GetVarint(p, end, length) && length <= (uint64_t)(end - p); ++i) {
+                std::string file(p, (size_t)length);
+                p += length;
+                if (!GetVarint(p, end, bytes) || !GetVarint(p, end, complete)) break;
+                held[file] = {bytes, complete != 0};
+                if (!complete) ++partial;
+            }
+            nodes[node].failures = 0;
+            connectedNode = node;
+            LogEvent("Shipping closed segments for host " + g_hostId + " to collector " + nodeName(node) + "; it holds " +
+                     std::to_string(held.size() - partial) + " files" +
+                     (partial ? " and " + std::to_string(partial) + " partial transfers" : ""));
+        }
+
+        std::vector<std::string> files = ListStorageFiles(g_storageDir);
+        uint64_t pending = 0;
+        for (const std::string& name : files) {
+            auto it = held.find(name);
+            if (it == held.end() || !it->second.second) ++pending;
+        }
+        g_shipPending.store(pending);
+        bool failed = false;
+        for (const std::string& name : files) {
+            if (g_shipperStop.load() && SteadyMicros() > g_shipperDeadline.load()) break;
+            std::filesystem::path path = g_storageDir / name;
+            uint64_t offset = 0;
+            auto it = held.find(name);
+            if (it != held.end()) {
+                if (it->second.second) continue;
+                offset = it->second.first;
+                g_shipResumedBytes += offset;
+            }
+            bool stored = false;
+            if (!ShipFile(connection, path, name, offset, throttle, stored)) {
+                failed = true;
+                break;
+            }
+            if (!stored) continue;
+            held[name] = {0, true};
+            ++g_shippedFiles;
+            if (g_shipPending.load() > 0) --g_shipPending;
+        }
+        if (failed) {
+            // Whatever the collector kept of the interrupted file is in its next manifest
+            backOff(connectedNode, "interrupted");
+            continue;
+        }
+        if (finalPass) break;
+        for (int i = 0; i < 10 && !g_shipperStop.load(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        int64_t now = SteadyMicros();
+        if (RouteOnRing(g_collectorRing, hostHash, [&](uint32_t n) { return nodes[n].downUntil <= now; }) != connectedNode) {
+            CloseSocket(connection); // The owner is back; ship there again
+            connection = kInvalidSocket;
+        }
+    }
+    CloseSocket(connection);
+    g_shipCpuMicros.store((uint64_t)ThreadCpuMicros());
+}
+
+// Called after the storage thread has closed its last segment; allows a bounded final pass
+void StopShipper() {
+    if (!g_shipperThread.joinable()) return;
+    g_shipperDeadline.store(SteadyMicros() + 10000000);
+    g_shipperStop.store(true);
+    g_shipperThread.join();
+}
+
+std::string FormatShippingStats() {
+    const uint64_t bytes = g_shippedBytes.load();
+    char line[256];
+    snprintf(line, sizeof(line), "Segment shipping: %llu files (%.2f MB) sent, %.2f MB skipped on resume, %llu pending, "
+             "%.1f CPU ms per GB sent",
+             (unsigned long long)g_shippedFiles.load(), bytes / 1048576.0, g_shipResumedBytes.load() / 1048576.0,
+             (unsigned long long)g_shipPending.load(), bytes ? g_shipCpuMicros.load() / 1000.0 / (bytes / 1073741824.0) : 0.0);
+    return line;
+}
+
+// Collector side: shipped/<host>/ holds verified files and the .part files of transfers in
+// progress, which survive disconnections. The directory is the manifest: whole files with
+// their sizes, partial ones with the bytes held so far.
+void ReceiveShipment(SocketHandle socket, const std::string& host) {
+    std::filesystem::path directory = g_shipRoot / host;
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    std::string records;
+    uint64_t listed = 0, partial = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        std::string name = entry.path().filename().string();
+        bool part = entry.path().extension() == ".part";
+        if (part) name = entry.path().stem().string();
+        if (!IsReplicaFileName(name)) continue;
+        std::error_code sizeError;
+        uint64_t size = entry.file_size(sizeError);
+        if (sizeError) continue;
+        PutVarint(records, name.size());
+        records += name;
+        PutVarint(records, size);
+        PutVarint(records, part ? 0 : 1);
+        ++listed;
+        if (part) ++partial;
+    }
+    std::string listing;
+    PutVarint(listing, listed);
+    listing += records;
+    if (!SendFrame(socket, FrameType::ShipManifest, listing)) {
+        CloseSocket(socket);
+        return;
+    }
+    LogEvent("Collector: agent " + host + " shipping segments, " + std::to_string(listed - partial) + " files on hand" +
+             (partial ? ", " + std::to_string(partial) + " to resume" : ""));
+
+    std::ofstream part;
+    std::string partName, name;
+    uint64_t partBytes = 0;
+    std::string buffer(1u << 20, '\0');
+    FrameType type;
+    std::string payload;
+    while (!g_collectorStop.load()) {
+        int ready = WaitReadable(socket, 250);
+        if (ready == 0) continue;
+        if (ready < 0 || !RecvFrame(socket, type, payload)) break;
+        const char* p = payload.data();
+        const char* end = p + payload.size();
+        uint64_t length = 0, offset = 0, checksum = 0;
+        if (!GetVarint(p, end, length) || length > (uint64_t)(end - p)) break;
+        name.assign(p, (size_t)length);
+        p += length;
+        if (!IsReplicaFileName(name) || !GetVarint(p, end, offset)) break;
+        const std::filesystem::path partPath = directory / (name + ".part");
+        if (type == FrameType::FileSpan) {
+            if (!GetVarint(p, end, length) || length > kShipSpanBytes) break;
+            if (name != partName) {
+                // A new file, or one resumed where an earlier connection left it
+                part.close();
+                std::error_code sizeError;
+                uint64_t have = std::filesystem::file_size(partPath, sizeError);
+                if (sizeError) have = 0;
+                if (offset != 0 && offset != have) break;
+                part.open(partPath, std::ios::binary | (offset == 0 ? std::ios::trunc : std::ios::app));
+                partName = name;
+                partBytes = offset;
+            }
+            if (offset != partBytes || !part.is_open()) break;
+            bool ok = true;
+            while (ok && length > 0) {
+                size_t n = (size_t)std::min<uint64_t>(length, buffer.size());
+                ok = RecvAll(socket, &buffer[0], n) && part.write(buffer.data(), (std::streamsize)n);
+                length -= n;
+                partBytes += n;
+            }
+            if (!ok || !part.flush()) break;
+            continue;
+        }
+        if (type != FrameType::FileDone || !GetVarint(p, end, checksum)) break;
+        if (name == partName) part.close();
+        partName.clear();
+        uint64_t stored = UINT64_MAX;
+        uint32_t embedded = 0;
+        std::error_code sizeError;
+        if (std::filesystem::file_size(partPath, sizeError) == offset && !sizeError &&
+            VerifyStorageFile(partPath, name, embedded) && embedded == (uint32_t)checksum) {
+            std::filesystem::rename(partPath, directory / name, ec);
+            if (!ec) stored = offset;
+        }
+        if (stored == UINT64_MAX) {
+            std::filesystem::remove(partPath, ec);
+            ++g_shipRejected;
+            LogEvent("WARNING: Shipped " + host + "/" + name + " failed verification; discarded");
+        } else {
+            if (name.compare(name.size() - 4, 4, ".arc") == 0) {
+                std::filesystem::remove(directory / (name.substr(0, name.size() - 4) + ".seg"), ec);
+            }
+            ++g_shipReceivedFiles;
+            g_shipReceivedBytes += stored;
+        }
+        if (!SendFrame(socket, FrameType::Ack, std::string(reinterpret_cast<const char*>(&stored), sizeof(stored)))) break;
+    }
+    part.close(); // Kept; the agent resumes from its size
+    LogEvent("Collector: agent " + host + " stopped shipping segments");
+    CloseSocket(socket);
+}
+
+// --- Query API ---
+
+// Re-encode the inventory for queries; the caller holds g_inventoryMutex
+void PublishQuerySnapshot() {
+    std::shared_ptr<QuerySnapshot> snapshot = std::make_shared<QuerySnapshot>();
+    snapshot->stateVersion = g_stateVersion.load(std::memory_order_relaxed);
+    snapshot->deviceCount = (uint32_t)g_inventory.size();
+    std::string& body = snapshot->inventory;
+    body.reserve(8 + g_inventory.size() * 96);
+    PutVarint(body, g_mountedVolumes);
+    for (const auto& device : g_inventory) {
+        PutVarint(body, (uint64_t)device.second.kind);
+        PutVarint(body, (uint64_t)device.second.firstSeen);
+        PutVarint(body, device.first.size());
+        body += device.first;
+    }
+    g_querySnapshotAt.store(SteadyMicros(), std::memory_order_relaxed);
+    g_querySnapshotStale.store(false, std::memory_order_relaxed);
+    std::atomic_store(&g_querySnapshot, std::shared_ptr<const QuerySnapshot>(std::move(snapshot)));
+}
+
+// Encode the response (header and body) to one request
+std::string AnswerQuery(const QueryRequest& request) {
+    QueryResponseHeader header;
+    header.type = request.type;
+    std::string response(sizeof(header), '\0');
+    auto counter = [&](const std::string& name, uint64_t value) {
+        PutVarint(response, name.size());
+        response += name;
+        PutVarint(response, value);
+        ++header.count;
+    };
+    if (request.magic != kQueryMagic) {
+        header.status = (uint16_t)QueryStatus::BadRequest;
+    } else {
+        switch ((QueryType)request.type) {
+            case QueryType::Ping:
+                break;
+            case QueryType::Inventory: {
+                std::shared_ptr<const QuerySnapshot> snapshot = std::atomic_load(&g_querySnapshot);
+                if (!snapshot) {
+                    header.status = (uint16_t)QueryStatus::Unavailable;
+                    break;
+                }
+                response += snapshot->inventory;
+                header.count = snapshot->deviceCount;
+                header.stateVersion = snapshot->stateVersion;
+                break;
+            }
+            case QueryType::RecentEvents: {
+                if (g_hotTier.capacity == 0) {
+                    header.status = (uint16_t)QueryStatus::Unavailable;
+                    break;
+                }
+                const size_t mask = g_hotTier.capacity - 1;
+                const uint64_t window = g_hotTier.capacity - g_hotTier.capacity / 8;
+                const uint32_t limit = request.limit == 0 ? 100 : std::min(request.limit, kQueryMaxEvents);
+                uint64_t first, last;
+                HotTierRange(request.sinceMicros, INT64_MAX, first, last);
+                EventPredicate predicate;
+                predicate.kindMask = request.kindMask;
+                std::vector<std::pair<uint64_t, size_t>> starts; // (position, response size before it)
+                // Newest first, a batch of up to 64 slots at a time
+                for (uint64_t end = last; end > first && header.count < limit;) {
+                    size_t endSlot = (size_t)((end - 1) & mask) + 1;
+                    size_t count = (size_t)std::min<uint64_t>({64, end - first, endSlot});
+                    size_t begin = endSlot - count;
+                    uint64_t bits = MatchHotTierBlock(begin, count, predicate);
+                    unsigned matched[64];
+                    size_t found = 0;
+                    for (; bits; bits &= bits - 1) matched[found++] = LowestBit(bits);
+                    for (size_t n = found; n-- > 0 && header.count < limit;) {
+                        size_t slot = begin + matched[n];
+                        // Encoded straight from the columns; the intern cache is refreshed as in HotTierEvent
+                        uint32_t deviceId = g_hotTier.deviceIds[slot];
+                        if (deviceId >= g_queryInternCache.size()) {
+                            std::lock_guard<std::mutex> lock(g_internMutex);
+                            g_queryInternCache.assign(g_devicePaths.begin(), g_devicePaths.end());
+                        }
+                        const std::string& detail = deviceId < g_queryInternCache.size() ? g_queryInternCache[deviceId] : g_queryInternCache[0];
+                        starts.push_back({end - count + matched[n], response.size()});
+                        PutVarint(response, g_hotTier.sequences[slot]);
+                        PutVarint(response, (uint64_t)g_hotTier.eventTimes[slot]);
+                        PutVarint(response, g_hotTier.flags[slot]);
+                        PutVarint(response, g_hotTier.kinds[slot]);
+                        PutVarint(response, detail.size());
+                        response += detail;
+                        ++header.count;
+                    }
+                    end -= count;
+                }
+                // The writer may have lapped the oldest slots while they were being read
+                uint64_t head = g_hotTier.head.load(std::memory_order_acquire);
+                uint64_t oldest = head > window ? head - window : 0;
+                while (!starts.empty() && starts.back().first < oldest) {
+                    response.resize(starts.back().second);
+                    starts.pop_back();
+                    --header.count;
+                }
+                break;
+            }
+            case QueryType::Counters: {
+                counter("events_sequenced", g_nextSequence.load() - 1);
+                counter("hot_tier_events", g_hotTier.head.load());
+                for (size_t reason = 0; reason < (size_t)DropReason::Count; ++reason) {
+                    uint64_t dropped = 0;
+                    for (size_t kind = 0; kind < (size_t)EventKind::Count; ++kind) dropped += g_dropCounts[reason][kind].load();
+                    counter(std::string("dropped.") + kDropReasonNames[reason], dropped);
+                }
+                for (size_t i = 0; i < kLagBuckets; ++i) {
+                    uint64_t lags = g_lagHistogram[i].load();
+                    if (lags) counter("loop_lag_under_" + std::to_string(1ull << i) + "_us", lags);
+                }
+                for (size_t stage = 0; stage < (size_t)Stage::Count; ++stage) {
+                    uint64_t samples = g_stageStats[stage].samples.load();
+                    if (samples == 0) continue;
+                    counter(std::string("stage.") + kStageNames[stage] + ".samples", samples);
+                    counter(std::string("stage.") + kStageNames[stage] + ".nanos", g_stageStats[stage].nanos.load());
+                }
+                if (!g_collectors.empty()) {
+                    counter("forward.events", g_forwardedEvents.load());
+                    counter("forward.failovers", g_forwardFailovers.load());
+                    counter("forward.overwritten", g_forwardOverrun.load());
+                }
+                counter("clock.tsc", g_timestampCalibration.tsc.load() ? 1 : 0);
+                counter("clock.calibrations", g_timestampCalibrations.load());
+                counter("clock.steps", g_timestampSteps.load());
+                counter("clock.drift_abs_us", (uint64_t)std::abs(g_timestampDrift.load()));
+                counter("clock.max_drift_us", (uint64_t)g_timestampMaxDrift.load());
+                counter("queries_served", g_queriesServed.load());
+                break;
+            }
+            case QueryType::RuleState: {
+                const ConfigImage& config = CurrentConfig();
+                uint64_t logKinds = 0;
+                for (size_t kind = 0; kind < (size_t)EventKind::Count; ++kind) {
+                    if (config.logKinds[kind]) logKinds |= 1ull << kind;
+                }
+                counter("config.generation", config.generation);
+                counter("config.checksum", config.checksum);
+                counter("config.log_kinds", logKinds);
+                counter("config.device_filter_usb_only", config.deviceFilterUsbOnly);
+                std::shared_ptr<const PrevalenceFilter> filter = std::atomic_load(&g_prevalence);
+                counter("prevalence.loaded", filter ? 1 : 0);
+                if (filter) {
+                    counter("prevalence.models", filter->header->itemCount);
+                    counter("prevalence.published_at", (uint64_t)filter->header->publishedAt);
+                }
+                std::shared_ptr<const PolicyImage> policy = std::atomic_load(&g_policy);
+                counter("policy.loaded", policy ? 1 : 0);
+                if (policy) {
+                    counter("policy.version", policy->header->version);
+                    counter("policy.allow", policy->allowCount);
+                    counter("policy.block", policy->blockCount);
+                }
+                break;
+            }
+            default:
+                header.status = (uint16_t)QueryStatus::BadRequest;
+        }
+    }
+    header.length = (uint32_t)(response.size() - sizeof(header));
+    std::memcpy(&response[0], &header, sizeof(header));
+    g_queriesServed.fetch_add(1, std::memory_order_relaxed);
+    return response;
+}
+
+// Publish the first snapshot and start serving; off Windows the socket is bound here so a
+// failure is reported to the caller
+bool StartQueryServer() {
+    if (g_queryServerThread.joinable()) return true;
+    {
+        std::lock_guard<std::mutex> lock(g_inventoryMutex);
+        PublishQuerySnapshot();
+    }
+#ifndef _WIN32
+    std::filesystem::path path = g_querySocketPath.empty() ? GetExecutableDirectory() / kQuerySocketName : g_querySocketPath;
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.string().size() >= sizeof(address.sun_path)) {
+        LogEvent("WARNING: Query API disabled: socket path too long: " + path.string());
+        return false;
+    }
+    std::strncpy(address.sun_path, path.string().c_str(), sizeof(address.sun_path) - 1);
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s >= 0 && connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        close(s);
+        LogEvent("WARNING: Query API disabled: another monitor is serving " + path.string());
+        return false;
+    }
+    if (s >= 0) close(s);
+    unlink(address.sun_path); // Left behind by a monitor that did not shut down cleanly
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t previousMask = umask(0177); // Owner only
+    bool ok = s >= 0 && bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && listen(s, 16) == 0;
+    umask(previousMask);
+    if (!ok) {
+        LogEvent("WARNING: Query API disabled: cannot listen on " + path.string() + ": " + std::strerror(errno));
+        if (s >= 0) close(s);
+        return false;
+    }
+    g_queryListener = s;
+    g_querySocketPath = path;
+#endif
+    g_queryServerStop.store(false);
+    g_queryServerExited.store(false);
+    g_queryServerRunning.store(true);
+    g_queryServerThread = std::thread(QueryServerThreadProc);
+    return true;
+}
+
+void QueryServerThreadProc() {
+#ifdef _WIN32
+    // One client at a time; requests on a connection are answered in order
+    auto readExact = [](HANDLE pipe, char* data, DWORD size) {
+        while (size > 0) {
+            DWORD read = 0;
+            if (!ReadFile(pipe, data, size, &read, NULL) || read == 0) return false;
+            data += read;
+            size -= read;
+        }
+        return true;
+    };
+    g_queryServerThreadId.store(GetCurrentThreadId());
+    while (!g_queryServerStop.load()) {
+        HANDLE pipe = CreateNamedPipeW(kQueryPipeName, PIPE_ACCESS_DUPLEX,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, 1 << 16, 1 << 12, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            LogEvent("WARNING: Query API stopped: cannot create " + WideToUtf8(kQueryPipeName) + ": " + std::to_string(GetLastError()));
+            break;
+        }
+        bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+        QueryRequest request;
+        while (connected && !g_queryServerStop.load() && readExact(pipe, reinterpret_cast<char*>(&request), sizeof(request))) {
+            std::string response = AnswerQuery(request);
+            DWORD written = 0;
+            if (!WriteFile(pipe, response.data(), (DWORD)response.size(), &written, NULL) || written != response.size()) break;
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+#else
+    std::vector<pollfd> fds = {{g_queryListener, POLLIN, 0}};
+    std::vector<std::string> pending(1);
+    char buffer[sizeof(QueryRequest) * 32];
+    while (!g_queryServerStop.load()) {
+        bool stale = g_querySnapshotStale.load(std::memory_order_relaxed);
+        int ready = poll(fds.data(), fds.size(), stale ? (int)(kQuerySnapshotMicros / 1000) : 250);
+        if (stale && SteadyMicros() - g_querySnapshotAt.load(std::memory_order_relaxed) >= kQuerySnapshotMicros) {
+            std::lock_guard<std::mutex> lock(g_inventoryMutex); // Changes stopped before the capture path republished
+            PublishQuerySnapshot();
+        }
+        if (ready <= 0) continue;
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(g_queryListener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0 && fds.size() > 64) {
+                close(client);
+            } else if (client >= 0) {
+                SetSocketTimeout(client, 1000); // A client that stops reading can't stall the others for long
+                fds.push_back({client, POLLIN, 0});
+                pending.emplace_back();
+            }
+        }
+        for (size_t i = fds.size(); i-- > 1;) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t received = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+            bool keep = received > 0;
+            std::string responses;
+            if (keep) {
+                pending[i].append(buffer, (size_t)received);
+                size_t used = 0;
+                for (; pending[i].size() - used >= sizeof(QueryRequest); used += sizeof(QueryRequest)) {
+                    QueryRequest request;
+                    std::memcpy(&request, pending[i].data() + used, sizeof(request));
+                    responses += AnswerQuery(request);
+                }
+                pending[i].erase(0, used);
+                keep = responses.empty() || SendAll(fds[i].fd, responses.data(), responses.size());
+            }
+            if (!keep) {
+                close(fds[i].fd);
+                fds.erase(fds.begin() + i);
+                pending.erase(pending.begin() + i);
+            }
+        }
+    }
+    for (const pollfd& fd : fds) close(fd.fd);
+    unlink(g_querySocketPath.c_str());
+#endif
+    g_queryServerExited.store(true);
+}
+
+void StopQueryServer() {
+    if (!g_queryServerThread.joinable()) return;
+    g_queryServerStop.store(true);
+#ifdef _WIN32
+    // Wake the thread from ConnectNamedPipe or ReadFile
+    while (g_queryServerThreadId.load() == 0 && !g_queryServerExited.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    HANDLE thread = OpenThread(THREAD_TERMINATE, FALSE, g_queryServerThreadId.load());
+    while (thread != NULL && !g_queryServerExited.load()) {
+        CancelSynchronousIo(thread);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (thread != NULL) CloseHandle(thread);
+#endif
+    g_queryServerThread.join();
+    g_queryServerRunning.store(false);
+}
+
+// Query a running monitor: "--query ping|inventory|events|counters|rules [limit=N] [kinds=MASK]
+// [since_s=S] [socket=PATH] [repeat=N]". With repeat the query is sent N times over one
+// connection and round-trip latency percentiles are printed after the last answer.
+int RunQueryCommand(int argc, char* argv[]) {
+    const char* const typeNames[] = {"ping", "inventory", "events", "counters", "rules"};
+    QueryRequest request;
+    std::string socketPath;
+    int repeat = 1;
+    std::string type = argc > 2 ? argv[2] : "";
+    size_t typeIndex = 0;
+    while (typeIndex < 5 && type != typeNames[typeIndex]) ++typeIndex;
+    if (typeIndex == 5) {
+        std::cerr << "Usage: --query ping|inventory|events|counters|rules [limit=N] [kinds=MASK] [since_s=S] [socket=PATH] [repeat=N]" << std::endl;
+        return 2;
+    }
+    request.type = (uint16_t)typeIndex;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        try {
+            if (key == "limit") request.limit = (uint32_t)std::stoul(value);
+            else if (key == "kinds") request.kindMask = (uint32_t)std::stoul(value, nullptr, 0);
+            else if (key == "since_s") request.sinceMicros = UnixMicrosNow() - (int64_t)(std::stod(value) * 1e6);
+            else if (key == "socket" && !value.empty()) socketPath = value;
+            else if (key == "repeat") repeat = std::max(1, std::stoi(value));
+            else {
+                std::cerr << "Unknown or invalid query option: " << arg << std::endl;
+                return 2;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+            return 2;
+        }
+    }
+
+#ifdef _WIN32
+    HANDLE pipe = CreateFileW(kQueryPipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        std::cerr << "Cannot open " << WideToUtf8(kQueryPipeName) << "; is the monitor running?" << std::endl;
+        return 1;
+    }
+    auto sendRequest = [&](const void* data, size_t size) {
+        DWORD written = 0;
+        return WriteFile(pipe, data, (DWORD)size, &written, NULL) && written == size;
+    };
+    auto receive = [&](void* data, size_t size) {
+        char* p = static_cast<char*>(data);
+        while (size > 0) {
+            DWORD read = 0;
+            if (!ReadFile(pipe, p, (DWORD)size, &read, NULL) || read == 0) return false;
+            p += read;
+            size -= read;
+        }
+        return true;
+    };
+#else
+    std::filesystem::path path = socketPath.empty() ? GetExecutableDirectory() / kQuerySocketName : std::filesystem::path(socketPath);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.string().c_str(), sizeof(address.sun_path) - 1);
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0 || connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Cannot connect to " << path.string() << "; is the monitor running?" << std::endl;
+        if (s >= 0) close(s);
+        return 1;
+    }
+    auto sendRequest = [&](const void* data, size_t size) { return SendAll(s, static_cast<const char*>(data), size); };
+    auto receive = [&](void* data, size_t size) { return RecvAll(s, static_cast<char*>(data), size); };
+#endif
+
+    QueryResponseHeader header;
+    std::string body;
+    std::vector<double> latencies;
+    bool ok = true;
+    for (int i = 0; i < repeat && ok; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        ok = sendRequest(&request, sizeof(request)) && receive(&header, sizeof(header)) && header.magic == kQueryMagic;
+        if (ok) {
+            body.resize(header.length);
+            ok = header.length == 0 || receive(&body[0], body.size());
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+#ifdef _WIN32
+    CloseHandle(pipe);
+#else
+    close(s);
+#endif
+    if (!ok) {
+        std::cerr << "Query failed: connection lost or malformed response" << std::endl;
+        return 1;
+    }
+    if (header.status != (uint16_t)QueryStatus::Ok) {
+        std::cerr << "Query " << type << " failed: " << (header.status == (uint16_t)QueryStatus::Unavailable ? "unavailable" : "bad request") << std::endl;
+        return 1;
+    }
+
+    const char* p = body.data();
+    const char* end = p + body.size();
+    uint64_t a = 0, b = 0, c = 0, d = 0, length = 0;
+    switch ((QueryType)request.type) {
+        case QueryType::Ping:
+            std::cout << "pong" << std::endl;
+            break;
+        case QueryType::Inventory: {
+            GetVarint(p, end, a);
+            std::cout << header.count << " devices present (state version " << header.stateVersion << "), volumes:";
+            for (int letter = 0; letter < 26; ++letter) {
+                if (a & (1ull << letter)) std::cout << ' ' << (char)('A' + letter) << ':';
+            }
+            std::cout << std::endl;
+            for (uint32_t i = 0; i < header.count && GetVarint(p, end, a) && GetVarint(p, end, b) && GetVarint(p, end, length) &&
+                                 length <= (uint64_t)(end - p); ++i, p += length) {
+                std::cout << "  " << (a < (uint64_t)EventKind::Count ? kEventKindNames[a] : "?") << " since " << b << ": "
+                          << std::string(p, (size_t)length) << std::endl;
+            }
+            break;
+        }
+        case QueryType::RecentEvents: {
+            for (uint32_t i = 0; i < header.count && GetVarint(p, end, a) && GetVarint(p, end, b) && GetVarint(p, end, c) &&
+                                 GetVarint(p, end, d) && GetVarint(p, end, length) && length <= (uint64_t)(end - p); ++i, p += length) {
+                SecurityEvent event;
+                event.kind = d < (uint64_t)EventKind::Count ? (EventKind)d : EventKind::Count;
+                event.detail.assign(p, (size_t)length);
+                std::cout << "#" << a << " @" << b << " " << FormatEvent(event) << FormatEventFlags((uint32_t)c) << std::endl;
+            }
+            break;
+        }
+        default:
+            for (uint32_t i = 0; i < header.count && GetVarint(p, end, length) && length <= (uint64_t)(end - p); ++i) {
+                std::string name(p, (size_t)length);
+                p += length;
+                if (!GetVarint(p, end, a)) break;
+                std::cout << name << " = " << a << std::endl;
+            }
+    }
+    if (repeat > 1) {
+        std::sort(latencies.begin(), latencies.end());
+        auto pct = [&](double q) { return latencies[std::min(latencies.size() - 1, (size_t)(q * latencies.size()))]; };
+        std::cout << std::fixed << std::setprecision(1) << repeat << " round trips: p50=" << pct(0.5) << "us p99=" << pct(0.99)
+                  << "us max=" << latencies.back() << "us (" << header.length + sizeof(header) << " byte responses)" << std::endl;
+    }
+    return 0;
+}
+
+// --- Synthetic Load Generator ---
+// Drives the pipeline without real devices: "--loadgen rate=N duration=S poisson=0|1
+// mix=usbIn,usbOut,volume,clipboard burst=N backlog_ms=N log=FILE perf=N hugepages=0|1
+// config=FILE checkpoint=FILE storage=DIR search=TEXT prevalence=FILE policy=FILE risk=FILE
+// collectors=HOST:PORT,... host=ID query=SOCKET clock=real|virtual".
+// Arrivals are open-loop: each event has a scheduled time and its latency is measured from
+// that time, so a slow pipeline shows up as latency (and eventually shed events) instead of a
+// lower offered rate. With clock=virtual the schedule is replayed as fast as possible instead:
+// the virtual clock jumps to each arrival and the periodic work the background threads would
+// do (storage ticks, loss reports, checkpoints, reload checks) runs inline every 250 ms of
+// virtual time, so a replay of the same options is reproducible.
+
+bool ParseLoadGenArgs(int argc, char* argv[], LoadGenConfig& config) {
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Invalid load generator option: " << arg << std::endl;
+            return false;
+        }
+        std::string key = arg.substr(0, eq);
+        std::string value = arg.substr(eq + 1);
+        try {
+            if (key == "rate") config.rate = std::stod(value);
+            else if (key == "duration") config.durationSec = std::stod(value);
+            else if (key == "poisson") config.poisson = (value == "1" || value == "true");
+            else if (key == "burst") config.clipboardBurst = std::max(1, std::stoi(value));
+            else if (key == "backlog_ms") config.maxBacklogMs = std::stod(value);
+            else if (key == "log") config.logFileName = value;
+            else if (key == "perf") config.stageSampleEvery = (uint32_t)std::stoul(value);
+            else if (key == "hugepages") config.hugePages = (value == "1" || value == "true");
+            else if (key == "config") config.configFileName = value;
+            else if (key == "checkpoint") config.checkpointFileName = value;
+            else if (key == "storage") config.storageDir = value;
+            else if (key == "search") config.search = value;
+            else if (key == "prevalence") config.prevalenceFileName = value;
+            else if (key == "policy") config.policyFileName = value;
+            else if (key == "risk") config.riskModelFileName = value;
+            else if (key == "collectors") config.collectors = value;
+            else if (key == "host") config.hostId = value;
+            else if (key == "query") config.querySocket = value;
+            else if (key == "clock") {
+                if (value != "real" && value != "virtual") {
+                    std::cerr << "clock must be real or virtual" << std::endl;
+                    return false;
+                }
+                config.virtualClock = (value == "virtual");
+            }
+            else if (key == "mix") {
+                std::stringstream ss(value);
+                std::string part;
+                for (size_t n = 0; n < config.mix.size(); ++n) {
+                    if (!std::getline(ss, part, ',')) {
+                        std::cerr << "mix needs " << config.mix.size() << " comma-separated weights" << std::endl;
+                        return false;
+                    }
+                    config.mix[n] = std::stod(part);
+                }
+            } else {
+                std::cerr << "Unknown load generator option: " << key << std::endl;
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (config.rate <= 0 || config.durationSec <= 0) {
+        std::cerr << "rate and duration must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+LoadGenResult RunLoadGen(const LoadGenConfig& config) {
+    static const EventKind kLoadGenKinds[] = {EventKind::UsbArrival, EventKind::UsbRemoval, EventKind::VolumeMount, EventKind::Clipboard};
+    LoadGenResult result;
+    std::mt19937_64 rng(0x5EC0A17u); // Fixed seed so runs are comparable
+    std::discrete_distribution<int> pickKind(config.mix.begin(), config.mix.end());
+    std::exponential_distribution<double> interArrival(config.rate);
+
+    // A pool of plausible device paths, decoded from wide strings like real notifications
+    std::vector<std::wstring> devicePaths;
+    for (int i = 0; i < 64; ++i) {
+        wchar_t buf[128];
+        swprintf(buf, 128, L"\\\\?\\USB#VID_%04X&PID_%04X#%08X#{a5dcbf10-6530-11d2-901f-00c04fb951ed}",
+                 0x0400 + i * 7, 0x1000 + i * 13, 0xC0FFEE00u + i);
+        devicePaths.push_back(buf);
+    }
+
+    // Latency samples: sized for the expected event count up front so recording never
+    // reallocates mid-run. Samples past capacity are not recorded.
+    double mixTotal = config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3];
+    double eventsPerArrival = mixTotal > 0 ? (config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3] * config.clipboardBurst) / mixTotal : 1.0;
+    size_t capacity = std::min<size_t>((size_t)(config.rate * config.durationSec * eventsPerArrival * 1.25) + 1024, 4u << 20);
+    const bool replay = config.virtualClock;
+    if (replay) capacity = 1; // Nothing waits, so there is no latency to sample
+    const bool ownsClock = replay && !g_virtualClock.load();
+    if (ownsClock) StartVirtualClock(kReplayEpochMicros);
+    PinnedBuffer sampleBuffer;
+    if (!AllocatePinnedBuffer(sampleBuffer, capacity * sizeof(uint32_t), config.hugePages)) {
+        std::cerr << "Could not allocate latency sample buffer" << std::endl;
+        return result;
+    }
+    result.sampleMemory = DescribePinnedBuffer(sampleBuffer);
+    uint32_t* latencies = static_cast<uint32_t*>(sampleBuffer.data);
+    size_t latencyCount = 0;
+    const int64_t backlogLimit = (int64_t)(config.maxBacklogMs * 1000.0);
+    const int64_t durationUs = (int64_t)(config.durationSec * 1e6);
+    const int64_t wallStart = SteadyMicros();
+    const int64_t start = replay ? UnixMicrosNow() : wallStart;
+    const int64_t kReplayTickMicros = 250000; // The storage thread's period
+    int64_t nextTick = start + kReplayTickMicros;
+    double scheduledOffset = 0.0; // Microseconds from start
+
+    while (true) {
+        int64_t scheduled = start + (int64_t)scheduledOffset;
+        if (scheduled - start >= durationUs) break;
+        scheduledOffset += config.poisson ? interArrival(rng) * 1e6 : 1e6 / config.rate;
+
+        if (replay) {
+            for (; nextTick <= scheduled; nextTick += kReplayTickMicros) {
+                AdvanceVirtualClock(nextTick);
+                ReplayTick();
+            }
+            AdvanceVirtualClock(scheduled);
+            int kind = pickKind(rng);
+            int count = (kind == 3) ? config.clipboardBurst : 1;
+            for (int n = 0; n < count; ++n) {
+                ++result.offered;
+                SecurityEvent event;
+                const std::wstring& path = devicePaths[rng() % devicePaths.size()];
+                switch (kind) {
+                    case 0: event = DecodeDeviceInterface(true, true, path.c_str()); break;
+                    case 1: event = DecodeDeviceInterface(false, true, path.c_str()); break;
+                    case 2: event = DecodeVolume(true, 1u << (3 + rng() % 20)); break;
+                    default: event.kind = EventKind::Clipboard; break;
+                }
+                if (DispatchEvent(event)) {
+                    ++result.delivered;
+                } else {
+                    ++result.dropped;
+                }
+            }
+            continue;
+        }
 
-// --- Implementation ---
+        int64_t now = SteadyMicros();
+        if (now - start >= durationUs) {
+            // The pipeline fell behind the schedule; arrivals it never got to count as dropped
+            uint64_t unsent = 1 + (uint64_t)((durationUs - (scheduled - start)) * config.rate / 1e6);
+            result.offered += unsent;
+            result.dropped += unsent;
+            for (uint64_t n = 0; n < unsent; ++n) {
+                g_nextSequence.fetch_add(1, std::memory_order_relaxed);
+                RecordDrop(kLoadGenKinds[pickKind(rng)], DropReason::Shed);
+            }
+            break;
+        }
+        while (now < scheduled) {
+            if (scheduled - now > 200) {
+                RecalibrateTimestamps(false); // No maintenance thread here; recalibrate while idle
+                std::this_thread::sleep_for(std::chrono::microseconds(scheduled - now - 100));
+            }
+            now = SteadyMicros();
+        }
 
-// Get current timestamp as string
-std::string GetTimestamp() {
-    try {
-        auto now = std::chrono::system_clock::now();
-        auto now_c = std::chrono::system_clock::to_time_t(now);
-        std::tm now_tm;
-        localtime_s(&now_tm, &now_c); // Use safer localtime_s on Windows
-        std::stringstream ss;
-        ss << std::put_time(&now_tm, "[%Y-%m-%d %H:%M:%S] ");
-        return ss.str();
-    } catch (const std::exception& e) {
-        std::cerr << "Error getting timestamp: " << e.what() << std::endl;
-        return "[TIMESTAMP_ERROR] ";
+        int kind = pickKind(rng);
+        int count = (kind == 3) ? config.clipboardBurst : 1;
+        for (int n = 0; n < count; ++n) {
+            ++result.offered;
+            if (SteadyMicros() - scheduled > backlogLimit) {
+                ++result.dropped; // Too far behind schedule; shed instead of queueing forever
+                g_nextSequence.fetch_add(1, std::memory_order_relaxed);
+                RecordDrop(kLoadGenKinds[kind], DropReason::Shed);
+                continue;
+            }
+            SecurityEvent event;
+            const std::wstring& path = devicePaths[rng() % devicePaths.size()];
+            switch (kind) {
+                case 0: event = DecodeDeviceInterface(true, true, path.c_str()); break;
+                case 1: event = DecodeDeviceInterface(false, true, path.c_str()); break;
+                case 2: event = DecodeVolume(true, 1u << (3 + rng() % 20)); break;
+                default: event.kind = EventKind::Clipboard; break;
+            }
+            if (DispatchEvent(event)) {
+                ++result.delivered;
+                int64_t latency = SteadyMicros() - scheduled;
+                if (result.delivered == 1) result.firstEventUs = (double)latency;
+                if (latencyCount < capacity) {
+                    latencies[latencyCount++] = (uint32_t)std::min<int64_t>(latency, UINT32_MAX);
+                }
+            } else {
+                ++result.dropped;
+            }
+        }
+    }
+
+    if (replay) {
+        AdvanceVirtualClock(start + durationUs);
+        ReplayTick();
+        result.virtualSec = (UnixMicrosNow() - start) / 1e6;
+        if (ownsClock) StopVirtualClock();
     }
+    result.elapsedSec = (SteadyMicros() - wallStart) / 1e6;
+    result.throughput = result.elapsedSec > 0 ? result.delivered / result.elapsedSec : 0.0;
+    if (latencyCount > 0) {
+        std::sort(latencies, latencies + latencyCount);
+        auto pct = [&](double q) { return (double)latencies[std::min(latencyCount - 1, (size_t)(q * latencyCount))]; };
+        result.p50Us = pct(0.50);
+        result.p90Us = pct(0.90);
+        result.p99Us = pct(0.99);
+        result.p999Us = pct(0.999);
+        result.maxUs = latencies[latencyCount - 1];
+    }
+    FreePinnedBuffer(sampleBuffer);
+    return result;
 }
 
-// Log an event to the file and console
-void LogEvent(const std::string& message) {
-    std::string timedMessage = GetTimestamp() + message;
-    std::cout << timedMessage << std::endl; // Also print to console for visibility
-    if (g_logFile.is_open()) {
-        g_logFile << timedMessage << std::endl;
-        g_logFile.flush(); // Ensure it's written immediately
-        if (g_logFile.fail()) {
-             std::cerr << GetTimestamp() << "FATAL: Failed to write to log file '" << g_logFilePath.string() << "'!" << std::endl;
-             // Consider more drastic action here? Maybe try reopening?
+std::string FormatLoadGenResult(const LoadGenResult& result) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1)
+       << "Load generator: offered=" << result.offered << " delivered=" << result.delivered
+       << " dropped=" << result.dropped << " elapsed=" << result.elapsedSec << "s"
+       << " throughput=" << result.throughput << "/s"
+       << " latency_us p50=" << result.p50Us << " p90=" << result.p90Us << " p99=" << result.p99Us
+       << " p99.9=" << result.p999Us << " max=" << result.maxUs << " first_event=" << result.firstEventUs;
+    if (result.virtualSec > 0) {
+        ss << " virtual=" << result.virtualSec << "s speedup=" << result.virtualSec / std::max(result.elapsedSec, 1e-6) << "x";
+    }
+    return ss.str();
+}
+
+// The periodic work of the storage, maintenance and reload threads, run inline by a virtual
+// clock replay so it happens at the same virtual times on every run
+void ReplayTick() {
+    if (!g_storageDir.empty() && g_hotTier.capacity > 0) StorageTick(false);
+    EmitLossReport(false);
+    WriteCheckpoint(false);
+    if (!g_prevalencePath.empty()) LoadPrevalenceFilter(false);
+    if (!g_policyPath.empty()) LoadPolicy(false);
+    if (!g_riskModelPath.empty()) LoadRiskModel(false);
+}
+
+int RunLoadGenCommand(int argc, char* argv[]) {
+    LoadGenConfig config;
+    if (!ParseLoadGenArgs(argc, argv, config)) {
+        return 2;
+    }
+    g_useHugePages = config.hugePages;
+    if (config.virtualClock) StartVirtualClock(kReplayEpochMicros); // Before anything reads the time
+    if (!OpenLogFile(GetExecutableDirectory() / config.logFileName, std::ios::app)) {
+        std::cerr << GetTimestamp() << "FATAL: Could not open log file: " << g_logFilePath.string() << std::endl;
+        return 1;
+    }
+    g_consoleEcho = false;
+    if (!config.configFileName.empty()) {
+        // Exercise hot reload under load; the config's stage_sample_every wins over perf=
+        g_configPath = std::filesystem::absolute(config.configFileName);
+        std::string configError;
+        if (!ReloadConfig(true, configError)) {
+            std::cerr << "Invalid config " << g_configPath.string() << ": " << configError << std::endl;
+            return 2;
         }
+        StartConfigWatcher();
     } else {
-         std::cerr << GetTimestamp() << "ERROR: Log file is not open. Cannot log: " << message << std::endl;
+        g_stageSampleEvery.store(config.stageSampleEvery);
+    }
+    InitTimestampClock();
+    if (!config.checkpointFileName.empty()) {
+        g_checkpointPath = std::filesystem::absolute(config.checkpointFileName);
+        std::string restoreSummary;
+        RestoreCheckpoint(restoreSummary);
+        LogEvent(restoreSummary);
+        WriteCheckpoint(true);
+    }
+    InitHotTier((size_t)CurrentConfig().hotTierMb << 20);
+    if (!config.prevalenceFileName.empty()) {
+        g_prevalencePath = std::filesystem::absolute(config.prevalenceFileName);
+        LoadPrevalenceFilter(true);
+    }
+    if (!config.policyFileName.empty()) {
+        g_policyPath = std::filesystem::absolute(config.policyFileName);
+        LoadPolicy(true);
+    }
+    if (!config.riskModelFileName.empty()) {
+        g_riskModelPath = std::filesystem::absolute(config.riskModelFileName);
+        LoadRiskModel(true);
+    }
+    if (!config.storageDir.empty()) {
+        std::string storageSummary;
+        InitStorage(std::filesystem::absolute(config.storageDir), storageSummary);
+        LogEvent(storageSummary);
+        if (!config.virtualClock) StartStorage(); // A replay ticks storage itself
+    }
+    if (!config.collectors.empty() && !StartForwarder(config.collectors, config.hostId)) {
+        std::cerr << "Could not start forwarding to " << config.collectors << std::endl;
+    }
+    StartShipper();
+    if (!config.querySocket.empty()) {
+        g_querySocketPath = std::filesystem::absolute(config.querySocket);
+        StartQueryServer();
+    }
+    int64_t runStart = UnixMicrosNow();
+    LoadGenResult result = RunLoadGen(config);
+    StopConfigWatcher();
+    if (config.virtualClock) {
+        if (!g_storageDir.empty() && g_hotTier.capacity > 0) StorageTick(true);
+    } else {
+        StopStorage();
+    }
+    StopForwarder();
+    StopShipper();
+    StopQueryServer();
+    WriteCheckpoint(true);
+    g_consoleEcho = true;
+    EmitLossReport(true);
+    LogEvent(FormatLoadGenResult(result));
+    if (!config.virtualClock) {
+        RecalibrateTimestamps(true);
+        LogEvent(FormatTimestampStats());
     }
+    if (config.hugePages) {
+        LogEvent("Memory: log buffer " + DescribePinnedBuffer(g_logBuffer) + "; latency samples " + result.sampleMemory);
+    }
+    if (config.stageSampleEvery > 0) {
+        LogEvent(FormatStageStats());
+    }
+    if (!config.collectors.empty()) {
+        LogEvent(FormatForwarderStats());
+    }
+    if (CurrentConfig().shipSegments && !config.collectors.empty() && !config.storageDir.empty()) {
+        LogEvent(FormatShippingStats());
+    }
+    if (!config.storageDir.empty()) {
+        LogEvent(FormatStorageStats()); // Before the read-back pulls the files into the page cache
+        // Read the run back through all tiers and check nothing was lost or duplicated
+        int64_t readStart = SteadyMicros();
+        std::vector<StoredEvent> events = ReadEvents(runStart, INT64_MAX, SIZE_MAX);
+        int64_t readMicros = SteadyMicros() - readStart;
+        size_t outOfOrder = 0;
+        for (size_t i = 1; i < events.size(); ++i) {
+            outOfOrder += events[i].sequence <= events[i - 1].sequence;
+        }
+        LogEvent("Storage read-back: " + std::to_string(events.size()) + " events (" + std::to_string(result.delivered) +
+                 " delivered) in " + std::to_string(readMicros / 1000) + " ms, " + std::to_string(outOfOrder) + " out of order");
+        if (!config.search.empty()) {
+            size_t expected = 0;
+            for (const StoredEvent& event : events) expected += event.message.find(config.search) != std::string::npos;
+            readStart = SteadyMicros();
+            size_t found = ReadEvents(runStart, INT64_MAX, SIZE_MAX, config.search).size();
+            LogEvent("Storage search '" + config.search + "': " + std::to_string(found) + " events (" + std::to_string(expected) +
+                     " expected) in " + std::to_string(SteadyMicros() - readStart) + " us");
+        }
+    }
+    g_logFile.close();
+    return 0;
 }
 
-// Log an error, including Windows error code
-void LogError(const std::string& context, DWORD errorCode) {
-     LPSTR messageBuffer = nullptr;
-     size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                                  NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
+// --- Benchmark Runner ---
+// "--bench reps=N warmup=S cpu=K tolerance=PCT noise=K baseline=FILE save=FILE perf=N
+// filter=PREFIX" runs the
+// benchmark suite on a pinned thread, optionally stores the results as a JSON baseline and
+// compares against a stored one. Exit code 1 means a regression beyond tolerance.
 
-     std::string errorMessage(messageBuffer, size);
-     LocalFree(messageBuffer); // Free the buffer allocated by FormatMessage
+bool ParseBenchArgs(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Invalid benchmark option: " << arg << std::endl;
+            return false;
+        }
+        std::string key = arg.substr(0, eq);
+        std::string value = arg.substr(eq + 1);
+        try {
+            if (key == "reps") config.repetitions = std::max(1, std::stoi(value));
+            else if (key == "warmup") config.warmupSec = std::stod(value);
+            else if (key == "cpu") config.cpu = std::stoi(value);
+            else if (key == "tolerance") config.tolerancePct = std::stod(value);
+            else if (key == "noise") config.noiseFactor = std::stod(value);
+            else if (key == "baseline") config.baselinePath = value;
+            else if (key == "save") config.savePath = value;
+            else if (key == "perf") config.stageSampleEvery = (uint32_t)std::stoul(value);
+            else if (key == "filter") config.filter = value;
+            else {
+                std::cerr << "Unknown benchmark option: " << key << std::endl;
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-     std::string logMsg = "ERROR in " + context + ": " + errorMessage + " (Code: " + std::to_string(errorCode) + ")";
-     LogEvent(logMsg); // Log it like a regular event
+// Pin the calling thread to one CPU so runs don't migrate between cores mid-measurement
+bool PinCurrentThread(int cpu) {
+    if (cpu < 0) return true;
+#ifdef _WIN32
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
 }
 
-// Get the directory where the executable is running
-std::filesystem::path GetExecutableDirectory() {
-    wchar_t path[MAX_PATH] = {0};
-    // Use GetModuleFileNameW for Unicode path support
-    if (GetModuleFileNameW(NULL, path, MAX_PATH) == 0) {
-        DWORD error = GetLastError();
-         std::cerr << "FATAL: Failed to get executable path. Error code: " << error << std::endl;
-         // Fallback or exit? For now, return current dir, but log the error severely.
-         LogError("GetExecutableDirectory/GetModuleFileNameW", error);
-         return std::filesystem::current_path();
+double Median(std::vector<double> values) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return (values.size() % 2) ? values[mid] : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+double MedianAbsDeviation(const std::vector<double>& values, double median) {
+    std::vector<double> deviations;
+    for (double v : values) deviations.push_back(std::fabs(v - median));
+    return Median(deviations);
+}
+
+std::vector<BenchResult> RunBenchSuite(const BenchConfig& config) {
+    struct Benchmark {
+        std::string name;
+        LoadGenConfig load;
+    };
+    std::vector<Benchmark> suite;
+    {
+        // Saturation: schedule far more than the pipeline can take so throughput is the limit
+        Benchmark b{"pipeline_saturated", LoadGenConfig()};
+        b.load.rate = 5e6;
+        b.load.durationSec = 2.0;
+        b.load.maxBacklogMs = 1e9;
+        suite.push_back(b);
     }
-    std::filesystem::path exePath(path);
-    return exePath.parent_path(); // Return the directory part
+    {
+        // Fixed moderate Poisson load: latency percentiles are the signal
+        Benchmark b{"pipeline_poisson_5k", LoadGenConfig()};
+        b.load.rate = 5000.0;
+        b.load.durationSec = 2.0;
+        b.load.poisson = true;
+        suite.push_back(b);
+        // Same load with pinned huge-page sample buffers, to compare first-event and steady-state latency
+        b.name = "pipeline_poisson_5k_hugepages";
+        b.load.hugePages = true;
+        suite.push_back(b);
+    }
+    {
+        Benchmark b{"pipeline_clipboard_bursts", LoadGenConfig()};
+        b.load.rate = 2000.0;
+        b.load.durationSec = 2.0;
+        b.load.mix = {0.0, 0.0, 0.0, 1.0};
+        b.load.clipboardBurst = 32;
+        suite.push_back(b);
+    }
+    {
+        // A week of light traffic replayed on the virtual clock: throughput is events per
+        // wall-clock second with all the periodic work of a week included
+        Benchmark b{"replay_week_virtual", LoadGenConfig()};
+        b.load.rate = 1.0;
+        b.load.durationSec = 7 * 86400.0;
+        b.load.virtualClock = true;
+        suite.push_back(b);
+    }
+
+    std::vector<BenchResult> results;
+    for (const Benchmark& bench : suite) {
+        if (bench.name.compare(0, config.filter.size(), config.filter) != 0) continue;
+        if (config.warmupSec > 0) {
+            LoadGenConfig warmup = bench.load;
+            warmup.durationSec = config.warmupSec;
+            RunLoadGen(warmup);
+        }
+        std::vector<double> throughput, p50, p99, firstEvent;
+        ResetStageStats();
+        for (int rep = 0; rep < config.repetitions; ++rep) {
+            LoadGenResult run = RunLoadGen(bench.load);
+            firstEvent.push_back(run.firstEventUs);
+            throughput.push_back(run.throughput);
+            p50.push_back(run.p50Us);
+            p99.push_back(run.p99Us);
+        }
+        BenchResult result;
+        result.name = bench.name;
+        result.repetitions = config.repetitions;
+        result.throughput = Median(throughput);
+        result.throughputMad = MedianAbsDeviation(throughput, result.throughput);
+        result.p50Us = Median(p50);
+        result.p99Us = Median(p99);
+        result.p99Mad = MedianAbsDeviation(p99, result.p99Us);
+        result.stageMetrics.push_back({"first_event_us", Median(firstEvent)});
+        for (size_t i = 0; i < (size_t)Stage::Count; ++i) {
+            const StageStats& stats = g_stageStats[i];
+            if (stats.samples.load() > 0) {
+                result.stageMetrics.push_back({std::string(kStageNames[i]) + "_ns", (double)stats.nanos.load() / stats.samples.load()});
+            }
+            uint64_t counted = stats.counterSamples.load();
+            for (size_t c = 0; c < kPerfCounters && counted > 0; ++c) {
+                result.stageMetrics.push_back({std::string(kStageNames[i]) + "_" + kPerfCounterNames[c],
+                                               (double)stats.counters[c].load() / counted});
+            }
+        }
+        results.push_back(result);
+        std::cout << std::fixed << std::setprecision(1) << bench.name << ": throughput=" << result.throughput
+                  << "/s (+/-" << result.throughputMad << ") p50=" << result.p50Us << "us p99=" << result.p99Us
+                  << "us (+/-" << result.p99Mad << ")" << std::endl;
+    }
+    RunMicroBenchmarks(config, results);
+    return results;
+}
+
+// Time op() individually for `iterations` calls per repetition. Throughput is ops/s and the
+// latency percentiles are per op.
+BenchResult RunMicroBench(const std::string& name, const BenchConfig& config, size_t iterations, const std::function<void()>& op) {
+    auto nowNanos = [] {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+    int64_t warmupEnd = nowNanos() + (int64_t)(config.warmupSec * 1e9);
+    while (nowNanos() < warmupEnd) op();
+
+    std::vector<double> throughput, p50, p99;
+    std::vector<int64_t> samples(iterations);
+    for (int rep = 0; rep < config.repetitions; ++rep) {
+        int64_t start = nowNanos();
+        for (size_t i = 0; i < iterations; ++i) {
+            int64_t before = nowNanos();
+            op();
+            samples[i] = nowNanos() - before;
+        }
+        double elapsed = (nowNanos() - start) / 1e9;
+        std::sort(samples.begin(), samples.end());
+        throughput.push_back(elapsed > 0 ? iterations / elapsed : 0.0);
+        p50.push_back(samples[iterations / 2] / 1000.0);
+        p99.push_back(samples[std::min(iterations - 1, iterations * 99 / 100)] / 1000.0);
+    }
+    BenchResult result;
+    result.name = name;
+    result.repetitions = config.repetitions;
+    result.throughput = Median(throughput);
+    result.throughputMad = MedianAbsDeviation(throughput, result.throughput);
+    result.p50Us = Median(p50);
+    result.p99Us = Median(p99);
+    result.p99Mad = MedianAbsDeviation(p99, result.p99Us);
+    std::cout << std::fixed << std::setprecision(3) << name << ": " << std::setprecision(1) << result.throughput
+              << " ops/s p50=" << std::setprecision(3) << result.p50Us << "us p99=" << result.p99Us << "us" << std::endl;
+    return result;
+}
+
+// Benchmarks of individual components, outside the end-to-end pipeline
+void RunMicroBenchmarks(const BenchConfig& config, std::vector<BenchResult>& results) {
+    auto wanted = [&](const std::string& group) {
+        return group.compare(0, config.filter.size(), config.filter) == 0 ||
+               config.filter.compare(0, group.size(), group) == 0;
+    };
+
+    // Hot tier: a full 16 MB ring spread over the last 24 hours
+    if (wanted("hot_tier") && InitHotTier((size_t)16 << 20)) {
+        std::mt19937 rng(7);
+        const int64_t now = UnixMicrosNow();
+        const int64_t day = 24LL * 3600 * 1000000;
+        const size_t events = g_hotTier.capacity;
+        for (size_t i = 0; i < events; ++i) {
+            size_t slot = i;
+            g_hotTier.timestamps[slot] = now - day + (int64_t)(day * (double)i / events);
+            g_hotTier.eventTimes[slot] = g_hotTier.timestamps[slot];
+            g_hotTier.sequences[slot] = i + 1;
+            g_hotTier.deviceIds[slot] = 1 + rng() % 500;
+            g_hotTier.hostIds[slot] = 0;
+            g_hotTier.flags[slot] = 0;
+            g_hotTier.kinds[slot] = (uint8_t)(rng() % (uint32_t)EventKind::Count);
+        }
+        g_hotTier.head.store(events);
+        uint64_t sink = 0;
+        results.push_back(RunMicroBench("hot_tier_counts_24h", config, 200, [&] {
+            sink += QueryHotTierCounts(now - day, now + 1).total;
+        }));
+        results.push_back(RunMicroBench("hot_tier_counts_1h", config, 2000, [&] {
+            sink += QueryHotTierCounts(now - day / 24, now + 1).total;
+        }));
+        results.push_back(RunMicroBench("hot_tier_device_filter_24h", config, 100, [&] {
+            EventPredicate predicate;
+            predicate.kindMask = 1u << (uint32_t)EventKind::UsbArrival;
+            predicate.deviceId = 42;
+            sink += QueryHotTierSequences(now - day, now + 1, predicate, 1u << 20).size();
+        }));
+
+        // Batch predicate evaluation, SIMD vs one event at a time, over batches of N events:
+        // arrivals (2 of 7 kinds) from one of 500 devices carrying a rare or blocked flag
+        for (size_t i = 0; i < events; ++i) g_hotTier.flags[i] = (rng() % 4 == 0) ? kFlagFleetRare : kFlagFleetCommon;
+        EventPredicate rule;
+        rule.kindMask = (1u << (uint32_t)EventKind::UsbArrival) | (1u << (uint32_t)EventKind::DeviceArrival);
+        rule.deviceId = 42;
+        rule.flagsAny = kFlagFleetRare | kFlagBlocklisted;
+        size_t mismatches = 0;
+        for (size_t begin = 0; begin < events; begin += 64) {
+            mismatches += MatchHotTierBlock(begin, 64, rule) != MatchHotTierBlockScalar(begin, 64, rule);
+        }
+        rule.deviceId = 0; // Also the common shape without a device
+        for (size_t begin = 0; begin < events; begin += 64) {
+            mismatches += MatchHotTierBlock(begin, 64, rule) != MatchHotTierBlockScalar(begin, 64, rule);
+        }
+        rule.deviceId = 42;
+        for (size_t batch : {64u, 256u, 1024u, 4096u}) {
+            size_t next = 0;
+            auto evaluate = [&](uint64_t (*match)(size_t, size_t, const EventPredicate&)) {
+                size_t begin = next;
+                next = (next + batch) & (events - 1);
+                for (size_t i = 0; i < batch; i += 64) sink += match(begin + i, 64, rule);
+            };
+            BenchResult scalar = RunMicroBench("predicate_scalar_" + std::to_string(batch), config, 20000, [&] { evaluate(MatchHotTierBlockScalar); });
+            BenchResult simd = RunMicroBench("predicate_simd_" + std::to_string(batch), config, 20000, [&] { evaluate(MatchHotTierBlock); });
+            simd.stageMetrics.push_back({"speedup", simd.throughput / scalar.throughput});
+            simd.stageMetrics.push_back({"mask_mismatches", (double)mismatches});
+            std::cout << std::fixed << std::setprecision(2) << "  batches of " << batch << ": " << simd.throughput * batch / 1e6
+                      << "M events/s SIMD vs " << scalar.throughput * batch / 1e6 << "M scalar (" << simd.throughput / scalar.throughput
+                      << "x), " << mismatches << " masks differ" << std::endl;
+            results.push_back(scalar);
+            results.push_back(simd);
+        }
+        if (sink == 42) std::cout << std::endl; // Keep the queries observable
+        InitHotTier(0);
+    }
+
+    // Fleet prevalence: lookups in a filter of 100k common models, half of the probes absent
+    if (wanted("prevalence")) {
+        CuckooFilter filter;
+        filter.bucketCount = 32768;
+        filter.slots.assign(filter.bucketCount * kCuckooSlots, 0);
+        std::vector<std::string> keys;
+        for (uint32_t i = 0; i < 200000; ++i) {
+            char key[32];
+            snprintf(key, sizeof(key), "VID_%04X&PID_%04X", i >> 16, i & 0xFFFF);
+            keys.push_back(key);
+            if (i % 2 == 0) CuckooInsert(filter, Hash64(key, std::strlen(key)));
+        }
+        size_t next = 0, hits = 0;
+        results.push_back(RunMicroBench("prevalence_lookup", config, 100000, [&] {
+            const std::string& key = keys[next++ % keys.size()];
+            hits += CuckooContains(filter.slots.data(), filter.bucketCount, Hash64(key.data(), key.size()));
+        }));
+        results.push_back(RunMicroBench("prevalence_arrival_key", config, 100000, [&] {
+            std::string key = DeviceModelKey("\\\\?\\USB#VID_0781&PID_5567#4C530001#{a5dcbf10-6530-11d2-901f-00c04fb951ed}");
+            hits += CuckooContains(filter.slots.data(), filter.bucketCount, Hash64(key.data(), key.size()));
+        }));
+        std::cout << std::fixed << std::setprecision(2) << "  " << filter.itemCount << " models in "
+                  << filter.slots.size() * sizeof(uint16_t) / 1024 << " KB, " << 100.0 * hits / next << "% of probes present" << std::endl;
+    }
+
+    // Policy updates: a 10k-model allowlist where one model is replaced, as a delta vs the
+    // full image, plus the per-arrival lookup
+    if (wanted("policy")) {
+        std::string v1 = "version = 1\n", v2 = "version = 2\n";
+        for (uint32_t i = 0; i < 10000; ++i) {
+            char line[48];
+            snprintf(line, sizeof(line), "allow VID_%04X&PID_%04X\n", (i * 40503u) & 0xFFFF, i);
+            v1 += line;
+            if (i != 5000) v2 += line;
+        }
+        v2 += "allow VID_ABCD&PID_0001\n";
+        std::string base, target, error;
+        CompilePolicy(v1, base, error);
+        CompilePolicy(v2, target, error);
+        std::string delta = MakePolicyDelta(base, target);
+        std::string rebuilt;
+        PolicyImage policy;
+        results.push_back(RunMicroBench("policy_delta_apply_10k", config, 200, [&] {
+            ApplyPolicyDelta(base, delta, rebuilt, error);
+            ParsePolicyImage(rebuilt, policy);
+        }));
+        results.push_back(RunMicroBench("policy_full_load_10k", config, 200, [&] { ParsePolicyImage(target, policy); }));
+        std::cout << std::fixed << std::setprecision(2) << "  update: " << delta.size() << " byte delta vs " << target.size()
+                  << " byte image (" << 100.0 * delta.size() / target.size() << "%)" << std::endl;
+        uint64_t probe = 0;
+        uint32_t flags = 0;
+        results.push_back(RunMicroBench("policy_lookup", config, 100000, [&] { flags |= PolicyFlags(policy, probe++ * 0x9E3779B97F4A7C15ull); }));
+        if (flags == 42) std::cout << std::endl;
+    }
+
+    // Policy JIT vs interpreter across list sizes. The traffic is a replay of device arrivals
+    // (paths hashed the way EvaluateEvent does) over twice as many models as the policy lists,
+    // so half the lookups hit; every verdict of the native code is checked against the
+    // interpreter's first.
+    if (wanted("policy_jit")) {
+        for (uint32_t entries : {16u, 256u, 4096u, 65536u}) {
+            auto modelPath = [](uint32_t model) {
+                char path[128];
+                snprintf(path, sizeof(path), "\\\\?\\USB#VID_%04X&PID_%04X#%08X#{a5dcbf10-6530-11d2-901f-00c04fb951ed}",
+                         0x1000 + (model >> 16), model & 0xFFFF, 0x5E000000u + model);
+                return std::string(path);
+            };
+            std::string text = "version = 1\n";
+            for (uint32_t model = 0; model < entries; ++model) {
+                text += (model % 2 ? "block " : "allow ") + DeviceModelKey(modelPath(model)) + "\n";
+            }
+            std::string image, error;
+            PolicyImage interpreted, compiled;
+            if (!CompilePolicy(text, image, error) || !ParsePolicyImage(image, interpreted) || !ParsePolicyImage(image, compiled) ||
+                !CompilePolicyCode(compiled, error)) {
+                std::cout << "  policy_jit_" << entries << ": " << error << std::endl;
+                continue;
+            }
+            std::mt19937 rng(entries);
+            std::vector<uint64_t> traffic(1u << 16);
+            for (uint64_t& hash : traffic) {
+                std::string key = DeviceModelKey(modelPath(rng() % (2 * entries)));
+                hash = Hash64(key.data(), key.size());
+            }
+            size_t mismatches = 0, hits = 0;
+            for (uint64_t hash : traffic) {
+                uint32_t expected = InterpretPolicyFlags(interpreted, hash);
+                mismatches += PolicyFlags(compiled, hash) != expected;
+                hits += expected != 0;
+            }
+            size_t next = 0;
+            uint32_t flags = 0;
+            BenchResult interpreter = RunMicroBench("policy_interpreted_" + std::to_string(entries), config, traffic.size(), [&] {
+                flags |= InterpretPolicyFlags(interpreted, traffic[next++ & (traffic.size() - 1)]);
+            });
+            BenchResult jit = RunMicroBench("policy_jit_" + std::to_string(entries), config, traffic.size(), [&] {
+                flags |= PolicyFlags(compiled, traffic[next++ & (traffic.size() - 1)]);
+            });
+            jit.stageMetrics.push_back({"code_bytes", (double)compiled.code.size});
+            jit.stageMetrics.push_back({"verdict_mismatches", (double)mismatches});
+            std::cout << std::fixed << std::setprecision(2) << "  " << entries << " entries: " << compiled.code.size
+                      << " bytes of code, " << hits << "/" << traffic.size() << " lookups hit, " << mismatches
+                      << " verdicts differ from the interpreter, " << jit.throughput / interpreter.throughput << "x interpreter speed"
+                      << std::endl;
+            results.push_back(interpreter);
+            results.push_back(jit);
+            if (flags == 42) std::cout << std::endl;
+        }
+    }
+
+    // Risk model: XGBoost-style dumps of uneven trees, converted, checked against a walk of the
+    // dump trees, then scored alone and with feature extraction from events
+    if (wanted("risk")) {
+        const float kRanges[] = {24.0f, 1.0f, 5.0f, 40.0f, 1.0f, 65536.0f};
+        std::string paths[4];
+        const char* const guids[] = {"a5dcbf10-6530-11d2-901f-00c04fb951ed", "4d1e55b2-f16f-11cf-88cb-001111000030",
+                                     "884b96c3-56ef-11d1-bc8c-00a0c91405dd", "53f56307-b6bf-11d0-94f2-00a0c91efb8b"};
+        for (int c = 0; c < 4; ++c) paths[c] = std::string("\\\\?\\USB#VID_%04X&PID_%04X#%08X#{") + guids[c] + "}";
+        for (std::pair<uint32_t, uint32_t> shape : {std::make_pair(20u, 4u), std::make_pair(50u, 5u), std::make_pair(100u, 6u)}) {
+            std::mt19937 rng(shape.first * 31 + shape.second);
+            std::string dump;
+            for (uint32_t t = 0; t < shape.first; ++t) {
+                dump += "booster[" + std::to_string(t) + "]:\n";
+                int nextId = 1;
+                std::function<void(int, uint32_t)> emit = [&](int id, uint32_t level) {
+                    char line[160];
+                    std::string indent(level, '\t');
+                    if (level == shape.second || (level > 1 && rng() % 4 == 0)) { // Uneven: some branches stop early
+                        snprintf(line, sizeof(line), "%d:leaf=%.6f\n", id, (int)(rng() % 2001 - 1000) / 4000.0);
+                        dump += indent + line;
+                        return;
+                    }
+                    uint32_t feature = rng() % (uint32_t)RiskFeature::Count;
+                    int yes = nextId++, no = nextId++;
+                    float threshold = kRanges[feature] * (rng() % 1000 + 1) / 1001.0f;
+                    snprintf(line, sizeof(line), "%d:[%s<%.6g] yes=%d,no=%d,missing=%d,gain=%.3f,cover=%d\n", id,
+                             rng() % 2 ? kRiskFeatureNames[feature] : ("f" + std::to_string(feature)).c_str(), threshold, yes, no,
+                             yes, (rng() % 10000) / 100.0, (int)(rng() % 500));
+                    dump += indent + line;
+                    emit(yes, level + 1);
+                    emit(no, level + 1);
+                };
+                emit(0, 0);
+            }
+            std::vector<std::vector<RiskDumpNode>> trees;
+            std::string bytes, error;
+            RiskModel model;
+            std::string name = "risk_" + std::to_string(shape.first) + "x" + std::to_string(shape.second);
+            if (!ParseRiskDump(dump, trees, error) || !BuildRiskModel(trees, -1.5f, 0.8f, bytes, error) || !ParseRiskModel(bytes, model)) {
+                std::cout << "  " << name << ": " << error << std::endl;
+                continue;
+            }
+            std::vector<std::array<float, (size_t)RiskFeature::Count>> vectors(1024);
+            for (auto& vector : vectors) {
+                for (size_t f = 0; f < vector.size(); ++f) vector[f] = kRanges[f] * (rng() % 1000) / 1000.0f;
+                vector[(size_t)RiskFeature::HourOfDay] = (float)(rng() % 24);
+                vector[(size_t)RiskFeature::DeviceClass] = (float)(rng() % 5);
+            }
+            size_t mismatches = 0, flagged = 0;
+            for (const auto& vector : vectors) {
+                float sum = -1.5f;
+                for (const std::vector<RiskDumpNode>& tree : trees) {
+                    int32_t node = 0;
+                    while (tree[node].yes >= 0) {
+                        node = vector[tree[node].feature] < tree[node].threshold ? tree[node].yes : tree[node].no;
+                    }
+                    sum += tree[node].leaf;
+                }
+                float score = RiskScore(model, vector.data());
+                mismatches += score != 1.0f / (1.0f + std::exp(-sum));
+                flagged += score >= 0.8f;
+            }
+            size_t next = 0;
+            float total = 0;
+            BenchResult score = RunMicroBench(name + "_score", config, 1u << 16, [&] {
+                total += RiskScore(model, vectors[next++ & (vectors.size() - 1)].data());
+            });
+            score.stageMetrics.push_back({"model_bytes", (double)bytes.size()});
+            score.stageMetrics.push_back({"score_mismatches", (double)mismatches});
+            std::vector<SecurityEvent> events(1024);
+            for (size_t i = 0; i < events.size(); ++i) {
+                char path[160];
+                uint32_t device = rng() % 4000;
+                snprintf(path, sizeof(path), paths[rng() % 4].c_str(), 0x0400 + device % 97, 0x1000 + device % 1013, device);
+                events[i].kind = EventKind::UsbArrival;
+                events[i].detail = path;
+            }
+            int64_t clock = kReplayEpochMicros;
+            BenchResult full = RunMicroBench(name + "_event", config, 1u << 16, [&] {
+                SecurityEvent& event = events[next++ & (events.size() - 1)];
+                event.timestampMicros = clock += 250000 + (int64_t)(next % 7) * 100000;
+                float features[(size_t)RiskFeature::Count];
+                RiskFeatures(event, (float)(next & 1), features);
+                total += RiskScore(model, features);
+            });
+            g_riskRecent.clear();
+            g_riskRecentHid = 0;
+            std::cout << std::fixed << std::setprecision(1) << "  " << shape.first << " trees, depth " << shape.second << ": "
+                      << bytes.size() << " bytes, " << mismatches << "/" << vectors.size() << " scores differ from the dump trees, "
+                      << flagged << " flagged, " << 1e9 / score.throughput << " ns per score, " << 1e9 / full.throughput
+                      << " ns per event with features" << std::endl;
+            results.push_back(score);
+            results.push_back(full);
+            if (total == 42) std::cout << std::endl;
+        }
+    }
+
+    // Text search: one full segment of device messages, trigram index vs a scan of all text
+    if (wanted("text_search")) {
+        std::mt19937 rng(11);
+        const size_t events = 65536;
+        std::vector<int64_t> timestamps(events);
+        std::vector<uint64_t> sequences(events);
+        std::vector<uint32_t> flags(events, 0), offsets{0};
+        std::vector<uint8_t> kinds(events);
+        std::string text;
+        for (size_t i = 0; i < events; ++i) {
+            SecurityEvent event = DecodeDeviceInterface(rng() % 2 == 0, true, L"");
+            char path[128];
+            uint32_t device = rng() % 4000;
+            snprintf(path, sizeof(path), "\\\\?\\USB#VID_%04X&PID_%04X#%08X#{a5dcbf10-6530-11d2-901f-00c04fb951ed}",
+                     0x0400 + device % 97, 0x1000 + device % 1013, 0x5E000000u + device * 7919u);
+            event.detail = path;
+            timestamps[i] = (int64_t)i;
+            sequences[i] = i + 1;
+            kinds[i] = (uint8_t)event.kind;
+            text += FormatEvent(event);
+            offsets.push_back((uint32_t)text.size());
+        }
+        SegmentView view;
+        view.count = events;
+        view.timestamps = timestamps.data();
+        view.sequences = sequences.data();
+        view.flags = flags.data();
+        view.kinds = kinds.data();
+        view.textOffsets = offsets.data();
+        view.text = text.data();
+
+        std::string body;
+        size_t trigrams = 0;
+        BenchResult build = RunMicroBench("text_index_build_64k", config, 3, [&] { trigrams = BuildTrigramIndex(view, body); });
+        IndexHeader header;
+        header.eventCount = events;
+        header.blockCount = (uint32_t)((events + kIndexBlockEvents - 1) / kIndexBlockEvents);
+        header.trigramCount = (uint32_t)trigrams;
+        header.postingBytes = body.size() - trigrams * sizeof(IndexEntry);
+        header.checksum = Fnv1a(body.data(), body.size());
+        std::string file(reinterpret_cast<const char*>(&header), sizeof(header));
+        file += body;
+        IndexView index;
+        ParseTrigramIndex(file.data(), file.size(), index);
+        double textMb = text.size() / 1048576.0;
+        build.stageMetrics.push_back({"ms_per_mb", 1000.0 / build.throughput / textMb});
+        build.stageMetrics.push_back({"index_pct_of_text", 100.0 * file.size() / text.size()});
+        std::cout << std::fixed << std::setprecision(2) << "  index: " << build.stageMetrics[0].second << " ms per MB of text, "
+                  << build.stageMetrics[1].second << "% of " << textMb << " MB" << std::endl;
+        results.push_back(build);
+
+        // A serial seen in a handful of events, and a fragment in every message
+        const std::string rare = "5E951C0E", common = "Plugged In";
+        std::vector<StoredEvent> found;
+        std::vector<uint8_t> blocks;
+        for (const std::string& needle : {rare, common}) {
+            std::string suffix = needle == rare ? "rare" : "common";
+            results.push_back(RunMicroBench("text_search_indexed_" + suffix, config, 50, [&] {
+                found.clear();
+                if (CandidateBlocks(index, needle, blocks)) SearchSegment(view, &blocks, needle, INT64_MIN, INT64_MAX, SIZE_MAX, found);
+            }));
+            size_t indexedHits = found.size();
+            results.push_back(RunMicroBench("text_search_scan_" + suffix, config, 50, [&] {
+                found.clear();
+                SearchSegment(view, nullptr, needle, INT64_MIN, INT64_MAX, SIZE_MAX, found);
+            }));
+            if (found.size() != indexedHits) {
+                std::cerr << "text_search: index found " << indexedHits << " events for '" << needle << "', scan found " << found.size() << std::endl;
+            } else {
+                std::cout << "  '" << needle << "': " << indexedHits << " matching events" << std::endl;
+            }
+        }
+    }
+
+    // Collector routing: 100k hosts on 4 collectors, then a 5th added and one removed.
+    // Ideally 1/5 resp. 1/4 of hosts move and no collector owns much more than its share.
+    if (wanted("routing")) {
+        const uint32_t hosts = 100000;
+        std::vector<uint64_t> hostHashes;
+        for (uint32_t i = 0; i < hosts; ++i) {
+            std::string host = "host-" + std::to_string(i);
+            hostHashes.push_back(Hash64(host.data(), host.size()));
+        }
+        std::vector<std::string> nodes = {"10.0.0.1:7420", "10.0.0.2:7420", "10.0.0.3:7420", "10.0.0.4:7420"};
+        auto all = [](uint32_t) { return true; };
+        auto assign = [&](const HashRing& ring, std::vector<std::string>& owners) {
+            std::vector<std::string> names = owners;
+            owners.assign(hosts, "");
+            for (uint32_t i = 0; i < hosts; ++i) owners[i] = names[RouteOnRing(ring, hostHashes[i], all)];
+        };
+        HashRing ring = BuildHashRing(nodes, CurrentConfig().virtualNodes);
+        std::vector<std::string> before = nodes;
+        assign(ring, before);
+        std::unordered_map<std::string, uint32_t> load;
+        for (const std::string& owner : before) ++load[owner];
+        uint32_t maxLoad = 0;
+        for (const auto& entry : load) maxLoad = std::max(maxLoad, entry.second);
+
+        std::vector<std::string> grown = nodes;
+        grown.push_back("10.0.0.5:7420");
+        std::vector<std::string> afterAdd = grown;
+        assign(BuildHashRing(grown, CurrentConfig().virtualNodes), afterAdd);
+        std::vector<std::string> shrunk = {nodes[0], nodes[1], nodes[3]};
+        std::vector<std::string> afterRemove = shrunk;
+        assign(BuildHashRing(shrunk, CurrentConfig().virtualNodes), afterRemove);
+        uint32_t movedAdd = 0, movedRemove = 0;
+        for (uint32_t i = 0; i < hosts; ++i) {
+            movedAdd += before[i] != afterAdd[i];
+            movedRemove += before[i] != afterRemove[i];
+        }
+        size_t next = 0;
+        uint64_t sink = 0;
+        BenchResult lookup = RunMicroBench("routing_lookup", config, 100000, [&] {
+            sink += (uint64_t)RouteOnRing(ring, hostHashes[next++ % hosts], all);
+        });
+        lookup.stageMetrics.push_back({"max_over_avg_load", maxLoad * 4.0 / hosts});
+        lookup.stageMetrics.push_back({"moved_pct_on_add", 100.0 * movedAdd / hosts});
+        lookup.stageMetrics.push_back({"moved_pct_on_remove", 100.0 * movedRemove / hosts});
+        std::cout << std::fixed << std::setprecision(2) << "  " << CurrentConfig().virtualNodes << " virtual nodes: busiest collector at "
+                  << lookup.stageMetrics[0].second << "x average; adding a 5th moves " << lookup.stageMetrics[1].second
+                  << "% of hosts (ideal 20%), removing one moves " << lookup.stageMetrics[2].second << "% (ideal 25%)" << std::endl;
+        results.push_back(lookup);
+        if (sink == 42) std::cout << std::endl;
+    }
+
+    // Reordering at the collector: 16 agents at 2000 events/s each ship 50 ms batches that
+    // arrive 0-300 ms later (in order per agent), merged with several allowed latenesses. Time is
+    // simulated from the arrival schedule, so late counts and added latency are exact for this
+    // delay distribution; lateness 0 is arrival order, the disorder windows would see without it.
+    if (wanted("reorder")) {
+        struct Arrival {
+            uint32_t source;
+            int64_t timestamp;
+            int64_t arrivedAt;
+        };
+        const uint32_t sources = 16;
+        const int64_t span = 10000000, spacing = 500, batch = 50000;
+        std::mt19937_64 rng(0x0DE5u);
+        std::uniform_int_distribution<int64_t> delay(0, 300000);
+        std::vector<Arrival> arrivals;
+        for (uint32_t source = 0; source < sources; ++source) {
+            int64_t delivered = 0;
+            for (int64_t batchStart = 0; batchStart < span; batchStart += batch) {
+                delivered = std::max(delivered, batchStart + batch + delay(rng)); // One connection delivers in order
+                for (int64_t t = batchStart + source * 31 % spacing; t < batchStart + batch; t += spacing) {
+                    arrivals.push_back({source, t, delivered});
+                }
+            }
+        }
+        std::stable_sort(arrivals.begin(), arrivals.end(), [](const Arrival& a, const Arrival& b) { return a.arrivedAt < b.arrivedAt; });
+
+        for (int64_t lateness : {0, 50000, 250000, 1000000}) {
+            ReorderBuffer buffer;
+            buffer.latenessMicros = lateness;
+            std::vector<SecurityEvent> released;
+            uint64_t outOfOrder = 0;
+            int64_t newest = INT64_MIN;
+            auto feed = [&](const Arrival& arrival, int64_t offset) {
+                SecurityEvent event;
+                event.timestampMicros = arrival.timestamp + offset;
+                ReorderAdd(buffer, arrival.source, std::move(event), arrival.arrivedAt + offset);
+                released.clear();
+                ReorderRelease(buffer, arrival.arrivedAt + offset, released);
+                for (const SecurityEvent& e : released) {
+                    outOfOrder += e.timestampMicros < newest;
+                    newest = std::max(newest, e.timestampMicros);
+                }
+            };
+            for (const Arrival& arrival : arrivals) feed(arrival, 0);
+            buffer.sources.clear();
+            released.clear();
+            ReorderRelease(buffer, arrivals.back().arrivedAt, released);
+            for (const SecurityEvent& e : released) outOfOrder += e.timestampMicros < newest;
+            std::cout << "  " << FormatReorderStats(buffer) << "; " << outOfOrder << " released out of order" << std::endl;
+            double late = 100.0 * buffer.late / buffer.released;
+            double meanHeldMs = buffer.heldMicros / 1000.0 / buffer.released;
+
+            size_t next = 0;
+            int64_t cycle = 1;
+            BenchResult result = RunMicroBench("reorder_lateness_" + std::to_string(lateness / 1000) + "ms", config, arrivals.size(), [&] {
+                feed(arrivals[next], cycle * (span + 1000000));
+                if (++next == arrivals.size()) {
+                    next = 0;
+                    ++cycle;
+                }
+            });
+            result.stageMetrics.push_back({"late_pct", late});
+            result.stageMetrics.push_back({"added_latency_mean_ms", meanHeldMs});
+            results.push_back(result);
+        }
+    }
+
+    // Storage writes: 4 MB segment-sized files through the buffered path and the direct path,
+    // and how much of what was written each leaves in the page cache
+    if (wanted("storage_io")) {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / "SecurityMonitorBenchIo";
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        const size_t kFiles = 32, kFileBytes = 4u << 20;
+        std::string body(kFileBytes - 64, '\0');
+        std::mt19937_64 rng(98);
+        for (size_t i = 0; i + 8 <= body.size(); i += 8) {
+            uint64_t word = rng();
+            std::memcpy(&body[i], &word, 8);
+        }
+        std::string header(64, 'H');
+        for (int direct = 0; direct < 2; ++direct) {
+            std::string mode = direct ? "direct" : "buffered";
+            uint64_t directBefore = g_storageDirectWrites.load();
+            size_t next = 0;
+            auto fileName = [&](size_t i) { return directory / (mode + "-" + std::to_string(i % kFiles) + ".seg"); };
+            BenchResult write = RunMicroBench("storage_write_" + mode + "_4mb", config, kFiles, [&] {
+                if (direct) {
+                    WriteFileDirect(fileName(next++), header, body);
+                } else {
+                    WriteFileAtomically(fileName(next++), header, body);
+                }
+            });
+            uint64_t cached = 0;
+            for (size_t i = 0; i < kFiles; ++i) cached += PageCacheBytes(fileName(i));
+            write.stageMetrics.push_back({"mb_per_s", write.throughput * kFileBytes / 1048576.0});
+            write.stageMetrics.push_back({"page_cache_mb", cached / 1048576.0});
+            std::cout << std::fixed << std::setprecision(1) << "  " << mode << ": " << write.stageMetrics[0].second << " MB/s, "
+                      << write.stageMetrics[1].second << " of " << kFiles * kFileBytes / 1048576.0 << " MB written left in the page cache"
+                      << (direct && g_storageDirectWrites.load() == directBefore ? " (O_DIRECT refused; synced and dropped)" : "")
+                      << std::endl;
+            results.push_back(write);
+        }
+        std::filesystem::remove_all(directory, ec);
+    }
+
+    // Shipping closed storage: CPU time of the sending thread per GB, for the same event bytes
+    // forwarded record by record (encode, checksum and send Events frames, one acknowledgement
+    // per batch) and sent as a whole file through ShipFile, each to a loopback thread that
+    // answers like a collector but discards what it receives
+    if (wanted("shipping")) {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / "SecurityMonitorBenchShip";
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        SocketHandle listener = InitNetwork() ? ListenTcp("0") : kInvalidSocket;
+        sockaddr_in bound = {};
+        socklen_t boundSize = sizeof(bound);
+        if (listener == kInvalidSocket || getsockname(listener, reinterpret_cast<sockaddr*>(&bound), &boundSize) != 0) {
+            std::cout << "  shipping: no loopback listener, skipped" << std::endl;
+        } else {
+            std::thread receiver([&] {
+                SocketHandle s = accept(listener, nullptr, nullptr);
+                std::string sink(1u << 20, '\0'), payload;
+                FrameType type;
+                while (s != kInvalidSocket && RecvFrame(s, type, payload)) {
+                    const char* p = payload.data();
+                    const char* end = p + payload.size();
+                    uint64_t length = 0, offset = 0, reply = 0;
+                    if (type == FrameType::FileSpan || type == FrameType::FileDone) {
+                        if (!GetVarint(p, end, length) || length > (uint64_t)(end - p)) break;
+                        p += length;
+                        if (!GetVarint(p, end, offset)) break;
+                        reply = offset; // FileDone: the size, as if stored
+                    }
+                    if (type == FrameType::FileSpan) {
+                        if (!GetVarint(p, end, length)) break;
+                        for (size_t n; length > 0; length -= n) {
+                            n = (size_t)std::min<uint64_t>(length, sink.size());
+                            if (!RecvAll(s, &sink[0], n)) break;
+                        }
+                        continue;
+                    }
+                    if (!SendFrame(s, FrameType::Ack, std::string(reinterpret_cast<const char*>(&reply), sizeof(reply)))) break;
+                }
+                CloseSocket(s);
+            });
+            SocketHandle connection = ConnectTcp("127.0.0.1", std::to_string(ntohs(bound.sin_port)), 1000);
+
+            // 256K events with 60-140 byte details, about 30 MB as WireEvent records
+            const size_t kEvents = 1u << 18, kBatch = 4096;
+            std::vector<SecurityEvent> events(kEvents);
+            std::mt19937_64 rng(99);
+            std::string encoded;
+            for (size_t i = 0; i < kEvents; ++i) {
+                SecurityEvent& event = events[i];
+                event.kind = EventKind::DeviceArrival;
+                event.sequence = i + 1;
+                event.timestampMicros = kReplayEpochMicros + (int64_t)i * 1000;
+                event.detail = "\\\\?\\USB#VID_" + std::to_string(rng() % 10000) + "&PID_" + std::to_string(rng() % 10000) + "#" +
+                               std::string(40 + rng() % 80, (char)('a' + rng() % 26));
+                WireEvent record = {};
+                record.sequence = event.sequence;
+                record.timestampMicros = event.timestampMicros;
+                record.kind = (uint8_t)event.kind;
+                record.detailLength = (uint16_t)event.detail.size();
+                encoded.append(reinterpret_cast<const char*>(&record), sizeof(record));
+                encoded += event.detail;
+            }
+            SegmentHeader header;
+            header.eventCount = kEvents;
+            header.checksum = Fnv1a(encoded.data(), encoded.size());
+            const std::filesystem::path file = directory / "seg-1.seg";
+            WriteFileAtomically(file, std::string(reinterpret_cast<const char*>(&header), sizeof(header)), encoded);
+
+            uint64_t bytes = 0;
+            std::string batch;
+            auto sendRecords = [&] {
+                for (size_t first = 0; first < kEvents; first += kBatch) {
+                    uint32_t count = (uint32_t)std::min(kBatch, kEvents - first);
+                    batch.assign(reinterpret_cast<const char*>(&count), sizeof(count));
+                    for (size_t i = first; i < first + count; ++i) {
+                        WireEvent record = {};
+                        record.sequence = events[i].sequence;
+                        record.timestampMicros = events[i].timestampMicros;
+                        record.flags = events[i].flags;
+                        record.kind = (uint8_t)events[i].kind;
+                        record.detailLength = (uint16_t)events[i].detail.size();
+                        batch.append(reinterpret_cast<const char*>(&record), sizeof(record));
+                        batch += events[i].detail;
+                    }
+                    FrameType type;
+                    std::string ack;
+                    if (!SendFrame(connection, FrameType::Events, batch) || !RecvFrame(connection, type, ack)) return;
+                    bytes += batch.size();
+                }
+            };
+            ReplicaThrottle unthrottled;
+            auto sendFile = [&] {
+                bool stored = false;
+                if (ShipFile(connection, file, "seg-1.seg", 0, unthrottled, stored) && stored) bytes += encoded.size();
+            };
+            // CPU per GB over the warm-up and timed runs together
+            auto measure = [&](const std::string& name, const std::function<void()>& op) {
+                bytes = 0;
+                int64_t cpuBefore = ThreadCpuMicros();
+                BenchResult result = RunMicroBench(name, config, 4, op);
+                double cpuMs = (ThreadCpuMicros() - cpuBefore) / 1000.0;
+                result.stageMetrics.push_back({"cpu_ms_per_gb", bytes ? cpuMs / (bytes / 1073741824.0) : 0.0});
+                result.stageMetrics.push_back({"mb_per_s", result.throughput * encoded.size() / 1048576.0});
+                return result;
+            };
+            if (connection != kInvalidSocket) {
+                BenchResult records = measure("ship_records_30mb", sendRecords);
+                BenchResult whole = measure("ship_file_30mb", sendFile);
+                std::cout << std::fixed << std::setprecision(1) << "  sender CPU per GB: records " << records.stageMetrics[0].second
+                          << " ms (" << records.stageMetrics[1].second << " MB/s), whole file " << whole.stageMetrics[0].second
+                          << " ms (" << whole.stageMetrics[1].second << " MB/s)" << std::endl;
+                results.push_back(records);
+                results.push_back(whole);
+            }
+            CloseSocket(connection);
+            receiver.join();
+        }
+        CloseSocket(listener);
+        std::filesystem::remove_all(directory, ec);
+    }
+
+    // Executable hashing on a build-server replay: exec events drawn Zipf-style (s = 1.1) over
+    // the binaries in /usr/bin, /usr/libexec and /usr/lib/gcc (System32 on Windows), so a few
+    // compilers and tools dominate. Each pool size starts from an empty cache; the files are
+    // read once beforehand so the page cache, not the disk, is what is measured.
+    if (wanted("exec_hash")) {
+        std::vector<std::filesystem::path> binaries;
+        std::error_code ec;
+#ifdef _WIN32
+        const char* const kRoots[] = {"C:\\Windows\\System32"};
+#else
+        const char* const kRoots[] = {"/usr/bin", "/usr/libexec", "/usr/lib/gcc"};
+#endif
+        for (const char* root : kRoots) {
+            for (std::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+                if (it.depth() > 3) it.disable_recursion_pending();
+                std::string extension = it->path().extension().string();
+                uint64_t size = it->is_regular_file(ec) ? it->file_size(ec) : 0;
+                if (size < 4096 || size > (256u << 20) || (extension != "" && extension != ".exe")) continue;
+                binaries.push_back(it->path());
+            }
+        }
+        std::sort(binaries.begin(), binaries.end());
+        if (binaries.size() > 1024) binaries.resize(1024);
+        std::vector<char> buffer(kHashReadBytes);
+        std::string check;
+        for (const auto& path : binaries) HashFile(path, std::filesystem::file_size(path, ec), buffer, check);
+
+        const size_t kExecs = 50000;
+        std::mt19937_64 rng(100);
+        std::vector<size_t> rank(binaries.size());
+        for (size_t i = 0; i < rank.size(); ++i) rank[i] = i;
+        std::shuffle(rank.begin(), rank.end(), rng);
+        std::vector<double> weights(binaries.size());
+        for (size_t i = 0; i < weights.size(); ++i) weights[i] = 1.0 / std::pow((double)(i + 1), 1.1);
+        std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+        std::vector<size_t> replay(binaries.empty() ? 0 : kExecs);
+        for (size_t& exec : replay) exec = rank[zipf(rng)];
+
+        const uint32_t wide = std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+        for (uint32_t workers : {1u, wide}) {
+            if (replay.empty()) break;
+            StopHashPool();
+            ClearHashCache();
+            g_hashHits = g_hashMisses = g_hashCoalesced = g_hashDropped = g_hashFailed = g_hashedBytes = g_hashMicros = 0;
+            StartHashPool(workers);
+            std::atomic<uint64_t> answered{0};
+            int64_t start = SteadyMicros();
+            for (size_t exec : replay) {
+                // Exec events arrive faster than cold hashing; wait for room rather than drop
+                while (!HashExecutable(binaries[exec], [&](const std::string&, uint64_t, bool) { ++answered; })) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+            while (answered.load() < replay.size()) std::this_thread::sleep_for(std::chrono::microseconds(100));
+            double seconds = (SteadyMicros() - start) / 1e6;
+            const double lookups = (double)(g_hashHits + g_hashMisses + g_hashCoalesced);
+            BenchResult result;
+            result.name = "exec_hash_replay_" + std::to_string(workers) + "w";
+            result.repetitions = 1;
+            result.throughput = replay.size() / seconds;
+            result.stageMetrics.push_back({"hit_rate", g_hashHits / lookups});
+            result.stageMetrics.push_back({"reads_avoided", (g_hashHits + g_hashCoalesced) / lookups});
+            result.stageMetrics.push_back({"hash_mb_per_s", g_hashedBytes / 1048576.0 / seconds});
+            result.stageMetrics.push_back({"worker_mb_per_s", g_hashMicros ? g_hashedBytes / (double)g_hashMicros * 1e6 / 1048576.0 : 0.0});
+            std::cout << std::fixed << std::setprecision(1) << result.name << ": " << result.throughput << " execs/s" << std::endl
+                      << "  " << FormatHashStats() << "; " << result.stageMetrics[2].second << " MB/s across " << workers
+                      << " workers" << std::endl;
+            results.push_back(result);
+        }
+        StopHashPool();
+        ClearHashCache();
+    }
+
+    // Timestamps: the system clock call the calibrated source replaces, the calibrated source
+    // (TSC or monotonic fallback), the cached log prefix, and drift over a few calibrations
+    if (wanted("clock")) {
+        InitTimestampClock();
+        const int kBatch = 64; // Reads per timed op, so the bench's own clock reads don't dominate
+        int64_t sink = 0;
+        BenchResult system = RunMicroBench("clock_system_x64", config, 1u << 14, [&] {
+            for (int i = 0; i < kBatch; ++i) sink += SystemMicros();
+        });
+        BenchResult calibrated = RunMicroBench("clock_calibrated_x64", config, 1u << 14, [&] {
+            for (int i = 0; i < kBatch; ++i) sink += UnixMicrosNow();
+        });
+        BenchResult formatted = RunMicroBench("clock_log_prefix_formatted_x64", config, 1u << 12, [&] {
+            for (int i = 0; i < kBatch; ++i) {
+                std::time_t now = (std::time_t)(SystemMicros() / 1000000);
+                std::tm local;
+#ifdef _WIN32
+                localtime_s(&local, &now);
+#else
+                localtime_r(&now, &local);
+#endif
+                std::stringstream ss;
+                ss << std::put_time(&local, "[%Y-%m-%d %H:%M:%S] ");
+                sink += (int64_t)ss.str().size();
+            }
+        });
+        BenchResult cached = RunMicroBench("clock_log_prefix_x64", config, 1u << 14, [&] {
+            for (int i = 0; i < kBatch; ++i) sink += (int64_t)GetTimestamp().size();
+        });
+        for (int i = 0; i < 10; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            RecalibrateTimestamps(true);
+        }
+        calibrated.stageMetrics.push_back({"tsc", g_timestampCalibration.tsc.load() ? 1.0 : 0.0});
+        calibrated.stageMetrics.push_back({"max_drift_us", (double)g_timestampMaxDrift.load()});
+        auto nanos = [&](const BenchResult& r) { return 1e9 / r.throughput / kBatch; };
+        std::cout << std::fixed << std::setprecision(1) << "  " << FormatTimestampStats() << std::endl
+                  << "  per read: system clock " << nanos(system) << " ns, calibrated " << nanos(calibrated)
+                  << " ns; log prefix: formatted " << nanos(formatted) << " ns, cached " << nanos(cached) << " ns" << std::endl;
+        results.push_back(system);
+        results.push_back(calibrated);
+        results.push_back(formatted);
+        results.push_back(cached);
+        if (sink == 42) std::cout << std::endl;
+    }
+
+    // Query API: answering each query type in process (the socket round trip adds ~10 us;
+    // see --query repeat=N), with 50 devices present and a full hot tier
+    if (wanted("query") && InitHotTier((size_t)1 << 20)) {
+        for (uint32_t i = 0; i < g_hotTier.capacity; ++i) {
+            char path[128];
+            snprintf(path, sizeof(path), "\\\\?\\USB#VID_%04X&PID_%04X#%08X#{a5dcbf10-6530-11d2-901f-00c04fb951ed}",
+                     0x0400 + i % 50, 0x1000 + i % 50, 0x5E000000u + i % 50);
+            SecurityEvent event;
+            event.kind = i % 2 ? EventKind::UsbArrival : EventKind::Clipboard;
+            event.detail = event.kind == EventKind::UsbArrival ? path : "";
+            event.sequence = i + 1;
+            event.timestampMicros = UnixMicrosNow();
+            UpdateInventory(event);
+            AppendHotTier(event);
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_inventoryMutex);
+            PublishQuerySnapshot();
+        }
+        const char* const names[] = {"query_ping", "query_inventory", "query_recent_events_100", "query_counters", "query_rule_state"};
+        size_t bytes = 0;
+        for (uint16_t type = 0; type <= (uint16_t)QueryType::RuleState; ++type) {
+            QueryRequest request;
+            request.type = type;
+            results.push_back(RunMicroBench(names[type], config, 20000, [&] { bytes += AnswerQuery(request).size(); }));
+        }
+        if (bytes == 42) std::cout << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(g_inventoryMutex);
+            g_inventory.clear();
+        }
+        std::atomic_store(&g_querySnapshot, std::shared_ptr<const QuerySnapshot>());
+        InitHotTier(0);
+    }
+}
+
+bool WriteBenchJson(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Could not write benchmark baseline: " << path << std::endl;
+        return false;
+    }
+    out << std::fixed << std::setprecision(3) << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"repetitions\": " << r.repetitions
+            << ", \"throughput\": " << r.throughput << ", \"throughput_mad\": " << r.throughputMad
+            << ", \"p50_us\": " << r.p50Us << ", \"p99_us\": " << r.p99Us << ", \"p99_mad\": " << r.p99Mad;
+        for (const auto& metric : r.stageMetrics) {
+            out << ", \"" << metric.first << "\": " << metric.second;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return !out.fail();
+}
+
+// Reads the files written by WriteBenchJson: one flat object per benchmark
+bool ReadBenchJson(const std::string& path, std::vector<BenchResult>& results) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Could not read benchmark baseline: " << path << std::endl;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string text = buffer.str();
+
+    auto numberField = [](const std::string& object, const std::string& key) {
+        size_t pos = object.find("\"" + key + "\"");
+        if (pos == std::string::npos) return 0.0;
+        pos = object.find(':', pos);
+        return pos == std::string::npos ? 0.0 : std::strtod(object.c_str() + pos + 1, nullptr);
+    };
+
+    size_t pos = text.find('[');
+    while (pos != std::string::npos) {
+        size_t open = text.find('{', pos);
+        if (open == std::string::npos) break;
+        size_t close = text.find('}', open);
+        if (close == std::string::npos) break;
+        std::string object = text.substr(open, close - open + 1);
+        BenchResult r;
+        size_t name = object.find("\"name\"");
+        if (name != std::string::npos) {
+            size_t q1 = object.find('"', object.find(':', name));
+            size_t q2 = object.find('"', q1 + 1);
+            r.name = object.substr(q1 + 1, q2 - q1 - 1);
+        }
+        r.repetitions = (int)numberField(object, "repetitions");
+        r.throughput = numberField(object, "throughput");
+        r.throughputMad = numberField(object, "throughput_mad");
+        r.p50Us = numberField(object, "p50_us");
+        r.p99Us = numberField(object, "p99_us");
+        r.p99Mad = numberField(object, "p99_mad");
+        if (!r.name.empty()) results.push_back(r);
+        pos = close + 1;
+    }
+    return true;
+}
+
+// A change counts as a regression only if it exceeds both the relative tolerance and
+// noiseFactor times the larger MAD of the two runs
+bool CompareBenchResults(const std::vector<BenchResult>& baseline, const std::vector<BenchResult>& current, const BenchConfig& config) {
+    bool ok = true;
+    for (const BenchResult& cur : current) {
+        auto base = std::find_if(baseline.begin(), baseline.end(), [&](const BenchResult& b) { return b.name == cur.name; });
+        if (base == baseline.end()) {
+            std::cout << cur.name << ": no baseline, skipped" << std::endl;
+            continue;
+        }
+        double tputSlack = std::max(base->throughput * config.tolerancePct / 100.0,
+                                    config.noiseFactor * std::max(base->throughputMad, cur.throughputMad));
+        double p99Slack = std::max(base->p99Us * config.tolerancePct / 100.0,
+                                   config.noiseFactor * std::max(base->p99Mad, cur.p99Mad));
+        bool tputRegressed = cur.throughput < base->throughput - tputSlack;
+        bool p99Regressed = cur.p99Us > base->p99Us + p99Slack;
+        std::cout << std::fixed << std::setprecision(1) << cur.name
+                  << ": throughput " << base->throughput << " -> " << cur.throughput << (tputRegressed ? " REGRESSED" : " ok")
+                  << ", p99 " << base->p99Us << "us -> " << cur.p99Us << "us" << (p99Regressed ? " REGRESSED" : " ok") << std::endl;
+        ok = ok && !tputRegressed && !p99Regressed;
+    }
+    return ok;
 }
 
+int RunBenchCommand(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!ParseBenchArgs(argc, argv, config)) {
+        return 2;
+    }
+    if (!PinCurrentThread(config.cpu)) {
+        std::cerr << "WARNING: Could not pin benchmark thread to CPU " << config.cpu << std::endl;
+    }
+    // Benchmarks write to a scratch log that is truncated on every run
+    if (!OpenLogFile(GetExecutableDirectory() / "SecurityMonitorBench.txt", std::ios::trunc)) {
+        std::cerr << "FATAL: Could not open log file: " << g_logFilePath.string() << std::endl;
+        return 1;
+    }
+    g_consoleEcho = false;
+    g_stageSampleEvery.store(config.stageSampleEvery);
+    std::vector<BenchResult> results = RunBenchSuite(config);
+    g_consoleEcho = true;
+    if (config.stageSampleEvery > 0) {
+        std::cout << FormatStageStats() << std::endl;
+    }
+    g_logFile.close();
+
+    if (!config.savePath.empty() && !WriteBenchJson(config.savePath, results)) {
+        return 1;
+    }
+    if (!config.baselinePath.empty()) {
+        std::vector<BenchResult> baseline;
+        if (!ReadBenchJson(config.baselinePath, baseline)) {
+            return 1;
+        }
+        if (!CompareBenchResults(baseline, results, config)) {
+            std::cout << "Benchmark regression detected." << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
 
+#ifdef _WIN32
 // Window Procedure to handle messages
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     switch (uMsg) {
@@ -102,67 +8870,51 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             PostQuitMessage(0);
             return 0;
 
+        case WM_APP_HEARTBEAT:
+        {
+            int64_t lag = SteadyMicros() - (int64_t)lParam;
+            RecordLoopLag(lag);
+            g_heartbeatPendingSince.store(0);
+            if (g_loopStallReported.exchange(false)) {
+                LogEvent("Capture loop recovered; heartbeat was delayed " + std::to_string(lag / 1000) + " ms.");
+            }
+            return 0;
+        }
+
+        case WM_APP_CONFIG_CHANGED:
+            if (g_hDevNotify) {
+                UnregisterDeviceNotification(g_hDevNotify);
+                g_hDevNotify = NULL;
+            }
+            RegisterDeviceNotifications(hwnd);
+            return 0;
+
         case WM_CLIPBOARDUPDATE:
-            LogEvent("Clipboard content changed (Copy/Paste detected).");
+        {
+            SecurityEvent event;
+            event.kind = EventKind::Clipboard;
+            DispatchEvent(event);
             return 0;
+        }
 
         case WM_DEVICECHANGE:
         {
             // Check if it's a device arrival or removal
             if (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE) {
+                 bool arrival = (wParam == DBT_DEVICEARRIVAL);
                  PDEV_BROADCAST_HDR pHdr = (PDEV_BROADCAST_HDR)lParam;
                  if (pHdr != nullptr && pHdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE) {
                      PDEV_BROADCAST_DEVICEINTERFACE pDevInf = (PDEV_BROADCAST_DEVICEINTERFACE)pHdr;
 
-                     // Check if it's a USB device interface
-                     // Compare pDevInf->dbcc_classguid with GUID_DEVINTERFACE_USB_DEVICE
-                     if (IsEqualGUID(pDevInf->dbcc_classguid, GUID_DEVINTERFACE_USB_DEVICE)) {
-                         std::wstring devPathW(pDevInf->dbcc_name);
-                         // Convert wide string path to narrow string for logging (potential data loss if non-ASCII)
-                         // A more robust solution would involve wide char logging or careful conversion
-                         int size_needed = WideCharToMultiByte(CP_UTF8, 0, &devPathW[0], (int)devPathW.size(), NULL, 0, NULL, NULL);
-                         std::string devPathA(size_needed, 0);
-                         WideCharToMultiByte(CP_UTF8, 0, &devPathW[0], (int)devPathW.size(), &devPathA[0], size_needed, NULL, NULL);
-
-                         if (wParam == DBT_DEVICEARRIVAL) {
-                             LogEvent("USB Device Plugged In: " + devPathA);
-                             // NOTE: This is where you'd add logic to check if it's "unusual"
-                         } else { // DBT_DEVICEREMOVECOMPLETE
-                             LogEvent("USB Device Removed: " + devPathA);
-                         }
-                     } else {
-                        // Log other device interface changes - might hint at driver installs sometimes
-                         std::wstring devPathW(pDevInf->dbcc_name);
-                         int size_needed = WideCharToMultiByte(CP_UTF8, 0, &devPathW[0], (int)devPathW.size(), NULL, 0, NULL, NULL);
-                         std::string devPathA(size_needed, 0);
-                         WideCharToMultiByte(CP_UTF8, 0, &devPathW[0], (int)devPathW.size(), &devPathA[0], size_needed, NULL, NULL);
-
-                         if (wParam == DBT_DEVICEARRIVAL) {
-                             LogEvent("Non-USB Device Interface Arrival (Potential Driver/Software Install?): " + devPathA);
-                         } else {
-                             LogEvent("Non-USB Device Interface Removal: " + devPathA);
-                         }
-                     }
-
+                     // Check if it's a USB device interface; other device interface changes
+                     // might hint at driver installs sometimes
+                     bool isUsb = IsEqualGUID(pDevInf->dbcc_classguid, GUID_DEVINTERFACE_USB_DEVICE) != FALSE;
+                     DispatchEvent(DecodeDeviceInterface(arrival, isUsb, pDevInf->dbcc_name));
                  }
-                 // Could also check for DBT_DEVTYP_VOLUME here for drive letters appearing/disappearing
+                 // Volumes: drive letters appearing/disappearing
                  else if (pHdr != nullptr && pHdr->dbch_devicetype == DBT_DEVTYP_VOLUME) {
                     PDEV_BROADCAST_VOLUME pVol = (PDEV_BROADCAST_VOLUME)pHdr;
-                    if(wParam == DBT_DEVICEARRIVAL) {
-                        // Get drive letter
-                        char driveLetter = '?';
-                        DWORD driveMask = pVol->dbcv_unitmask;
-                        for (char i = 0; i < 26; ++i) {
-                            if (driveMask & (1 << i)) {
-                                driveLetter = 'A' + i;
-                                break;
-                            }
-                        }
-                        LogEvent("Volume/Drive Mounted: " + std::string(1, driveLetter) + ":\\");
-                    } else if (wParam == DBT_DEVICEREMOVECOMPLETE) {
-                         // Similar logic to find drive letter if needed
-                        LogEvent("Volume/Drive Removed.");
-                    }
+                    DispatchEvent(DecodeVolume(arrival, pVol->dbcv_unitmask));
                  }
             }
             // Add detection for app installs here (VERY HARD - see notes)
@@ -183,8 +8935,10 @@ bool RegisterDeviceNotifications(HWND hwnd) {
     DEV_BROADCAST_DEVICEINTERFACE notificationFilter = {0};
     notificationFilter.dbcc_size = sizeof(DEV_BROADCAST_DEVICEINTERFACE);
     notificationFilter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
-    // Optionally filter by GUID, e.g., GUID_DEVINTERFACE_USB_DEVICE
-    // notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_USB_DEVICE; // Uncomment to only get USB *interface* notifications
+    // Optionally filter by GUID (device_filter = usb in the config) to only get USB *interface* notifications
+    if (CurrentConfig().deviceFilterUsbOnly) {
+        notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_USB_DEVICE;
+    }
 
     HDEVNOTIFY hDevNotify = RegisterDeviceNotification(
         hwnd,                       // events recipient
@@ -197,20 +8951,28 @@ bool RegisterDeviceNotifications(HWND hwnd) {
         LogError("RegisterDeviceNotification", GetLastError());
         return false;
     }
-    // Note: We don't store hDevNotify globally here because we'd need to unregister it
-    // during WM_DESTROY, which might be complex if the app is terminated abruptly.
-    // The OS usually cleans up notifications when the window is destroyed.
-    LogEvent("Successfully registered for device notifications.");
+    // Stored so a config reload can swap the filter and shutdown can unregister it
+    g_hDevNotify = hDevNotify;
+    LogEvent(std::string("Successfully registered for device notifications") +
+             (CurrentConfig().deviceFilterUsbOnly ? " (USB only)." : "."));
     return true;
 }
 
 
-int main() {
+// Live monitoring: message-only window receiving clipboard and device notifications
+int RunMonitor() {
     // 1. Determine Project/Executable Directory and Log File Path
     std::filesystem::path projectDir;
     try {
         projectDir = GetExecutableDirectory();
-        g_logFilePath = projectDir / g_logFileName;
+        g_configPath = projectDir / kConfigFileName;
+        std::string configError;
+        if (!ReloadConfig(true, configError)) {
+            std::cerr << "WARNING: Ignoring invalid " << g_configPath.string() << " (" << configError << "), using defaults" << std::endl;
+        }
+        g_useHugePages = g_useHugePages || CurrentConfig().hugePages;
+        g_logFilePath = projectDir / CurrentConfig().logFileName;
+        g_checkpointPath = projectDir / kCheckpointFileName;
          std::cout << "Project Directory (Executable Location): " << projectDir.string() << std::endl;
          std::cout << "Log file path: " << g_logFilePath.string() << std::endl;
     } catch (const std::exception& e) {
@@ -221,16 +8983,33 @@ int main() {
 
     // 2. Open Log File
     // Use std::ios::app to append to the file if it exists
-    g_logFile.open(g_logFilePath, std::ios::app);
-    if (!g_logFile.is_open()) {
+    if (!OpenLogFile(g_logFilePath, std::ios::app)) {
         std::cerr << GetTimestamp() << "FATAL: Could not open log file: " << g_logFilePath.string() << std::endl;
         // Log error using system means if possible (maybe event log?)
         // Or just exit
         return 1;
     }
 
+    InitTimestampClock();
     LogEvent("--- SecurityMonitor Started ---");
     LogEvent("Project Directory: " + projectDir.string());
+    LogEvent(FormatTimestampStats());
+    if (g_useHugePages) {
+        LogEvent("Log buffer: " + DescribePinnedBuffer(g_logBuffer));
+    }
+    std::string restoreSummary;
+    RestoreCheckpoint(restoreSummary);
+    LogEvent(restoreSummary);
+    WriteCheckpoint(true); // Reserve a fresh sequence range before any event is numbered
+    if (InitHotTier((size_t)CurrentConfig().hotTierMb << 20)) {
+        LogEvent("Hot tier: last " + std::to_string(g_hotTier.capacity) + " events kept in memory (" +
+                 DescribePinnedBuffer(g_hotTier.memory) + ")");
+        std::string storageSummary;
+        if (CurrentConfig().storage) {
+            InitStorage(projectDir / "segments", storageSummary);
+            LogEvent(storageSummary);
+        }
+    }
 
     // 3. Create a message-only window to receive system messages
     const wchar_t CLASS_NAME[] = L"SecurityMonitorMessageWindowClass";
@@ -284,7 +9063,26 @@ int main() {
         // Decide whether to continue or exit based on severity
     }
 
-    // 6. Message Loop (Run indefinitely)
+    // 6. Start the watchdog that measures message loop latency, the maintenance thread, the
+    // config file watcher and the storage thread that moves events from memory to segment
+    // files and archives
+    StartWatchdog();
+    StartMaintenance();
+    StartConfigWatcher();
+    StartStorage();
+    if (CurrentConfig().collectors[0] != '\0' &&
+        !StartForwarder(CurrentConfig().collectors, CurrentConfig().hostId)) {
+        LogEvent("WARNING: Could not start forwarding to " + std::string(CurrentConfig().collectors));
+    }
+    StartShipper();
+    if (CurrentConfig().hashExecutables) {
+        StartHashPool(CurrentConfig().hashWorkers);
+    }
+    if (CurrentConfig().queryApi) {
+        StartQueryServer();
+    }
+
+    // 7. Message Loop (Run indefinitely)
     LogEvent("Starting message loop. Monitoring active...");
     MSG msg = {};
     while (GetMessage(&msg, NULL, 0, 0) > 0) { // GetMessage returns > 0 for messages other than WM_QUIT
@@ -293,12 +9091,39 @@ int main() {
     }
 
     // --- Cleanup (only reached if PostQuitMessage is called) ---
+    StopConfigWatcher();
+    StopWatchdog();
+    StopMaintenance();
+    StopStorage();
+    StopForwarder();
+    StopShipper();
+    StopHashPool();
+    StopQueryServer();
+    EmitLossReport(true);
+    WriteCheckpoint(true);
+    LogEvent(FormatLagHistogram());
+    RecalibrateTimestamps(true);
+    LogEvent(FormatTimestampStats());
+    if (!g_storageDir.empty()) {
+        LogEvent(FormatStorageStats());
+    }
+    if (!g_collectors.empty()) {
+        LogEvent(FormatForwarderStats());
+    }
+    if (CurrentConfig().shipSegments && !g_collectors.empty()) {
+        LogEvent(FormatShippingStats());
+    }
+    if (CurrentConfig().hashExecutables) {
+        LogEvent(FormatHashStats());
+    }
     LogEvent("--- SecurityMonitor Stopping ---");
 
     // Unregister listeners (optional but good practice if shutdown is clean)
     RemoveClipboardFormatListener(g_hwnd); // No return value check needed/possible easily
-    // UnregisterDeviceNotification requires the HDEVNOTIFY handle, which we didn't store globally for simplicity.
-    // The OS cleans this up when the window is destroyed anyway.
+    if (g_hDevNotify) {
+        UnregisterDeviceNotification(g_hDevNotify);
+        g_hDevNotify = NULL;
+    }
 
     DestroyWindow(g_hwnd); // Destroy the hidden window
 
@@ -307,4 +9132,39 @@ int main() {
     }
 
     return (int)msg.wParam; // Return quit code
+}
+#endif
+
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--loadgen") {
+        return RunLoadGenCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        return RunBenchCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--prevalence") {
+        return RunPrevalenceCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--policy") {
+        return RunPolicyCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--risk") {
+        return RunRiskCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--collector") {
+        return RunCollectorCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--query") {
+        return RunQueryCommand(argc, argv);
+    }
+#ifdef _WIN32
+    if (argc > 1 && std::string(argv[1]) == "--hugepages") {
+        g_useHugePages = true;
+    }
+    return RunMonitor();
+#else
+    std::cerr << "Live monitoring requires Windows. Available here: --loadgen [options], --bench [options], --prevalence [options], --policy compile|delta|apply [options], --risk convert|score [options], --collector [options], --query TYPE [options]" << std::endl;
+    return 1;
+#endif
 }
\ No newline at end of file